@@ -0,0 +1,620 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <mach/mach_time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "xnumem.h"
+#include "CodeIntegrity.h"
+#include "DaemonClient.h"
+#include "DaemonServer.h"
+#include "Epoch.h"
+#include "HeapWalker.h"
+#include "MemoryUsage.h"
+#include "MultiPatternScanner.h"
+#include "PageTriage.h"
+#include "RemoteArena.h"
+#include "Scheduler.h"
+#include "Snapshot.h"
+#include "StringExtractor.h"
+
+/*
+ Benchmarks against a child process with a known memory layout.
+
+    xnumem_bench [--mappings N] [--mapping-kb N] [--nodes N] [--fanout N]
+                 [--strings PERCENT] [--churn WRITES_PER_MS] [--iterations N] [--out FILE]
+
+ The child maps the requested regions, fills them with text, zeros and noise, builds a
+ heap graph and keeps writing to the mappings at the churn rate while the parent
+ measures. Results go to stdout (or FILE) as JSON.
+ */
+
+static const size_t kMaxMappings = 1024;
+static const size_t kMaxFanout = 8;
+
+typedef struct BenchConfig {
+    size_t          mappings;       // anonymous mappings in the target
+    size_t          mapping_size;   // bytes per mapping
+    size_t          nodes;          // heap graph nodes
+    size_t          fanout;         // children per node, 1 is a list
+    unsigned        strings;        // text pages per hundred
+    unsigned        churn;          // target writes per millisecond
+    unsigned        iterations;     // runs per benchmark
+    const char *    output;         // JSON file, stdout if null
+} BenchConfig_t;
+
+typedef struct TargetLayout {
+    uint64_t    mappings[kMaxMappings];
+    uint64_t    root;               // heap graph root
+    uint64_t    string;             // NUL terminated text
+    uint64_t    scratch;            // page the benchmark may write
+} TargetLayout_t;
+
+typedef struct BenchNode {
+    BenchNode * children[kMaxFanout];
+    uint64_t    payload[4];
+} BenchNode_t;
+
+typedef struct BenchResult {
+    std::string name;
+    unsigned    iterations;
+    uint64_t    min_ns;
+    uint64_t    mean_ns;
+    uint64_t    max_ns;
+    uint64_t    bytes;              // per iteration
+    uint64_t    operations;         // per iteration
+    bool        ok;
+} BenchResult_t;
+
+typedef std::function<kern_return_t( uint64_t& bytes )> BenchFn;
+
+static inline uint64_t Next( uint64_t& state )
+{
+    state ^= state << 13; state ^= state >> 7; state ^= state << 17;
+    return state;
+}
+
+static uint64_t Nanoseconds( uint64_t ticks )
+{
+    static mach_timebase_info_data_t timebase;
+    if(timebase.denom == 0)
+        mach_timebase_info(&timebase);
+    return ticks * timebase.numer / timebase.denom;
+}
+
+void RunTarget( const BenchConfig_t& config, int layout_fd, int control_fd );
+void RunBenchmarks( const BenchConfig_t& config, pid_t pid, const TargetLayout_t& layout, std::vector<BenchResult_t>& results );
+void WriteJSON( FILE * out, const BenchConfig_t& config, const std::vector<BenchResult_t>& results );
+
+int main (int argc, const char * argv[]) {
+
+    BenchConfig_t config = { 64, 1024 * 1024, 100000, 2, 20, 0, 10, nullptr };
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        unsigned long value = strtoul(argv[i + 1], nullptr, 0);
+        if(!strcmp(argv[i], "--mappings"))          config.mappings = std::min<size_t>(std::max<size_t>(value, 1), kMaxMappings);
+        else if(!strcmp(argv[i], "--mapping-kb"))   config.mapping_size = std::max<size_t>(value, 16) * 1024;
+        else if(!strcmp(argv[i], "--nodes"))        config.nodes = std::max<size_t>(value, 1);
+        else if(!strcmp(argv[i], "--fanout"))       config.fanout = std::min<size_t>(std::max<size_t>(value, 1), kMaxFanout);
+        else if(!strcmp(argv[i], "--strings"))      config.strings = (unsigned)std::min<unsigned long>(value, 100);
+        else if(!strcmp(argv[i], "--churn"))        config.churn = (unsigned)value;
+        else if(!strcmp(argv[i], "--iterations"))   config.iterations = (unsigned)std::max<unsigned long>(value, 1);
+        else if(!strcmp(argv[i], "--out"))          config.output = argv[i + 1];
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    // Layout goes up one pipe; the child lives until the other one closes
+    int layout_pipe[2], control_pipe[2];
+    if(pipe(layout_pipe) != 0 || pipe(control_pipe) != 0)
+        return 1;
+
+    pid_t pid = fork();
+    if(pid < 0)
+        return 1;
+    if(pid == 0)
+    {
+        close(layout_pipe[0]);
+        close(control_pipe[1]);
+        RunTarget(config, layout_pipe[1], control_pipe[0]);
+        _exit(0);
+    }
+    close(layout_pipe[1]);
+    close(control_pipe[0]);
+
+    TargetLayout_t layout;
+    size_t received = 0;
+    while(received < sizeof(layout))
+    {
+        ssize_t count = read(layout_pipe[0], (uint8_t *)&layout + received, sizeof(layout) - received);
+        if(count <= 0)
+            break;
+        received += count;
+    }
+
+    std::vector<BenchResult_t> results;
+    if(received == sizeof(layout))
+        RunBenchmarks(config, pid, layout, results);
+    else
+        fprintf(stderr, "Target did not report its layout\n");
+
+    close(control_pipe[1]);
+    close(layout_pipe[0]);
+    waitpid(pid, nullptr, 0);
+
+    FILE * out = config.output ? fopen(config.output, "w") : stdout;
+    if(!out)
+        return 1;
+    WriteJSON(out, config, results);
+    if(out != stdout)
+        fclose(out);
+
+    return results.empty() ? 1 : 0;
+}
+
+void RunTarget( const BenchConfig_t& config, int layout_fd, int control_fd )
+{
+    static const char Text[] = "xnumem benchmark target, reading remote memory at speed ";
+    static const char String[] = "xnumem benchmark string";
+
+    TargetLayout_t layout;
+    memset(&layout, 0, sizeof(layout));
+    size_t page = getpagesize();
+    uint64_t seed = 0x9e3779b97f4a7c15ULL;
+
+    // Text, zero and noise pages in the requested proportion
+    for (size_t i = 0; i < config.mappings; i++)
+    {
+        uint8_t * mapping = (uint8_t *)mmap(nullptr, config.mapping_size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+        if(mapping == MAP_FAILED)
+            _exit(1);
+
+        for (size_t offset = 0; offset + page <= config.mapping_size; offset += page)
+        {
+            uint64_t kind = Next(seed) % 100;
+            if(kind < config.strings)
+            {
+                for (size_t n = 0; n < page; n++)
+                    mapping[offset + n] = Text[n % (sizeof(Text) - 1)];
+            }
+            else if(kind < config.strings + (100 - config.strings) / 4)
+                continue;
+            else
+            {
+                for (size_t n = 0; n + 8 <= page; n += 8)
+                {
+                    uint64_t noise = Next(seed);
+                    memcpy(mapping + offset + n, &noise, 8);
+                }
+            }
+        }
+        layout.mappings[i] = (uintptr_t)mapping;
+    }
+
+    // Breadth-first tree; a fanout of one makes a list
+    std::vector<BenchNode_t *> nodes(config.nodes);
+    for (size_t i = 0; i < config.nodes; i++)
+    {
+        nodes[i] = (BenchNode_t *)calloc(1, sizeof(BenchNode_t));
+        nodes[i]->payload[0] = i;
+        if(i > 0)
+            nodes[(i - 1) / config.fanout]->children[(i - 1) % config.fanout] = nodes[i];
+    }
+
+    layout.root = (uintptr_t)nodes[0];
+    layout.string = (uintptr_t)String;
+    layout.scratch = (uintptr_t)mmap(nullptr, page, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+    if(write(layout_fd, &layout, sizeof(layout)) != sizeof(layout))
+        _exit(1);
+
+    // Dirty random words until told to stop
+    std::atomic<bool> running(true);
+    std::thread churn([&]() {
+        uint64_t state = seed;
+        while(running.load(std::memory_order_relaxed))
+        {
+            for (unsigned n = 0; n < config.churn; n++)
+            {
+                uint64_t value = Next(state);
+                uint8_t * mapping = (uint8_t *)layout.mappings[value % config.mappings];
+                *(uint64_t *)(mapping + ((value >> 16) % (config.mapping_size / 8)) * 8) = value;
+            }
+            usleep(1000);
+        }
+    });
+
+    char byte;
+    while(read(control_fd, &byte, 1) > 0)
+        ;
+    running = false;
+    churn.join();
+}
+
+static void Measure( const BenchConfig_t& config, const char * name, uint64_t operations, const BenchFn& fn, std::vector<BenchResult_t>& results )
+{
+    BenchResult_t result = { name, config.iterations, UINT64_MAX, 0, 0, 0, operations, true };
+    uint64_t total = 0;
+    for (unsigned i = 0; i < config.iterations; i++)
+    {
+        uint64_t bytes = 0;
+        uint64_t start = mach_absolute_time();
+        result.ok = fn(bytes) == KERN_SUCCESS && result.ok;
+        uint64_t elapsed = Nanoseconds(mach_absolute_time() - start);
+
+        total += elapsed;
+        result.min_ns = std::min(result.min_ns, elapsed);
+        result.max_ns = std::max(result.max_ns, elapsed);
+        result.bytes = bytes;
+    }
+    result.mean_ns = total / config.iterations;
+    results.push_back(result);
+    fprintf(stderr, "%-24s %12llu ns%s\n", name, (unsigned long long)result.mean_ns, result.ok ? "" : " (failed)");
+}
+
+void RunBenchmarks( const BenchConfig_t& config, pid_t pid, const TargetLayout_t& layout, std::vector<BenchResult_t>& results )
+{
+    xnu_proc *Process = new xnu_proc();
+    if(!Process->Attach(pid))
+    {
+        fprintf(stderr, "Cannot attach to %d, task_for_pid() needs root\n", pid);
+        delete Process;
+        return;
+    }
+    ProcessMemory& memory = Process->memory();
+
+    // Scans are scoped to the target's own mappings, so they measure the configured layout
+    std::vector<uint64_t> mappings(layout.mappings, layout.mappings + config.mappings);
+    std::sort(mappings.begin(), mappings.end());
+    ScanScope scope;
+    for (size_t i = 0; i < mappings.size(); i++)
+        scope.Within(mappings[i], mappings[i] + config.mapping_size);
+
+    static const size_t kSmallReads = 4096;
+    std::vector<mach_vm_address_t> addresses(kSmallReads);
+    uint64_t seed = 0x2545f4914f6cdd1dULL;
+    for (size_t i = 0; i < addresses.size(); i++)
+    {
+        uint64_t value = Next(seed);
+        addresses[i] = mappings[value % mappings.size()] + ((value >> 16) % (config.mapping_size / 64)) * 64;
+    }
+    std::sort(addresses.begin(), addresses.end());
+
+    Measure(config, "read.small", kSmallReads, [&](uint64_t& bytes) {
+        kern_return_t kret = KERN_SUCCESS;
+        uint64_t value;
+        for (size_t i = 0; i < addresses.size() && kret == KERN_SUCCESS; i++)
+            kret = memory.Read(addresses[i], sizeof(value), &value);
+        bytes = addresses.size() * sizeof(value);
+        return kret;
+    }, results);
+
+    std::vector<uint8_t> batch(kSmallReads * 64);
+    Measure(config, "read.batched", kSmallReads, [&](uint64_t& bytes) {
+        std::vector<ReadRequest_t> requests(addresses.size());
+        for (size_t i = 0; i < addresses.size(); i++)
+        {
+            ReadRequest_t request = { addresses[i], 64, &batch[i * 64], KERN_SUCCESS };
+            requests[i] = request;
+        }
+        bytes = batch.size();
+        return memory.ReadBatch(requests);
+    }, results);
+
+    std::vector<uint8_t> large(config.mapping_size);
+    Measure(config, "read.large", config.mappings, [&](uint64_t& bytes) {
+        kern_return_t kret = KERN_SUCCESS;
+        for (size_t i = 0; i < mappings.size() && kret == KERN_SUCCESS; i++)
+            kret = memory.Read(mappings[i], large.size(), large.data());
+        bytes = mappings.size() * large.size();
+        return kret;
+    }, results);
+
+    Measure(config, "read.string", 1000, [&](uint64_t& bytes) {
+        bytes = 0;
+        for (int i = 0; i < 1000; i++)
+        {
+            const char * text = memory.ReadString(layout.string);
+            if(!text)
+                return KERN_FAILURE;
+            bytes += strlen(text) + 1;
+            free((void *)text);
+        }
+        return KERN_SUCCESS;
+    }, results);
+
+    Measure(config, "write.small", 1000, [&](uint64_t& bytes) {
+        kern_return_t kret = KERN_SUCCESS;
+        for (uint64_t i = 0; i < 1000 && kret == KERN_SUCCESS; i++)
+            kret = memory.Write(layout.scratch + (i % 512) * 8, sizeof(i), &i);
+        bytes = 1000 * sizeof(uint64_t);
+        return kret;
+    }, results);
+
+    // Bulk copies into a block allocated in the target: between its own mappings, and streamed in from our task
+    uintptr_t copy_target = memory.Allocate(mappings.size() * config.mapping_size, VM_PROT_READ | VM_PROT_WRITE);
+    if(copy_target)
+    {
+        Measure(config, "copy.local", config.mappings, [&](uint64_t& bytes) {
+            kern_return_t kret = KERN_SUCCESS;
+            for (size_t i = 0; i < mappings.size() && kret == KERN_SUCCESS; i++)
+                kret = memory.Copy(mappings[i], config.mapping_size, copy_target + i * config.mapping_size);
+            bytes = mappings.size() * config.mapping_size;
+            return kret;
+        }, results);
+
+        xnu_proc self;
+        std::vector<uint8_t> local(mappings.size() * config.mapping_size, 0x5a);
+        if(self.Attach(getpid()))
+        {
+            Measure(config, "copy.cross", 1, [&](uint64_t& bytes) {
+                bytes = local.size();
+                return ProcessMemory::Copy(self, (uintptr_t)local.data(), *Process, copy_target, local.size());
+            }, results);
+            self.Detach();
+        }
+        memory.Free(copy_target, mappings.size() * config.mapping_size);
+    }
+
+    // Small target-side buffers: a kernel allocation each, against an arena's local bookkeeping
+    static const size_t kAllocations = 1000;
+    Measure(config, "allocate.direct", kAllocations, [&](uint64_t& bytes) {
+        std::vector<uintptr_t> blocks;
+        for (size_t i = 0; i < kAllocations; i++)
+            blocks.push_back(memory.Allocate(64 + (i % 8) * 32, VM_PROT_READ | VM_PROT_WRITE));
+        kern_return_t kret = KERN_SUCCESS;
+        for (size_t i = 0; i < blocks.size(); i++)
+        {
+            if(blocks[i] == 0 || memory.Free(blocks[i], 64 + (i % 8) * 32) != KERN_SUCCESS)
+                kret = KERN_FAILURE;
+        }
+        bytes = 0;
+        return kret;
+    }, results);
+
+    Measure(config, "allocate.arena", kAllocations, [&](uint64_t& bytes) {
+        RemoteArena arena(*Process);
+        kern_return_t kret = KERN_SUCCESS;
+        for (size_t i = 0; i < kAllocations && kret == KERN_SUCCESS; i++)
+            kret = arena.Allocate(64 + (i % 8) * 32) ? KERN_SUCCESS : KERN_FAILURE;
+        bytes = 0;
+        return kret == KERN_SUCCESS ? arena.Release() : kret;
+    }, results);
+
+    // Breadth-first over the heap graph, one batch per level
+    Measure(config, "read.graph", config.nodes, [&](uint64_t& bytes) {
+        std::vector<mach_vm_address_t> level(1, layout.root), next;
+        std::vector<BenchNode_t> nodes;
+        bytes = 0;
+        while(!level.empty())
+        {
+            nodes.resize(level.size());
+            std::vector<ReadRequest_t> requests(level.size());
+            for (size_t i = 0; i < level.size(); i++)
+            {
+                ReadRequest_t request = { level[i], sizeof(BenchNode_t), &nodes[i], KERN_SUCCESS };
+                requests[i] = request;
+            }
+            if(memory.ReadBatch(requests) != KERN_SUCCESS)
+                return KERN_FAILURE;
+            bytes += level.size() * sizeof(BenchNode_t);
+
+            next.clear();
+            for (size_t i = 0; i < nodes.size(); i++)
+            {
+                for (size_t c = 0; c < config.fanout; c++)
+                {
+                    if(nodes[i].children[c])
+                        next.push_back((uintptr_t)nodes[i].children[c]);
+                }
+            }
+            level.swap(next);
+        }
+        return KERN_SUCCESS;
+    }, results);
+
+    // Attaching enumerates regions and modules
+    Measure(config, "attach", 1, [&](uint64_t& bytes) {
+        xnu_proc process;
+        bytes = 0;
+        kern_return_t kret = process.Attach(pid) ? KERN_SUCCESS : KERN_FAILURE;
+        process.Detach();
+        return kret;
+    }, results);
+
+    // What a short-lived tool pays with xnumemd holding the target: connect and one batch, against attach above
+    DaemonServer server;
+    if(server.Listen("/tmp/xnumem_bench.sock") == KERN_SUCCESS && server.Attach(pid) == KERN_SUCCESS)
+    {
+        std::thread serving([&server]() { server.Run(); });
+        
+        Measure(config, "daemon.connect", 1, [&](uint64_t& bytes) {
+            DaemonClient client;
+            uint64_t value;
+            std::vector<ReadRequest_t> requests(1);
+            ReadRequest_t request = { addresses[0], sizeof(value), &value, KERN_SUCCESS };
+            requests[0] = request;
+            bytes = sizeof(value);
+            kern_return_t kret = client.Connect("/tmp/xnumem_bench.sock");
+            return kret == KERN_SUCCESS ? client.ReadBatch(pid, requests) : kret;
+        }, results);
+        
+        DaemonClient client;
+        client.Connect("/tmp/xnumem_bench.sock");
+        Measure(config, "daemon.read.batched", kSmallReads, [&](uint64_t& bytes) {
+            std::vector<ReadRequest_t> requests(addresses.size());
+            for (size_t i = 0; i < addresses.size(); i++)
+            {
+                ReadRequest_t request = { addresses[i], 64, &batch[i * 64], KERN_SUCCESS };
+                requests[i] = request;
+            }
+            bytes = batch.size();
+            return client.ReadBatch(pid, requests);
+        }, results);
+        
+        // Through the shared segment
+        Measure(config, "daemon.read.large", config.mappings, [&](uint64_t& bytes) {
+            std::vector<ReadRequest_t> requests(mappings.size());
+            std::vector<uint8_t> data(mappings.size() * config.mapping_size);
+            for (size_t i = 0; i < mappings.size(); i++)
+            {
+                ReadRequest_t request = { mappings[i], config.mapping_size, &data[i * config.mapping_size], KERN_SUCCESS };
+                requests[i] = request;
+            }
+            bytes = data.size();
+            return client.ReadBatch(pid, requests);
+        }, results);
+        
+        client.Close();
+        server.Stop();
+        serving.join();
+    }
+
+    Measure(config, "modules.refresh", 1, [&](uint64_t& bytes) {
+        bytes = 0;
+        return Process->modules().Refresh();
+    }, results);
+
+    Measure(config, "scan.patterns", 3, [&](uint64_t& bytes) {
+        MultiPatternScanner scanner;
+        scanner.AddSignature(1, "78 6E 75 6D 65 6D ?? 62 65 6E 63 68");
+        scanner.Add(2, "READING REMOTE", 14, nullptr, kPatternNoCase);
+        scanner.AddSignature(3, "DE AD BE EF ?? ?? CA FE");
+        std::atomic<size_t> found(0);
+        ScanJob job;
+        kern_return_t kret = scanner.Scan(*Process, [&](uint32_t id, mach_vm_address_t address) { found++; }, &job, &scope);
+        bytes = job.done();
+        return kret;
+    }, results);
+
+    Measure(config, "scan.strings", 1, [&](uint64_t& bytes) {
+        StringExtractor extractor;
+        std::atomic<size_t> found(0);
+        ScanJob job;
+        kern_return_t kret = extractor.ExtractStrings(*Process, 8, kStringASCII | kStringUTF16LE,
+                                                      [&](mach_vm_address_t address, uint32_t encoding, const std::string& text) { found++; },
+                                                      false, &job, &scope);
+        bytes = job.done();
+        return kret;
+    }, results);
+
+    Measure(config, "scan.triage", 1, [&](uint64_t& bytes) {
+        PageTriage triage;
+        ScanJob job;
+        kern_return_t kret = triage.Triage(*Process, &job, &scope);
+        bytes = job.done();
+        return kret;
+    }, results);
+
+    Measure(config, "dump.snapshot", 1, [&](uint64_t& bytes) {
+        ScanJob job;
+        kern_return_t kret = Snapshot::Capture(*Process, "/tmp/xnumem_bench.snap", &job, &scope);
+        bytes = job.done();
+        unlink("/tmp/xnumem_bench.snap");
+        return kret;
+    }, results);
+
+    Measure(config, "heap.walk", 1, [&](uint64_t& bytes) {
+        HeapWalker walker(*Process);
+        std::vector<HeapZoneStats_t> zones;
+        HeapZoneStats_t total;
+        kern_return_t kret = walker.Walk(zones);
+        HeapWalker::Merge(zones, total);
+        bytes = total.bytes_mapped;
+        return kret;
+    }, results);
+
+    Measure(config, "usage.collect", 1, [&](uint64_t& bytes) {
+        MemoryUsage usage(*Process);
+        bytes = 0;
+        return usage.Collect();
+    }, results);
+
+    Measure(config, "integrity.check", 1, [&](uint64_t& bytes) {
+        CodeIntegrity integrity(*Process);
+        std::vector<IntegrityDiff_t> diffs;
+        ScanJob job;
+        kern_return_t kret = integrity.Check(diffs, &job);
+        bytes = job.done();
+        return kret;
+    }, results);
+
+    // Region and module lookups from many threads while a writer keeps republishing both indexes
+    static const size_t kLookups = 100000;
+    const ModuleData_t* main_module = Process->modules().GetMainModule();
+    module_t main_base = main_module ? (module_t)main_module->imageLoadAddress : 0;
+    for (size_t threads = 1; threads <= 32; threads *= 2)
+    {
+        std::string name = "lookup.threads." + std::to_string(threads);
+        Measure(config, name.c_str(), threads * kLookups, [&](uint64_t& bytes) {
+            std::atomic<size_t> running(threads), misses(0);
+            std::thread writer([&]() {
+                while (running.load() > 0)
+                {
+                    memory.RefreshRegions();
+                    Process->modules().Refresh();
+                }
+            });
+            std::vector<std::thread> readers;
+            for (size_t t = 0; t < threads; t++)
+            {
+                readers.push_back(std::thread([&, t]() {
+                    size_t missed = 0;
+                    for (size_t i = 0; i < kLookups; i++)
+                    {
+                        EpochGuard guard;
+                        if(memory.regions().Find(addresses[(t * kLookups + i) % addresses.size()]) == nullptr ||
+                           Process->modules().GetModule(main_base) == nullptr)
+                            missed++;
+                    }
+                    misses += missed;
+                    running--;
+                }));
+            }
+            for (size_t t = 0; t < readers.size(); t++)
+                readers[t].join();
+            writer.join();
+            Epoch::Reclaim();
+            bytes = 0;
+            return misses == 0 ? KERN_SUCCESS : KERN_FAILURE;
+        }, results);
+    }
+
+    Process->Detach();
+    delete Process;
+}
+
+void WriteJSON( FILE * out, const BenchConfig_t& config, const std::vector<BenchResult_t>& results )
+{
+    fprintf(out, "{\n  \"backend\": \"mach\",\n  \"workers\": %u,\n", Scheduler::Shared().workers());
+    fprintf(out, "  \"config\": { \"mappings\": %zu, \"mapping_size\": %zu, \"nodes\": %zu, \"fanout\": %zu, "
+                 "\"strings\": %u, \"churn\": %u, \"iterations\": %u },\n",
+            config.mappings, config.mapping_size, config.nodes, config.fanout, config.strings, config.churn, config.iterations);
+    fprintf(out, "  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchResult_t& result = results[i];
+        double seconds = result.mean_ns / 1e9;
+        fprintf(out, "    { \"name\": \"%s\", \"ok\": %s, \"iterations\": %u, \"min_ns\": %llu, \"mean_ns\": %llu, \"max_ns\": %llu, "
+                     "\"bytes\": %llu, \"operations\": %llu, \"mb_per_s\": %.1f, \"ns_per_op\": %.1f }%s\n",
+                result.name.c_str(), result.ok ? "true" : "false", result.iterations,
+                (unsigned long long)result.min_ns, (unsigned long long)result.mean_ns, (unsigned long long)result.max_ns,
+                (unsigned long long)result.bytes, (unsigned long long)result.operations,
+                seconds > 0 ? result.bytes / seconds / (1024 * 1024) : 0.0,
+                result.operations ? (double)result.mean_ns / result.operations : 0.0,
+                i + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
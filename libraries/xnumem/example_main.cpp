@@ -2,10 +2,49 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+#include <atomic>
+#include <map>
+#include <thread>
+
 #include "xnumem.h"
+#include "CodeIntegrity.h"
+#include "ContainerWalker.h"
+#include "DaemonClient.h"
+#include "DaemonServer.h"
+#include "Epoch.h"
+#include "GrowthTracker.h"
+#include "HeapWalker.h"
+#include "MemoryUsage.h"
+#include "MultiPatternScanner.h"
+#include "PageTriage.h"
+#include "RemoteArena.h"
+#include "RemoteLayout.h"
+#include "Scheduler.h"
+#include "Snapshot.h"
+#include "SnapshotStore.h"
+#include "Stats.h"
+#include "StringExtractor.h"
+#include "Trace.h"
 
 void TestProcessMemory( xnu_proc *process );
 void TestProcessModules( xnu_proc *process );
+void TestSnapshot( xnu_proc *process );
+void TestProcessThreads( xnu_proc *process );
+void TestHeapWalker( xnu_proc *process );
+void TestGrowthTracker( xnu_proc *process );
+void TestMultiPatternScanner( xnu_proc *process );
+void TestStringExtractor( xnu_proc *process );
+void TestPageTriage( xnu_proc *process );
+void TestCodeIntegrity( xnu_proc *process );
+void TestContainerWalker( xnu_proc *process );
+void TestRemoteLayout( xnu_proc *process );
+void TestStats( xnu_proc *process );
+void TestTrace( xnu_proc *process );
+void TestEpoch( xnu_proc *process );
+void TestMapView( xnu_proc *process );
+void TestCopy( xnu_proc *process );
+void TestRemoteArena( xnu_proc *process );
+void TestDaemon( xnu_proc *process );
 
 int main (int argc, const char * argv[]) {
     
@@ -20,6 +59,57 @@ int main (int argc, const char * argv[]) {
     
     // Test modules
     TestProcessModules(Process);
+    
+    // Test threads
+    TestProcessThreads(Process);
+    
+    // Test heap walking
+    TestHeapWalker(Process);
+    
+    // Test growth tracking
+    TestGrowthTracker(Process);
+    
+    // Test pattern search
+    TestMultiPatternScanner(Process);
+    
+    // Test strings extraction
+    TestStringExtractor(Process);
+    
+    // Test page triage
+    TestPageTriage(Process);
+    
+    // Test code integrity
+    TestCodeIntegrity(Process);
+    
+    // Test container walking
+    TestContainerWalker(Process);
+    
+    // Test remote struct layouts
+    TestRemoteLayout(Process);
+    
+    // Test operation counters
+    TestStats(Process);
+    
+    // Test tracing
+    TestTrace(Process);
+    
+    // Test concurrent lookups
+    TestEpoch(Process);
+    
+    // Test zero-copy views
+    TestMapView(Process);
+    
+    // Test bulk copies
+    TestCopy(Process);
+    
+    // Test remote sub-allocation
+    TestRemoteArena(Process);
+    
+    // Test the inspection daemon
+    TestDaemon(Process);
+    
+    // Test snapshots
+    TestSnapshot(Process);
 
     // Detach from process
     Process->Detach();
@@ -44,6 +134,699 @@ void TestProcessModules( xnu_proc *process )
     
 }
 
+void TestProcessThreads( xnu_proc *process )
+{
+    // The thread running this must be among them
+    bool found = false;
+    thread_act_t self = mach_thread_self();
+    if(process->threads().QueryThreads() == KERN_SUCCESS)
+    {
+        for (size_t i = 0; i < process->threads().threads().size(); i++)
+            found |= process->threads().threads()[i].port == self;
+    }
+    mach_port_deallocate(mach_task_self(), self);
+    
+    if(found)
+        printf("Success : threads().QueryThreads\n");
+    else
+        printf("Error : threads().QueryThreads\n");
+}
+
+void TestHeapWalker( xnu_proc *process )
+{
+    // Our own heap has at least the blocks this program allocated
+    HeapWalker walker(*process);
+    std::vector<HeapZoneStats_t> zones;
+    HeapZoneStats_t total;
+    if(walker.Walk(zones) == KERN_SUCCESS && !zones.empty())
+    {
+        HeapWalker::Merge(zones, total);
+        if(total.blocks_in_use > 0 && total.bytes_in_use + total.bytes_free <= total.bytes_mapped)
+            printf("Success : HeapWalker::Walk\n");
+        else
+            printf("Error : HeapWalker::Walk\n");
+    }
+    else
+    {
+        printf("Error : HeapWalker::Walk\n");
+    }
+}
+
+void TestGrowthTracker( xnu_proc *process )
+{
+    // A megabyte more heap every sample
+    GrowthConfig_t config = GrowthTracker::DefaultConfig();
+    config.min_steps = 3;
+    GrowthTracker tracker(*process, config);
+    std::vector<void *> blocks;
+    std::vector<GrowthSuspect_t> suspects;
+    for (int n = 0; n < 6; n++)
+    {
+        tracker.Sample();
+        blocks.push_back(malloc(1024 * 1024));
+        memset(blocks.back(), 1, 1024 * 1024);
+    }
+    tracker.Suspects(suspects);
+    if(tracker.samples() == 6 && !suspects.empty())
+        printf("Success : GrowthTracker::Suspects\n");
+    else
+        printf("Error : GrowthTracker::Suspects\n");
+    for (size_t n = 0; n < blocks.size(); n++)
+        free(blocks[n]);
+}
+
+void TestMultiPatternScanner( xnu_proc *process )
+{
+    // Both patterns are in our data, the wildcard one in any case
+    static const unsigned char Needle[] = { 0x4d, 0x50, 0x53, 0x00, 0x2a, 0x5a };
+    static const char Text[] = "xnumem Pattern Scanner";
+    MultiPatternScanner scanner;
+    scanner.AddSignature(1, "4D 50 53 ?? 2A 5A");
+    scanner.Add(2, "PATTERN SCANNER", 15, nullptr, kPatternNoCase);
+    
+    std::atomic<int> found(0);
+    if(scanner.Scan(*process, [&](uint32_t id, mach_vm_address_t address) {
+            if((id == 1 && address == (uintptr_t)Needle) || (id == 2 && address == (uintptr_t)Text + 7))
+                found++;
+        }) == KERN_SUCCESS && found == 2)
+        printf("Success : MultiPatternScanner::Scan\n");
+    else
+        printf("Error : MultiPatternScanner::Scan\n");
+}
+
+void TestStringExtractor( xnu_proc *process )
+{
+    // Both strings are in our data, one of them wide
+    static const char Text[] = "xnumem string extractor";
+    static const char16_t Wide[] = u"xnumem wide string";
+    StringExtractor extractor;
+    
+    std::atomic<int> found(0);
+    if(extractor.ExtractStrings(*process, 8, kStringASCII | kStringUTF16LE, [&](mach_vm_address_t address, uint32_t encoding, const std::string& text) {
+            if((encoding == kStringASCII && address == (uintptr_t)Text && text == Text) ||
+               (encoding == kStringUTF16LE && address == (uintptr_t)Wide && text == "xnumem wide string"))
+                found++;
+        }) == KERN_SUCCESS && found == 2)
+        printf("Success : StringExtractor::ExtractStrings\n");
+    else
+        printf("Error : StringExtractor::ExtractStrings\n");
+}
+
+void TestPageTriage( xnu_proc *process )
+{
+    // One page of text, one of noise, one of zeros; static so the region is already indexed
+    static uint8_t Pages[16384 * 4];
+    size_t page = getpagesize();
+    uint8_t *pages = (uint8_t *)(((uintptr_t)Pages + page - 1) & ~(uintptr_t)(page - 1));
+    
+    uint64_t noise = 0x9e3779b97f4a7c15ULL;
+    for (size_t n = 0; n < page; n++)
+    {
+        pages[n] = "xnumem page triage "[n % 19];
+        noise ^= noise << 13; noise ^= noise >> 7; noise ^= noise << 17;
+        pages[page + n] = (uint8_t)noise;
+        pages[page * 2 + n] = 0;
+    }
+    
+    PageTriage triage;
+    ScanScope scope;
+    scope.Within((uintptr_t)pages, (uintptr_t)pages + page * 3);
+    const TriagePage_t *text = nullptr, *random = nullptr, *zero = nullptr;
+    if(triage.Triage(*process, nullptr, &scope) == KERN_SUCCESS)
+    {
+        text   = triage.Find((uintptr_t)pages);
+        random = triage.Find((uintptr_t)pages + page);
+        zero   = triage.Find((uintptr_t)pages + page * 2);
+    }
+    
+    ScanScope selected;
+    triage.Select(1 << kPageRandom, selected);
+    if(text && text->kind == kPageText && random && random->kind == kPageRandom && zero && zero->kind == kPageZero &&
+       selected.ranges().size() == 1 && selected.ranges()[0].start == (uintptr_t)pages + page)
+        printf("Success : PageTriage::Triage\n");
+    else
+        printf("Error : PageTriage::Triage\n");
+    
+    // A page of arm64 bl / stp / ldr / add / adrp / mov / b.cond / ret with random operands is code only to the arm64 heuristic
+    static const uint32_t kCode[][2] = {
+        { 0xfc000000, 0x94000000 }, { 0xffc00000, 0xa9000000 }, { 0xffc00000, 0xf9400000 }, { 0xff800000, 0x91000000 },
+        { 0x9f000000, 0x90000000 }, { 0xffe0ffe0, 0xaa0003e0 }, { 0xff000010, 0x54000000 }, { 0xffffffff, 0xd65f03c0 } };
+    std::vector<uint8_t> code(page);
+    for (size_t n = 0; n < page / 4; n++)
+    {
+        noise ^= noise << 13; noise ^= noise >> 7; noise ^= noise << 17;
+        uint32_t word = kCode[n % 8][1] | ((uint32_t)noise & ~kCode[n % 8][0]);
+        memcpy(&code[n * 4], &word, sizeof(word));
+    }
+    
+    TriagePage_t arm64 = PageTriage::Classify(code.data(), page, VM_PROT_READ, 0, 0, CPU_TYPE_ARM64);
+    TriagePage_t x86_64 = PageTriage::Classify(code.data(), page, VM_PROT_READ, 0, 0, CPU_TYPE_X86_64);
+    TriagePage_t data = PageTriage::Classify(pages + page, page, VM_PROT_READ, 0, 0, CPU_TYPE_ARM64);
+    if(arm64.kind == kPageCode && x86_64.kind != kPageCode && data.kind != kPageCode)
+        printf("Success : PageTriage::Classify arm64\n");
+    else
+        printf("Error : PageTriage::Classify arm64 (%u %u %u, entropy %u)\n", arm64.kind, x86_64.kind, data.kind, arm64.entropy);
+}
+
+void TestCodeIntegrity( xnu_proc *process )
+{
+    // Nothing patches our own code, so no module may differ from its file
+    CodeIntegrity integrity(*process);
+    std::vector<IntegrityDiff_t> diffs;
+    bool intact = integrity.Check(diffs) == KERN_SUCCESS && diffs.empty() && integrity.Recheck(diffs) == KERN_SUCCESS && diffs.empty();
+    for (size_t n = 0; n < integrity.modules().size(); n++)
+        intact = intact && integrity.modules()[n].status != kIntegrityModified;
+    
+    if(intact)
+        printf("Success : CodeIntegrity::Check\n");
+    else
+        printf("Error : CodeIntegrity::Check\n");
+}
+
+void TestContainerWalker( xnu_proc *process )
+{
+    ContainerWalker walker(*process);
+    std::vector<int> values;
+    for (int n = 0; n < 10000; n++)
+        values.push_back(n);
+    
+    long sum = 0;
+    bool walked = walker.Vector<int>((uintptr_t)&values, [&](size_t index, const int& value) { sum += value; }) == KERN_SUCCESS && sum == 49995000;
+    
+#if defined(_LIBCPP_VERSION)
+    // Node layouts are libc++'s
+    std::map<int, double> map;
+    for (int n = 0; n < 10000; n++)
+        map[n] = n * 0.5;
+    
+    size_t entries = 0;
+    walked = walked && walker.Map<int, double>((uintptr_t)&map, [&](const int& key, const double& value) {
+        entries += value == key * 0.5;
+    }) == KERN_SUCCESS && entries == map.size();
+#endif
+    
+    if(walked)
+        printf("Success : ContainerWalker::Walk\n");
+    else
+        printf("Error : ContainerWalker::Walk\n");
+}
+
+struct LayoutInner { uint32_t length; uint32_t pad; uint64_t flags; };
+struct LayoutOuter { uint32_t id; uint16_t kind; uint16_t pad; uint64_t unused[8]; LayoutInner * inner; };
+struct LayoutPair { LayoutInner * left; uint64_t unused[4]; LayoutInner * right; };
+
+void TestRemoteLayout( xnu_proc *process )
+{
+    typedef RemoteLayout<REMOTE_FIELD(LayoutInner, length), REMOTE_FIELD(LayoutInner, flags)> InnerLayout;
+    typedef RemoteLayout<REMOTE_FIELD(LayoutOuter, id), REMOTE_FIELD(LayoutOuter, kind),
+                         REMOTE_POINTER(LayoutOuter, inner, InnerLayout)> OuterLayout;
+    static_assert(OuterLayout::kSpans == 2 && OuterLayout::kStride == 14, "id and kind share a span");
+    
+    static LayoutInner inners[4];
+    static LayoutOuter outers[4];
+    std::vector<mach_vm_address_t> addresses;
+    for (uint32_t i = 0; i < 4; i++)
+    {
+        inners[i].length = i * 10;
+        inners[i].flags = 0x100 + i;
+        outers[i].id = i;
+        outers[i].kind = (uint16_t)(i + 1);
+        outers[i].inner = i == 3 ? nullptr : &inners[i];
+        addresses.push_back((uintptr_t)&outers[i]);
+    }
+    
+    std::vector<OuterLayout::Object> objects;
+    bool read = OuterLayout::Read(process->memory(), addresses, objects) == KERN_SUCCESS && objects.size() == 4;
+    for (uint32_t i = 0; read && i < 4; i++)
+    {
+        const InnerLayout::Object& inner = std::get<2>(objects[i].values);
+        read = objects[i].valid && std::get<0>(objects[i].values) == i && std::get<1>(objects[i].values) == i + 1 &&
+               inner.valid == (i != 3) && (i == 3 || (std::get<0>(inner.values) == i * 10 && std::get<1>(inner.values) == 0x100 + i));
+    }
+    
+    // Sibling pointer fields are read in the same batch: one for the pairs, one for all their pointees
+    typedef RemoteLayout<REMOTE_POINTER(LayoutPair, left, InnerLayout), REMOTE_POINTER(LayoutPair, right, InnerLayout)> PairLayout;
+    static LayoutPair pairs[2] = { { &inners[0], {}, &inners[1] }, { &inners[2], {}, nullptr } };
+    std::vector<mach_vm_address_t> pair_addresses = { (uintptr_t)&pairs[0], (uintptr_t)&pairs[1] };
+    std::vector<PairLayout::Object> pair_objects;
+    StatsSnapshot_t before, after;
+    Stats::Collect(before);
+    read = read && PairLayout::Read(process->memory(), pair_addresses, pair_objects) == KERN_SUCCESS &&
+           std::get<0>(std::get<0>(pair_objects[0].values).values) == 0 && std::get<0>(std::get<1>(pair_objects[0].values).values) == 10 &&
+           std::get<0>(std::get<0>(pair_objects[1].values).values) == 20 && !std::get<1>(pair_objects[1].values).valid;
+    Stats::Collect(after);
+    read = read && (!Stats::enabled() || after.ops[kStatReadBatch].calls - before.ops[kStatReadBatch].calls == 2);
+    
+    if(read)
+        printf("Success : RemoteLayout::Read\n");
+    else
+        printf("Error : RemoteLayout::Read\n");
+}
+
+void TestStats( xnu_proc *process )
+{
+    // Ten reads of our own memory, counted on this thread
+    static uint64_t Values[64];
+    Stats::Reset();
+    for (int n = 0; n < 10; n++)
+        process->memory().Read<uint64_t>((uintptr_t)&Values[n]);
+    
+    StatsSnapshot_t snapshot;
+    Stats::Collect(snapshot);
+    const StatCounters_t& reads = snapshot.ops[kStatRead];
+    if(!Stats::enabled() || (reads.calls == 10 && reads.transferred == 10 * sizeof(uint64_t) && Stats::Percentile(reads, 0.5) > 0))
+        printf("Success : Stats::Collect\n");
+    else
+        printf("Error : Stats::Collect\n");
+}
+
+void TestTrace( xnu_proc *process )
+{
+    // A scan over our own data, its scheduler tasks must show up in the timeline
+    static uint8_t Data[256 * 1024];
+    const char * path = "/tmp/xnumem_example.trace.json";
+    MultiPatternScanner scanner;
+    scanner.AddSignature(1, "DE AD BE EF");
+    ScanScope scope;
+    scope.Within((uintptr_t)Data, (uintptr_t)Data + sizeof(Data));
+    
+    Trace::Start();
+    scanner.Scan(*process, [](uint32_t id, mach_vm_address_t address) {}, nullptr, &scope);
+    Trace::Stop();
+    
+    std::string text;
+    if(Trace::WriteFile(path) == KERN_SUCCESS)
+    {
+        char buffer[4096];
+        FILE * in = fopen(path, "r");
+        for (size_t count; in && (count = fread(buffer, 1, sizeof(buffer), in)) > 0; )
+            text.append(buffer, count);
+        if(in)
+            fclose(in);
+    }
+    unlink(path);
+    
+    if(text.find("\"name\": \"Scan\"") != std::string::npos && text.find("\"cat\": \"scheduler\"") != std::string::npos && Trace::dropped() == 0)
+        printf("Success : Trace::Write\n");
+    else
+        printf("Error : Trace::Write\n");
+}
+
+void TestEpoch( xnu_proc *process )
+{
+    // Readers look up while the indexes are swapped under them
+    static int Marker = 0xe90c;
+    std::atomic<bool> stop(false);
+    std::atomic<size_t> lookups(0), misses(0);
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; i++)
+    {
+        readers.push_back(std::thread([&]() {
+            while (!stop.load())
+            {
+                EpochGuard guard;
+                const MemoryRegion_t* region = process->memory().regions().Find((uintptr_t)&Marker);
+                if(region == nullptr || region->address > (uintptr_t)&Marker || process->modules().GetMainModule() == nullptr)
+                    misses++;
+                lookups++;
+            }
+        }));
+    }
+    
+    for (int i = 0; i < 50; i++)
+    {
+        process->memory().RefreshRegions();
+        process->modules().Refresh();
+    }
+    stop = true;
+    for (size_t i = 0; i < readers.size(); i++)
+        readers[i].join();
+    
+    if(lookups > 0 && misses == 0 && Epoch::Reclaim() == 0)
+        printf("Success : Epoch\n");
+    else
+        printf("Error : Epoch\n");
+}
+
+void TestMapView( xnu_proc *process )
+{
+    // A shared mapping is scanned through a view of its pages, which sees later writes
+    size_t size = 4 * getpagesize();
+    uint8_t * shared = (uint8_t *)mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    if(shared == MAP_FAILED)
+    {
+        printf("Error : memory().MapView\n");
+        return;
+    }
+    memcpy(shared + 100, "\xDE\xC0\xAD\xDE\x5E\xED", 6);
+    
+    void * file = MAP_FAILED;
+    FILE * backing = tmpfile();
+    if(backing && ftruncate(fileno(backing), size) == 0)
+        file = mmap(nullptr, size, PROT_READ, MAP_SHARED, fileno(backing), 0);
+    process->memory().RefreshRegions();
+    
+    size_t found = 0;
+    {
+        EpochGuard guard;
+        const uint8_t * view = (const uint8_t *)process->memory().Map((uintptr_t)shared, size);
+        shared[200] = 0x7f;
+        
+        MultiPatternScanner scanner;
+        scanner.AddSignature(1, "DE C0 AD DE 5E ED");
+        ScanScope scope;
+        scope.Within((uintptr_t)shared, (uintptr_t)shared + size);
+        scanner.Scan(*process, [&](uint32_t id, mach_vm_address_t address) { found += address == (uintptr_t)shared + 100; }, nullptr, &scope);
+        
+        // A shared file mapping is read instead, a view would fault if the file were truncated
+        const void * file_view = file != MAP_FAILED ? process->memory().Map((uintptr_t)file, size) : (const void *)1;
+        
+        if(view && view != shared && view[200] == 0x7f && found == 1 && file_view == nullptr)
+            printf("Success : memory().MapView\n");
+        else
+            printf("Error : memory().MapView\n");
+    }
+    
+    process->memory().ReleaseViews();
+    munmap(shared, size);
+    if(file != MAP_FAILED)
+        munmap(file, size);
+    if(backing)
+        fclose(backing);
+    process->memory().RefreshRegions();
+}
+
+void TestCopy( xnu_proc *process )
+{
+    // Several pieces, so the reads overlap the writes; a second process object stands in for another target
+    size_t size = ProcessMemory::kCopyChunk * 2 + 12345;
+    std::vector<uint8_t> source(size), target(size, 0);
+    for (size_t i = 0; i < size; i++)
+        source[i] = (uint8_t)(i * 7 + (i >> 12));
+    
+    xnu_proc other;
+    other.Attach(getpid());
+    kern_return_t across = ProcessMemory::Copy(*process, (uintptr_t)source.data(), other, (uintptr_t)target.data(), size);
+    other.Detach();
+    bool copied = target == source;
+    
+    // Overlapping copy inside the task, memmove semantics
+    std::vector<uint8_t> expected(source);
+    memmove(&expected[100], &expected[0], size - 100);
+    kern_return_t within = process->memory().Copy((uintptr_t)source.data(), size - 100, (uintptr_t)source.data() + 100);
+    
+    if(across == KERN_SUCCESS && copied && within == KERN_SUCCESS && source == expected)
+        printf("Success : memory().Copy\n");
+    else
+        printf("Error : memory().Copy\n");
+}
+
+void TestRemoteArena( xnu_proc *process )
+{
+    // Thousands of small staging buffers out of a few blocks, written through the normal path
+    RemoteArena arena(*process);
+    std::vector<mach_vm_address_t> addresses;
+    bool valid = true;
+    for (uint64_t i = 0; i < 2000; i++)
+    {
+        size_t alignment = (size_t)16 << (i % 4);
+        mach_vm_address_t address = arena.Allocate(1 + (i * 37) % 3000, alignment);
+        valid = valid && address != 0 && address % alignment == 0 && process->memory().Write(address, sizeof(i), &i) == KERN_SUCCESS;
+        addresses.push_back(address);
+    }
+    for (uint64_t i = 0; valid && i < addresses.size(); i++)
+    {
+        uint64_t value = 0;
+        valid = process->memory().Read(addresses[i], sizeof(value), &value) == KERN_SUCCESS && value == i;
+    }
+    
+    // What is given back is handed out again before another block is reserved
+    size_t blocks = arena.blocks();
+    for (size_t i = 0; i < addresses.size(); i += 2)
+        valid = valid && arena.Free(addresses[i]) == KERN_SUCCESS;
+    valid = valid && arena.Free(addresses[0]) == KERN_INVALID_ADDRESS;
+    for (uint64_t i = 0; i < addresses.size(); i += 2)
+        valid = valid && arena.Allocate(1 + (i * 37) % 3000, (size_t)16 << (i % 4)) != 0;
+    
+    // Allocating over mapped memory fails without aborting
+    valid = valid && process->memory().Allocate(getpagesize(), VM_PROT_READ, (uintptr_t)addresses[1]) == 0;
+    
+    // Once its process object is detached, an arena neither allocates nor frees
+    xnu_proc *other = new xnu_proc();
+    if(other->Attach(getpid()))
+    {
+        RemoteArena orphan(*other);
+        valid = valid && orphan.Allocate(64) != 0;
+        other->Detach();
+        valid = valid && orphan.Allocate(64) == 0 && orphan.Release() == KERN_INVALID_TASK && orphan.blocks() == 0;
+    }
+    delete other;
+    
+    if(valid && blocks <= 8 && arena.blocks() == blocks && arena.Release() == KERN_SUCCESS && arena.blocks() == 0)
+        printf("Success : RemoteArena\n");
+    else
+        printf("Error : RemoteArena\n");
+}
+
+void TestDaemon( xnu_proc *process )
+{
+    DaemonServer server;
+    if(server.Listen("/tmp/xnumem_example.sock") != KERN_SUCCESS)
+    {
+        printf("Error : DaemonServer\n");
+        return;
+    }
+    std::thread serving([&server]() { server.Run(); });
+    
+    DaemonClient client;
+    DaemonAttachResult_t first = {}, second = {};
+    bool valid = client.Connect("/tmp/xnumem_example.sock") == KERN_SUCCESS &&
+                 client.Attach(getpid(), &first) == KERN_SUCCESS && !first.warm && first.regions > 0 &&
+                 client.Attach(getpid(), &second) == KERN_SUCCESS && second.warm;
+    
+    // A pid that cannot be attached fails the request, not the daemon
+    valid = valid && client.Attach(0x7ffffff0) != KERN_SUCCESS && client.connected();
+    
+    // A small read inline and a large one through the shared segment, in one batch
+    uint64_t value = 0x1122334455667788ULL, small = 0;
+    std::vector<uint8_t> large(1024 * 1024), copy(large.size());
+    for (size_t i = 0; i < large.size(); i++)
+        large[i] = (uint8_t)(i * 13);
+    std::vector<ReadRequest_t> requests = {
+        { (mach_vm_address_t)&value, sizeof(value), &small, KERN_FAILURE },
+        { (mach_vm_address_t)large.data(), large.size(), copy.data(), KERN_FAILURE },
+    };
+    valid = valid && client.ReadBatch(getpid(), requests) == KERN_SUCCESS && small == value && copy == large;
+    
+    // &pointer -> pointer -> value
+    uint64_t * pointer = &value;
+    uint64_t * const * base = &pointer;
+    uint64_t resolved = 0;
+    std::vector<PointerChain_t> chains(1);
+    chains[0].base = (mach_vm_address_t)&base;
+    chains[0].offsets = { 0, 0 };
+    chains[0].size = sizeof(resolved);
+    chains[0].buffer = &resolved;
+    valid = valid && client.ReadPointerChains(getpid(), chains) == KERN_SUCCESS &&
+            chains[0].address == (mach_vm_address_t)&value && chains[0].depth == 2 && resolved == value;
+    
+    static uint8_t haystack[64] = { 0 };
+    const uint8_t needle[] = { 0xDE, 0xAD, 0x42, 0xEF, 0x13, 0x37 };
+    memcpy(haystack + 8, needle, sizeof(needle));
+    memcpy(haystack + 40, needle, sizeof(needle));
+    std::vector<mach_vm_address_t> matches, lowest;
+    valid = valid && client.Scan(getpid(), "DE AD ?? EF 13 37", matches, (mach_vm_address_t)haystack, (mach_vm_address_t)haystack + sizeof(haystack)) == KERN_SUCCESS &&
+            matches.size() == 2 && matches[0] == (mach_vm_address_t)haystack + 8 && matches[1] == (mach_vm_address_t)haystack + 40;
+    valid = valid && client.Scan(getpid(), "DE AD ?? EF 13 37", lowest, (mach_vm_address_t)haystack, (mach_vm_address_t)haystack + sizeof(haystack), 1) == KERN_SUCCESS &&
+            lowest.size() == 1 && lowest[0] == (mach_vm_address_t)haystack + 8;
+    
+    MemoryUsageStats_t total = {};
+    std::vector<DaemonModuleUsage_t> modules;
+    valid = valid && client.Usage(getpid(), total, &modules) == KERN_SUCCESS && total.resident > 0;
+    
+    valid = valid && client.Detach(getpid()) == KERN_SUCCESS && client.Detach(getpid()) == KERN_INVALID_ARGUMENT && server.sessions() == 0;
+    client.Close();
+    
+    server.Stop();
+    serving.join();
+    
+    if(valid)
+        printf("Success : DaemonServer\n");
+    else
+        printf("Error : DaemonServer\n");
+}
+
+void TestSnapshot( xnu_proc *process )
+{
+    static int Marker = 0x5eed;
+    const char * path = "/tmp/xnumem_example.snap";
+    
+    // A clean page of a private file mapping, its file changes between the captures
+    FILE * backing = tmpfile();
+    char * file_page = (char *)MAP_FAILED;
+    if(backing && ftruncate(fileno(backing), getpagesize()) == 0 && pwrite(fileno(backing), "before", 7, 0) == 7)
+        file_page = (char *)mmap(nullptr, getpagesize(), PROT_READ, MAP_PRIVATE, fileno(backing), 0);
+    process->memory().RefreshRegions();
+    
+    if(Snapshot::Capture(*process, path) != KERN_SUCCESS)
+    {
+        printf("Error : Snapshot::Capture\n");
+        return;
+    }
+    Marker = 0;
+    
+    // Read the captured value back through a second, offline process object
+    SnapshotSource source;
+    xnu_proc *offline = new xnu_proc();
+    if(source.Open(path) == KERN_SUCCESS && offline->Attach(&source) &&
+       offline->memory().Read<int>((uintptr_t)&Marker) == 0x5eed &&
+       offline->memory().segments().size() == process->memory().segments().size())
+        printf("Success : SnapshotSource\n");
+    else
+        printf("Error : SnapshotSource\n");
+    
+    offline->Detach();
+    
+    // A region count that overflows the table size, or paths running off the string table, are refused
+    const char * bad = "/tmp/xnumem_example.bad.snap";
+    std::vector<uint8_t> image;
+    FILE * in = fopen(path, "rb");
+    if(in && fseek(in, 0, SEEK_END) == 0)
+    {
+        image.resize((size_t)ftell(in));
+        rewind(in);
+        if(fread(image.data(), 1, image.size(), in) != image.size())
+            image.clear();
+    }
+    if(in)
+        fclose(in);
+    
+    bool refused = image.size() >= sizeof(SnapshotHeader_t) && ((SnapshotHeader_t*)image.data())->module_count > 0;
+    for (int n = 0; refused && n < 2; n++)
+    {
+        std::vector<uint8_t> copy(image);
+        SnapshotHeader_t* h = (SnapshotHeader_t*)copy.data();
+        if(n == 0)
+            h->region_count = ~0ULL / sizeof(SnapshotRegion_t) + 2;
+        else
+            memset(copy.data() + h->strings_offset, 'x', h->strings_size);
+        
+        Snapshot corrupt;
+        FILE * out = fopen(bad, "wb");
+        refused = out && fwrite(copy.data(), 1, copy.size(), out) == copy.size();
+        if(out)
+            fclose(out);
+        refused = refused && corrupt.Open(bad) == KERN_INVALID_ARGUMENT;
+    }
+    unlink(bad);
+    if(refused)
+        printf("Success : Snapshot::Open validation\n");
+    else
+        printf("Error : Snapshot::Open validation\n");
+    
+    // Incremental capture on top of it, unchanged pages are read back through the first file
+    const char * next = "/tmp/xnumem_example.1.snap";
+    SnapshotSource incremental;
+    Marker = 0x1234;
+    bool rewritten = file_page != MAP_FAILED && pwrite(fileno(backing), "after!", 7, 0) == 7 && strcmp(file_page, "after!") == 0;
+    if(Snapshot::CaptureIncremental(*process, next, path) == KERN_SUCCESS &&
+       incremental.Open(next) == KERN_SUCCESS && incremental.snapshot().parent() != nullptr &&
+       offline->Attach(&incremental) && offline->memory().Read<int>((uintptr_t)&Marker) == 0x1234 &&
+       offline->memory().Read<int>((uintptr_t)&TestSnapshot) == *(int *)&TestSnapshot &&
+       (!rewritten || offline->memory().Read<char>((uintptr_t)file_page) == 'a'))
+        printf("Success : Snapshot::CaptureIncremental\n");
+    else
+        printf("Error : Snapshot::CaptureIncremental\n");
+    
+    offline->Detach();
+    unlink(next);
+    if(file_page != MAP_FAILED)
+        munmap(file_page, getpagesize());
+    if(backing)
+        fclose(backing);
+    
+    // Scoped to our own writable data, a few pages instead of the whole task
+    ScanScope scope;
+    scope.Module(process->modules(), nullptr, kScopeWritable);
+    Marker = 0x5eed;
+    if(Snapshot::Capture(*process, path, nullptr, &scope) == KERN_SUCCESS &&
+       source.Open(path) == KERN_SUCCESS && offline->Attach(&source) &&
+       offline->memory().Read<int>((uintptr_t)&Marker) == 0x5eed &&
+       offline->memory().segments().size() < process->memory().segments().size())
+        printf("Success : ScanScope\n");
+    else
+        printf("Error : ScanScope\n");
+    
+    offline->Detach();
+    unlink(path);
+    
+    // A second capture into the store should reuse almost every page of the first
+    SnapshotStore store;
+    StoreSource stored;
+    Marker = 0x5eed;
+    if(store.Open("/tmp/xnumem_example.store") == KERN_SUCCESS &&
+       store.Capture(*process, "first") == KERN_SUCCESS)
+    {
+        uint64_t pages = store.pages();
+        Marker = 0;
+        if(store.Capture(*process, "second") == KERN_SUCCESS && store.pages() < pages * 2 &&
+           stored.Open(store, "first") == KERN_SUCCESS && offline->Attach(&stored) &&
+           offline->memory().Read<int>((uintptr_t)&Marker) == 0x5eed)
+            printf("Success : SnapshotStore\n");
+        else
+            printf("Error : SnapshotStore\n");
+        
+        offline->Detach();
+        stored.Close();
+        
+        // A module path off the string table, or regions out of order, are refused like in Snapshot::Open
+        std::vector<uint8_t> manifest;
+        FILE * in = fopen("/tmp/xnumem_example.store/first.manifest", "rb");
+        if(in && fseek(in, 0, SEEK_END) == 0)
+        {
+            manifest.resize((size_t)ftell(in));
+            rewind(in);
+            if(fread(manifest.data(), 1, manifest.size(), in) != manifest.size())
+                manifest.clear();
+        }
+        if(in)
+            fclose(in);
+        
+        const StoreManifestHeader_t* header = (const StoreManifestHeader_t*)manifest.data();
+        bool refused = manifest.size() >= sizeof(StoreManifestHeader_t) && header->module_count > 0 && header->region_count > 1;
+        for (int n = 0; refused && n < 2; n++)
+        {
+            std::vector<uint8_t> copy(manifest);
+            StoreManifestHeader_t* h = (StoreManifestHeader_t*)copy.data();
+            if(n == 0)
+                ((SnapshotModule_t*)(copy.data() + h->module_offset))->path_offset = h->strings_size;
+            else
+                std::swap(((SnapshotRegion_t*)(copy.data() + h->region_offset))[0], ((SnapshotRegion_t*)(copy.data() + h->region_offset))[1]);
+            
+            StoreSource corrupt;
+            FILE * out = fopen("/tmp/xnumem_example.store/bad.manifest", "wb");
+            refused = out && fwrite(copy.data(), 1, copy.size(), out) == copy.size();
+            if(out)
+                fclose(out);
+            refused = refused && corrupt.Open(store, "bad") == KERN_INVALID_ARGUMENT;
+        }
+        unlink("/tmp/xnumem_example.store/bad.manifest");
+        if(refused)
+            printf("Success : StoreSource::Open validation\n");
+        else
+            printf("Error : StoreSource::Open validation\n");
+        
+        store.Remove("first");
+        store.Remove("second");
+    }
+    else
+    {
+        printf("Error : SnapshotStore\n");
+    }
+    
+    delete offline;
+}
+
 void TestProcessMemory(xnu_proc *process)
 {
     int i = 1337;
@@ -51,6 +834,15 @@ void TestProcessMemory(xnu_proc *process)
     int i3 = 4141;
     const char * TestString = "Hello Xnumem";
     
+    // resident memory, our stack is certainly in
+    MemoryUsage usage(*process);
+    const MemoryRegion_t* stack = process->memory().regions().Find((uintptr_t)&i);
+    if(usage.Collect() == KERN_SUCCESS && stack != nullptr && usage.total().resident > 0 &&
+       usage.by_region()[stack - process->memory().segments().data()].resident > 0)
+        printf("Success : MemoryUsage::Collect\n");
+    else
+        printf("Error : MemoryUsage::Collect\n");
+    
     // read int
     i2 = process->memory().Read<int>((uintptr_t)&i);
     if(i2 == i)
@@ -95,6 +887,44 @@ void TestProcessMemory(xnu_proc *process)
     else
         printf("Error : memory().ReadString\n");
     
+    // Filtered region view
+    size_t ReadablePrivate = 0;
+    for (std::vector<MemoryRegion_t>::const_iterator it = process->memory().segments().begin(); it != process->memory().segments().end(); ++it)
+    {
+        if((it->info.protection & VM_PROT_READ) && !it->info.shared)
+            ReadablePrivate++;
+    }
+    RegionView view = process->memory().regions().where(RegionFilter().Protection(VM_PROT_READ).Private());
+    if(view.count() == ReadablePrivate && process->memory().regions().partition(VM_PROT_READ, 0).count() == ReadablePrivate)
+        printf("Success : memory().regions\n");
+    else
+        printf("Error : memory().regions\n");
+    
+    // Parallel walk over the readable regions
+    std::atomic<mach_vm_size_t> ChunkBytes(0);
+    Scheduler::Shared().ForEachChunk(process->memory().regions().partition(VM_PROT_READ), [&](const ScanChunk_t& chunk, unsigned worker) {
+        ChunkBytes += chunk.size;
+    });
+    if(ChunkBytes == process->memory().regions().partition(VM_PROT_READ).bytes())
+        printf("Success : Scheduler::ForEachChunk\n");
+    else
+        printf("Error : Scheduler::ForEachChunk\n");
+
+    // Nested operations run from a worker, reconfiguring from one is refused; a reused job counts again
+    std::atomic<size_t> NestedItems(0);
+    std::atomic<bool> ConfigureRefused(true);
+    ScanJob ReusedJob;
+    Scheduler::Shared().ForEach(4, [&](size_t index, unsigned worker) {
+        if(Scheduler::Shared().Configure(Scheduler::DefaultConfig()) != KERN_FAILURE)
+            ConfigureRefused = false;
+        Scheduler::Shared().ForEach(4, [&](size_t nested, unsigned nested_worker) { NestedItems++; });
+    }, &ReusedJob);
+    Scheduler::Shared().ForEach(3, [&](size_t index, unsigned worker) {}, &ReusedJob);
+    if(NestedItems == 16 && ConfigureRefused && ReusedJob.total() == 3 && ReusedJob.done() == 3)
+        printf("Success : Scheduler nesting\n");
+    else
+        printf("Error : Scheduler nesting\n");
+
     // print all segments
     process->memory().PrintSegments();
 }
\ No newline at end of file
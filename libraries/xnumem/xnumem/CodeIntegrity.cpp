@@ -0,0 +1,427 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+
+
+#include "CodeIntegrity.h"
+#include "Hash.h"
+#include "Scheduler.h"
+#include "Trace.h"
+#include "xnumem.h"
+
+#include <libkern/OSByteOrder.h>
+#include <mach-o/fat.h>
+#include <mach-o/loader.h>
+#include <mach-o/reloc.h>
+
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Slice of a file for an architecture, the whole file when it is not universal
+static const uint8_t * FindSlice( const uint8_t * file, size_t size, cpu_type_t cputype, cpu_subtype_t cpusubtype, size_t& slice_size )
+{
+    if(size < sizeof(struct fat_header))
+        return nullptr;
+    
+    const struct fat_header *fat = (const struct fat_header *)file;
+    uint32_t magic = OSSwapBigToHostInt32(fat->magic);
+    if(magic != FAT_MAGIC && magic != FAT_MAGIC_64)
+    {
+        slice_size = size;
+        return file;
+    }
+    
+    uint32_t count = OSSwapBigToHostInt32(fat->nfat_arch);
+    size_t entry = magic == FAT_MAGIC_64 ? sizeof(struct fat_arch_64) : sizeof(struct fat_arch);
+    for (uint32_t i = 0; i < count && sizeof(struct fat_header) + (i + 1) * entry <= size; i++)
+    {
+        const uint8_t *arch = file + sizeof(struct fat_header) + i * entry;
+        cpu_type_t type;
+        cpu_subtype_t subtype;
+        uint64_t offset, length;
+        if(magic == FAT_MAGIC_64)
+        {
+            const struct fat_arch_64 *fat_arch = (const struct fat_arch_64 *)arch;
+            type    = OSSwapBigToHostInt32(fat_arch->cputype);
+            subtype = OSSwapBigToHostInt32(fat_arch->cpusubtype);
+            offset  = OSSwapBigToHostInt64(fat_arch->offset);
+            length  = OSSwapBigToHostInt64(fat_arch->size);
+        }
+        else
+        {
+            const struct fat_arch *fat_arch = (const struct fat_arch *)arch;
+            type    = OSSwapBigToHostInt32(fat_arch->cputype);
+            subtype = OSSwapBigToHostInt32(fat_arch->cpusubtype);
+            offset  = OSSwapBigToHostInt32(fat_arch->offset);
+            length  = OSSwapBigToHostInt32(fat_arch->size);
+        }
+        
+        if(type != cputype || (subtype & ~CPU_SUBTYPE_MASK) != (cpusubtype & ~CPU_SUBTYPE_MASK))
+            continue;
+        if(offset > size || length > size - offset)
+            return nullptr;
+        
+        slice_size = length;
+        return file + offset;
+    }
+    
+    return nullptr;
+}
+
+static const uint8_t * FindUUID( const uint8_t * commands, size_t size, uint32_t ncmds )
+{
+    size_t offset = 0;
+    for (uint32_t i = 0; i < ncmds && offset + sizeof(struct load_command) <= size; i++)
+    {
+        const struct load_command *lc = (const struct load_command *)(commands + offset);
+        if(lc->cmdsize == 0 || offset + lc->cmdsize > size)
+            break;
+        if(lc->cmd == LC_UUID && lc->cmdsize >= sizeof(struct uuid_command))
+            return ((const struct uuid_command *)lc)->uuid;
+        offset += lc->cmdsize;
+    }
+    return nullptr;
+}
+
+CodeIntegrity::CodeIntegrity( xnu_proc& process ) :
+    _process(process),
+    _rehashed(0)
+{
+}
+
+CodeIntegrity::~CodeIntegrity()
+{
+    Release();
+}
+
+void CodeIntegrity::Release()
+{
+    for (std::vector<Mapping>::iterator it = _mappings.begin(); it != _mappings.end(); ++it)
+        munmap(it->data, it->size);
+    
+    _mappings.clear();
+    _modules.clear();
+    _pieces.clear();
+}
+
+void CodeIntegrity::Mask( mach_vm_address_t start, mach_vm_address_t end )
+{
+    _user_mask.Within(start, end);
+    _mask.Within(start, end);
+}
+
+int CodeIntegrity::Load( size_t index, mach_vm_address_t base, const char * path )
+{
+    ProcessMemory& memory = _process.memory();
+    const mach_vm_size_t page = getpagesize();
+    
+    struct mach_header_native header;
+    if(memory.TryRead(base, sizeof(header), &header) != KERN_SUCCESS || (header.magic != MH_MAGIC && header.magic != MH_MAGIC_64))
+        return kIntegrityUnreadable;
+    
+    std::vector<uint8_t> commands(header.sizeofcmds);
+    if(memory.TryRead(base + sizeof(header), commands.size(), commands.data()) != KERN_SUCCESS)
+        return kIntegrityUnreadable;
+    
+    // Shared cache images were relinked into the cache, the dylib on disk (if any) differs
+    if(header.flags & MH_DYLIB_IN_CACHE)
+        return kIntegrityNoFile;
+    
+    int fd = path ? open(path, O_RDONLY) : -1;
+    if(fd < 0)
+        return kIntegrityNoFile;
+    
+    struct stat st;
+    void * data = MAP_FAILED;
+    if(fstat(fd, &st) == 0 && st.st_size > 0)
+        data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
+        return kIntegrityNoFile;
+    
+    Mapping mapping = { data, (size_t)st.st_size };
+    _mappings.push_back(mapping);
+    
+    size_t slice_size = 0;
+    const uint8_t *slice = FindSlice((const uint8_t *)data, mapping.size, header.cputype, header.cpusubtype, slice_size);
+    if(slice == nullptr || slice_size < sizeof(header))
+        return kIntegrityMismatch;
+    
+    const struct mach_header_native *file_header = (const struct mach_header_native *)slice;
+    if(file_header->magic != header.magic || file_header->cputype != header.cputype || file_header->sizeofcmds > slice_size - sizeof(header))
+        return kIntegrityMismatch;
+    
+    const uint8_t *file_commands = slice + sizeof(header);
+    const uint8_t *uuid = FindUUID(commands.data(), commands.size(), header.ncmds);
+    const uint8_t *file_uuid = FindUUID(file_commands, file_header->sizeofcmds, file_header->ncmds);
+    if((uuid == nullptr) != (file_uuid == nullptr) || (uuid && memcmp(uuid, file_uuid, 16) != 0))
+        return kIntegrityMismatch;
+    
+    // The slide comes from __TEXT, relocations are relative to the first (writable) segment
+    mach_vm_address_t slide = 0, first = 0, first_writable = 0;
+    bool have_first = false, have_writable = false;
+    const struct dysymtab_command *dysymtab = nullptr;
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < file_header->ncmds && offset + sizeof(struct load_command) <= file_header->sizeofcmds; i++)
+    {
+        const struct load_command *lc = (const struct load_command *)(file_commands + offset);
+        if(lc->cmdsize == 0 || offset + lc->cmdsize > file_header->sizeofcmds)
+            break;
+        
+        if(lc->cmd == LC_SEGMENT_NATIVE)
+        {
+            const struct segment_command_native *seg = (const struct segment_command_native *)lc;
+            if(seg->fileoff == 0 && seg->filesize != 0)
+                slide = base - seg->vmaddr;
+            if(!have_first && seg->vmsize != 0 && seg->initprot != VM_PROT_NONE)
+            {
+                first = seg->vmaddr;
+                have_first = true;
+            }
+            if(!have_writable && (seg->initprot & VM_PROT_WRITE))
+            {
+                first_writable = seg->vmaddr;
+                have_writable = true;
+            }
+        }
+        else if(lc->cmd == LC_DYSYMTAB && lc->cmdsize >= sizeof(struct dysymtab_command))
+            dysymtab = (const struct dysymtab_command *)lc;
+        
+        offset += lc->cmdsize;
+    }
+    
+    // Cut the instruction sections along the target's pages
+    offset = 0;
+    for (uint32_t i = 0; i < file_header->ncmds && offset + sizeof(struct load_command) <= file_header->sizeofcmds; i++)
+    {
+        const struct load_command *lc = (const struct load_command *)(file_commands + offset);
+        if(lc->cmdsize == 0 || offset + lc->cmdsize > file_header->sizeofcmds)
+            break;
+        offset += lc->cmdsize;
+        if(lc->cmd != LC_SEGMENT_NATIVE)
+            continue;
+        
+        const struct segment_command_native *seg = (const struct segment_command_native *)lc;
+        const struct section_native *sect = (const struct section_native *)(seg + 1);
+        for (uint32_t n = 0; n < seg->nsects && (const uint8_t *)(sect + n + 1) <= (const uint8_t *)lc + lc->cmdsize; n++)
+        {
+            // dyld rewrites self-modifying sections (i386 __IMPORT jump tables) at bind time
+            if(!(sect[n].flags & (S_ATTR_PURE_INSTRUCTIONS | S_ATTR_SOME_INSTRUCTIONS)) || (sect[n].flags & S_ATTR_SELF_MODIFYING_CODE))
+                continue;
+            if(sect[n].size == 0 || sect[n].offset > slice_size || sect[n].size > slice_size - sect[n].offset)
+                continue;
+            
+            mach_vm_address_t start = sect[n].addr + slide;
+            mach_vm_address_t end = start + sect[n].size;
+            for (mach_vm_address_t address = start; address < end; )
+            {
+                mach_vm_address_t next = std::min((address & ~(page - 1)) + page, end);
+                Piece piece = { address, (uint32_t)(next - address), (uint32_t)index, slice + sect[n].offset + (address - start), 0, false, false };
+                _pieces.push_back(piece);
+                address = next;
+            }
+        }
+    }
+    
+    if(dysymtab)
+    {
+        mach_vm_address_t reloc_base = (header.cputype == CPU_TYPE_X86_64 || (file_header->flags & MH_SPLIT_SEGS)) ? first_writable : first;
+        const uint32_t tables[2][2] = { { dysymtab->locreloff, dysymtab->nlocrel }, { dysymtab->extreloff, dysymtab->nextrel } };
+        for (unsigned t = 0; t < 2; t++)
+        {
+            if(tables[t][0] > slice_size || (uint64_t)tables[t][1] * sizeof(struct relocation_info) > slice_size - tables[t][0])
+                continue;
+            
+            const struct relocation_info *relocs = (const struct relocation_info *)(slice + tables[t][0]);
+            for (uint32_t r = 0; r < tables[t][1]; r++)
+            {
+                uint32_t address, length;
+                if((uint32_t)relocs[r].r_address & R_SCATTERED)
+                {
+                    const struct scattered_relocation_info *scattered = (const struct scattered_relocation_info *)&relocs[r];
+                    address = scattered->r_address;
+                    length  = scattered->r_length;
+                }
+                else
+                {
+                    address = (uint32_t)relocs[r].r_address;
+                    length  = relocs[r].r_length;
+                }
+                
+                mach_vm_address_t target = reloc_base + slide + address;
+                _mask.Within(target, target + (1 << length));
+            }
+        }
+    }
+    
+    return kIntegrityIntact;
+}
+
+void CodeIntegrity::Diff( const Piece& piece, const uint8_t * data, std::vector<IntegrityDiff_t>& diffs ) const
+{
+    const std::vector<AddressRange_t>& masks = _mask.ranges();
+    std::vector<AddressRange_t>::const_iterator mask = std::upper_bound(masks.begin(), masks.end(), piece.address,
+        [](mach_vm_address_t address, const AddressRange_t& range) { return address < range.end; });
+    
+    size_t run = piece.size;
+    for (size_t i = 0; i <= piece.size; i++)
+    {
+        mach_vm_address_t address = piece.address + i;
+        while(mask != masks.end() && mask->end <= address)
+            ++mask;
+        
+        bool differs = i < piece.size && data[i] != piece.file[i] && !(mask != masks.end() && mask->start <= address);
+        if(differs && run == piece.size)
+            run = i;
+        else if(!differs && run != piece.size)
+        {
+            IntegrityDiff_t diff = { piece.address + run, i - run, piece.module };
+            diffs.push_back(diff);
+            run = piece.size;
+        }
+    }
+}
+
+kern_return_t CodeIntegrity::Verify( const std::vector<size_t>& pieces, std::vector<IntegrityDiff_t>& diffs, ScanJob* job )
+{
+    ProcessMemory& memory = _process.memory();
+    SchedulerGuard scheduling;   // per-worker state below stays sized for the workers that run
+    std::vector<std::vector<uint8_t> > buffers(scheduling.workers());
+    std::vector<std::vector<IntegrityDiff_t> > found(scheduling.workers());
+    
+    kern_return_t kret = Scheduler::Shared().ForEach(pieces.size(), [&](size_t index, unsigned worker) {
+        Piece& piece = _pieces[pieces[index]];
+        if(!piece.hashed)
+        {
+            piece.file_hash = Hash64(piece.file, piece.size);
+            piece.hashed = true;
+        }
+        
+        // A page that can't be read keeps its last verdict
+        std::vector<uint8_t>& buffer = buffers[worker];
+        buffer.resize(piece.size);
+        if(memory.TryRead(piece.address, piece.size, buffer.data()) != KERN_SUCCESS)
+            return;
+        
+        if(Hash64(buffer.data(), piece.size) == piece.file_hash)
+        {
+            piece.modified = false;
+            return;
+        }
+        
+        size_t before = found[worker].size();
+        Diff(piece, buffer.data(), found[worker]);
+        piece.modified = found[worker].size() != before;
+    }, job);
+    
+    diffs.clear();
+    for (size_t i = 0; i < found.size(); i++)
+        diffs.insert(diffs.end(), found[i].begin(), found[i].end());
+    std::sort(diffs.begin(), diffs.end(), [](const IntegrityDiff_t& a, const IntegrityDiff_t& b) { return a.address < b.address; });
+    
+    // Runs that continue over a page boundary
+    size_t count = 0;
+    for (size_t i = 0; i < diffs.size(); i++)
+    {
+        if(count && diffs[count - 1].address + diffs[count - 1].size == diffs[i].address && diffs[count - 1].module == diffs[i].module)
+            diffs[count - 1].size += diffs[i].size;
+        else
+            diffs[count++] = diffs[i];
+    }
+    diffs.resize(count);
+    
+    for (std::vector<ModuleIntegrity_t>::iterator it = _modules.begin(); it != _modules.end(); ++it)
+        it->modified = 0;
+    for (std::vector<Piece>::const_iterator it = _pieces.begin(); it != _pieces.end(); ++it)
+        _modules[it->module].modified += it->modified;
+    for (std::vector<ModuleIntegrity_t>::iterator it = _modules.begin(); it != _modules.end(); ++it)
+    {
+        if(it->status == kIntegrityIntact || it->status == kIntegrityModified)
+            it->status = it->modified ? kIntegrityModified : kIntegrityIntact;
+    }
+    
+    _rehashed = pieces.size();
+    return kret;
+}
+
+kern_return_t CodeIntegrity::Check( std::vector<IntegrityDiff_t>& diffs, ScanJob* job /* = nullptr */ )
+{
+    TraceSpan span("Check", "CodeIntegrity");
+    Release();
+    _mask = _user_mask;
+    
+    ProcessModules& modules = _process.modules();
+    modules.Refresh();
+    std::vector<ModuleData_t> list = modules.modules();
+    
+    for (size_t i = 0; i < list.size(); i++)
+    {
+        ModuleIntegrity_t entry = { (mach_vm_address_t)list[i].imageLoadAddress, list[i].imageFilePath, kIntegrityIntact, 0, 0 };
+        _modules.push_back(entry);
+        
+        size_t before = _pieces.size();
+        _modules[i].status = Load(i, entry.base, entry.path);
+        _modules[i].pages = _pieces.size() - before;
+    }
+    
+    std::vector<size_t> pieces(_pieces.size());
+    for (size_t i = 0; i < pieces.size(); i++)
+        pieces[i] = i;
+    return Verify(pieces, diffs, job);
+}
+
+kern_return_t CodeIntegrity::Recheck( std::vector<IntegrityDiff_t>& diffs, ScanJob* job /* = nullptr */ )
+{
+    TraceSpan span("Recheck", "CodeIntegrity");
+    ProcessMemory& memory = _process.memory();
+    const mach_vm_size_t page = getpagesize();
+    std::vector<size_t> pieces;
+    std::vector<integer_t> dispositions;
+    
+    for (size_t first = 0; first < _pieces.size(); )
+    {
+        // Pieces of one module on adjacent pages share one query
+        mach_vm_address_t start = _pieces[first].address & ~(page - 1);
+        mach_vm_address_t end = (_pieces[first].address + _pieces[first].size + page - 1) & ~(page - 1);
+        size_t last = first + 1;
+        while(last < _pieces.size() && _pieces[last].module == _pieces[first].module && (_pieces[last].address & ~(page - 1)) <= end)
+        {
+            end = std::max(end, (_pieces[last].address + _pieces[last].size + page - 1) & ~(page - 1));
+            last++;
+        }
+        
+        bool queried = memory.QueryPages(start, end - start, dispositions) == KERN_SUCCESS;
+        for (size_t i = first; i < last; i++)
+        {
+            // Only a resident page that is neither dirty, copied nor paged out is known to match its file
+            integer_t state = queried ? dispositions[(_pieces[i].address - start) / page] : VM_PAGE_QUERY_PAGE_DIRTY;
+            bool clean = (state & VM_PAGE_QUERY_PAGE_PRESENT) &&
+                         !(state & (VM_PAGE_QUERY_PAGE_DIRTY | VM_PAGE_QUERY_PAGE_COPIED | VM_PAGE_QUERY_PAGE_PAGED_OUT));
+            if(_pieces[i].modified || !clean)
+                pieces.push_back(i);
+        }
+        first = last;
+    }
+    
+    return Verify(pieces, diffs, job);
+}
@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+
+
+#ifndef __xnumem__CodeIntegrity__
+#define __xnumem__CodeIntegrity__
+
+#include <mach/mach.h>
+#include <stdint.h>
+#include <vector>
+
+#include "RegionIndex.h"
+
+class ScanJob;
+
+enum {
+    kIntegrityIntact = 0,       // every verified page matches the file
+    kIntegrityModified,         // some pages differ outside masked bytes
+    kIntegrityNoFile,           // no file to compare with, e.g. images only in the shared cache
+    kIntegrityMismatch,         // the file is not the mapped image: other UUID or no matching architecture
+    kIntegrityUnreadable,       // the image header can't be read
+};
+
+typedef struct IntegrityDiff {
+    mach_vm_address_t address;
+    mach_vm_size_t    size;
+    size_t            module;   // index into modules()
+} IntegrityDiff_t;
+
+typedef struct ModuleIntegrity {
+    mach_vm_address_t base;
+    const char *      path;     // from ProcessModules
+    int               status;   // kIntegrity*
+    size_t            pages;    // page pieces of code compared
+    size_t            modified; // page pieces differing
+} ModuleIntegrity_t;
+
+/**
+ Compares the code of every loaded module with its image on disk, to catch hot patches
+ and corruption of executable mappings.
+ 
+ The instruction sections of each module file are mapped and cut along the target's
+ pages; a check hashes both sides of every page and byte-compares only the pages whose
+ hashes differ. Relocation targets and self-modifying sections are masked, as are any
+ ranges passed to Mask. Clean resident pages of a file mapping can't differ from the file,
+ so a recheck skips them and hashes only the pages that are dirty, copied, paged out or not
+ resident, plus those already found modified; it is cheap enough to run every few seconds:
+ 
+    CodeIntegrity integrity(process);
+    std::vector<IntegrityDiff_t> diffs;
+    integrity.Check(diffs);
+    ...
+    integrity.Recheck(diffs);
+ */
+class CodeIntegrity
+{
+public:
+    CodeIntegrity( class xnu_proc& process );
+    ~CodeIntegrity();
+    
+    /**
+     Map the files of all loaded modules and compare every page of their code.
+     Picks up modules loaded since the last check.
+     
+     @param diffs -- Output byte ranges that differ, in address order.
+     @param job   -- Cancellation / progress, counted in pages. (optional)
+     @return Status.
+     */
+    kern_return_t Check( std::vector<IntegrityDiff_t>& diffs, ScanJob* job = nullptr );
+    
+    /**
+     Compare again the pages that may have changed since the last check. Falls back to
+     every page when page state can't be queried, as for offline sources.
+     
+     @param diffs -- Output byte ranges that differ, in address order.
+     @param job   -- Cancellation / progress, counted in pages. (optional)
+     @return Status.
+     */
+    kern_return_t Recheck( std::vector<IntegrityDiff_t>& diffs, ScanJob* job = nullptr );
+    
+    /**
+     Ignore differences in [start, end), e.g. around known, legitimate patches.
+     
+     @param start -- First address.
+     @param end   -- One past the last address.
+     @return void
+     */
+    void Mask( mach_vm_address_t start, mach_vm_address_t end );
+    
+    inline const std::vector<ModuleIntegrity_t>& modules() const { return _modules; }
+    
+    // Pages hashed by the last check or recheck.
+    inline size_t rehashed() const { return _rehashed; }
+    
+private:
+    CodeIntegrity( const CodeIntegrity& ) = delete;
+    CodeIntegrity& operator =(const CodeIntegrity&) = delete;
+    
+    struct Mapping {
+        void * data;
+        size_t size;
+    };
+    
+    // Part of a code section within one target page
+    struct Piece {
+        mach_vm_address_t address;
+        uint32_t          size;
+        uint32_t          module;
+        const uint8_t *   file;
+        uint64_t          file_hash;
+        bool              hashed;       // file_hash is computed on first use, in parallel
+        bool              modified;
+    };
+    
+    int Load( size_t index, mach_vm_address_t base, const char * path );
+    kern_return_t Verify( const std::vector<size_t>& pieces, std::vector<IntegrityDiff_t>& diffs, ScanJob* job );
+    void Diff( const Piece& piece, const uint8_t * data, std::vector<IntegrityDiff_t>& diffs ) const;
+    void Release();
+    
+    class xnu_proc&                 _process;
+    std::vector<ModuleIntegrity_t>  _modules;
+    std::vector<Mapping>            _mappings;
+    std::vector<Piece>              _pieces;    // address order within each module
+    ScanScope                       _user_mask;
+    ScanScope                       _mask;      // _user_mask and relocations
+    size_t                          _rehashed;
+};
+
+#endif /* defined(__xnumem__CodeIntegrity__) */
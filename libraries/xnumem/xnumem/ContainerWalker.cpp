@@ -0,0 +1,323 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+
+
+#include "ContainerWalker.h"
+#include "Epoch.h"
+#include "Trace.h"
+#include "xnumem.h"
+
+#include <algorithm>
+#include <unordered_set>
+
+// List nodes are read through windows of this size, a frontier's nodes in one batch
+static const mach_vm_size_t kWindowSize = 16 * 1024;
+static const size_t         kMaxWindows = 256;
+
+// Elements read from a vector per read
+static const size_t         kVectorBlock = 1024 * 1024;
+
+ContainerWalker::ContainerWalker( xnu_proc& process ) :
+    _process(process),
+    _reads(0)
+{
+}
+
+bool ContainerWalker::Valid( mach_vm_address_t address, size_t size ) const
+{
+    if(address == 0 || (address & (sizeof(void *) - 1)) || address + size < address)
+        return false;
+    
+    // Regions mapped or grown since the index was built are left to the read
+    EpochGuard guard;
+    const MemoryRegion_t* region = _process.memory().regions().Find(address);
+    return region == nullptr || (region->info.protection & VM_PROT_READ);
+}
+
+const uint8_t * ContainerWalker::Fetch( mach_vm_address_t address, size_t size )
+{
+    mach_vm_address_t window = address & ~(kWindowSize - 1);
+    if(address + size <= window + kWindowSize)
+    {
+        std::unordered_map<mach_vm_address_t, std::vector<uint8_t> >::iterator it = _windows.find(window);
+        if(it != _windows.end())
+            return it->second.empty() ? nullptr : &it->second[address - window];
+        
+        if(_windows.size() >= kMaxWindows)
+            _windows.clear();
+        
+        std::vector<uint8_t>& data = _windows[window];
+        data.resize(kWindowSize);
+        _reads++;
+        if(_process.memory().TryRead(window, kWindowSize, data.data()) == KERN_SUCCESS)
+            return &data[address - window];
+        
+        // Part of the window is unmapped, don't try it again
+        data.clear();
+    }
+    
+    // Straddles windows or sits next to a hole: read the node alone
+    std::vector<uint8_t>& data = _windows[address | 1];
+    data.resize(size);
+    _reads++;
+    return _process.memory().TryRead(address, size, data.data()) == KERN_SUCCESS ? data.data() : nullptr;
+}
+
+kern_return_t ContainerWalker::WalkVector( mach_vm_address_t address, size_t element_size, const ElementFn& fn )
+{
+    TraceSpan span("WalkVector", "ContainerWalker");
+    // begin, end, end of capacity
+    uint8_t header[3 * sizeof(void *)];
+    _reads = 1;
+    kern_return_t kret = _process.memory().TryRead(address, sizeof(header), header);
+    if(kret != KERN_SUCCESS)
+        return kret;
+    
+    mach_vm_address_t begin = Pointer(header, 0), end = Pointer(header, 1), capacity = Pointer(header, 2);
+    if(begin == end)
+        return KERN_SUCCESS;
+    if(element_size == 0 || end < begin || capacity < end || (end - begin) % element_size || !Valid(begin, end - begin))
+        return KERN_INVALID_ADDRESS;
+    
+    size_t count = (end - begin) / element_size;
+    size_t block = std::max<size_t>(1, kVectorBlock / element_size);
+    std::vector<uint8_t> data;
+    for (size_t first = 0; first < count; first += block)
+    {
+        size_t elements = std::min(block, count - first);
+        data.resize(elements * element_size);
+        _reads++;
+        kret = _process.memory().TryRead(begin + first * element_size, data.size(), data.data());
+        if(kret != KERN_SUCCESS)
+            return kret;
+        
+        for (size_t i = 0; i < elements; i++)
+            fn(first + i, &data[i * element_size]);
+    }
+    
+    return KERN_SUCCESS;
+}
+
+kern_return_t ContainerWalker::WalkList( mach_vm_address_t address, size_t value_offset, size_t value_size, const ElementFn& fn )
+{
+    TraceSpan span("WalkList", "ContainerWalker");
+    // The list object holds the sentinel node: prev (last), next (first), then the size
+    _windows.clear();
+    _reads = 0;
+    const uint8_t *header = Fetch(address, 3 * sizeof(void *));
+    if(header == nullptr)
+        return KERN_INVALID_ADDRESS;
+    
+    size_t size = Pointer(header, 2);
+    size_t node_size = value_offset + value_size;
+    mach_vm_address_t previous = address;
+    mach_vm_address_t node = Pointer(header, 1);
+    std::unordered_set<mach_vm_address_t> seen;
+    
+    for (size_t index = 0; node != address; index++)
+    {
+        if(index >= size || !Valid(node, node_size) || !seen.insert(node).second)
+            return KERN_INVALID_ADDRESS;
+        
+        const uint8_t *data = Fetch(node, node_size);
+        if(data == nullptr || Pointer(data, 0) != previous)
+            return KERN_INVALID_ADDRESS;
+        
+        fn(index, data + value_offset);
+        previous = node;
+        node = Pointer(data, 1);
+    }
+    
+    _windows.clear();
+    return seen.size() == size ? KERN_SUCCESS : KERN_INVALID_ADDRESS;
+}
+
+kern_return_t ContainerWalker::WalkTree( mach_vm_address_t address, size_t value_offset, size_t value_size, const ElementFn& fn )
+{
+    TraceSpan span("WalkTree", "ContainerWalker");
+    // begin node, end node (whose left is the root), size
+    ProcessMemory& memory = _process.memory();
+    uint8_t header[3 * sizeof(void *)];
+    _reads = 1;
+    kern_return_t kret = memory.TryRead(address, sizeof(header), header);
+    if(kret != KERN_SUCCESS)
+        return kret;
+    
+    size_t size = Pointer(header, 2);
+    mach_vm_address_t root = Pointer(header, 1);
+    if(root == 0)
+        return size == 0 ? KERN_SUCCESS : KERN_INVALID_ADDRESS;
+    
+    struct Visit {
+        mach_vm_address_t node;
+        mach_vm_address_t parent;
+    };
+    
+    size_t node_size = value_offset + value_size;
+    std::vector<Visit> frontier(1), next;
+    frontier[0].node = root;
+    frontier[0].parent = address + sizeof(void *);
+    std::unordered_set<mach_vm_address_t> seen;
+    std::vector<uint8_t> nodes;
+    std::vector<ReadRequest_t> requests;
+    size_t index = 0;
+    
+    while(!frontier.empty())
+    {
+        if(index + frontier.size() > size)
+            return KERN_INVALID_ADDRESS;
+        
+        nodes.resize(frontier.size() * node_size);
+        requests.resize(frontier.size());
+        for (size_t i = 0; i < frontier.size(); i++)
+        {
+            if(!Valid(frontier[i].node, node_size) || !seen.insert(frontier[i].node).second)
+                return KERN_INVALID_ADDRESS;
+            
+            ReadRequest_t request = { frontier[i].node, node_size, &nodes[i * node_size], KERN_SUCCESS };
+            requests[i] = request;
+        }
+        
+        _reads++;
+        if(memory.ReadBatch(requests) != KERN_SUCCESS)
+            return KERN_INVALID_ADDRESS;
+        
+        next.clear();
+        for (size_t i = 0; i < frontier.size(); i++)
+        {
+            // left, right, parent
+            const uint8_t *data = &nodes[i * node_size];
+            if(Pointer(data, 2) != frontier[i].parent)
+                return KERN_INVALID_ADDRESS;
+            
+            fn(index++, data + value_offset);
+            for (size_t child = 0; child < 2; child++)
+            {
+                Visit visit = { Pointer(data, child), frontier[i].node };
+                if(visit.node)
+                    next.push_back(visit);
+            }
+        }
+        frontier.swap(next);
+    }
+    
+    return index == size ? KERN_SUCCESS : KERN_INVALID_ADDRESS;
+}
+
+kern_return_t ContainerWalker::WalkHash( mach_vm_address_t address, size_t value_offset, size_t value_size, const ElementFn& fn )
+{
+    TraceSpan span("WalkHash", "ContainerWalker");
+    // buckets, bucket count, first node (the list before the first bucket), size
+    ProcessMemory& memory = _process.memory();
+    uint8_t header[4 * sizeof(void *)];
+    _reads = 1;
+    kern_return_t kret = memory.TryRead(address, sizeof(header), header);
+    if(kret != KERN_SUCCESS)
+        return kret;
+    
+    mach_vm_address_t buckets = Pointer(header, 0);
+    size_t bucket_count = Pointer(header, 1);
+    size_t size = Pointer(header, 3);
+    if(size == 0)
+        return KERN_SUCCESS;
+    if(bucket_count == 0 || bucket_count > SIZE_MAX / sizeof(void *) || !Valid(buckets, bucket_count * sizeof(void *)))
+        return KERN_INVALID_ADDRESS;
+    
+    // Each bucket points at the node before its first one, so all chains start one read in
+    std::vector<mach_vm_address_t> table(bucket_count);
+    _reads++;
+    kret = memory.TryRead(buckets, bucket_count * sizeof(void *), table.data());
+    if(kret != KERN_SUCCESS)
+        return kret;
+    
+    struct Chain {
+        size_t            bucket;
+        mach_vm_address_t node;
+    };
+    
+    std::vector<Chain> chains, next;
+    std::vector<ReadRequest_t> requests;
+    for (size_t bucket = 0; bucket < bucket_count; bucket++)
+    {
+        if(table[bucket] == 0)
+            continue;
+        if(!Valid(table[bucket], sizeof(void *)))
+            return KERN_INVALID_ADDRESS;
+        
+        Chain chain = { bucket, 0 };
+        ReadRequest_t request = { table[bucket], sizeof(void *), nullptr, KERN_SUCCESS };
+        chains.push_back(chain);
+        requests.push_back(request);
+    }
+    for (size_t i = 0; i < chains.size(); i++)
+        requests[i].buffer = &chains[i].node;
+    
+    _reads++;
+    if(memory.ReadBatch(requests) != KERN_SUCCESS)
+        return KERN_INVALID_ADDRESS;
+    
+    // Advance every chain one node per batch until each runs into the next bucket
+    bool pow2 = (bucket_count & (bucket_count - 1)) == 0;
+    size_t node_size = value_offset + value_size;
+    std::unordered_set<mach_vm_address_t> seen;
+    std::vector<uint8_t> nodes;
+    size_t index = 0;
+    
+    while(!chains.empty())
+    {
+        nodes.resize(chains.size() * node_size);
+        requests.resize(chains.size());
+        for (size_t i = 0; i < chains.size(); i++)
+        {
+            if(!Valid(chains[i].node, node_size))
+                return KERN_INVALID_ADDRESS;
+            
+            ReadRequest_t request = { chains[i].node, node_size, &nodes[i * node_size], KERN_SUCCESS };
+            requests[i] = request;
+        }
+        
+        _reads++;
+        if(memory.ReadBatch(requests) != KERN_SUCCESS)
+            return KERN_INVALID_ADDRESS;
+        
+        next.clear();
+        for (size_t i = 0; i < chains.size(); i++)
+        {
+            // next, hash
+            const uint8_t *data = &nodes[i * node_size];
+            size_t hash = Pointer(data, 1);
+            size_t bucket = pow2 ? hash & (bucket_count - 1) : (hash < bucket_count ? hash : hash % bucket_count);
+            if(bucket != chains[i].bucket)
+                continue;
+            
+            if(index >= size || !seen.insert(chains[i].node).second)
+                return KERN_INVALID_ADDRESS;
+            fn(index++, data + value_offset);
+            
+            Chain chain = { chains[i].bucket, Pointer(data, 0) };
+            if(chain.node)
+                next.push_back(chain);
+        }
+        chains.swap(next);
+    }
+    
+    return index == size ? KERN_SUCCESS : KERN_INVALID_ADDRESS;
+}
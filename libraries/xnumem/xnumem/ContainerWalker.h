@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+
+
+#ifndef __xnumem__ContainerWalker__
+#define __xnumem__ContainerWalker__
+
+#include <mach/mach.h>
+#include <stdint.h>
+#include <string.h>
+#include <functional>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+typedef std::function<void( size_t index, const uint8_t * value )> ElementFn;
+
+/**
+ Walks the standard containers of a process without a round trip per element.
+ 
+ Layouts are libc++'s, the standard library of every macOS target, and element types
+ must match the target's (same pointer size, trivially copyable). Trees and hash tables
+ are walked breadth first: every node of a frontier is fetched with one ReadBatch, so a
+ million node std::map costs about twenty batches. Lists can only be followed node by
+ node and are read through a cache of 16KB windows, which takes whole runs of nodes
+ allocated back to back in one read.
+ 
+ Every node pointer is checked before it is followed: it must be aligned, not point
+ into a region the index knows to be unreadable, not have been seen before, and a tree
+ node must point back at its parent. The walk stops at the first bad pointer, keeping
+ the elements already reported, and returns KERN_INVALID_ADDRESS.
+ 
+    ContainerWalker walker(process);
+    walker.Map<int, double>(address, [](const int& key, const double& value) { ... });
+ */
+class ContainerWalker
+{
+public:
+    ContainerWalker( class xnu_proc& process );
+    
+    /**
+     Walk a std::vector<T>.
+     
+     @param address -- Address of the vector object.
+     @param fn      -- Called for every element, in order.
+     @return Status.
+     */
+    template <typename T>
+    inline kern_return_t Vector( mach_vm_address_t address, const std::function<void( size_t index, const T& value )>& fn )
+    {
+        return WalkVector(address, sizeof(T), [&](size_t index, const uint8_t * data) { fn(index, Element<T>(data)); });
+    }
+    
+    /**
+     Walk a std::list<T>.
+     
+     @param address -- Address of the list object.
+     @param fn      -- Called for every element, in order.
+     @return Status.
+     */
+    template <typename T>
+    inline kern_return_t List( mach_vm_address_t address, const std::function<void( size_t index, const T& value )>& fn )
+    {
+        return WalkList(address, ValueOffset(2 * sizeof(void *), alignof(T)), sizeof(T), [&](size_t index, const uint8_t * data) { fn(index, Element<T>(data)); });
+    }
+    
+    /**
+     Walk a std::map<K, V>.
+     
+     @param address -- Address of the map object.
+     @param fn      -- Called for every entry, breadth first, not in key order.
+     @return Status.
+     */
+    template <typename K, typename V>
+    inline kern_return_t Map( mach_vm_address_t address, const std::function<void( const K& key, const V& value )>& fn )
+    {
+        // __tree_node_base: left, right, parent, is_black, with the value in its tail padding
+        return WalkTree(address, ValueOffset(3 * sizeof(void *) + 1, EntryAlign<K, V>()), EntrySize<K, V>(), [&](size_t, const uint8_t * data) {
+            fn(Element<K>(data), Element<V>(data + ValueOffset(sizeof(K), alignof(V))));
+        });
+    }
+    
+    /**
+     Walk a std::unordered_map<K, V>.
+     
+     @param address -- Address of the unordered map object.
+     @param fn      -- Called for every entry, in no particular order.
+     @return Status.
+     */
+    template <typename K, typename V>
+    inline kern_return_t UnorderedMap( mach_vm_address_t address, const std::function<void( const K& key, const V& value )>& fn )
+    {
+        // __hash_node: next, hash, value
+        return WalkHash(address, ValueOffset(2 * sizeof(void *), EntryAlign<K, V>()), EntrySize<K, V>(), [&](size_t, const uint8_t * data) {
+            fn(Element<K>(data), Element<V>(data + ValueOffset(sizeof(K), alignof(V))));
+        });
+    }
+    
+    // Untyped walks. value_offset is the offset of the element within a node.
+    kern_return_t WalkVector( mach_vm_address_t address, size_t element_size, const ElementFn& fn );
+    kern_return_t WalkList( mach_vm_address_t address, size_t value_offset, size_t value_size, const ElementFn& fn );
+    kern_return_t WalkTree( mach_vm_address_t address, size_t value_offset, size_t value_size, const ElementFn& fn );
+    kern_return_t WalkHash( mach_vm_address_t address, size_t value_offset, size_t value_size, const ElementFn& fn );
+    
+    // Reads issued by the last walk.
+    inline size_t reads() const { return _reads; }
+    
+private:
+    ContainerWalker( const ContainerWalker& ) = delete;
+    ContainerWalker& operator =(const ContainerWalker&) = delete;
+    
+    static inline size_t ValueOffset( size_t header, size_t align ) { return (header + align - 1) & ~(align - 1); }
+    
+    // Layout of std::pair<K, V>, computed rather than taken from std::pair, which isn't trivially copyable
+    template <typename K, typename V>
+    static inline size_t EntryAlign() { return alignof(K) > alignof(V) ? alignof(K) : alignof(V); }
+    template <typename K, typename V>
+    static inline size_t EntrySize() { return ValueOffset(ValueOffset(sizeof(K), alignof(V)) + sizeof(V), EntryAlign<K, V>()); }
+    
+    template <typename T>
+    static inline T Element( const uint8_t * data )
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "remote elements are copied bytewise");
+        T value;
+        memcpy((void *)&value, data, sizeof(T));
+        return value;
+    }
+    
+    static inline mach_vm_address_t Pointer( const uint8_t * data, size_t index )
+    {
+        mach_vm_address_t pointer = 0;
+        memcpy(&pointer, data + index * sizeof(void *), sizeof(void *));
+        return pointer;
+    }
+    
+    bool Valid( mach_vm_address_t address, size_t size ) const;
+    const uint8_t * Fetch( mach_vm_address_t address, size_t size );
+    
+    class xnu_proc&     _process;
+    size_t              _reads;
+    
+    // List node windows, by window address
+    std::unordered_map<mach_vm_address_t, std::vector<uint8_t> > _windows;
+};
+
+#endif /* defined(__xnumem__ContainerWalker__) */
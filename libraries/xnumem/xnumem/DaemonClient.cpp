@@ -0,0 +1,290 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+
+#include "DaemonClient.h"
+#include "xnumem.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+DaemonClient::DaemonClient()
+: _socket(-1), _sequence(0), _segment(nullptr), _segment_size(0)
+{
+    
+}
+
+DaemonClient::~DaemonClient()
+{
+    Close();
+}
+
+kern_return_t DaemonClient::Connect( const char * path /* = kDaemonSocketPath */ )
+{
+    Close();
+    
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if(path == nullptr || strlen(path) >= sizeof(address.sun_path))
+        return KERN_INVALID_ARGUMENT;
+    strcpy(address.sun_path, path);
+    
+    _socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(_socket < 0)
+        return KERN_FAILURE;
+    if(connect(_socket, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+        Close();
+        return KERN_FAILURE;
+    }
+    DaemonNoSigPipe(_socket);
+    return KERN_SUCCESS;
+}
+
+void DaemonClient::Close()
+{
+    if(_socket >= 0)
+        close(_socket);
+    if(_segment)
+        munmap((void *)_segment, _segment_size);
+    _socket = -1;
+    _segment = nullptr;
+    _segment_size = 0;
+}
+
+kern_return_t DaemonClient::Call( int pid, uint16_t op, const void * payload, size_t size, const uint8_t *& result, uint64_t& result_size )
+{
+    result = nullptr;
+    result_size = 0;
+    if(_socket < 0)
+        return KERN_FAILURE;
+    
+    // Header and payload in one write
+    DaemonHeader_t header = {};
+    header.magic = kDaemonMagic;
+    header.version = kDaemonVersion;
+    header.op = op;
+    header.sequence = ++_sequence;
+    header.pid = pid;
+    header.size = size;
+    _request.resize(sizeof(header) + size);
+    memcpy(_request.data(), &header, sizeof(header));
+    if(size)
+        memcpy(_request.data() + sizeof(header), payload, size);
+    
+    DaemonHeader_t reply;
+    int fd = -1;
+    if(!DaemonSend(_socket, _request.data(), _request.size()) ||
+       !DaemonReceive(_socket, &reply, sizeof(reply), &fd) ||
+       reply.magic != kDaemonMagic || reply.sequence != header.sequence)
+    {
+        if(fd >= 0)
+            close(fd);
+        Close();
+        return KERN_FAILURE;
+    }
+    
+    if(fd >= 0)
+    {
+        struct stat info;
+        void * segment = MAP_FAILED;
+        if(fstat(fd, &info) == 0)
+            segment = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if(_segment)
+            munmap((void *)_segment, _segment_size);
+        _segment = segment == MAP_FAILED ? nullptr : (const uint8_t *)segment;
+        _segment_size = segment == MAP_FAILED ? 0 : info.st_size;
+    }
+    
+    if(reply.flags & kDaemonShared)
+    {
+        if(_segment == nullptr || reply.size > _segment_size)
+        {
+            Close();
+            return KERN_FAILURE;
+        }
+        result = _segment;
+    }
+    else
+    {
+        _result.resize(reply.size);
+        if(reply.size && !DaemonReceive(_socket, _result.data(), reply.size))
+        {
+            Close();
+            return KERN_FAILURE;
+        }
+        result = _result.data();
+    }
+    result_size = reply.size;
+    return reply.status;
+}
+
+kern_return_t DaemonClient::Attach( int pid, DaemonAttachResult_t * result /* = nullptr */ )
+{
+    const uint8_t * data;
+    uint64_t size;
+    kern_return_t kret = Call(pid, kDaemonAttach, nullptr, 0, data, size);
+    if(result && kret == KERN_SUCCESS && size == sizeof(DaemonAttachResult_t))
+        memcpy(result, data, sizeof(DaemonAttachResult_t));
+    return kret;
+}
+
+kern_return_t DaemonClient::Detach( int pid )
+{
+    const uint8_t * data;
+    uint64_t size;
+    return Call(pid, kDaemonDetach, nullptr, 0, data, size);
+}
+
+kern_return_t DaemonClient::Refresh( int pid, DaemonAttachResult_t * result /* = nullptr */ )
+{
+    const uint8_t * data;
+    uint64_t size;
+    kern_return_t kret = Call(pid, kDaemonRefresh, nullptr, 0, data, size);
+    if(result && kret == KERN_SUCCESS && size == sizeof(DaemonAttachResult_t))
+        memcpy(result, data, sizeof(DaemonAttachResult_t));
+    return kret;
+}
+
+kern_return_t DaemonClient::ReadBatch( int pid, std::vector<ReadRequest_t>& requests )
+{
+    std::vector<DaemonRange_t> ranges(requests.size());
+    uint64_t expected = DaemonAlign(requests.size() * sizeof(int32_t));
+    for (size_t i = 0; i < requests.size(); i++)
+    {
+        ranges[i].address = requests[i].address;
+        ranges[i].size = requests[i].size;
+        expected += requests[i].size;
+    }
+    
+    const uint8_t * data;
+    uint64_t size;
+    kern_return_t kret = Call(pid, kDaemonReadBatch, ranges.data(), ranges.size() * sizeof(DaemonRange_t), data, size);
+    if(size != expected)
+    {
+        for (size_t i = 0; i < requests.size(); i++)
+            requests[i].status = kret == KERN_SUCCESS ? KERN_FAILURE : kret;
+        return kret == KERN_SUCCESS ? KERN_FAILURE : kret;
+    }
+    
+    const int32_t * status = (const int32_t *)data;
+    data += DaemonAlign(requests.size() * sizeof(int32_t));
+    for (size_t i = 0; i < requests.size(); i++)
+    {
+        requests[i].status = status[i];
+        if(status[i] == KERN_SUCCESS)
+            memcpy(requests[i].buffer, data, requests[i].size);
+        data += requests[i].size;
+    }
+    return kret;
+}
+
+kern_return_t DaemonClient::ReadPointerChains( int pid, std::vector<PointerChain_t>& chains )
+{
+    std::vector<uint8_t> payload;
+    uint64_t expected = 0;
+    for (size_t i = 0; i < chains.size(); i++)
+    {
+        DaemonChain_t chain;
+        chain.base = chains[i].base;
+        chain.levels = (uint32_t)chains[i].offsets.size();
+        chain.size = (uint32_t)chains[i].size;
+        
+        size_t offset = payload.size();
+        payload.resize(offset + sizeof(chain) + chain.levels * sizeof(int64_t));
+        memcpy(&payload[offset], &chain, sizeof(chain));
+        if(chain.levels)
+            memcpy(&payload[offset + sizeof(chain)], chains[i].offsets.data(), chain.levels * sizeof(int64_t));
+        expected += sizeof(DaemonChainResult_t) + DaemonAlign(chain.size);
+    }
+    
+    const uint8_t * data;
+    uint64_t size;
+    kern_return_t kret = Call(pid, kDaemonPointerChain, payload.data(), payload.size(), data, size);
+    if(size != expected)
+    {
+        for (size_t i = 0; i < chains.size(); i++)
+            chains[i].status = kret == KERN_SUCCESS ? KERN_FAILURE : kret;
+        return kret == KERN_SUCCESS ? KERN_FAILURE : kret;
+    }
+    
+    for (size_t i = 0; i < chains.size(); i++)
+    {
+        const DaemonChainResult_t * resolved = (const DaemonChainResult_t *)data;
+        data += sizeof(DaemonChainResult_t);
+        chains[i].address = resolved->address;
+        chains[i].depth = resolved->depth;
+        chains[i].status = resolved->status;
+        if(resolved->status == KERN_SUCCESS && chains[i].size)
+            memcpy(chains[i].buffer, data, chains[i].size);
+        data += DaemonAlign(chains[i].size);
+    }
+    return kret;
+}
+
+kern_return_t DaemonClient::Scan( int pid, const char * signature, std::vector<mach_vm_address_t>& matches,
+                                  mach_vm_address_t start /* = 0 */, mach_vm_address_t end /* = 0 */,
+                                  uint32_t limit /* = 0 */, uint32_t flags /* = 0 */ )
+{
+    matches.clear();
+    if(signature == nullptr)
+        return KERN_INVALID_ARGUMENT;
+    
+    DaemonScan_t scan;
+    scan.start = start;
+    scan.end = end;
+    scan.limit = limit;
+    scan.flags = flags;
+    std::vector<uint8_t> payload(sizeof(scan) + strlen(signature) + 1);
+    memcpy(payload.data(), &scan, sizeof(scan));
+    memcpy(payload.data() + sizeof(scan), signature, strlen(signature) + 1);
+    
+    const uint8_t * data;
+    uint64_t size;
+    kern_return_t kret = Call(pid, kDaemonScan, payload.data(), payload.size(), data, size);
+    matches.resize(size / sizeof(uint64_t));
+    for (size_t i = 0; i < matches.size(); i++)
+        matches[i] = ((const uint64_t *)data)[i];
+    return kret;
+}
+
+kern_return_t DaemonClient::Usage( int pid, MemoryUsageStats_t& total, std::vector<DaemonModuleUsage_t> * modules /* = nullptr */ )
+{
+    const uint8_t * data;
+    uint64_t size;
+    kern_return_t kret = Call(pid, kDaemonUsage, nullptr, 0, data, size);
+    if(kret != KERN_SUCCESS)
+        return kret;
+    
+    const DaemonUsage_t * report = (const DaemonUsage_t *)data;
+    if(size < sizeof(DaemonUsage_t) || size != sizeof(DaemonUsage_t) + report->modules * sizeof(DaemonModuleUsage_t))
+        return KERN_FAILURE;
+    
+    total = report->total;
+    if(modules)
+    {
+        const DaemonModuleUsage_t * entries = (const DaemonModuleUsage_t *)(report + 1);
+        modules->assign(entries, entries + report->modules);
+    }
+    return KERN_SUCCESS;
+}
@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+
+
+#ifndef __xnumem__DaemonClient__
+#define __xnumem__DaemonClient__
+
+#include <mach/mach.h>
+#include <stdint.h>
+#include <vector>
+
+#include "DaemonProtocol.h"
+#include "ProcessMemory.h"
+
+typedef struct PointerChain {
+    mach_vm_address_t    base;
+    std::vector<int64_t> offsets;   // per level: address = *address + offset
+    size_t               size;      // bytes to read at the final address
+    void *               buffer;
+    mach_vm_address_t    address;   // set by ReadPointerChains: final address, or the pointer that failed
+    uint32_t             depth;     // set by ReadPointerChains: levels followed
+    kern_return_t        status;    // set by ReadPointerChains
+} PointerChain_t;
+
+/**
+ Talks to xnumemd. Calls block until the reply came, one request in flight at a time.
+ 
+ Large results arrive in a segment the daemon shares with this connection and are
+ copied out of it into the caller's buffers, so there is no socket copy of the data.
+ 
+    DaemonClient client;
+    if(client.Connect() == KERN_SUCCESS)
+        client.ReadBatch(pid, requests);
+ */
+class DaemonClient
+{
+public:
+    DaemonClient();
+    ~DaemonClient();
+    
+    /**
+     Connect to a daemon.
+     
+     @param path -- Socket path. (optional)
+     @return KERN_FAILURE if no daemon listens there.
+     */
+    kern_return_t Connect( const char * path = kDaemonSocketPath );
+    
+    void Close();
+    
+    /**
+     Have the daemon attach a process, or tell whether it already is. Other calls attach
+     on first use too, this only makes the first one fast.
+     
+     @param pid    -- Process id.
+     @param result -- Index sizes, and whether the process was attached before. (optional)
+     @return Status.
+     */
+    kern_return_t Attach( int pid, DaemonAttachResult_t * result = nullptr );
+    
+    /**
+     Have the daemon drop a process.
+     
+     @param pid -- Process id.
+     @return KERN_INVALID_ARGUMENT if it was not attached.
+     */
+    kern_return_t Detach( int pid );
+    
+    /**
+     Rebuild the region index and refresh the module list of an attached process.
+     
+     @param pid    -- Process id.
+     @param result -- New index sizes. (optional)
+     @return Status.
+     */
+    kern_return_t Refresh( int pid, DaemonAttachResult_t * result = nullptr );
+    
+    /**
+     ProcessMemory::ReadBatch, in the daemon.
+     
+     @param pid      -- Process id.
+     @param requests -- Ranges and output buffers, statuses are set.
+     @return KERN_SUCCESS if every request was read, otherwise the status of a failed one.
+     */
+    kern_return_t ReadBatch( int pid, std::vector<ReadRequest_t>& requests );
+    
+    /**
+     Follow pointer chains and read where they end, all in one round trip.
+     
+     @param pid    -- Process id.
+     @param chains -- Chains and output buffers, results are set.
+     @return KERN_SUCCESS if every chain resolved, otherwise the status of a failed one.
+     */
+    kern_return_t ReadPointerChains( int pid, std::vector<PointerChain_t>& chains );
+    
+    /**
+     Scan for a signature with MultiPatternScanner, in the daemon.
+     
+     @param pid       -- Process id.
+     @param signature -- Hex bytes and wildcards, see MultiPatternScanner::AddSignature.
+     @param matches   -- Output addresses, ascending.
+     @param start     -- Only scan [start, end), 0 and 0 for every readable region. (optional)
+     @param end       -- One past the last address. (optional)
+     @param limit     -- Return the lowest limit matches, 0 for up to kDaemonMaxMatches. (optional)
+     @param flags     -- kPattern* flags. (optional)
+     @return Status.
+     */
+    kern_return_t Scan( int pid, const char * signature, std::vector<mach_vm_address_t>& matches,
+                        mach_vm_address_t start = 0, mach_vm_address_t end = 0, uint32_t limit = 0, uint32_t flags = 0 );
+    
+    /**
+     MemoryUsage totals and per module figures, in the daemon.
+     
+     @param pid     -- Process id.
+     @param total   -- Output totals.
+     @param modules -- Output per module usage. (optional)
+     @return Status.
+     */
+    kern_return_t Usage( int pid, MemoryUsageStats_t& total, std::vector<DaemonModuleUsage_t> * modules = nullptr );
+    
+    inline bool connected() const { return _socket >= 0; }
+    
+private:
+    DaemonClient( const DaemonClient& ) = delete;
+    DaemonClient& operator =(const DaemonClient&) = delete;
+    
+    // One round trip; the result stays valid until the next call
+    kern_return_t Call( int pid, uint16_t op, const void * payload, size_t size, const uint8_t *& result, uint64_t& result_size );
+    
+    int                  _socket;
+    uint32_t             _sequence;
+    std::vector<uint8_t> _request;
+    std::vector<uint8_t> _result;       // inline results
+    const uint8_t *      _segment;      // shared results, read only
+    size_t               _segment_size;
+};
+
+#endif /* defined(__xnumem__DaemonClient__) */
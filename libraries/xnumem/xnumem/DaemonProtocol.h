@@ -0,0 +1,244 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+
+
+#ifndef __xnumem__DaemonProtocol__
+#define __xnumem__DaemonProtocol__
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "MemoryUsage.h"
+
+/*
+ Wire format of xnumemd, shared by DaemonServer and DaemonClient.
+ 
+ A connection is a stream of requests, each a DaemonHeader_t followed by size payload
+ bytes, answered in order by a DaemonHeader_t with the same op and sequence. Numbers are
+ in host order, the socket is local. Every request names its process; the first request
+ for a pid attaches it, later ones reuse the attached xnu_proc and its indexes.
+ 
+ A result larger than kDaemonInlineLimit is written to the connection's shared memory
+ segment instead of the socket and flagged kDaemonShared; it starts at offset 0 and stays
+ valid until the next request. A reply that comes with a new, larger segment also
+ carries its descriptor (SCM_RIGHTS) and is flagged kDaemonSegment.
+ 
+    op                  request payload                     result
+    kDaemonAttach       -                                   DaemonAttachResult_t
+    kDaemonDetach       -                                   -
+    kDaemonRefresh      -                                   DaemonAttachResult_t
+    kDaemonReadBatch    DaemonRange_t[]                     int32_t status[] (8 aligned), data of each range
+    kDaemonPointerChain DaemonChain_t + int64_t offsets[],  DaemonChainResult_t + data (8 aligned),
+                        per chain                           per chain
+    kDaemonScan         DaemonScan_t + signature            uint64_t matches[], ascending
+    kDaemonUsage        -                                   DaemonUsage_t + DaemonModuleUsage_t[]
+ */
+
+static const uint32_t kDaemonMagic       = 0x646d6e78;         // "xnmd"
+static const uint16_t kDaemonVersion     = 1;
+static const size_t   kDaemonInlineLimit = 64 * 1024;          // larger results go through shared memory
+static const size_t   kDaemonMaxRequest  = 16 * 1024 * 1024;
+static const size_t   kDaemonMaxResult   = 1024 * 1024 * 1024;
+static const uint32_t kDaemonMaxMatches  = 1024 * 1024;        // per scan
+static const char     kDaemonSocketPath[] = "/tmp/xnumemd.sock";
+
+enum {
+    kDaemonAttach = 1,
+    kDaemonDetach,
+    kDaemonRefresh,
+    kDaemonReadBatch,
+    kDaemonPointerChain,
+    kDaemonScan,
+    kDaemonUsage,
+};
+
+enum {
+    kDaemonShared  = 1 << 0,    // result is in the shared segment
+    kDaemonSegment = 1 << 1,    // a new segment's descriptor comes with this reply
+};
+
+typedef struct DaemonHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t op;                // kDaemon*
+    uint32_t sequence;          // echoed in the reply
+    int32_t  pid;               // request: target process
+    int32_t  status;            // reply: kern_return_t
+    uint32_t flags;             // reply: kDaemonShared | kDaemonSegment
+    uint64_t size;              // payload bytes
+} DaemonHeader_t;
+
+typedef struct DaemonAttachResult {
+    uint64_t regions;
+    uint64_t modules;
+    uint32_t warm;              // 1 if the process was already attached
+    uint32_t reserved;
+} DaemonAttachResult_t;
+
+typedef struct DaemonRange {
+    uint64_t address;
+    uint64_t size;
+} DaemonRange_t;
+
+// Starting at base, each offset dereferences a pointer: address = *address + offset
+typedef struct DaemonChain {
+    uint64_t base;
+    uint32_t levels;            // offsets that follow
+    uint32_t size;              // bytes to read at the final address
+} DaemonChain_t;
+
+typedef struct DaemonChainResult {
+    uint64_t address;           // final address, or the pointer that could not be read
+    int32_t  status;
+    uint32_t depth;             // levels followed
+} DaemonChainResult_t;
+
+typedef struct DaemonScan {
+    uint64_t start;             // [start, end), 0 and 0 for every readable region
+    uint64_t end;
+    uint32_t limit;             // lowest matches returned, 0 or more than kDaemonMaxMatches for kDaemonMaxMatches
+    uint32_t flags;             // kPattern*
+} DaemonScan_t;
+
+typedef struct DaemonUsage {
+    MemoryUsageStats_t total;
+    uint64_t           modules;     // DaemonModuleUsage_t that follow
+} DaemonUsage_t;
+
+typedef struct DaemonModuleUsage {
+    uint64_t           address;
+    MemoryUsageStats_t usage;
+    char               name[64];    // file name, NUL terminated
+} DaemonModuleUsage_t;
+
+static inline uint64_t DaemonAlign( uint64_t size )
+{
+    return (size + 7) & ~7ULL;
+}
+
+// Broken connections fail the call instead of raising SIGPIPE
+static inline void DaemonNoSigPipe( int socket )
+{
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    setsockopt(socket, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+}
+
+/**
+ Send all of a buffer, optionally passing a descriptor along with its first byte.
+ 
+ @param socket -- Connected socket.
+ @param data   -- Bytes.
+ @param size   -- Size.
+ @param fd     -- Descriptor to pass, -1 for none. (optional)
+ @return false if the connection failed.
+ */
+static inline bool DaemonSend( int socket, const void * data, size_t size, int fd = -1 )
+{
+    const uint8_t * bytes = (const uint8_t *)data;
+    while(size)
+    {
+        struct iovec iov = { (void *)bytes, size };
+        struct msghdr message = {};
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        
+        char control[CMSG_SPACE(sizeof(int))];
+        if(fd >= 0)
+        {
+            memset(control, 0, sizeof(control));
+            message.msg_control = control;
+            message.msg_controllen = sizeof(control);
+            struct cmsghdr * header = CMSG_FIRSTHDR(&message);
+            header->cmsg_level = SOL_SOCKET;
+            header->cmsg_type = SCM_RIGHTS;
+            header->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(header), &fd, sizeof(int));
+        }
+        
+        ssize_t sent = sendmsg(socket, &message, 0);
+        if(sent < 0 && errno == EINTR)
+            continue;
+        if(sent <= 0)
+            return false;
+        
+        fd = -1;
+        bytes += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+/**
+ Receive exactly size bytes, picking up a descriptor passed along with them.
+ 
+ @param socket -- Connected socket.
+ @param data   -- Output buffer.
+ @param size   -- Size.
+ @param fd     -- Output descriptor, -1 if none came. (optional)
+ @return false on end of stream or error.
+ */
+static inline bool DaemonReceive( int socket, void * data, size_t size, int * fd = nullptr )
+{
+    uint8_t * bytes = (uint8_t *)data;
+    if(fd)
+        *fd = -1;
+    while(size)
+    {
+        struct iovec iov = { bytes, size };
+        struct msghdr message = {};
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        
+        char control[CMSG_SPACE(sizeof(int))];
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        
+        ssize_t received = recvmsg(socket, &message, 0);
+        if(received < 0 && errno == EINTR)
+            continue;
+        if(received <= 0)
+            return false;
+        
+        for (struct cmsghdr * header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header))
+        {
+            if(header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+                continue;
+            int passed;
+            memcpy(&passed, CMSG_DATA(header), sizeof(int));
+            if(fd && *fd < 0)
+                *fd = passed;
+            else
+                close(passed);
+        }
+        
+        bytes += received;
+        size -= received;
+    }
+    return true;
+}
+
+#endif /* defined(__xnumem__DaemonProtocol__) */
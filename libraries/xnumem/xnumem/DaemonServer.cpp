@@ -0,0 +1,577 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+
+#include "DaemonServer.h"
+#include "Epoch.h"
+#include "MemoryUsage.h"
+#include "MultiPatternScanner.h"
+#include "RegionIndex.h"
+#include "Trace.h"
+#include "xnumem.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <thread>
+
+static const size_t   kSegmentMinSize = 1024 * 1024;
+static const uint32_t kChainMaxLevels = 64;
+
+struct DaemonServer::Session
+{
+    xnu_proc process;
+    
+    ~Session()
+    {
+        process.Detach();
+    }
+};
+
+DaemonServer::DaemonServer()
+: _listen(-1), _stopping(false), _serving(0)
+{
+    if(pipe(_wake) != 0)
+        _wake[0] = _wake[1] = -1;
+}
+
+DaemonServer::~DaemonServer()
+{
+    if(_listen >= 0)
+    {
+        close(_listen);
+        unlink(_path.c_str());
+    }
+    if(_wake[0] >= 0)
+    {
+        close(_wake[0]);
+        close(_wake[1]);
+    }
+    
+    // No request can be running any more
+    for (auto it = _sessions.begin(); it != _sessions.end(); ++it)
+        delete it->second;
+}
+
+kern_return_t DaemonServer::Listen( const char * path /* = kDaemonSocketPath */ )
+{
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if(path == nullptr || strlen(path) >= sizeof(address.sun_path))
+        return KERN_INVALID_ARGUMENT;
+    strcpy(address.sun_path, path);
+    
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listener < 0)
+        return KERN_FAILURE;
+    
+    // A socket file nobody accepts on is left over from a daemon that died
+    if(connect(listener, (struct sockaddr *)&address, sizeof(address)) == 0)
+    {
+        printf("xnumemd is already serving %s\n", path);
+        close(listener);
+        return KERN_FAILURE;
+    }
+    close(listener);
+    unlink(path);
+    
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listener < 0)
+        return KERN_FAILURE;
+    // Owner only before anyone can connect: the daemon reads any process it may attach
+    if(bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || chmod(path, 0600) != 0 || listen(listener, 64) != 0)
+    {
+        close(listener);
+        return KERN_FAILURE;
+    }
+    
+    _listen = listener;
+    _path = path;
+    return KERN_SUCCESS;
+}
+
+kern_return_t DaemonServer::Attach( int pid )
+{
+    return Find(pid, true) ? KERN_SUCCESS : KERN_FAILURE;
+}
+
+kern_return_t DaemonServer::Run()
+{
+    if(_listen < 0 || _wake[0] < 0)
+        return KERN_FAILURE;
+    
+    while(!_stopping.load())
+    {
+        struct pollfd fds[2] = { { _listen, POLLIN, 0 }, { _wake[0], POLLIN, 0 } };
+        if(poll(fds, 2, -1) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+        if(fds[1].revents)
+            break;
+        if((fds[0].revents & POLLIN) == 0)
+            continue;
+        
+        int connection = accept(_listen, nullptr, nullptr);
+        if(connection < 0)
+            continue;
+        DaemonNoSigPipe(connection);
+        
+        {
+            std::lock_guard<std::mutex> lock(_connections_lock);
+            _connections.push_back(connection);
+            _serving++;
+        }
+        std::thread(&DaemonServer::Serve, this, connection).detach();
+    }
+    
+    // Wake every connection blocked in a read and wait for its thread
+    std::unique_lock<std::mutex> lock(_connections_lock);
+    for (size_t i = 0; i < _connections.size(); i++)
+        shutdown(_connections[i], SHUT_RDWR);
+    _connections_done.wait(lock, [this]() { return _serving == 0; });
+    
+    close(_listen);
+    unlink(_path.c_str());
+    _listen = -1;
+    return KERN_SUCCESS;
+}
+
+void DaemonServer::Stop()
+{
+    _stopping.store(true);
+    if(_wake[1] >= 0)
+    {
+        ssize_t written = write(_wake[1], "", 1);
+        (void)written;
+    }
+}
+
+size_t DaemonServer::sessions()
+{
+    std::lock_guard<std::mutex> lock(_sessions_lock);
+    size_t attached = 0;
+    for (auto it = _sessions.begin(); it != _sessions.end(); ++it)
+        attached += it->second != nullptr;
+    return attached;
+}
+
+void DaemonServer::Serve( int socket )
+{
+    Connection_t connection;
+    connection.socket = socket;
+    connection.segment = nullptr;
+    connection.segment_size = 0;
+    connection.segment_fd = -1;
+    
+    DaemonHeader_t request;
+    while(DaemonReceive(socket, &request, sizeof(request)))
+    {
+        if(request.magic != kDaemonMagic || request.version != kDaemonVersion || request.size > kDaemonMaxRequest)
+            break;
+        connection.request.resize(request.size);
+        if(request.size && !DaemonReceive(socket, connection.request.data(), request.size))
+            break;
+        
+        uint8_t * result = nullptr;
+        uint64_t size = 0;
+        kern_return_t kret;
+        {
+            TraceSpan span("request", "DaemonServer", request.op);
+            kret = Dispatch(connection, request, result, size);
+        }
+        if(result == nullptr)
+            size = 0;
+        
+        DaemonHeader_t reply = request;
+        reply.status = kret;
+        reply.flags = 0;
+        reply.size = size;
+        if(size > kDaemonInlineLimit)
+            reply.flags |= kDaemonShared;
+        if(connection.segment_fd >= 0)
+            reply.flags |= kDaemonSegment;
+        
+        bool sent = DaemonSend(socket, &reply, sizeof(reply), connection.segment_fd);
+        if(connection.segment_fd >= 0)
+        {
+            close(connection.segment_fd);
+            connection.segment_fd = -1;
+        }
+        if(sent && size && (reply.flags & kDaemonShared) == 0)
+            sent = DaemonSend(socket, result, size);
+        if(!sent)
+            break;
+    }
+    
+    if(connection.segment)
+        munmap(connection.segment, connection.segment_size);
+    if(connection.segment_fd >= 0)
+        close(connection.segment_fd);
+    
+    std::lock_guard<std::mutex> lock(_connections_lock);
+    _connections.erase(std::find(_connections.begin(), _connections.end(), socket));
+    close(socket);
+    _serving--;
+    _connections_done.notify_all();
+}
+
+uint8_t * DaemonServer::Reserve( Connection_t& connection, uint64_t size )
+{
+    if(size <= kDaemonInlineLimit)
+    {
+        connection.result.resize(size);
+        return connection.result.data();
+    }
+    if(size > kDaemonMaxResult)
+        return nullptr;
+    if(size <= connection.segment_size)
+        return connection.segment;
+    
+    size_t segment_size = std::max(kSegmentMinSize, connection.segment_size * 2);
+    while(segment_size < size)
+        segment_size *= 2;
+    
+    // Unlinked at once, the client gets the descriptor with the reply
+    static std::atomic<uint32_t> serial(0);
+    char name[64];
+    snprintf(name, sizeof(name), "/xnumemd.%d.%u", getpid(), serial.fetch_add(1));
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if(fd < 0)
+        return nullptr;
+    shm_unlink(name);
+    
+    void * segment = MAP_FAILED;
+    if(ftruncate(fd, segment_size) == 0)
+        segment = mmap(nullptr, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(segment == MAP_FAILED)
+    {
+        close(fd);
+        return nullptr;
+    }
+    
+    if(connection.segment)
+        munmap(connection.segment, connection.segment_size);
+    if(connection.segment_fd >= 0)
+        close(connection.segment_fd);
+    connection.segment = (uint8_t *)segment;
+    connection.segment_size = segment_size;
+    connection.segment_fd = fd;
+    return connection.segment;
+}
+
+DaemonServer::Session * DaemonServer::Find( int pid, bool attach, bool * warm /* = nullptr */ )
+{
+    std::unique_lock<std::mutex> lock(_sessions_lock);
+    auto it = Settled(lock, pid);
+    if(warm)
+        *warm = it != _sessions.end();
+    if(it != _sessions.end())
+        return it->second;
+    if(!attach || pid <= 0)
+        return nullptr;
+    
+    // Attach outside the lock, a pending entry makes other requests for this pid wait for it
+    _sessions[pid] = nullptr;
+    lock.unlock();
+    Session * session = new Session;
+    bool attached = session->process.Attach(pid) != 0;
+    lock.lock();
+    if(attached)
+        _sessions[pid] = session;
+    else
+        _sessions.erase(pid);
+    _attached.notify_all();
+    lock.unlock();
+    
+    if(!attached)
+    {
+        delete session;
+        return nullptr;
+    }
+    return session;
+}
+
+std::map<int, DaemonServer::Session*>::iterator DaemonServer::Settled( std::unique_lock<std::mutex>& lock, int pid )
+{
+    auto it = _sessions.find(pid);
+    while(it != _sessions.end() && it->second == nullptr)
+    {
+        _attached.wait(lock);
+        it = _sessions.find(pid);
+    }
+    return it;
+}
+
+kern_return_t DaemonServer::Dispatch( Connection_t& connection, const DaemonHeader_t& request, uint8_t *& result, uint64_t& size )
+{
+    EpochGuard guard;
+    if(request.op == kDaemonDetach)
+    {
+        Session * session = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(_sessions_lock);
+            auto it = Settled(lock, request.pid);
+            if(it == _sessions.end())
+                return KERN_INVALID_ARGUMENT;
+            session = it->second;
+            _sessions.erase(it);
+        }
+        // Other connections may be in a request on it
+        Epoch::Retire(session);
+        return KERN_SUCCESS;
+    }
+    
+    bool warm = false;
+    Session * session = Find(request.pid, true, &warm);
+    if(session == nullptr)
+        return KERN_FAILURE;
+    
+    switch(request.op)
+    {
+        case kDaemonAttach:
+        case kDaemonRefresh:
+        {
+            if(request.op == kDaemonRefresh && warm)
+            {
+                session->process.memory().RefreshRegions();
+                session->process.modules().Refresh();
+            }
+            result = Reserve(connection, sizeof(DaemonAttachResult_t));
+            size = sizeof(DaemonAttachResult_t);
+            DaemonAttachResult_t * attach = (DaemonAttachResult_t *)result;
+            attach->regions = session->process.memory().regions().size();
+            attach->modules = session->process.modules().modules().size();
+            attach->warm = warm;
+            attach->reserved = 0;
+            return KERN_SUCCESS;
+        }
+        case kDaemonReadBatch:
+            return ReadBatch(session, connection, result, size);
+        case kDaemonPointerChain:
+            return PointerChain(session, connection, result, size);
+        case kDaemonScan:
+            return Scan(session, connection, result, size);
+        case kDaemonUsage:
+            return Usage(session, connection, result, size);
+        default:
+            return KERN_INVALID_ARGUMENT;
+    }
+}
+
+kern_return_t DaemonServer::ReadBatch( Session * session, Connection_t& connection, uint8_t *& result, uint64_t& size )
+{
+    const std::vector<uint8_t>& payload = connection.request;
+    if(payload.size() % sizeof(DaemonRange_t))
+        return KERN_INVALID_ARGUMENT;
+    
+    size_t count = payload.size() / sizeof(DaemonRange_t);
+    const DaemonRange_t * ranges = (const DaemonRange_t *)payload.data();
+    uint64_t header = DaemonAlign(count * sizeof(int32_t));
+    uint64_t total = header;
+    for (size_t i = 0; i < count; i++)
+    {
+        if(ranges[i].size > kDaemonMaxResult - total)
+            return KERN_INVALID_ARGUMENT;
+        total += ranges[i].size;
+    }
+    
+    result = Reserve(connection, total);
+    if(result == nullptr)
+        return KERN_RESOURCE_SHORTAGE;
+    size = total;
+    
+    // Straight into the result, which for large batches is the client's shared segment
+    std::vector<ReadRequest_t> requests(count);
+    uint8_t * data = result + header;
+    for (size_t i = 0; i < count; i++)
+    {
+        requests[i].address = ranges[i].address;
+        requests[i].size = ranges[i].size;
+        requests[i].buffer = data;
+        requests[i].status = KERN_SUCCESS;
+        data += ranges[i].size;
+    }
+    kern_return_t kret = session->process.memory().ReadBatch(requests);
+    
+    int32_t * status = (int32_t *)result;
+    for (size_t i = 0; i < count; i++)
+    {
+        status[i] = requests[i].status;
+        if(requests[i].status != KERN_SUCCESS)
+            memset(requests[i].buffer, 0, requests[i].size);
+    }
+    memset(result + count * sizeof(int32_t), 0, header - count * sizeof(int32_t));
+    return kret;
+}
+
+kern_return_t DaemonServer::PointerChain( Session * session, Connection_t& connection, uint8_t *& result, uint64_t& size )
+{
+    const std::vector<uint8_t>& payload = connection.request;
+    
+    // Validate and size every chain first
+    uint64_t total = 0;
+    for (size_t offset = 0; offset < payload.size(); )
+    {
+        if(payload.size() - offset < sizeof(DaemonChain_t))
+            return KERN_INVALID_ARGUMENT;
+        const DaemonChain_t * chain = (const DaemonChain_t *)(payload.data() + offset);
+        offset += sizeof(DaemonChain_t);
+        if(chain->levels > kChainMaxLevels || payload.size() - offset < chain->levels * sizeof(int64_t))
+            return KERN_INVALID_ARGUMENT;
+        offset += chain->levels * sizeof(int64_t);
+        total += sizeof(DaemonChainResult_t) + DaemonAlign(chain->size);
+        if(total > kDaemonMaxResult)
+            return KERN_INVALID_ARGUMENT;
+    }
+    
+    result = Reserve(connection, total);
+    if(result == nullptr)
+        return KERN_RESOURCE_SHORTAGE;
+    size = total;
+    
+    ProcessMemory& memory = session->process.memory();
+    kern_return_t kret = KERN_SUCCESS;
+    uint8_t * out = result;
+    for (size_t offset = 0; offset < payload.size(); )
+    {
+        const DaemonChain_t * chain = (const DaemonChain_t *)(payload.data() + offset);
+        const int64_t * offsets = (const int64_t *)(chain + 1);
+        offset += sizeof(DaemonChain_t) + chain->levels * sizeof(int64_t);
+        
+        DaemonChainResult_t * resolved = (DaemonChainResult_t *)out;
+        uint8_t * data = out + sizeof(DaemonChainResult_t);
+        out = data + DaemonAlign(chain->size);
+        
+        uint64_t address = chain->base;
+        uint32_t depth = 0;
+        kern_return_t status = KERN_SUCCESS;
+        for (; depth < chain->levels; depth++)
+        {
+            uint64_t pointer = 0;
+            status = memory.TryRead(address, sizeof(pointer), &pointer);
+            if(status != KERN_SUCCESS)
+                break;
+            address = pointer + offsets[depth];
+        }
+        if(status == KERN_SUCCESS && chain->size)
+            status = memory.TryRead(address, chain->size, data);
+        if(status != KERN_SUCCESS)
+        {
+            memset(data, 0, chain->size);
+            kret = status;
+        }
+        memset(data + chain->size, 0, DaemonAlign(chain->size) - chain->size);
+        
+        resolved->address = address;
+        resolved->status = status;
+        resolved->depth = depth;
+    }
+    return kret;
+}
+
+kern_return_t DaemonServer::Scan( Session * session, Connection_t& connection, uint8_t *& result, uint64_t& size )
+{
+    const std::vector<uint8_t>& payload = connection.request;
+    if(payload.size() <= sizeof(DaemonScan_t))
+        return KERN_INVALID_ARGUMENT;
+    
+    const DaemonScan_t * scan = (const DaemonScan_t *)payload.data();
+    const char * text = (const char *)(scan + 1);
+    std::string signature(text, strnlen(text, payload.size() - sizeof(DaemonScan_t)));
+    
+    MultiPatternScanner scanner;
+    kern_return_t kret = scanner.AddSignature(0, signature.c_str(), scan->flags);
+    if(kret != KERN_SUCCESS)
+        return kret;
+    
+    ScanScope scope;
+    if(scan->end > scan->start)
+        scope.Within(scan->start, scan->end);
+    
+    // A max-heap of the lowest limit matches, whatever order the workers find them in,
+    // so a signature that matches everywhere costs limit entries
+    size_t limit = scan->limit && scan->limit < kDaemonMaxMatches ? scan->limit : kDaemonMaxMatches;
+    std::mutex lock;
+    std::vector<uint64_t> matches;
+    matches.reserve(std::min<size_t>(limit, 4096));
+    kret = scanner.Scan(session->process, [&](uint32_t id, mach_vm_address_t address) {
+        std::lock_guard<std::mutex> guard(lock);
+        if(matches.size() < limit)
+        {
+            matches.push_back(address);
+            std::push_heap(matches.begin(), matches.end());
+        }
+        else if(address < matches.front())
+        {
+            std::pop_heap(matches.begin(), matches.end());
+            matches.back() = address;
+            std::push_heap(matches.begin(), matches.end());
+        }
+    }, nullptr, scope.empty() ? nullptr : &scope);
+    std::sort_heap(matches.begin(), matches.end());
+    
+    result = Reserve(connection, matches.size() * sizeof(uint64_t));
+    if(result == nullptr)
+        return KERN_RESOURCE_SHORTAGE;
+    size = matches.size() * sizeof(uint64_t);
+    memcpy(result, matches.data(), size);
+    return kret;
+}
+
+kern_return_t DaemonServer::Usage( Session * session, Connection_t& connection, uint8_t *& result, uint64_t& size )
+{
+    MemoryUsage usage(session->process);
+    kern_return_t kret = usage.Collect();
+    if(kret != KERN_SUCCESS)
+        return kret;
+    
+    // Names and addresses as of Collect, a module loaded or unloaded since can't shift the rows
+    size_t count = usage.by_module().size();
+    
+    result = Reserve(connection, sizeof(DaemonUsage_t) + count * sizeof(DaemonModuleUsage_t));
+    if(result == nullptr)
+        return KERN_RESOURCE_SHORTAGE;
+    size = sizeof(DaemonUsage_t) + count * sizeof(DaemonModuleUsage_t);
+    
+    DaemonUsage_t * report = (DaemonUsage_t *)result;
+    report->total = usage.total();
+    report->modules = count;
+    
+    DaemonModuleUsage_t * entries = (DaemonModuleUsage_t *)(report + 1);
+    for (size_t i = 0; i < count; i++)
+    {
+        const char * path = usage.module_paths()[i];
+        const char * name = strrchr(path, '/');
+        memset(&entries[i], 0, sizeof(DaemonModuleUsage_t));
+        entries[i].address = usage.module_addresses()[i];
+        entries[i].usage = usage.by_module()[i];
+        snprintf(entries[i].name, sizeof(entries[i].name), "%s", name ? name + 1 : path);
+    }
+    return KERN_SUCCESS;
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+
+
+#ifndef __xnumem__DaemonServer__
+#define __xnumem__DaemonServer__
+
+#include <mach/mach.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "DaemonProtocol.h"
+
+/**
+ Serves DaemonProtocol requests on a Unix domain socket, keeping every process it was
+ asked about attached. Region and module indexes stay warm between requests, so a tool
+ that connects, asks and exits pays for a round trip instead of an attach.
+ 
+ Each connection is served on a thread of its own, requests in order. Sessions are shared
+ between connections and read concurrently; a detached session is retired through Epoch
+ so requests still using it finish first.
+ 
+    DaemonServer server;
+    if(server.Listen(kDaemonSocketPath) == KERN_SUCCESS)
+        server.Run();       // until Stop, e.g. from a signal handler
+ */
+class DaemonServer
+{
+public:
+    DaemonServer();
+    ~DaemonServer();
+    
+    /**
+     Bind and listen. A stale socket file at path is replaced. The socket is made
+     accessible to the daemon's user only.
+     
+     @param path -- Socket path.
+     @return KERN_FAILURE if the socket could not be bound.
+     */
+    kern_return_t Listen( const char * path = kDaemonSocketPath );
+    
+    /**
+     Attach a process ahead of the first request for it.
+     
+     @param pid -- Process id.
+     @return KERN_FAILURE if it could not be attached.
+     */
+    kern_return_t Attach( int pid );
+    
+    /**
+     Accept and serve connections until Stop. Connections are closed and their threads
+     joined before returning; attached processes stay attached until destruction.
+     
+     @param void
+     @return KERN_SUCCESS once stopped, KERN_FAILURE if not listening.
+     */
+    kern_return_t Run();
+    
+    /**
+     Make Run return. Async-signal-safe.
+     
+     @param void
+     @return void
+     */
+    void Stop();
+    
+    size_t sessions();
+    
+private:
+    DaemonServer( const DaemonServer& ) = delete;
+    DaemonServer& operator =(const DaemonServer&) = delete;
+    
+    struct Session;
+    
+    typedef struct Connection {
+        int                  socket;
+        std::vector<uint8_t> request;
+        std::vector<uint8_t> result;    // inline results
+        uint8_t *            segment;   // shared results
+        size_t               segment_size;
+        int                  segment_fd;    // new segment, sent with the next reply
+    } Connection_t;
+    
+    void Serve( int socket );
+    kern_return_t Dispatch( Connection_t& connection, const DaemonHeader_t& request, uint8_t *& result, uint64_t& size );
+    
+    // Result space: the inline buffer, or the shared segment grown to fit
+    uint8_t * Reserve( Connection_t& connection, uint64_t size );
+    
+    // Attached session for pid, attaching it if asked to. Call inside an EpochGuard.
+    Session * Find( int pid, bool attach, bool * warm = nullptr );
+    
+    // Entry for pid once no attach of it is pending, end() if there is none
+    std::map<int, Session*>::iterator Settled( std::unique_lock<std::mutex>& lock, int pid );
+    
+    kern_return_t ReadBatch( Session * session, Connection_t& connection, uint8_t *& result, uint64_t& size );
+    kern_return_t PointerChain( Session * session, Connection_t& connection, uint8_t *& result, uint64_t& size );
+    kern_return_t Scan( Session * session, Connection_t& connection, uint8_t *& result, uint64_t& size );
+    kern_return_t Usage( Session * session, Connection_t& connection, uint8_t *& result, uint64_t& size );
+    
+    std::string             _path;
+    int                     _listen;
+    int                     _wake[2];       // Stop -> Run
+    std::atomic<bool>       _stopping;
+    
+    std::mutex              _sessions_lock;
+    std::condition_variable _attached;      // a pending attach finished
+    std::map<int, Session*> _sessions;      // nullptr while being attached
+    
+    std::mutex              _connections_lock;
+    std::condition_variable _connections_done;
+    std::vector<int>        _connections;   // open sockets
+    size_t                  _serving;       // threads still running
+};
+
+#endif /* defined(__xnumem__DaemonServer__) */
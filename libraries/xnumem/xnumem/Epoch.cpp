@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+#include "Epoch.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+namespace {
+    
+    struct Slot {
+        std::atomic<uint64_t>   epoch;      // pinned epoch, 0 when outside any guard
+        unsigned                depth;      // owner only
+    };
+    
+    struct Retired {
+        void *      object;
+        void        (*destroy)( void * object );
+        uint64_t    epoch;                  // global epoch when it was unpublished
+    };
+    
+    struct Domain {
+        std::atomic<uint64_t>   epoch;
+        std::mutex              lock;
+        std::vector<Slot *>     slots;
+        std::vector<Slot *>     spare;      // slots of exited threads, never freed
+        std::vector<Retired>    retired;
+        pthread_key_t           key;
+        
+        Domain() : epoch(1)
+        {
+            pthread_key_create(&key, [](void * slot) {
+                Domain& domain = Shared();
+                std::lock_guard<std::mutex> guard(domain.lock);
+                ((Slot *)slot)->epoch.store(0, std::memory_order_release);
+                ((Slot *)slot)->depth = 0;
+                domain.spare.push_back((Slot *)slot);
+            });
+        }
+        
+        static Domain& Shared()
+        {
+            static Domain * domain = new Domain();
+            return *domain;
+        }
+    };
+    
+    __thread Slot * t_slot = nullptr;
+    
+    Slot * ThreadSlot()
+    {
+        if(t_slot)
+            return t_slot;
+        
+        Domain& domain = Domain::Shared();
+        std::lock_guard<std::mutex> guard(domain.lock);
+        if(!domain.spare.empty())
+        {
+            t_slot = domain.spare.back();
+            domain.spare.pop_back();
+        }
+        else
+        {
+            t_slot = new Slot();
+            t_slot->epoch.store(0, std::memory_order_relaxed);
+            t_slot->depth = 0;
+            domain.slots.push_back(t_slot);
+        }
+        pthread_setspecific(domain.key, t_slot);
+        return t_slot;
+    }
+    
+    // Split off what no pinned reader can see, under the domain lock
+    void Collect( Domain& domain, std::vector<Retired>& done )
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        uint64_t oldest = UINT64_MAX;
+        for (size_t i = 0; i < domain.slots.size(); i++)
+        {
+            uint64_t pinned = domain.slots[i]->epoch.load(std::memory_order_acquire);
+            if(pinned != 0 && pinned < oldest)
+                oldest = pinned;
+        }
+        
+        // A reader that saw the old pointer pinned at or before its retire epoch
+        std::vector<Retired> kept;
+        for (size_t i = 0; i < domain.retired.size(); i++)
+        {
+            if(domain.retired[i].epoch < oldest)
+                done.push_back(domain.retired[i]);
+            else
+                kept.push_back(domain.retired[i]);
+        }
+        domain.retired.swap(kept);
+    }
+}
+
+void Epoch::Enter()
+{
+    Slot * slot = ThreadSlot();
+    if(slot->depth++ > 0)
+        return;
+    
+    // Pin before loading any published pointer; the fence pairs with the one in Collect
+    slot->epoch.store(Domain::Shared().epoch.load(std::memory_order_acquire), std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void Epoch::Exit()
+{
+    Slot * slot = t_slot;
+    if(--slot->depth == 0)
+        slot->epoch.store(0, std::memory_order_release);
+}
+
+void Epoch::Retire( void * object, void (*destroy)( void * object ) )
+{
+    Domain& domain = Domain::Shared();
+    std::vector<Retired> done;
+    {
+        std::lock_guard<std::mutex> guard(domain.lock);
+        Retired entry = { object, destroy, domain.epoch.fetch_add(1, std::memory_order_seq_cst) };
+        domain.retired.push_back(entry);
+        Collect(domain, done);
+    }
+    
+    for (size_t i = 0; i < done.size(); i++)
+        done[i].destroy(done[i].object);
+}
+
+size_t Epoch::Reclaim()
+{
+    Domain& domain = Domain::Shared();
+    std::vector<Retired> done;
+    size_t waiting = 0;
+    {
+        std::lock_guard<std::mutex> guard(domain.lock);
+        Collect(domain, done);
+        waiting = domain.retired.size();
+    }
+    
+    for (size_t i = 0; i < done.size(); i++)
+        done[i].destroy(done[i].object);
+    return waiting;
+}
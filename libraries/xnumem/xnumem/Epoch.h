@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+
+
+#ifndef __xnumem__Epoch__
+#define __xnumem__Epoch__
+
+#include <stddef.h>
+
+/**
+ Epoch-based reclamation for indexes that are replaced while other threads read them.
+ 
+ A writer publishes a new object with an atomic pointer swap and retires the old one;
+ it is destroyed once every thread that was inside an EpochGuard at the time of the
+ swap has left it. Readers take no lock: entering pins the global epoch in a slot of
+ their own, leaving clears it.
+ 
+    EpochGuard guard;
+    const RegionIndex& regions = process.memory().regions();   // stays valid until guard goes
+ */
+class Epoch
+{
+public:
+    // Pin / unpin the calling thread, nests. Use EpochGuard.
+    static void Enter();
+    static void Exit();
+    
+    /**
+     Destroy an object once no reader can hold it. Call after it was unpublished.
+     
+     @param object  -- Object.
+     @param destroy -- Destructor, called on the retiring thread or a later one.
+     */
+    static void Retire( void * object, void (*destroy)( void * object ) );
+    
+    template <typename T>
+    static inline void Retire( const T * object )
+    {
+        if(object)
+            Retire((void *)object, [](void * pointer) { delete (T *)pointer; });
+    }
+    
+    /**
+     Destroy what is no longer reachable; Retire does this as it goes.
+     
+     @return Objects still waiting for readers.
+     */
+    static size_t Reclaim();
+};
+
+/**
+ Keeps the objects published at construction alive until destruction.
+ */
+class EpochGuard
+{
+public:
+    inline EpochGuard() { Epoch::Enter(); }
+    inline ~EpochGuard() { Epoch::Exit(); }
+    
+private:
+    EpochGuard( const EpochGuard& ) = delete;
+    EpochGuard& operator =(const EpochGuard&) = delete;
+};
+
+#endif /* defined(__xnumem__Epoch__) */
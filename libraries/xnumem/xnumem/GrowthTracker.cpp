@@ -0,0 +1,403 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+
+#include "GrowthTracker.h"
+#include "Hash.h"
+#include "MemoryUsage.h"
+#include "Trace.h"
+#include "xnumem.h"
+
+#include <mach/mach_time.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+
+static const uint32_t kGrowthVersion = 1;
+
+// Counters of a point without its time, what the series hash covers
+static uint64_t HashPoint( const GrowthPoint_t& point )
+{
+    return Hash64(&point.virtual_pages, sizeof(point) - offsetof(GrowthPoint_t, virtual_pages));
+}
+
+static void AddPoint( GrowthPoint_t& to, const GrowthPoint_t& point )
+{
+    to.virtual_pages  += point.virtual_pages;
+    to.resident_pages += point.resident_pages;
+    to.dirty_pages    += point.dirty_pages;
+    to.swapped_pages  += point.swapped_pages;
+}
+
+GrowthTracker::GrowthTracker( xnu_proc& process, const GrowthConfig_t& config /* = DefaultConfig() */ ) :
+    _process(process),
+    _config(config),
+    _page(getpagesize()),
+    _loaded(false),
+    _start(0),
+    _tick(0),
+    _samples(0),
+    _cost(0),
+    _running(false)
+{
+    if(_config.ring_size < 2)
+        _config.ring_size = 2;
+}
+
+GrowthTracker::~GrowthTracker()
+{
+    Stop();
+}
+
+GrowthConfig_t GrowthTracker::DefaultConfig()
+{
+    GrowthConfig_t config;
+    config.interval_ms = 1000;
+    config.ring_size   = 256;
+    config.min_steps   = 5;
+    config.min_growth  = 1024 * 1024;
+    return config;
+}
+
+uint64_t GrowthTracker::SeriesKey( GrowthSeriesKind kind, uint64_t key )
+{
+    return ((uint64_t)kind << 62) | (key & ((1ULL << 62) - 1));
+}
+
+kern_return_t GrowthTracker::Sample()
+{
+    TraceSpan span("Sample", "GrowthTracker");
+    std::lock_guard<std::mutex> sample_lock(_sample_lock);
+    if(_process.memory().source())
+        return KERN_NOT_SUPPORTED;
+    
+    uint64_t start = mach_absolute_time();
+    
+    // Images come and go over hours of tracking; while dyld's list is unchanged this is one small read
+    bool changed = false;
+    _process.modules().Refresh(&changed);
+    if(!_loaded || changed)
+    {
+        std::vector<ModuleData_t> modules = _process.modules().modules();
+        _process.modules().GetModuleRanges(modules, _ranges);
+        
+        // Module series are keyed by load address, indices shift when the list changes
+        std::unordered_map<uint64_t, std::string> names;
+        _module_addresses.resize(modules.size());
+        for (size_t i = 0; i < modules.size(); i++)
+        {
+            const char * path = modules[i].imageFilePath ? modules[i].imageFilePath : "";
+            const char * file = strrchr(path, '/');
+            _module_addresses[i] = (uint64_t)modules[i].imageLoadAddress;
+            names[_module_addresses[i]] = file ? file + 1 : path;
+        }
+        
+        std::lock_guard<std::mutex> lock(_lock);
+        
+        // Unloaded modules keep their names while their series are remembered
+        for (std::unordered_map<uint64_t, std::string>::const_iterator it = _module_names.begin(); it != _module_names.end(); ++it)
+        {
+            if(_series.count(SeriesKey(kGrowthModule, it->first)))
+                names.insert(*it);
+        }
+        _module_names.swap(names);
+        if(!_loaded)
+            _start = start;
+        _loaded = true;
+    }
+    
+    mach_timebase_info_data_t timebase;
+    mach_timebase_info(&timebase);
+    uint32_t time_ms = (uint32_t)((start - _start) * timebase.numer / timebase.denom / 1000000);
+    
+    // Region points straight from the walk, modules and tags summed over it; the buffers
+    // keep their capacity from the previous sample
+    std::vector<Entry>& entries = _entries;
+    std::vector<GrowthPoint_t>& modules = _module_points;
+    GrowthPoint_t tags[256];
+    entries.clear();
+    modules.assign(_module_addresses.size(), GrowthPoint_t());
+    memset(tags, 0, sizeof(tags));
+    
+    kern_return_t kret = MemoryUsage::Walk(_process, [&](mach_vm_address_t address, mach_vm_size_t size,
+                                                         const vm_region_submap_info_data_64_t& info, const MemoryUsageStats_t& usage) {
+        Entry entry;
+        entry.kind                 = kGrowthRegion;
+        entry.key                  = address;
+        entry.point.time_ms        = time_ms;
+        entry.point.virtual_pages  = (uint32_t)(size / _page);
+        entry.point.resident_pages = (uint32_t)(usage.resident / _page);
+        entry.point.dirty_pages    = (uint32_t)(usage.private_dirty / _page);
+        entry.point.swapped_pages  = (uint32_t)(usage.swapped / _page);
+        entry.hash                 = HashPoint(entry.point);
+        entries.push_back(entry);
+        
+        const ModuleRange_t* module = ProcessModules::FindModuleRange(_ranges, address);
+        if(module)
+            AddPoint(modules[module->index], entry.point);
+        else
+            AddPoint(tags[info.user_tag & 0xff], entry.point);
+    });
+    if(kret != KERN_SUCCESS)
+        return kret;
+    
+    for (size_t i = 0; i < modules.size() + 256; i++)
+    {
+        Entry entry;
+        entry.kind  = i < modules.size() ? kGrowthModule : kGrowthTag;
+        entry.key   = i < modules.size() ? _module_addresses[i] : i - modules.size();
+        entry.point = i < modules.size() ? modules[i] : tags[i - modules.size()];
+        if(entry.point.virtual_pages == 0)
+            continue;
+        
+        entry.point.time_ms = time_ms;
+        entry.hash          = HashPoint(entry.point);
+        entries.push_back(entry);
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _tick++;
+        
+        for (std::vector<Entry>::const_iterator it = entries.begin(); it != entries.end(); ++it)
+        {
+            std::pair<std::unordered_map<uint64_t, Series>::iterator, bool> inserted = _series.insert(std::make_pair(SeriesKey(it->kind, it->key), Series()));
+            Series& series = inserted.first->second;
+            if(inserted.second)
+            {
+                series.kind  = it->kind;
+                series.key   = it->key;
+                series.head  = 0;
+                series.count = 0;
+                series.points.resize(_config.ring_size);
+            }
+            
+            series.seen = _tick;
+            if(inserted.second || series.hash != it->hash)
+                Append(series, *it);
+        }
+        
+        // Forget what has been gone for a whole ring
+        for (std::unordered_map<uint64_t, Series>::iterator it = _series.begin(); it != _series.end();)
+        {
+            if(_tick - it->second.seen > _config.ring_size)
+                it = _series.erase(it);
+            else
+                ++it;
+        }
+    }
+    
+    _cost.fetch_add(mach_absolute_time() - start, std::memory_order_relaxed);
+    _samples.fetch_add(1, std::memory_order_relaxed);
+    return KERN_SUCCESS;
+}
+
+void GrowthTracker::Append( Series& series, const Entry& entry )
+{
+    series.hash = entry.hash;
+    series.points[series.head] = entry.point;
+    series.head = (series.head + 1) % _config.ring_size;
+    if(series.count < _config.ring_size)
+        series.count++;
+}
+
+void GrowthTracker::Points( const Series& series, std::vector<GrowthPoint_t>& points ) const
+{
+    points.clear();
+    uint32_t first = (series.head + _config.ring_size - series.count) % _config.ring_size;
+    for (uint32_t i = 0; i < series.count; i++)
+        points.push_back(series.points[(first + i) % _config.ring_size]);
+}
+
+std::string GrowthTracker::Name( const Series& series ) const
+{
+    switch(series.kind)
+    {
+        case kGrowthModule:
+        {
+            std::unordered_map<uint64_t, std::string>::const_iterator name = _module_names.find(series.key);
+            return name != _module_names.end() ? name->second : std::string();
+        }
+        case kGrowthTag:
+            return MemoryUsage::TagName((unsigned)series.key);
+        default:
+        {
+            char name[32];
+            snprintf(name, sizeof(name), "0x%llx", (unsigned long long)series.key);
+            return name;
+        }
+    }
+}
+
+kern_return_t GrowthTracker::Start()
+{
+    std::lock_guard<std::mutex> lock(_run_lock);
+    if(_running || _thread.joinable())
+        return KERN_FAILURE;
+    if(_process.memory().source())
+        return KERN_NOT_SUPPORTED;
+    
+    _running = true;
+    _thread = std::thread([this]() {
+        std::unique_lock<std::mutex> lock(_run_lock);
+        while(_running)
+        {
+            lock.unlock();
+            Sample();
+            lock.lock();
+            _wake.wait_for(lock, std::chrono::milliseconds(_config.interval_ms), [this]() { return !_running; });
+        }
+    });
+    
+    return KERN_SUCCESS;
+}
+
+void GrowthTracker::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(_run_lock);
+        _running = false;
+    }
+    _wake.notify_all();
+    
+    if(_thread.joinable())
+        _thread.join();
+}
+
+void GrowthTracker::Suspects( std::vector<GrowthSuspect_t>& suspects )
+{
+    suspects.clear();
+    std::vector<GrowthPoint_t> points;
+    
+    std::lock_guard<std::mutex> lock(_lock);
+    for (std::unordered_map<uint64_t, Series>::const_iterator it = _series.begin(); it != _series.end(); ++it)
+    {
+        Points(it->second, points);
+        if(points.size() < 2)
+            continue;
+        
+        uint32_t rises = 0, falls = 0;
+        for (size_t i = 1; i < points.size(); i++)
+        {
+            const GrowthPoint_t& previous = points[i - 1];
+            const GrowthPoint_t& point = points[i];
+            if(point.virtual_pages > previous.virtual_pages || point.dirty_pages > previous.dirty_pages)
+                rises++;
+            if(point.virtual_pages < previous.virtual_pages || point.dirty_pages < previous.dirty_pages)
+                falls++;
+        }
+        
+        GrowthSuspect_t suspect;
+        suspect.kind           = it->second.kind;
+        suspect.key            = it->second.key;
+        suspect.steps          = rises;
+        suspect.virtual_growth = ((int64_t)points.back().virtual_pages - points.front().virtual_pages) * (int64_t)_page;
+        suspect.dirty_growth   = ((int64_t)points.back().dirty_pages - points.front().dirty_pages) * (int64_t)_page;
+        suspect.first_ms       = points.front().time_ms;
+        suspect.last_ms        = points.back().time_ms;
+        
+        int64_t growth = std::max(suspect.virtual_growth, suspect.dirty_growth);
+        if(rises < _config.min_steps || falls * 8 > rises || growth < (int64_t)_config.min_growth)
+            continue;
+        
+        suspect.name = Name(it->second);
+        suspects.push_back(suspect);
+    }
+    
+    std::sort(suspects.begin(), suspects.end(), [](const GrowthSuspect_t& a, const GrowthSuspect_t& b) {
+        return std::max(a.virtual_growth, a.dirty_growth) > std::max(b.virtual_growth, b.dirty_growth);
+    });
+}
+
+kern_return_t GrowthTracker::WriteCSV( FILE * out )
+{
+    static const char * kinds[] = { "region", "module", "tag" };
+    std::vector<GrowthPoint_t> points;
+    
+    std::lock_guard<std::mutex> lock(_lock);
+    if(fprintf(out, "time_ms,kind,key,name,virtual,resident,dirty,swapped\n") < 0)
+        return KERN_FAILURE;
+    
+    for (std::unordered_map<uint64_t, Series>::const_iterator it = _series.begin(); it != _series.end(); ++it)
+    {
+        std::string name = Name(it->second);
+        Points(it->second, points);
+        for (std::vector<GrowthPoint_t>::const_iterator point = points.begin(); point != points.end(); ++point)
+        {
+            if(fprintf(out, "%u,%s,%llu,%s,%llu,%llu,%llu,%llu\n", point->time_ms, kinds[it->second.kind],
+                       (unsigned long long)it->second.key, name.c_str(),
+                       (unsigned long long)point->virtual_pages * _page, (unsigned long long)point->resident_pages * _page,
+                       (unsigned long long)point->dirty_pages * _page, (unsigned long long)point->swapped_pages * _page) < 0)
+                return KERN_FAILURE;
+        }
+    }
+    
+    return KERN_SUCCESS;
+}
+
+kern_return_t GrowthTracker::WriteBinary( FILE * out )
+{
+    std::vector<GrowthPoint_t> points;
+    
+    std::lock_guard<std::mutex> lock(_lock);
+    uint32_t header[3] = { kGrowthVersion, (uint32_t)_page, (uint32_t)_series.size() };
+    if(fwrite("XNUGROW", 8, 1, out) != 1 || fwrite(header, sizeof(header), 1, out) != 1)
+        return KERN_FAILURE;
+    
+    for (std::unordered_map<uint64_t, Series>::const_iterator it = _series.begin(); it != _series.end(); ++it)
+    {
+        std::string name = Name(it->second);
+        Points(it->second, points);
+        
+        uint32_t kind = it->second.kind, count = (uint32_t)points.size(), length = (uint32_t)name.size();
+        if(fwrite(&kind, sizeof(kind), 1, out) != 1 ||
+           fwrite(&count, sizeof(count), 1, out) != 1 ||
+           fwrite(&it->second.key, sizeof(it->second.key), 1, out) != 1 ||
+           fwrite(&length, sizeof(length), 1, out) != 1 ||
+           fwrite(name.data(), 1, length, out) != length ||
+           fwrite(points.data(), sizeof(GrowthPoint_t), count, out) != count)
+            return KERN_FAILURE;
+    }
+    
+    return KERN_SUCCESS;
+}
+
+void GrowthTracker::Reset()
+{
+    std::lock_guard<std::mutex> sample_lock(_sample_lock);
+    std::lock_guard<std::mutex> lock(_lock);
+    _loaded = false;
+    _series.clear();
+    _tick = 0;
+    _samples = 0;
+    _cost = 0;
+}
+
+uint64_t GrowthTracker::average_cost() const
+{
+    uint64_t count = samples();
+    if(count == 0)
+        return 0;
+    
+    mach_timebase_info_data_t timebase;
+    mach_timebase_info(&timebase);
+    return _cost.load(std::memory_order_relaxed) * timebase.numer / timebase.denom / count;
+}
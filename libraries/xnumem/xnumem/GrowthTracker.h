@@ -0,0 +1,223 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+
+#ifndef __xnumem__GrowthTracker__
+#define __xnumem__GrowthTracker__
+
+#include <mach/mach.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "ProcessModules.h"
+
+typedef struct GrowthConfig {
+    uint32_t interval_ms;       // between samples
+    uint32_t ring_size;         // points kept per series, and ticks an unmapped region is remembered
+    uint32_t min_steps;         // growing points needed before a series is flagged
+    uint64_t min_growth;        // bytes of net growth needed before a series is flagged
+} GrowthConfig_t;
+
+enum GrowthSeriesKind {
+    kGrowthRegion = 0,          // one VM entry, keyed by start address
+    kGrowthModule = 1,          // all entries of a module, keyed by load address
+    kGrowthTag    = 2           // entries in no module, keyed by VM_MEMORY_* tag
+};
+
+typedef struct GrowthPoint {
+    uint32_t time_ms;           // since Start or the first Sample
+    uint32_t virtual_pages;
+    uint32_t resident_pages;
+    uint32_t dirty_pages;
+    uint32_t swapped_pages;
+} GrowthPoint_t;
+
+typedef struct GrowthSuspect {
+    GrowthSeriesKind kind;
+    uint64_t         key;
+    std::string      name;
+    uint32_t         steps;             // growing points in the ring
+    int64_t          virtual_growth;    // bytes, oldest to newest point
+    int64_t          dirty_growth;
+    uint32_t         first_ms;
+    uint32_t         last_ms;
+} GrowthSuspect_t;
+
+/**
+ Low overhead memory growth tracker for an attached process.
+ 
+ Every tick walks the VM entries with MemoryUsage::Walk and keeps a time series of
+ virtual, resident, dirty and swapped pages per region, per module and per tag for
+ memory outside modules. An entry's counters are hashed and a point is only appended
+ when the hash changes, so an idle address space costs one region call per entry; the
+ per-sample buffers are kept between samples and only new series allocate. Page
+ contents are never read. Series are fixed size rings:
+ 
+    GrowthTracker tracker(process);
+    tracker.Start();
+    sleep(600);
+    tracker.Stop();
+    tracker.Suspects(suspects);         // steadily growing regions, modules and tags
+    tracker.WriteCSV(stdout);
+ 
+ A series is a suspect when its size or dirty pages rose at least min_steps times,
+ fell at most once every eight rises, and grew by at least min_growth overall.
+ The module list is refreshed every tick, one small read while dyld reports no change,
+ so images loaded later get series of their own.
+ */
+class GrowthTracker
+{
+public:
+    GrowthTracker( class xnu_proc& process, const GrowthConfig_t& config = DefaultConfig() );
+    ~GrowthTracker();
+    
+    /**
+     Default configuration: a sample a second, 256 points, 5 growing points, 1MB growth.
+     
+     @param void
+     @return Configuration.
+     */
+    static GrowthConfig_t DefaultConfig();
+    
+    /**
+     Take one sample of the address space.
+     
+     @param void
+     @return Status.
+     */
+    kern_return_t Sample();
+    
+    /**
+     Sample on a background thread every interval until Stop.
+     
+     @param void
+     @return Status.
+     */
+    kern_return_t Start();
+    
+    /**
+     Stop background sampling.
+     
+     @param void
+     @return void
+     */
+    void Stop();
+    
+    /**
+     Get the series that grow steadily, largest growth first.
+     
+     @param suspects -- Output suspects.
+     @return void
+     */
+    void Suspects( std::vector<GrowthSuspect_t>& suspects );
+    
+    /**
+     Write every series as "time_ms,kind,key,name,virtual,resident,dirty,swapped" lines, sizes in bytes.
+     
+     @param out -- Output stream.
+     @return Status.
+     */
+    kern_return_t WriteCSV( FILE * out );
+    
+    /**
+     Write every series in binary, native endian:
+     
+        "XNUGROW\0", uint32 version, uint32 page size, uint32 series count
+        per series: uint32 kind, uint32 point count, uint64 key, uint32 name length, name,
+                    GrowthPoint_t points[point count], oldest first
+     
+     @param out -- Output stream.
+     @return Status.
+     */
+    kern_return_t WriteBinary( FILE * out );
+    
+    /**
+     Drop every series. The next sample restarts the clock and reloads the modules.
+     
+     @param void
+     @return void
+     */
+    void Reset();
+    
+    // Samples taken, and their average cost in nanoseconds.
+    inline uint64_t samples() const { return _samples.load(std::memory_order_relaxed); }
+    uint64_t average_cost() const;
+    
+private:
+    GrowthTracker( const GrowthTracker& ) = delete;
+    GrowthTracker& operator =(const GrowthTracker&) = delete;
+    
+    struct Series {
+        GrowthSeriesKind           kind;
+        uint64_t                   key;
+        uint64_t                   hash;        // of the counters in the newest point
+        uint32_t                   seen;        // tick last mapped
+        uint32_t                   head;        // next point slot
+        uint32_t                   count;
+        std::vector<GrowthPoint_t> points;      // ring of ring_size
+    };
+    
+    // One tick's counters of a series, before it is merged
+    struct Entry {
+        GrowthSeriesKind kind;
+        uint64_t         key;
+        uint64_t         hash;
+        GrowthPoint_t    point;
+    };
+    
+    static uint64_t SeriesKey( GrowthSeriesKind kind, uint64_t key );
+    void Append( Series& series, const Entry& entry );
+    void Points( const Series& series, std::vector<GrowthPoint_t>& points ) const;
+    std::string Name( const Series& series ) const;
+    
+    class xnu_proc&                     _process;
+    GrowthConfig_t                      _config;
+    uint64_t                            _page;
+    
+    std::mutex                          _sample_lock;   // one Sample at a time, _ranges, scratch
+    std::vector<ModuleRange_t>          _ranges;        // module segments, by address
+    std::vector<Entry>                  _entries;       // scratch, this tick's counters
+    std::vector<GrowthPoint_t>          _module_points; // scratch, per module sums
+    std::vector<uint64_t>               _module_addresses;  // load addresses, parallel to the module list of _ranges
+    bool                                _loaded;
+    uint64_t                            _start;         // mach_absolute_time of the first sample
+    
+    std::mutex                          _lock;          // everything below
+    std::unordered_map<uint64_t, Series> _series;       // by SeriesKey
+    std::unordered_map<uint64_t, std::string> _module_names;   // by load address
+    uint32_t                            _tick;
+    
+    std::atomic<uint64_t>               _samples;
+    std::atomic<uint64_t>               _cost;          // mach_absolute_time units
+    
+    std::thread                         _thread;
+    std::mutex                          _run_lock;
+    std::condition_variable             _wake;
+    bool                                _running;
+};
+
+#endif /* defined(__xnumem__GrowthTracker__) */
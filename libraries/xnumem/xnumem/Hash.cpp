@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+#include "Hash.h"
+
+#include <string.h>
+
+static const uint64_t kPrime1 = 11400714785074694791ULL;
+static const uint64_t kPrime2 = 14029467366897019727ULL;
+static const uint64_t kPrime3 =  1609587929392839161ULL;
+static const uint64_t kPrime4 =  9650029242287828579ULL;
+static const uint64_t kPrime5 =  2870177450012600261ULL;
+
+static const uint64_t kSeedHi = 0x9e3779b97f4a7c15ULL;
+
+static inline uint64_t Rotl( uint64_t x, int r )
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t Load64( const uint8_t * p )
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t Load32( const uint8_t * p )
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t Round( uint64_t acc, uint64_t input )
+{
+    acc += input * kPrime2;
+    acc  = Rotl(acc, 31);
+    return acc * kPrime1;
+}
+
+static inline uint64_t MergeRound( uint64_t acc, uint64_t value )
+{
+    acc ^= Round(0, value);
+    return acc * kPrime1 + kPrime4;
+}
+
+static inline uint64_t Converge( const uint64_t v[4] )
+{
+    uint64_t h = Rotl(v[0], 1) + Rotl(v[1], 7) + Rotl(v[2], 12) + Rotl(v[3], 18);
+    for (int i = 0; i < 4; i++)
+        h = MergeRound(h, v[i]);
+    return h;
+}
+
+static inline void Init( uint64_t v[4], uint64_t seed )
+{
+    v[0] = seed + kPrime1 + kPrime2;
+    v[1] = seed + kPrime2;
+    v[2] = seed;
+    v[3] = seed - kPrime1;
+}
+
+static uint64_t Finish( uint64_t h, const uint8_t * p, size_t remaining )
+{
+    while(remaining >= 8)
+    {
+        h ^= Round(0, Load64(p));
+        h  = Rotl(h, 27) * kPrime1 + kPrime4;
+        p += 8;
+        remaining -= 8;
+    }
+    
+    if(remaining >= 4)
+    {
+        h ^= (uint64_t)Load32(p) * kPrime1;
+        h  = Rotl(h, 23) * kPrime2 + kPrime3;
+        p += 4;
+        remaining -= 4;
+    }
+    
+    while(remaining > 0)
+    {
+        h ^= (*p) * kPrime5;
+        h  = Rotl(h, 11) * kPrime1;
+        p++;
+        remaining--;
+    }
+    
+    h ^= h >> 33;
+    h *= kPrime2;
+    h ^= h >> 29;
+    h *= kPrime3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t Hash64( const void * data, size_t size, uint64_t seed /* = 0 */ )
+{
+    const uint8_t * p = (const uint8_t *)data;
+    size_t remaining = size;
+    uint64_t h;
+    
+    if(size >= 32)
+    {
+        uint64_t v[4];
+        Init(v, seed);
+        for (; remaining >= 32; remaining -= 32, p += 32)
+        {
+            v[0] = Round(v[0], Load64(p));
+            v[1] = Round(v[1], Load64(p + 8));
+            v[2] = Round(v[2], Load64(p + 16));
+            v[3] = Round(v[3], Load64(p + 24));
+        }
+        h = Converge(v);
+    }
+    else
+    {
+        h = seed + kPrime5;
+    }
+    
+    return Finish(h + size, p, remaining);
+}
+
+Hash128_t Hash128( const void * data, size_t size )
+{
+    const uint8_t * p = (const uint8_t *)data;
+    size_t remaining = size;
+    uint64_t lo, hi;
+    
+    if(size >= 32)
+    {
+        // Both lanes share every load
+        uint64_t a[4], b[4];
+        Init(a, 0);
+        Init(b, kSeedHi);
+        for (; remaining >= 32; remaining -= 32, p += 32)
+        {
+            uint64_t w0 = Load64(p), w1 = Load64(p + 8), w2 = Load64(p + 16), w3 = Load64(p + 24);
+            a[0] = Round(a[0], w0); b[0] = Round(b[0], w0);
+            a[1] = Round(a[1], w1); b[1] = Round(b[1], w1);
+            a[2] = Round(a[2], w2); b[2] = Round(b[2], w2);
+            a[3] = Round(a[3], w3); b[3] = Round(b[3], w3);
+        }
+        lo = Converge(a);
+        hi = Converge(b);
+    }
+    else
+    {
+        lo = kPrime5;
+        hi = kSeedHi + kPrime5;
+    }
+    
+    Hash128_t hash;
+    hash.lo = Finish(lo + size, p, remaining);
+    hash.hi = Finish(hi + size, p, remaining);
+    if(hash.lo == 0 && hash.hi == 0)
+        hash.lo = 1;
+    
+    return hash;
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+#ifndef __xnumem__Hash__
+#define __xnumem__Hash__
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct Hash128 {
+    uint64_t lo;
+    uint64_t hi;
+} Hash128_t;
+
+inline bool operator ==( const Hash128_t& a, const Hash128_t& b ) { return a.lo == b.lo && a.hi == b.hi; }
+inline bool operator !=( const Hash128_t& a, const Hash128_t& b ) { return !(a == b); }
+inline bool operator <( const Hash128_t& a, const Hash128_t& b ) { return a.hi < b.hi || (a.hi == b.hi && a.lo < b.lo); }
+
+// For unordered containers keyed by Hash128_t
+struct Hash128Hasher {
+    inline size_t operator ()( const Hash128_t& hash ) const { return (size_t)hash.lo; }
+};
+
+/**
+ XXH64 of a buffer.
+ 
+ @param data -- Input.
+ @param size -- Input size.
+ @param seed -- Seed.
+ @return Hash.
+ */
+uint64_t Hash64( const void * data, size_t size, uint64_t seed = 0 );
+
+/**
+ 128-bit content hash: two XXH64 lanes with independent seeds, computed in one pass.
+ Used to identify pages by content.
+ 
+ @param data -- Input.
+ @param size -- Input size.
+ @return Hash, never all zero (reserved for "zero page").
+ */
+Hash128_t Hash128( const void * data, size_t size );
+
+#endif /* defined(__xnumem__Hash__) */
@@ -0,0 +1,405 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+#include "HeapWalker.h"
+#include "Epoch.h"
+#include "Scheduler.h"
+#include "Trace.h"
+#include "xnumem.h"
+
+#include <dlfcn.h>
+#include <mach-o/dyld_images.h>
+
+#include <algorithm>
+
+static const mach_vm_size_t kBlockSize   = 1024 * 1024;
+static const uint64_t       kQuantum     = 16;
+static const size_t         kMaxZoneName = 256;
+static const size_t         kCacheHeader = 0x68;    // dyld_cache_header from its magic up to and including the uuid
+
+// The reader callback has no context argument
+static __thread HeapWalker *s_walker = nullptr;
+
+struct HeapWalker::Context {
+    HeapWalker          *walker;
+    HeapZoneStats_t     *zone;
+    std::vector<Region> *regions;
+};
+
+// The target has our dyld shared cache mapped at our address, i.e. the same cache UUID
+// and the same slide, so code pointers read from it are code in our own copy
+static bool SameSharedCache( ProcessMemory& memory )
+{
+    struct task_dyld_info dyld_info;
+    mach_msg_type_number_t count = TASK_DYLD_INFO_COUNT;
+    if(task_info(mach_task_self(), TASK_DYLD_INFO, (task_info_t)&dyld_info, &count) != KERN_SUCCESS)
+        return false;
+    
+    const struct dyld_all_image_infos * infos = (const struct dyld_all_image_infos *)dyld_info.all_image_info_addr;
+    if(infos == nullptr || infos->version < 15 || infos->sharedCacheBaseAddress == 0)
+        return false;
+    
+    uint8_t remote[kCacheHeader];
+    if(memory.TryRead(infos->sharedCacheBaseAddress, sizeof(remote), remote) != KERN_SUCCESS)
+        return false;
+    return memcmp(remote, (const void *)infos->sharedCacheBaseAddress, sizeof(remote)) == 0 &&
+           memcmp(remote + kCacheHeader - sizeof(infos->sharedCacheUUID), infos->sharedCacheUUID, sizeof(infos->sharedCacheUUID)) == 0;
+}
+
+// Code of our libmalloc, and nothing else, may be called on the target's behalf
+static bool InMallocLibrary( const void * code )
+{
+    Dl_info info;
+    if(dladdr(code, &info) == 0 || info.dli_fname == nullptr)
+        return false;
+    const char * name = strrchr(info.dli_fname, '/');
+    return strcmp(name ? name + 1 : info.dli_fname, "libsystem_malloc.dylib") == 0;
+}
+
+static size_t SizeClass( uint64_t size )
+{
+    size_t index = 0;
+    while((kQuantum << index) < size)
+        index++;
+    return index;
+}
+
+static HeapClassStats_t& ClassOf( HeapZoneStats_t& zone, uint64_t size )
+{
+    size_t index = SizeClass(size);
+    while(zone.classes.size() <= index)
+    {
+        HeapClassStats_t entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.size = kQuantum << zone.classes.size();
+        zone.classes.push_back(entry);
+    }
+    return zone.classes[index];
+}
+
+HeapWalker::HeapWalker( xnu_proc& process ) : _process(process)
+{
+}
+
+HeapWalker::~HeapWalker()
+{
+    Release();
+}
+
+void HeapWalker::Release()
+{
+    for (std::multimap<mach_vm_address_t, Mapping>::iterator it = _mappings.begin(); it != _mappings.end(); ++it)
+    {
+        if(it->second.mapped)
+            _process.memory().ReleaseMapped(it->second.data, it->second.size);
+    }
+    _mappings.clear();
+}
+
+const uint8_t * HeapWalker::Fetch( mach_vm_address_t address, mach_vm_size_t size )
+{
+    ProcessMemory& memory = _process.memory();
+    
+    // Offline sources hand out their own mappings
+    if(memory.source())
+    {
+        const void * data = memory.Map(address, size);
+        if(data)
+            return (const uint8_t *)data;
+    }
+    
+    // The latest mapping at the closest start; equal starts keep insertion order
+    std::multimap<mach_vm_address_t, Mapping>::iterator it = _mappings.upper_bound(address);
+    if(it != _mappings.begin() && address + size <= (--it)->first + it->second.size)
+        return it->second.data + (address - it->first);
+    
+    // Whole blocks of the region, so neighbouring headers come from the same read
+    mach_vm_address_t start = address & ~(kBlockSize - 1);
+    mach_vm_address_t end   = (address + size + kBlockSize - 1) & ~(kBlockSize - 1);
+    EpochGuard guard;
+    const MemoryRegion_t* region = memory.regions().Find(address);
+    if(region && region->address + region->size >= address + size)
+    {
+        start = std::max<mach_vm_address_t>(start, region->address);
+        end   = std::min<mach_vm_address_t>(end, region->address + region->size);
+    }
+    else
+    {
+        // Not in the region table, or straddling regions: just the pages asked for
+        start = address & ~(mach_vm_address_t)(getpagesize() - 1);
+        end   = (address + size + getpagesize() - 1) & ~(mach_vm_address_t)(getpagesize() - 1);
+    }
+    
+    // Mappings may overlap earlier ones. Those stay until the walk ends, the
+    // enumerator can still hold pointers into them
+    std::multimap<mach_vm_address_t, Mapping>::iterator stored = _mappings.insert(std::make_pair(start, Mapping()));
+    Mapping& mapping = stored->second;
+    mapping.size   = end - start;
+    mapping.mapped = false;
+    
+    const void * data = nullptr;
+    if(memory.ReadMapped(start, mapping.size, &data) == KERN_SUCCESS)
+    {
+        mapping.data   = (const uint8_t *)data;
+        mapping.mapped = true;
+        return mapping.data + (address - start);
+    }
+    
+    // Copy what was asked for when the block can't be had
+    _mappings.erase(stored);
+    stored = _mappings.insert(std::make_pair(address, Mapping()));
+    stored->second.size = size;
+    stored->second.mapped = false;
+    stored->second.copy.resize(size);
+    if(memory.TryRead(address, size, stored->second.copy.data()) != KERN_SUCCESS)
+    {
+        _mappings.erase(stored);
+        return nullptr;
+    }
+    
+    stored->second.data = stored->second.copy.data();
+    return stored->second.data;
+}
+
+kern_return_t HeapWalker::Reader( task_t task, vm_address_t address, vm_size_t size, void ** local )
+{
+    const uint8_t * data = s_walker ? s_walker->Fetch(address, size) : nullptr;
+    if(data == nullptr)
+        return KERN_INVALID_ADDRESS;
+    
+    *local = (void *)data;
+    return KERN_SUCCESS;
+}
+
+void HeapWalker::Recorder( task_t task, void * context, unsigned type, vm_range_t * ranges, unsigned count )
+{
+    Context *ctx = (Context *)context;
+    HeapZoneStats_t& zone = *ctx->zone;
+    std::vector<Region>& regions = *ctx->regions;
+    
+    for (unsigned i = 0; i < count; i++)
+    {
+        const vm_range_t& range = ranges[i];
+        
+        if(type == MALLOC_ADMIN_REGION_RANGE_TYPE)
+        {
+            zone.bytes_admin += range.size;
+        }
+        else if(type == MALLOC_PTR_REGION_RANGE_TYPE)
+        {
+            Region region;
+            region.start = range.address;
+            region.end   = range.address + range.size;
+            regions.push_back(region);
+            zone.regions++;
+            zone.bytes_mapped += range.size;
+        }
+        else if(type == MALLOC_PTR_IN_USE_RANGE_TYPE)
+        {
+            HeapClassStats_t& entry = ClassOf(zone, range.size);
+            entry.blocks_in_use++;
+            entry.bytes_in_use += range.size;
+            zone.blocks_in_use++;
+            zone.bytes_in_use += range.size;
+            
+            // Mark the block in its region, the gaps are the free space
+            std::vector<Region>::iterator region = std::upper_bound(regions.begin(), regions.end(), (mach_vm_address_t)range.address,
+                                                                    [](mach_vm_address_t address, const Region& region) {
+                                                                        return address < region.start;
+                                                                    });
+            if(region == regions.begin() || range.address >= (--region)->end || region->live.empty())
+                continue;
+            
+            uint64_t first = (range.address - region->start) / kQuantum;
+            uint64_t last  = (std::min<uint64_t>(range.address + range.size, region->end) - region->start + kQuantum - 1) / kQuantum;
+            for (uint64_t bit = first; bit < last; )
+            {
+                if((bit & 63) == 0 && bit + 64 <= last)
+                {
+                    region->live[bit / 64] = ~0ULL;
+                    bit += 64;
+                }
+                else
+                {
+                    region->live[bit / 64] |= 1ULL << (bit & 63);
+                    bit++;
+                }
+            }
+        }
+    }
+}
+
+kern_return_t HeapWalker::WalkZone( mach_vm_address_t address, HeapZoneStats_t& zone )
+{
+    TraceSpan span("WalkZone", "HeapWalker");
+    zone.address = address;
+    
+    const malloc_zone_t* remote = (const malloc_zone_t*)Fetch(address, sizeof(malloc_zone_t));
+    if(remote == nullptr)
+        return KERN_INVALID_ADDRESS;
+    
+    // The name may end right before an unmapped page, read it a page at a time
+    mach_vm_address_t name = (mach_vm_address_t)remote->zone_name;
+    while(name && zone.name.size() < kMaxZoneName)
+    {
+        char buffer[kMaxZoneName];
+        size_t count = std::min<size_t>(sizeof(buffer), getpagesize() - (name & (getpagesize() - 1)));
+        if(_process.memory().TryRead(name, count, buffer) != KERN_SUCCESS)
+            break;
+        
+        size_t length = strnlen(buffer, count);
+        zone.name.append(buffer, length);
+        name = length < count ? 0 : name + count;
+    }
+    if(zone.name.size() > kMaxZoneName)
+        zone.name.resize(kMaxZoneName);
+    
+    const malloc_introspection_t* introspect = (const malloc_introspection_t*)Fetch((mach_vm_address_t)remote->introspect, sizeof(malloc_introspection_t));
+    if(introspect == nullptr || introspect->enumerator == nullptr)
+        return KERN_NOT_SUPPORTED;
+    
+    // The enumerator runs here; Walk checked the shared cache, so this is our libmalloc's
+    if(!InMallocLibrary((const void *)introspect->enumerator))
+        return KERN_NOT_SUPPORTED;
+    
+    task_t task = _process.memory().source() ? MACH_PORT_NULL : _process.core()._pmach_port;
+    std::vector<Region> regions;
+    Context context = { this, &zone, &regions };
+    
+    // Regions first, so the second pass can mark blocks inside them
+    kern_return_t kret = introspect->enumerator(task, &context, MALLOC_PTR_REGION_RANGE_TYPE | MALLOC_ADMIN_REGION_RANGE_TYPE,
+                                                (vm_address_t)address, Reader, Recorder);
+    if(kret != KERN_SUCCESS)
+        return kret;
+    
+    std::sort(regions.begin(), regions.end(), [](const Region& a, const Region& b) { return a.start < b.start; });
+    for (std::vector<Region>::iterator it = regions.begin(); it != regions.end(); ++it)
+        it->live.assign(((it->end - it->start) / kQuantum + 63) / 64, 0);
+    
+    kret = introspect->enumerator(task, &context, MALLOC_PTR_IN_USE_RANGE_TYPE, (vm_address_t)address, Reader, Recorder);
+    if(kret != KERN_SUCCESS)
+        return kret;
+    
+    // Free space is every run of unmarked quanta
+    for (std::vector<Region>::const_iterator it = regions.begin(); it != regions.end(); ++it)
+    {
+        uint64_t quanta = (it->end - it->start) / kQuantum;
+        uint64_t run = 0;
+        for (uint64_t bit = 0; bit <= quanta; bit++)
+        {
+            bool live = bit == quanta || (it->live[bit / 64] >> (bit & 63)) & 1;
+            if(!live)
+            {
+                run++;
+                continue;
+            }
+            
+            if(run)
+            {
+                HeapClassStats_t& entry = ClassOf(zone, run * kQuantum);
+                entry.free_spans++;
+                entry.bytes_free += run * kQuantum;
+                zone.bytes_free  += run * kQuantum;
+                zone.largest_free = std::max(zone.largest_free, run * kQuantum);
+                run = 0;
+            }
+        }
+    }
+    
+    zone.fragmentation = zone.bytes_free ? 1.0 - (double)zone.largest_free / zone.bytes_free : 0.0;
+    return KERN_SUCCESS;
+}
+
+kern_return_t HeapWalker::Walk( std::vector<HeapZoneStats_t>& zones, ScanJob* job /* = nullptr */ )
+{
+    TraceSpan span("Walk", "HeapWalker");
+    
+    // malloc_get_all_zones and the enumerators read the target's malloc state at the
+    // addresses of our libmalloc and run our code on it. Live or offline, that is only
+    // sound when the target maps the very same shared cache at the very same slide
+    if(!SameSharedCache(_process.memory()))
+        return KERN_NOT_SUPPORTED;
+    
+    s_walker = this;
+    
+    task_t task = _process.memory().source() ? MACH_PORT_NULL : _process.core()._pmach_port;
+    vm_address_t *addresses = NULL;
+    unsigned count = 0;
+    kern_return_t kret = malloc_get_all_zones(task, Reader, &addresses, &count);
+    
+    // The list lives in our mappings, take a copy before walking
+    std::vector<vm_address_t> zone_addresses;
+    if(kret == KERN_SUCCESS)
+        zone_addresses.assign(addresses, addresses + count);
+    
+    for (size_t i = 0; i < zone_addresses.size() && kret == KERN_SUCCESS; i++)
+    {
+        if(job && job->cancelled())
+        {
+            kret = KERN_ABORTED;
+            break;
+        }
+        
+        HeapZoneStats_t zone;
+        zone.address = 0;
+        zone.regions = zone.bytes_mapped = zone.bytes_admin = 0;
+        zone.blocks_in_use = zone.bytes_in_use = zone.bytes_free = zone.largest_free = 0;
+        zone.fragmentation = 0;
+        
+        // A zone we can't introspect is skipped, the others are still worth having
+        if(WalkZone(zone_addresses[i], zone) == KERN_SUCCESS)
+            zones.push_back(zone);
+    }
+    
+    Release();
+    s_walker = nullptr;
+    return kret;
+}
+
+void HeapWalker::Merge( const std::vector<HeapZoneStats_t>& zones, HeapZoneStats_t& total )
+{
+    total.address = 0;
+    total.name = "total";
+    total.regions = total.bytes_mapped = total.bytes_admin = 0;
+    total.blocks_in_use = total.bytes_in_use = total.bytes_free = total.largest_free = 0;
+    total.classes.clear();
+    
+    for (std::vector<HeapZoneStats_t>::const_iterator zone = zones.begin(); zone != zones.end(); ++zone)
+    {
+        total.regions       += zone->regions;
+        total.bytes_mapped  += zone->bytes_mapped;
+        total.bytes_admin   += zone->bytes_admin;
+        total.blocks_in_use += zone->blocks_in_use;
+        total.bytes_in_use  += zone->bytes_in_use;
+        total.bytes_free    += zone->bytes_free;
+        total.largest_free   = std::max(total.largest_free, zone->largest_free);
+        
+        for (std::vector<HeapClassStats_t>::const_iterator it = zone->classes.begin(); it != zone->classes.end(); ++it)
+        {
+            HeapClassStats_t& entry = ClassOf(total, it->size);
+            entry.blocks_in_use += it->blocks_in_use;
+            entry.bytes_in_use  += it->bytes_in_use;
+            entry.free_spans    += it->free_spans;
+            entry.bytes_free    += it->bytes_free;
+        }
+    }
+    
+    total.fragmentation = total.bytes_free ? 1.0 - (double)total.largest_free / total.bytes_free : 0.0;
+}
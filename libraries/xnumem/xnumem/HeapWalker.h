@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+#ifndef __xnumem__HeapWalker__
+#define __xnumem__HeapWalker__
+
+#include <mach/mach.h>
+#include <malloc/malloc.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+class ScanJob;
+
+typedef struct HeapClassStats {
+    uint64_t size;              // upper bound of the class, classes are powers of two from 16 bytes
+    uint64_t blocks_in_use;
+    uint64_t bytes_in_use;
+    uint64_t free_spans;        // gaps between live blocks that fall in this class
+    uint64_t bytes_free;
+} HeapClassStats_t;
+
+typedef struct HeapZoneStats {
+    mach_vm_address_t address;          // malloc_zone_t in the target
+    std::string       name;
+    uint64_t          regions;          // heap regions the zone allocates from
+    uint64_t          bytes_mapped;
+    uint64_t          bytes_admin;      // allocator bookkeeping regions
+    uint64_t          blocks_in_use;
+    uint64_t          bytes_in_use;
+    uint64_t          bytes_free;       // mapped but not covered by a live block, in-region metadata included
+    uint64_t          largest_free;
+    double            fragmentation;    // 1 - largest_free / bytes_free, 0 when free space is one piece
+    std::vector<HeapClassStats_t> classes;
+} HeapZoneStats_t;
+
+/**
+ Walks the malloc zones of an attached process and reports live and free bytes per
+ size class and per zone.
+ 
+ Zones are found with malloc_get_all_zones and walked with their own introspection
+ enumerators, the way heap(1) and leaks(1) do, so every allocator libmalloc ships is
+ understood without knowing its layout. The introspection code is run locally and
+ only works when the target uses the same libmalloc, i.e. the same shared cache at the
+ same slide; Walk checks that, for offline sources too, and refuses otherwise.
+ 
+ The enumerators ask for memory through a reader. The reader maps heap regions in
+ 1MB blocks with copy-on-write reads instead of copying each chunk header it is asked
+ for, and serves later requests from those mappings.
+ */
+class HeapWalker
+{
+public:
+    HeapWalker( class xnu_proc& process );
+    ~HeapWalker();
+    
+    /**
+     Walk every zone.
+     
+     @param zones -- Output statistics, one entry per zone.
+     @param job   -- Cancellation, checked between zones. (optional)
+     @return KERN_NOT_SUPPORTED if the target does not map our dyld shared cache at our slide.
+     */
+    kern_return_t Walk( std::vector<HeapZoneStats_t>& zones, ScanJob* job = nullptr );
+    
+    /**
+     Sum zone statistics, e.g. for a process-wide line.
+     
+     @param zones -- Zone statistics.
+     @param total -- Output totals.
+     @return void
+     */
+    static void Merge( const std::vector<HeapZoneStats_t>& zones, HeapZoneStats_t& total );
+    
+private:
+    HeapWalker( const HeapWalker& ) = delete;
+    HeapWalker& operator =(const HeapWalker&) = delete;
+    
+    struct Mapping {
+        mach_vm_size_t        size;
+        const uint8_t        *data;
+        bool                  mapped;   // from ReadMapped, released with ReleaseMapped
+        std::vector<uint8_t>  copy;     // otherwise
+    };
+    
+    struct Region {
+        mach_vm_address_t     start;
+        mach_vm_address_t     end;
+        std::vector<uint64_t> live;     // one bit per 16 bytes covered by a live block
+    };
+    
+    struct Context;
+    
+    // memory_reader_t and vm_range_recorder_t callbacks
+    static kern_return_t Reader( task_t task, vm_address_t address, vm_size_t size, void ** local );
+    static void Recorder( task_t task, void * context, unsigned type, vm_range_t * ranges, unsigned count );
+    
+    const uint8_t * Fetch( mach_vm_address_t address, mach_vm_size_t size );
+    kern_return_t WalkZone( mach_vm_address_t address, HeapZoneStats_t& zone );
+    void Release();
+    
+    class xnu_proc&                         _process;
+    std::multimap<mach_vm_address_t, Mapping> _mappings;    // by start address, for the duration of a walk
+};
+
+#endif /* defined(__xnumem__HeapWalker__) */
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+#ifndef __xnumem__MemorySource__
+#define __xnumem__MemorySource__
+
+#include <mach/mach.h>
+#include <vector>
+
+#include "RegionIndex.h"
+
+struct ModuleData;
+
+/**
+ Backend that ProcessMemory reads from instead of a live task, e.g. a snapshot file.
+ Sources are read-only; ProcessMemory refuses writes, protection changes and allocations.
+ */
+class MemorySource
+{
+public:
+    virtual ~MemorySource() {}
+    
+    /**
+     Read data.
+     
+     @param address -- Memory address.
+     @param size    -- Size to read.
+     @param buffer  -- Output buffer.
+     @return Status.
+     */
+    virtual kern_return_t Read( mach_vm_address_t address, mach_vm_size_t size, void * buffer ) = 0;
+    
+    /**
+     Retrieve all regions, in address order.
+     
+     @param regions -- Output regions.
+     @return Status.
+     */
+    virtual kern_return_t QueryRegions( std::vector<MemoryRegion_t>& regions ) = 0;
+    
+    /**
+     Retrieve all modules. Path strings are owned by the source.
+     
+     @param modules -- Output modules.
+     @return Status.
+     */
+    virtual kern_return_t QueryModules( std::vector<struct ModuleData>& modules ) = 0;
+    
+    /**
+     Zero-copy access to memory, for sources that keep it mapped.
+     
+     @param address -- Memory address.
+     @param size    -- Size of the range, must not cross a region boundary.
+     @return Pointer to the data, nullptr if the range can't be mapped and has to be Read.
+     */
+    virtual const void * Map( mach_vm_address_t address, mach_vm_size_t size ) { return nullptr; }
+};
+
+#endif /* defined(__xnumem__MemorySource__) */
@@ -0,0 +1,252 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+#include "MemoryUsage.h"
+#include "Epoch.h"
+#include "Trace.h"
+#include "xnumem.h"
+
+#include <mach/mach_vm.h>
+
+#include <algorithm>
+
+static void Add( MemoryUsageStats_t& to, const MemoryUsageStats_t& entry )
+{
+    to.regions       += entry.regions;
+    to.virtual_size  += entry.virtual_size;
+    to.resident      += entry.resident;
+    to.proportional  += entry.proportional;
+    to.shared        += entry.shared;
+    to.private_dirty += entry.private_dirty;
+    to.swapped       += entry.swapped;
+}
+
+// Page counters of one entry, split by how its object is shared
+static void Account( const vm_region_submap_info_data_64_t& info, mach_vm_size_t size, uint64_t page, MemoryUsageStats_t& entry )
+{
+    memset(&entry, 0, sizeof(entry));
+    entry.regions      = 1;
+    entry.virtual_size = size;
+    entry.swapped      = (uint64_t)info.pages_swapped_out * page;
+    
+    uint64_t resident = (uint64_t)info.pages_resident * page;
+    uint64_t dirty    = (uint64_t)info.pages_dirtied * page;
+    uint64_t refs     = info.ref_count ? info.ref_count : 1;
+    
+    switch(info.share_mode)
+    {
+        case SM_COW:
+        {
+            // Pages copied on write are ours, the rest is still the shared original
+            uint64_t owned = refs == 1 ? resident : std::min<uint64_t>(resident, (uint64_t)info.pages_shared_now_private * page);
+            entry.resident      = resident;
+            entry.shared        = resident - owned;
+            entry.proportional  = owned + entry.shared / refs;
+            entry.private_dirty = std::min(dirty, owned);
+            break;
+        }
+        case SM_SHARED:
+        case SM_TRUESHARED:
+        case SM_SHARED_ALIASED:
+            entry.resident      = resident;
+            entry.shared        = refs == 1 ? 0 : resident;
+            entry.proportional  = resident / refs;
+            entry.private_dirty = refs == 1 ? dirty : 0;
+            break;
+        case SM_EMPTY:
+            break;
+        default:
+            // SM_PRIVATE, SM_PRIVATE_ALIASED, SM_LARGE_PAGE
+            entry.resident      = resident;
+            entry.proportional  = resident;
+            entry.private_dirty = dirty;
+            break;
+    }
+}
+
+MemoryUsage::MemoryUsage( xnu_proc& process ) : _process(process)
+{
+    memset(&_total, 0, sizeof(_total));
+    memset(_by_tag, 0, sizeof(_by_tag));
+    memset(_by_protection, 0, sizeof(_by_protection));
+}
+
+MemoryUsage::~MemoryUsage()
+{
+}
+
+kern_return_t MemoryUsage::Collect()
+{
+    TraceSpan span("Collect", "MemoryUsage");
+    ProcessMemory& memory = _process.memory();
+    if(memory.source())
+        return KERN_NOT_SUPPORTED;
+    
+    // Region pointers are turned into indices of this table, keep it for the whole walk
+    EpochGuard guard;
+    const RegionIndex& index = memory.regions();
+    const std::vector<MemoryRegion_t>& segments = index.table();
+    std::vector<ModuleData_t> modules = _process.modules().modules();
+    
+    MemoryUsageStats_t empty;
+    memset(&empty, 0, sizeof(empty));
+    _total = empty;
+    _by_region.assign(segments.size(), empty);
+    _by_module.assign(modules.size(), empty);
+    _module_paths.resize(modules.size());
+    _module_addresses.resize(modules.size());
+    for (size_t i = 0; i < modules.size(); i++)
+    {
+        _module_paths[i] = modules[i].imageFilePath ? modules[i].imageFilePath : "";
+        _module_addresses[i] = (mach_vm_address_t)modules[i].imageLoadAddress;
+    }
+    std::fill(_by_tag, _by_tag + 256, empty);
+    std::fill(_by_protection, _by_protection + VM_PROT_ALL + 1, empty);
+    
+    // Module segments by address, for the per-entry lookups; indices are into the same copy
+    _process.modules().GetModuleRanges(modules, _module_ranges);
+    
+    return Walk(_process, [&](mach_vm_address_t address, mach_vm_size_t size,
+                              const vm_region_submap_info_data_64_t& info, const MemoryUsageStats_t& entry) {
+        Add(_total, entry);
+        Add(_by_protection[info.protection & VM_PROT_ALL], entry);
+        
+        const MemoryRegion_t* region = index.Find(address);
+        if(region)
+            Add(_by_region[region - segments.data()], entry);
+        
+        const ModuleRange_t* module = ProcessModules::FindModuleRange(_module_ranges, address);
+        if(module)
+            Add(_by_module[module->index], entry);
+        else
+            Add(_by_tag[info.user_tag & 0xff], entry);
+    });
+}
+
+kern_return_t MemoryUsage::Walk( xnu_proc& process, const UsageEntryFn& fn )
+{
+    if(process.memory().source())
+        return KERN_NOT_SUPPORTED;
+    
+    const uint64_t page = getpagesize();
+    mach_vm_address_t address = 0;
+    natural_t depth = 0;
+    
+    while(true)
+    {
+        mach_vm_size_t size = 0;
+        vm_region_submap_info_data_64_t info;
+        mach_msg_type_number_t count = VM_REGION_SUBMAP_INFO_COUNT_64;
+        kern_return_t kret = mach_vm_region_recurse(process.core()._pmach_port, &address, &size, &depth,
+                                                    (vm_region_recurse_info_t)&info, &count);
+        if(kret == KERN_INVALID_ADDRESS)
+            break;
+        if(kret != KERN_SUCCESS)
+            return kret;
+        
+        // Look inside submaps (the shared cache) instead of counting them whole
+        if(info.is_submap)
+        {
+            depth++;
+            continue;
+        }
+        
+        MemoryUsageStats_t entry;
+        Account(info, size, page, entry);
+        fn(address, size, info, entry);
+        
+        address += size;
+    }
+    
+    return KERN_SUCCESS;
+}
+
+const char * MemoryUsage::TagName( unsigned tag )
+{
+    switch(tag)
+    {
+        case 0:                                 return "untagged";
+        case VM_MEMORY_MALLOC:                  return "malloc";
+        case VM_MEMORY_MALLOC_SMALL:            return "malloc small";
+        case VM_MEMORY_MALLOC_LARGE:            return "malloc large";
+        case VM_MEMORY_MALLOC_HUGE:             return "malloc huge";
+        case VM_MEMORY_SBRK:                    return "sbrk";
+        case VM_MEMORY_REALLOC:                 return "realloc";
+        case VM_MEMORY_MALLOC_TINY:             return "malloc tiny";
+        case VM_MEMORY_MALLOC_LARGE_REUSABLE:   return "malloc large reusable";
+        case VM_MEMORY_MALLOC_LARGE_REUSED:     return "malloc large reused";
+        case VM_MEMORY_MALLOC_NANO:             return "malloc nano";
+        case VM_MEMORY_MALLOC_MEDIUM:           return "malloc medium";
+        case VM_MEMORY_IOKIT:                   return "IOKit";
+        case VM_MEMORY_STACK:                   return "stack";
+        case VM_MEMORY_GUARD:                   return "guard";
+        case VM_MEMORY_SHARED_PMAP:             return "shared pmap";
+        case VM_MEMORY_DYLIB:                   return "dylib";
+        case VM_MEMORY_DYLD:                    return "dyld";
+        case VM_MEMORY_DYLD_MALLOC:             return "dyld malloc";
+        case VM_MEMORY_JAVASCRIPT_JIT_EXECUTABLE_ALLOCATOR: return "JIT";
+    }
+    
+    static __thread char name[16];
+    snprintf(name, sizeof(name), "tag %u", tag);
+    return name;
+}
+
+static void PrintLine( FILE * out, const char * name, const MemoryUsageStats_t& stats )
+{
+    fprintf(out, " %-40.40s %8lluK %8lluK %8lluK %8lluK %8lluK %6llu\n", name,
+            (unsigned long long)(stats.virtual_size >> 10), (unsigned long long)(stats.resident >> 10),
+            (unsigned long long)(stats.proportional >> 10), (unsigned long long)(stats.private_dirty >> 10),
+            (unsigned long long)(stats.swapped >> 10), (unsigned long long)stats.regions);
+}
+
+void MemoryUsage::Print( FILE * out ) const
+{
+    fprintf(out, " %-40s %9s %9s %9s %9s %9s %6s\n", "", "virtual", "resident", "pss", "dirty", "swapped", "count");
+    PrintLine(out, "total", _total);
+    
+    // Named as collected, the module list may have changed since
+    for (size_t i = 0; i < _by_module.size(); i++)
+    {
+        if(_by_module[i].resident == 0 && _by_module[i].swapped == 0)
+            continue;
+        
+        const char * path = _module_paths[i];
+        const char * file = strrchr(path, '/');
+        PrintLine(out, file ? file + 1 : path, _by_module[i]);
+    }
+    
+    for (unsigned tag = 0; tag < 256; tag++)
+    {
+        if(_by_tag[tag].resident || _by_tag[tag].swapped)
+            PrintLine(out, TagName(tag), _by_tag[tag]);
+    }
+    
+    for (vm_prot_t protection = 0; protection <= VM_PROT_ALL; protection++)
+    {
+        if(_by_protection[protection].resident == 0)
+            continue;
+        
+        char name[8];
+        snprintf(name, sizeof(name), "%c%c%c",
+                 protection & VM_PROT_READ ? 'r' : '-', protection & VM_PROT_WRITE ? 'w' : '-', protection & VM_PROT_EXECUTE ? 'x' : '-');
+        PrintLine(out, name, _by_protection[protection]);
+    }
+}
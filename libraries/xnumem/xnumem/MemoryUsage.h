@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+#ifndef __xnumem__MemoryUsage__
+#define __xnumem__MemoryUsage__
+
+#include <mach/mach.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <functional>
+#include <vector>
+
+#include "ProcessModules.h"
+
+typedef struct MemoryUsageStats {
+    uint64_t regions;           // VM entries, submap entries counted individually
+    uint64_t virtual_size;
+    uint64_t resident;
+    uint64_t proportional;      // resident, shared pages divided by their mapping count (PSS)
+    uint64_t shared;            // resident and mapped by other tasks too
+    uint64_t private_dirty;
+    uint64_t swapped;           // compressed or paged out
+} MemoryUsageStats_t;
+
+typedef std::function<void( mach_vm_address_t address, mach_vm_size_t size,
+                            const vm_region_submap_info_data_64_t& info, const MemoryUsageStats_t& usage )> UsageEntryFn;
+
+/**
+ Resident memory accounting of an attached process, the Mach counterpart of smaps.
+ 
+ Every VM entry is visited with mach_vm_region_recurse, descending into submaps so the
+ dyld shared cache is accounted per image, and its page counters are charged to:
+ 
+    the region of the index it lies in          by_region()
+    the module whose segment holds it           by_module()
+    its VM_MEMORY_* tag, when in no module      by_tag()
+    its current protection                      by_protection()
+ 
+ The walk makes one call per entry and allocates nothing per entry, so it stays cheap
+ enough to run periodically. Proportional size divides shared pages by the object's
+ reference count, which is what the kernel exposes; for the shared cache that count
+ is system wide.
+ */
+class MemoryUsage
+{
+public:
+    MemoryUsage( class xnu_proc& process );
+    ~MemoryUsage();
+    
+    /**
+     Walk the address space and aggregate. Regions and modules are taken as last queried.
+     
+     @param void
+     @return Status. KERN_NOT_SUPPORTED for offline sources, which have no page counters.
+     */
+    kern_return_t Collect();
+    
+    /**
+     Visit every VM entry with its accounted usage, submaps descended into.
+     
+     @param process -- Attached process.
+     @param fn      -- Called once per entry, in address order.
+     @return Status. KERN_NOT_SUPPORTED for offline sources.
+     */
+    static kern_return_t Walk( class xnu_proc& process, const UsageEntryFn& fn );
+    
+    /**
+     Print totals, then modules, tags and protections with resident memory.
+     
+     @param out -- Output stream.
+     @return void
+     */
+    void Print( FILE * out ) const;
+    
+    /**
+     Name of a VM_MEMORY_* tag.
+     
+     @param tag -- User tag.
+     @return Name, "tag N" for tags without one. Points to a static buffer for those.
+     */
+    static const char * TagName( unsigned tag );
+    
+    inline const MemoryUsageStats_t& total() const { return _total; }
+    
+    // Parallel to ProcessMemory::segments() and ProcessModules::modules() at Collect time
+    inline const std::vector<MemoryUsageStats_t>& by_region() const { return _by_region; }
+    inline const std::vector<MemoryUsageStats_t>& by_module() const { return _by_module; }
+    inline const std::vector<const char *>& module_paths() const { return _module_paths; }
+    inline const std::vector<mach_vm_address_t>& module_addresses() const { return _module_addresses; }
+    
+    inline const MemoryUsageStats_t& by_tag( unsigned tag ) const { return _by_tag[tag & 0xff]; }
+    inline const MemoryUsageStats_t& by_protection( vm_prot_t protection ) const { return _by_protection[protection & VM_PROT_ALL]; }
+    
+private:
+    MemoryUsage( const MemoryUsage& ) = delete;
+    MemoryUsage& operator =(const MemoryUsage&) = delete;
+    
+    class xnu_proc&                 _process;
+    std::vector<ModuleRange_t>      _module_ranges;     // by address
+    
+    MemoryUsageStats_t              _total;
+    std::vector<MemoryUsageStats_t> _by_region;
+    std::vector<MemoryUsageStats_t> _by_module;
+    std::vector<const char *>       _module_paths;      // as of Collect, interned so they outlive refreshes
+    std::vector<mach_vm_address_t>  _module_addresses;  // load addresses, as of Collect
+    MemoryUsageStats_t              _by_tag[256];
+    MemoryUsageStats_t              _by_protection[VM_PROT_ALL + 1];
+};
+
+#endif /* defined(__xnumem__MemoryUsage__) */
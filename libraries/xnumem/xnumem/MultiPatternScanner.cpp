@@ -0,0 +1,469 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+
+#include "MultiPatternScanner.h"
+#include "Epoch.h"
+#include "Scheduler.h"
+#include "Trace.h"
+#include "xnumem.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include <algorithm>
+#include <deque>
+#include <string>
+
+// ASCII lower case, the automaton runs on folded input
+static struct FoldTable {
+    uint8_t map[256];
+    FoldTable()
+    {
+        for (int b = 0; b < 256; b++)
+            map[b] = (b >= 'A' && b <= 'Z') ? (uint8_t)(b + 'a' - 'A') : (uint8_t)b;
+    }
+} s_fold;
+
+static int HexDigit( char c )
+{
+    if(c >= '0' && c <= '9')
+        return c - '0';
+    if(c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+MultiPatternScanner::MultiPatternScanner() :
+    _compiled(false),
+    _class_count(0),
+    _state_count(0),
+    _max_size(0),
+    _start_count(-1)
+{
+    memset(_classes, 0, sizeof(_classes));
+    memset(_single, 0, sizeof(_single));
+    memset(_starts, 0, sizeof(_starts));
+}
+
+MultiPatternScanner::~MultiPatternScanner()
+{
+}
+
+kern_return_t MultiPatternScanner::Add( uint32_t id, const void * bytes, size_t size, const char * mask /* = nullptr */, uint32_t flags /* = 0 */ )
+{
+    if(bytes == nullptr || size == 0)
+        return KERN_INVALID_ARGUMENT;
+    
+    Pattern pattern;
+    pattern.id          = id;
+    pattern.nocase      = (flags & kPatternNoCase) != 0;
+    pattern.anchor      = 0;
+    pattern.anchor_size = 0;
+    pattern.value.resize(size);
+    pattern.care.resize(size);
+    
+    // Wildcards compare as zero, so a match is (byte & care) == value
+    size_t run = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+        bool fixed = mask == nullptr || mask[i] != '?';
+        uint8_t value = ((const uint8_t *)bytes)[i];
+        pattern.care[i]  = fixed ? 0xff : 0;
+        pattern.value[i] = fixed ? (pattern.nocase ? s_fold.map[value] : value) : 0;
+        
+        // The longest fixed run is what the automaton looks for
+        run = fixed ? run + 1 : 0;
+        if(run > pattern.anchor_size)
+        {
+            pattern.anchor_size = (uint32_t)run;
+            pattern.anchor      = (uint32_t)(i + 1 - run);
+        }
+    }
+    
+    if(pattern.anchor_size == 0)
+        return KERN_INVALID_ARGUMENT;
+    
+    _patterns.push_back(pattern);
+    _compiled = false;
+    return KERN_SUCCESS;
+}
+
+kern_return_t MultiPatternScanner::AddSignature( uint32_t id, const char * signature, uint32_t flags /* = 0 */ )
+{
+    if(signature == nullptr)
+        return KERN_INVALID_ARGUMENT;
+    
+    std::vector<uint8_t> bytes;
+    std::string mask;
+    for (const char * it = signature; *it; )
+    {
+        if(*it == ' ')
+        {
+            it++;
+            continue;
+        }
+        
+        if(*it == '?')
+        {
+            it += it[1] == '?' ? 2 : 1;
+            bytes.push_back(0);
+            mask.push_back('?');
+        }
+        else if(HexDigit(it[0]) >= 0 && HexDigit(it[1]) >= 0)
+        {
+            bytes.push_back((uint8_t)(HexDigit(it[0]) << 4 | HexDigit(it[1])));
+            mask.push_back('x');
+            it += 2;
+        }
+        else
+        {
+            return KERN_INVALID_ARGUMENT;
+        }
+        
+        if(*it != ' ' && *it != '\0')
+            return KERN_INVALID_ARGUMENT;
+    }
+    
+    if(bytes.empty())
+        return KERN_INVALID_ARGUMENT;
+    
+    return Add(id, bytes.data(), bytes.size(), mask.c_str(), flags);
+}
+
+kern_return_t MultiPatternScanner::Compile()
+{
+    if(_patterns.empty())
+        return KERN_INVALID_ARGUMENT;
+    
+    // One class per folded byte used by an anchor, everything else is class 0
+    uint8_t folded_class[256];
+    memset(folded_class, 0, sizeof(folded_class));
+    _class_count = 1;
+    _max_size = 0;
+    for (std::vector<Pattern>::const_iterator it = _patterns.begin(); it != _patterns.end(); ++it)
+    {
+        for (uint32_t k = 0; k < it->anchor_size; k++)
+        {
+            uint8_t folded = s_fold.map[it->value[it->anchor + k]];
+            if(folded_class[folded] == 0)
+                folded_class[folded] = (uint8_t)_class_count++;
+        }
+        _max_size = std::max(_max_size, it->value.size());
+    }
+    for (int b = 0; b < 256; b++)
+        _classes[b] = folded_class[s_fold.map[b]];
+    
+    // Trie of the anchors. No edge leads back to the root, so 0 doubles as "no edge"
+    const uint32_t classes = _class_count;
+    std::vector<std::vector<uint32_t> > out(1);
+    _delta.assign(classes, 0);
+    _state_count = 1;
+    for (size_t i = 0; i < _patterns.size(); i++)
+    {
+        const Pattern& pattern = _patterns[i];
+        uint32_t state = 0;
+        for (uint32_t k = 0; k < pattern.anchor_size; k++)
+        {
+            uint32_t cls = _classes[pattern.value[pattern.anchor + k]];
+            uint32_t next = _delta[state * classes + cls];
+            if(next == 0)
+            {
+                next = _state_count++;
+                _delta.resize((size_t)_state_count * classes, 0);
+                out.push_back(std::vector<uint32_t>());
+                _delta[state * classes + cls] = next;
+            }
+            state = next;
+        }
+        out[state].push_back((uint32_t)i);
+    }
+    
+    // Failure links, breadth first, folded straight into the table so scanning never follows them
+    std::vector<uint32_t> fail(_state_count, 0);
+    std::deque<uint32_t> queue;
+    for (uint32_t cls = 0; cls < classes; cls++)
+    {
+        if(_delta[cls] != 0)
+            queue.push_back(_delta[cls]);
+    }
+    while(!queue.empty())
+    {
+        uint32_t state = queue.front();
+        queue.pop_front();
+        out[state].insert(out[state].end(), out[fail[state]].begin(), out[fail[state]].end());
+        
+        for (uint32_t cls = 0; cls < classes; cls++)
+        {
+            uint32_t& next = _delta[state * classes + cls];
+            uint32_t fallback = _delta[fail[state] * classes + cls];
+            if(next != 0)
+            {
+                fail[next] = fallback;
+                queue.push_back(next);
+            }
+            else
+            {
+                next = fallback;
+            }
+        }
+    }
+    
+    _out_first.assign(_state_count + 1, 0);
+    _out.clear();
+    for (uint32_t state = 0; state < _state_count; state++)
+    {
+        _out_first[state] = (uint32_t)_out.size();
+        _out.insert(_out.end(), out[state].begin(), out[state].end());
+    }
+    _out_first[_state_count] = (uint32_t)_out.size();
+    
+    // Where an anchor can start: single bytes, pairs, and the raw start bytes for SIMD
+    bool first[256] = { false };
+    memset(_single, 0, sizeof(_single));
+    _pairs.assign(65536 / 64, 0);
+    for (std::vector<Pattern>::const_iterator it = _patterns.begin(); it != _patterns.end(); ++it)
+    {
+        const uint8_t * anchor = &it->value[it->anchor];
+        uint8_t head = s_fold.map[anchor[0]];
+        first[head] = true;
+        if(it->anchor_size == 1)
+        {
+            for (int b = 0; b < 256; b++)
+                _single[b] |= s_fold.map[b] == head;
+        }
+        else
+        {
+            uint32_t pair = (uint32_t)head << 8 | s_fold.map[anchor[1]];
+            _pairs[pair >> 6] |= 1ULL << (pair & 63);
+        }
+    }
+    
+    _start_count = 0;
+    for (int b = 0; b < 256 && _start_count >= 0; b++)
+    {
+        if(!first[s_fold.map[b]])
+            continue;
+        if(_start_count == (int)sizeof(_starts))
+            _start_count = -1;
+        else
+            _starts[_start_count++] = (uint8_t)b;
+    }
+    
+    _compiled = true;
+    return KERN_SUCCESS;
+}
+
+inline bool MultiPatternScanner::Starts( const uint8_t * data, size_t position, size_t size ) const
+{
+    if(_single[data[position]])
+        return true;
+    if(position + 1 >= size)
+        return false;
+    
+    uint32_t pair = (uint32_t)s_fold.map[data[position]] << 8 | s_fold.map[data[position + 1]];
+    return (_pairs[pair >> 6] >> (pair & 63)) & 1;
+}
+
+size_t MultiPatternScanner::Skip( const uint8_t * data, size_t position, size_t size ) const
+{
+#if defined(__SSE2__)
+    if(_start_count > 0)
+    {
+        __m128i starts[sizeof(_starts)];
+        for (int i = 0; i < _start_count; i++)
+            starts[i] = _mm_set1_epi8((char)_starts[i]);
+        
+        for (; position + 16 <= size; position += 16)
+        {
+            __m128i block = _mm_loadu_si128((const __m128i *)(data + position));
+            __m128i hits = _mm_cmpeq_epi8(block, starts[0]);
+            for (int i = 1; i < _start_count; i++)
+                hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, starts[i]));
+            
+            for (unsigned bits = (unsigned)_mm_movemask_epi8(hits); bits; bits &= bits - 1)
+            {
+                size_t candidate = position + __builtin_ctz(bits);
+                if(Starts(data, candidate, size))
+                    return candidate;
+            }
+        }
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    if(_start_count > 0)
+    {
+        uint8x16_t starts[sizeof(_starts)];
+        for (int i = 0; i < _start_count; i++)
+            starts[i] = vdupq_n_u8(_starts[i]);
+        
+        for (; position + 16 <= size; position += 16)
+        {
+            uint8x16_t block = vld1q_u8(data + position);
+            uint8x16_t hits = vceqq_u8(block, starts[0]);
+            for (int i = 1; i < _start_count; i++)
+                hits = vorrq_u8(hits, vceqq_u8(block, starts[i]));
+            if(vmaxvq_u8(hits) == 0)
+                continue;
+            
+            uint8_t lanes[16];
+            vst1q_u8(lanes, hits);
+            for (size_t i = 0; i < 16; i++)
+            {
+                if(lanes[i] && Starts(data, position + i, size))
+                    return position + i;
+            }
+        }
+    }
+#endif
+    
+    for (; position < size; position++)
+    {
+        if(Starts(data, position, size))
+            return position;
+    }
+    return size;
+}
+
+bool MultiPatternScanner::Verify( const Pattern& pattern, const uint8_t * data ) const
+{
+    const uint8_t * value = pattern.value.data();
+    const uint8_t * care = pattern.care.data();
+    size_t size = pattern.value.size();
+    
+    if(pattern.nocase)
+    {
+        for (size_t k = 0; k < size; k++)
+        {
+            if((s_fold.map[data[k]] & care[k]) != value[k])
+                return false;
+        }
+        return true;
+    }
+    
+    for (size_t k = 0; k < size; k++)
+    {
+        if((data[k] & care[k]) != value[k])
+            return false;
+    }
+    return true;
+}
+
+size_t MultiPatternScanner::Scan( const uint8_t * data, size_t size, size_t report, mach_vm_address_t base, const PatternMatchFn& fn ) const
+{
+    if(!_compiled)
+        return 0;
+    
+    // Past this no match can start before report
+    size = std::min(size, report + _max_size - 1);
+    
+    const uint32_t classes = _class_count;
+    size_t count = 0;
+    uint32_t state = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+        if(state == 0)
+        {
+            i = Skip(data, i, size);
+            if(i >= size)
+                break;
+        }
+        
+        state = _delta[state * classes + _classes[data[i]]];
+        for (uint32_t o = _out_first[state]; o < _out_first[state + 1]; o++)
+        {
+            const Pattern& pattern = _patterns[_out[o]];
+            size_t anchor = i + 1 - pattern.anchor_size;
+            if(anchor < pattern.anchor)
+                continue;
+            
+            size_t start = anchor - pattern.anchor;
+            if(start >= report || start + pattern.value.size() > size || !Verify(pattern, data + start))
+                continue;
+            
+            fn(pattern.id, base + start);
+            count++;
+        }
+    }
+    
+    return count;
+}
+
+kern_return_t MultiPatternScanner::Scan( xnu_proc& process, const PatternMatchFn& fn, ScanJob* job /* = nullptr */, const ScanScope* scope /* = nullptr */ )
+{
+    TraceSpan span("Scan", "MultiPatternScanner");
+    if(!_compiled && Compile() != KERN_SUCCESS)
+        return KERN_INVALID_ARGUMENT;
+    
+    ProcessMemory& memory = process.memory();
+    const mach_vm_size_t page = getpagesize();
+    SchedulerGuard scheduling;   // per-worker state below stays sized for the workers that run
+    std::vector<std::vector<uint8_t> > buffers(scheduling.workers());
+    
+    ChunkFn chunk_fn = [&](const ScanChunk_t& chunk, unsigned worker) {
+        // Read on into the next chunk so matches that start here can complete
+        mach_vm_address_t end = chunk.address + chunk.size;
+        mach_vm_size_t size = chunk.size + std::min<mach_vm_size_t>(_max_size - 1, chunk.limit - end);
+        // Shared and read-only regions are scanned where they are mapped
+        const uint8_t * view = (const uint8_t *)memory.Map(chunk.address, size);
+        if(view)
+        {
+            Scan(view, size, chunk.size, chunk.address, fn);
+            return;
+        }
+        
+        std::vector<uint8_t>& buffer = buffers[worker];
+        buffer.resize(size);
+        
+        if(memory.TryRead(chunk.address, size, buffer.data()) == KERN_SUCCESS)
+        {
+            Scan(buffer.data(), size, chunk.size, chunk.address, fn);
+            return;
+        }
+        
+        // Some pages can't be read, scan the runs of those that can
+        mach_vm_address_t run = chunk.address;
+        mach_vm_address_t address = chunk.address;
+        while(address < chunk.address + size)
+        {
+            mach_vm_address_t next = std::min((address & ~(page - 1)) + page, chunk.address + size);
+            bool readable = memory.TryRead(address, next - address, &buffer[address - chunk.address]) == KERN_SUCCESS;
+            
+            if(!readable || next == chunk.address + size)
+            {
+                mach_vm_address_t run_end = readable ? next : address;
+                if(run_end > run && run < end)
+                    Scan(&buffer[run - chunk.address], run_end - run, end - run, run, fn);
+                run = next;
+            }
+            address = next;
+        }
+    };
+    
+    // Pins the region index and the views taken from it until the workers are done
+    EpochGuard guard;
+    if(scope)
+        return Scheduler::Shared().ForEachChunk(scope->ranges(), chunk_fn, job);
+    return Scheduler::Shared().ForEachChunk(memory.regions().partition(VM_PROT_READ), chunk_fn, job);
+}
@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+
+#ifndef __xnumem__MultiPatternScanner__
+#define __xnumem__MultiPatternScanner__
+
+#include <mach/mach.h>
+#include <stdint.h>
+#include <functional>
+#include <vector>
+
+class ScanJob;
+class ScanScope;
+
+enum {
+    kPatternNoCase = 1 << 0,    // ASCII letters match either case
+};
+
+typedef std::function<void( uint32_t id, mach_vm_address_t address )> PatternMatchFn;
+
+/**
+ Searches memory for a whole set of patterns in one pass.
+ 
+ Patterns are byte strings with optional wildcards. The longest run of fixed bytes of
+ each one goes into a single Aho-Corasick automaton, stored as a dense table over the
+ byte classes the patterns actually use, so the inner loop is one load per byte
+ whatever the number of patterns. Hits are checked against the full pattern.
+ 
+ While the automaton sits in its root state no pattern has started, and the scan skips
+ ahead to the next byte pair that starts one, 16 bytes at a time with SSE2 / NEON when
+ there are few distinct start bytes:
+ 
+    MultiPatternScanner scanner;
+    scanner.AddSignature(1, "48 8B 05 ?? ?? ?? ?? 48 85 C0");
+    scanner.Add(2, "BEGIN RSA PRIVATE KEY", 21);
+    scanner.Add(3, "password=", 9, nullptr, kPatternNoCase);
+    scanner.Scan(process, [](uint32_t id, mach_vm_address_t address) { ... });
+ */
+class MultiPatternScanner
+{
+public:
+    MultiPatternScanner();
+    ~MultiPatternScanner();
+    
+    /**
+     Add a pattern.
+     
+     @param id    -- Reported with every match.
+     @param bytes -- Pattern bytes.
+     @param size  -- Pattern size.
+     @param mask  -- 'x' for a fixed byte, '?' for any, one per byte; nullptr for all fixed. (optional)
+     @param flags -- kPattern* flags. (optional)
+     @return KERN_INVALID_ARGUMENT if the pattern has no fixed byte.
+     */
+    kern_return_t Add( uint32_t id, const void * bytes, size_t size, const char * mask = nullptr, uint32_t flags = 0 );
+    
+    /**
+     Add a pattern written as hex bytes and wildcards, e.g. "48 8B ?? 05".
+     
+     @param id        -- Reported with every match.
+     @param signature -- Space separated hex bytes, '?' or "??" for any byte.
+     @param flags     -- kPattern* flags. (optional)
+     @return KERN_INVALID_ARGUMENT if the signature does not parse or has no fixed byte.
+     */
+    kern_return_t AddSignature( uint32_t id, const char * signature, uint32_t flags = 0 );
+    
+    /**
+     Build the automaton. Scan does this when patterns were added since.
+     
+     @param void
+     @return KERN_INVALID_ARGUMENT if there are no patterns.
+     */
+    kern_return_t Compile();
+    
+    /**
+     Scan every readable region of a process, or a scope, in one parallel pass on the
+     shared scheduler. Matches are reported from worker threads, in no particular order.
+     
+     @param process -- Attached process or source.
+     @param fn      -- Called for every match, concurrently.
+     @param job     -- Cancellation / progress. (optional)
+     @param scope   -- Only scan these ranges. (optional)
+     @return Status.
+     */
+    kern_return_t Scan( class xnu_proc& process, const PatternMatchFn& fn, ScanJob* job = nullptr, const ScanScope* scope = nullptr );
+    
+    /**
+     Scan a local buffer. The automaton must be compiled.
+     
+     @param data   -- Bytes to scan.
+     @param size   -- Bytes available, matches may extend up to here.
+     @param report -- Only matches starting before this offset are reported.
+     @param base   -- Address of data[0], added to reported offsets.
+     @param fn     -- Called for every match.
+     @return Number of matches.
+     */
+    size_t Scan( const uint8_t * data, size_t size, size_t report, mach_vm_address_t base, const PatternMatchFn& fn ) const;
+    
+    inline size_t patterns() const { return _patterns.size(); }
+    inline size_t states() const { return _state_count; }
+    
+private:
+    MultiPatternScanner( const MultiPatternScanner& ) = delete;
+    MultiPatternScanner& operator =(const MultiPatternScanner&) = delete;
+    
+    struct Pattern {
+        uint32_t             id;
+        std::vector<uint8_t> value;     // folded when nocase
+        std::vector<uint8_t> care;      // 0xff fixed, 0 wildcard
+        bool                 nocase;
+        uint32_t             anchor;    // offset of the longest fixed run
+        uint32_t             anchor_size;
+    };
+    
+    bool Verify( const Pattern& pattern, const uint8_t * data ) const;
+    size_t Skip( const uint8_t * data, size_t position, size_t size ) const;
+    inline bool Starts( const uint8_t * data, size_t position, size_t size ) const;
+    
+    std::vector<Pattern>  _patterns;
+    bool                  _compiled;
+    
+    // Automaton, over byte classes of the folded input
+    uint8_t               _classes[256];
+    uint32_t              _class_count;
+    uint32_t              _state_count;
+    std::vector<uint32_t> _delta;       // state * _class_count + class -> state
+    std::vector<uint32_t> _out_first;   // state -> first entry in _out, state_count + 1 entries
+    std::vector<uint32_t> _out;         // pattern indices ending in each state
+    size_t                _max_size;    // longest pattern
+    
+    // Root state prefilter
+    uint8_t               _single[256]; // raw bytes that complete a one byte anchor
+    std::vector<uint64_t> _pairs;       // bitmap of folded first two anchor bytes
+    uint8_t               _starts[4];   // raw bytes that start an anchor, when there are few
+    int                   _start_count; // -1 for too many to compare in SIMD
+};
+
+#endif /* defined(__xnumem__MultiPatternScanner__) */
@@ -0,0 +1,275 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+
+
+#include "PageTriage.h"
+#include "Epoch.h"
+#include "Scheduler.h"
+#include "Trace.h"
+#include "xnumem.h"
+
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+// Entropy (bits per byte) from which a page counts as compressed / encrypted
+static const double kRandomEntropy = 7.5;
+
+// Bytes most frequent in x86-64 instruction streams: REX prefixes, mov, lea, call, jcc, ret ...
+static const uint8_t kOpcodeBytes[] = { 0x0f, 0x48, 0x49, 0x4c, 0x74, 0x75, 0x83, 0x85, 0x89, 0x8b, 0x8d, 0xc3, 0xe8, 0xff };
+
+// Most frequent arm64 encodings as { mask, value }: branches, frame pairs, loads / stores, adrp, add / sub, mov
+static const uint32_t kInstructions[][2] = {
+    { 0x7c000000, 0x14000000 },     // b, bl
+    { 0xff000010, 0x54000000 },     // b.cond
+    { 0x7e000000, 0x34000000 },     // cbz, cbnz
+    { 0xffdffc1f, 0xd61f0000 },     // br, blr
+    { 0xfffffc1f, 0xd65f0000 },     // ret
+    { 0xfffff01f, 0xd503201f },     // nop, pacibsp, autibsp, bti
+    { 0xfe000000, 0xa8000000 },     // stp, ldp (64 bit)
+    { 0xbf000000, 0xb9000000 },     // str, ldr (unsigned offset)
+    { 0x1f000000, 0x10000000 },     // adr, adrp
+    { 0x1f800000, 0x11000000 },     // add, sub, cmp (immediate)
+    { 0x7fe0ffe0, 0x2a0003e0 },     // mov (register)
+    { 0x1f800000, 0x12800000 },     // movz, movn, movk
+};
+
+// Share of a page in arm64 instruction words (random words match about an eighth)
+static const size_t kInstructionPercent = 40;
+
+static size_t CountInstructions( const uint8_t * data, size_t size )
+{
+    size_t instructions = 0;
+    for (size_t i = 0; i + 4 <= size; i += 4)
+    {
+        uint32_t word;
+        memcpy(&word, data + i, sizeof(word));
+        for (size_t j = 0; j < sizeof(kInstructions) / sizeof(kInstructions[0]); j++)
+        {
+            if((word & kInstructions[j][0]) == kInstructions[j][1])
+            {
+                instructions++;
+                break;
+            }
+        }
+    }
+    return instructions;
+}
+
+// Instruction set of the code in a process: the host's, or x86-64 when translated by Rosetta
+static cpu_type_t CodeType( xnu_proc& process )
+{
+#if defined(__arm64__)
+#if defined(P_TRANSLATED)
+    const struct kinfo_proc *info = process.core().pinfo_proc();
+    if(info && (info->kp_proc.p_flag & P_TRANSLATED))
+        return CPU_TYPE_X86_64;
+#endif
+    return CPU_TYPE_ARM64;
+#else
+    return CPU_TYPE_X86_64;
+#endif
+}
+
+static bool RegionStartLess( const TriageRegion_t& region, mach_vm_address_t address )
+{
+    return region.address + region.size <= address;
+}
+
+PageTriage::PageTriage() :
+    _page_size(getpagesize())
+{
+    memset(_counts, 0, sizeof(_counts));
+}
+
+TriagePage_t PageTriage::Classify( const uint8_t * data, size_t size, vm_prot_t protection, mach_vm_address_t low, mach_vm_address_t high, cpu_type_t cputype )
+{
+    TriagePage_t page = { kPageData, 0 };
+    
+    // Four interleaved tables, so consecutive bytes of a word don't wait on the same counter
+    uint32_t counts[4][256];
+    memset(counts, 0, sizeof(counts));
+    
+    uint64_t any = 0;
+    size_t pointers = 0;
+    size_t words = size / 8;
+    for (size_t i = 0; i < words; i++)
+    {
+        uint64_t word;
+        memcpy(&word, data + i * 8, sizeof(word));
+        any |= word;
+        pointers += (word >= low && word < high);
+        
+        counts[0][word & 0xff]++;
+        counts[1][(word >> 8) & 0xff]++;
+        counts[2][(word >> 16) & 0xff]++;
+        counts[3][(word >> 24) & 0xff]++;
+        counts[0][(word >> 32) & 0xff]++;
+        counts[1][(word >> 40) & 0xff]++;
+        counts[2][(word >> 48) & 0xff]++;
+        counts[3][word >> 56]++;
+    }
+    for (size_t i = words * 8; i < size; i++)
+    {
+        any |= data[i];
+        counts[0][data[i]]++;
+    }
+    
+    if(!any)
+    {
+        page.kind = kPageZero;
+        return page;
+    }
+    
+    double sum = 0;
+    size_t printable = 0;
+    for (unsigned byte = 0; byte < 256; byte++)
+    {
+        uint32_t count = counts[0][byte] + counts[1][byte] + counts[2][byte] + counts[3][byte];
+        if(!count)
+            continue;
+        
+        sum += count * log2((double)count);
+        if((byte >= 0x20 && byte < 0x7f) || byte == '\t' || byte == '\n' || byte == '\r')
+            printable += count;
+    }
+    
+    size_t opcodes = 0;
+    for (size_t i = 0; i < sizeof(kOpcodeBytes); i++)
+        opcodes += counts[0][kOpcodeBytes[i]] + counts[1][kOpcodeBytes[i]] + counts[2][kOpcodeBytes[i]] + counts[3][kOpcodeBytes[i]];
+    
+    double entropy = log2((double)size) - sum / size;
+    page.entropy = (uint8_t)std::min(entropy * 16 + 0.5, 128.0);
+    
+    if(protection & VM_PROT_EXECUTE)
+        page.kind = kPageCode;
+    else if(entropy >= kRandomEntropy)
+        page.kind = kPageRandom;
+    else if(printable * 100 >= size * 85)
+        page.kind = kPageText;
+    else if(words && pointers * 4 >= words)
+        page.kind = kPagePointers;
+    else if(entropy >= 5 && (cputype == CPU_TYPE_ARM64 ? CountInstructions(data, size) * 4 * 100 >= size * kInstructionPercent : opcodes * 100 >= size * 20))
+        page.kind = kPageCode;
+    
+    return page;
+}
+
+kern_return_t PageTriage::Triage( xnu_proc& process, ScanJob* job /* = nullptr */, const ScanScope* scope /* = nullptr */ )
+{
+    TraceSpan span("Triage", "PageTriage");
+    _regions.clear();
+    _pages.clear();
+    _protections.clear();
+    memset(_counts, 0, sizeof(_counts));
+    
+    ProcessMemory& memory = process.memory();
+    EpochGuard guard;
+    const std::vector<MemoryRegion_t>& table = memory.regions().table();
+    if(table.empty())
+        return KERN_SUCCESS;
+    
+    // Anything inside the mapped span may be a pointer
+    mach_vm_address_t low = table.front().address;
+    mach_vm_address_t high = table.back().address + table.back().size;
+    cpu_type_t cputype = CodeType(process);
+    
+    std::vector<MemoryRegion_t> clipped;
+    if(scope)
+        scope->Clip(table, clipped);
+    const std::vector<MemoryRegion_t>& source = scope ? clipped : table;
+    
+    std::vector<AddressRange_t> ranges;
+    size_t total = 0;
+    for (std::vector<MemoryRegion_t>::const_iterator it = source.begin(); it != source.end(); ++it)
+    {
+        if(!(it->info.protection & VM_PROT_READ))
+            continue;
+        
+        TriageRegion_t region = { it->address, it->size, total };
+        AddressRange_t range = { it->address, it->address + it->size };
+        _regions.push_back(region);
+        _protections.push_back(it->info.protection);
+        ranges.push_back(range);
+        total += (it->size + _page_size - 1) / _page_size;
+    }
+    
+    TriagePage_t unread = { kPageUnread, 0 };
+    _pages.assign(total, unread);
+    SchedulerGuard scheduling;   // per-worker state below stays sized for the workers that run
+    std::vector<std::vector<uint8_t> > buffers(scheduling.workers());
+    
+    ChunkFn chunk_fn = [&](const ScanChunk_t& chunk, unsigned worker) {
+        // Chunks are cut from one region each
+        size_t index = std::lower_bound(_regions.begin(), _regions.end(), chunk.address, RegionStartLess) - _regions.begin();
+        const TriageRegion_t& region = _regions[index];
+        size_t slot = region.first + (chunk.address - region.address) / _page_size;
+        
+        std::vector<uint8_t>& buffer = buffers[worker];
+        buffer.resize(chunk.size);
+        bool whole = memory.TryRead(chunk.address, chunk.size, buffer.data()) == KERN_SUCCESS;
+        
+        for (mach_vm_size_t offset = 0; offset < chunk.size; offset += _page_size, slot++)
+        {
+            mach_vm_size_t size = std::min(_page_size, chunk.size - offset);
+            if(!whole && memory.TryRead(chunk.address + offset, size, &buffer[offset]) != KERN_SUCCESS)
+                continue;
+            _pages[slot] = Classify(&buffer[offset], size, _protections[index], low, high, cputype);
+        }
+    };
+    
+    kern_return_t kret = Scheduler::Shared().ForEachChunk(ranges, chunk_fn, job);
+    
+    for (std::vector<TriagePage_t>::const_iterator it = _pages.begin(); it != _pages.end(); ++it)
+        _counts[it->kind]++;
+    
+    return kret;
+}
+
+const TriagePage_t* PageTriage::Find( mach_vm_address_t address ) const
+{
+    std::vector<TriageRegion_t>::const_iterator it = std::lower_bound(_regions.begin(), _regions.end(), address, RegionStartLess);
+    if(it == _regions.end() || address < it->address)
+        return nullptr;
+    
+    return &_pages[it->first + (address - it->address) / _page_size];
+}
+
+void PageTriage::Select( uint32_t kinds, ScanScope& scope ) const
+{
+    // Regions and pages are in address order, so the scope only ever appends
+    for (std::vector<TriageRegion_t>::const_iterator it = _regions.begin(); it != _regions.end(); ++it)
+    {
+        size_t count = (it->size + _page_size - 1) / _page_size;
+        size_t run = count;
+        for (size_t i = 0; i <= count; i++)
+        {
+            bool wanted = i < count && (kinds >> _pages[it->first + i].kind) & 1;
+            if(wanted && run == count)
+                run = i;
+            else if(!wanted && run != count)
+            {
+                scope.Within(it->address + run * _page_size, std::min(it->address + i * _page_size, it->address + it->size));
+                run = count;
+            }
+        }
+    }
+}
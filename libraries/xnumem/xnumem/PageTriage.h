@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+
+
+#ifndef __xnumem__PageTriage__
+#define __xnumem__PageTriage__
+
+#include <mach/mach.h>
+#include <stdint.h>
+#include <vector>
+
+class ScanJob;
+class ScanScope;
+
+enum {
+    kPageUnread = 0,    // could not be read
+    kPageZero,          // all zero
+    kPageText,          // mostly printable ASCII
+    kPagePointers,      // a quarter or more of the words point into the address space
+    kPageCode,          // executable, or dense in opcode bytes / instruction words of the target's CPU
+    kPageRandom,        // near 8 bits of entropy per byte: compressed, encrypted, random
+    kPageData,          // anything else
+    kPageKindCount
+};
+
+typedef struct TriagePage {
+    uint8_t kind;       // kPage*
+    uint8_t entropy;    // bits per byte, in sixteenths
+} TriagePage_t;
+
+typedef struct TriageRegion {
+    mach_vm_address_t address;
+    mach_vm_size_t    size;
+    size_t            first;    // index of the region's first page in pages()
+} TriageRegion_t;
+
+/**
+ One pass over the readable memory of a process that sorts every page into a kind, so
+ later passes over a very large target know where the interesting data is.
+ 
+ Each page gets a byte histogram, its entropy, and a count of words that look like
+ pointers into the mapped address space; the map keeps two bytes per page. Pages of
+ the kinds wanted can be turned into a ScanScope for the scan, dump and diff engines,
+ or a pass can take the likely kinds first and the rest afterwards:
+ 
+    PageTriage triage;
+    triage.Triage(process);
+    ScanScope scope;
+    triage.Select(1 << kPagePointers | 1 << kPageData, scope);
+    scanner.Scan(process, fn, nullptr, &scope);
+ */
+class PageTriage
+{
+public:
+    PageTriage();
+    
+    /**
+     Classify every readable page of a process, or of a scope, in parallel on the
+     shared scheduler. Replaces the previous map.
+     
+     @param process -- Attached process or source.
+     @param job     -- Cancellation / progress. (optional)
+     @param scope   -- Only classify these ranges. (optional)
+     @return Status.
+     */
+    kern_return_t Triage( class xnu_proc& process, ScanJob* job = nullptr, const ScanScope* scope = nullptr );
+    
+    /**
+     Page entry.
+     
+     @param address -- Memory address.
+     @return Entry of the page holding address, nullptr if it was not triaged.
+     */
+    const TriagePage_t* Find( mach_vm_address_t address ) const;
+    
+    /**
+     Add the pages of some kinds to a scope, adjacent pages merged.
+     
+     @param kinds -- Mask of (1 << kPage*) bits.
+     @param scope -- Scope to add to.
+     @return void
+     */
+    void Select( uint32_t kinds, ScanScope& scope ) const;
+    
+    /**
+     Classify one page of local data.
+     
+     @param data       -- Page bytes.
+     @param size       -- Page size.
+     @param protection -- Protection of the page.
+     @param low        -- Lowest mapped address, for the pointer test.
+     @param high       -- One past the highest mapped address.
+     @param cputype    -- CPU_TYPE_X86_64 or CPU_TYPE_ARM64, picks the code heuristic.
+     @return Entry.
+     */
+    static TriagePage_t Classify( const uint8_t * data, size_t size, vm_prot_t protection, mach_vm_address_t low, mach_vm_address_t high, cpu_type_t cputype );
+    
+    inline const std::vector<TriageRegion_t>& regions() const { return _regions; }
+    inline const std::vector<TriagePage_t>& pages() const { return _pages; }
+    inline size_t count( unsigned kind ) const { return kind < kPageKindCount ? _counts[kind] : 0; }
+    inline mach_vm_size_t page_size() const { return _page_size; }
+    
+private:
+    PageTriage( const PageTriage& ) = delete;
+    PageTriage& operator =(const PageTriage&) = delete;
+    
+    std::vector<TriageRegion_t> _regions;   // address order
+    std::vector<TriagePage_t>   _pages;
+    std::vector<vm_prot_t>      _protections;   // per region
+    size_t                      _counts[kPageKindCount];
+    mach_vm_size_t              _page_size;
+};
+
+#endif /* defined(__xnumem__PageTriage__) */
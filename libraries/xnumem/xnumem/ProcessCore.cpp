@@ -18,6 +18,7 @@
  */
 
 #include "ProcessCore.h"
+#include "Stats.h"
 
 #include <sys/sysctl.h>
 
@@ -33,54 +34,63 @@ ProcessCore::~ProcessCore()
     Close();
 }
 
-int ProcessCore::Open(int pid)
+kern_return_t ProcessCore::Open(int pid)
 {
     // Prevent leak
     Close();
+    StatScope stat(kStatOpen);
     
     if(pid)
         _pid = pid;
     
     // retrieve kinfo_proc
     int j;
-	kinfo_proc * proclist;
-	size_t procCount;
+	kinfo_proc * proclist = NULL;
+	size_t procCount = 0;
 	
-    xnu_proc::GetProcessList(&proclist, &procCount);
+    stat.syscall(xnu_proc::GetProcessList(&proclist, &procCount) == 0 ? KERN_SUCCESS : KERN_FAILURE);
 	
-	for (j = 0; j < procCount +1; j++) {
-		if (proclist[j].kp_proc.p_pid == _pid ){
+	for (j = 0; j < procCount; j++) {
+		if (proclist[j].kp_proc.p_pid == _pid && _pinfo_proc == NULL){
             _pinfo_proc = (struct kinfo_proc*)malloc(sizeof(struct kinfo_proc));
             memcpy(_pinfo_proc, &proclist[j], sizeof(struct kinfo_proc));
         }
 	}
+    free(proclist);
 	
+    // Not fatal: the pid may be gone, protected or never have existed
     kern_return_t kret = task_for_pid(mach_task_self(), _pid, &_pmach_port);
+    stat.syscall(kret);
 	if(kret != KERN_SUCCESS)
     {
        printf("task_for_pid() error, try running as sudo!\n");
-       MACH_CHECK_ERROR(kret);
-       return 0;
+       _pmach_port = 0;
+       Close();
+       return kret;
     }
     
-    free(proclist);
-    return 1;
+    return KERN_SUCCESS;
 }
 
 int ProcessCore::Close()
 {
     if (_pmach_port || _pid || _pinfo_proc)
     {
-        kern_return_t kret = mach_port_deallocate(mach_task_self(), _pmach_port);
-        if(kret != KERN_SUCCESS)
+        StatScope stat(kStatClose);
+        kern_return_t kret = KERN_SUCCESS;
+        if(_pmach_port)
         {
-            MACH_CHECK_ERROR(kret);
-            return 0;
+            kret = mach_port_deallocate(mach_task_self(), _pmach_port);
+            stat.syscall(kret);
         }
         
+        // The state is dropped either way, a failed Open or a dead task must not stick
         _pid = 0;
         _pmach_port = 0;
         free(_pinfo_proc);
+        _pinfo_proc = NULL;
+        if(kret != KERN_SUCCESS)
+            return 0;
     }
     
     return 1;
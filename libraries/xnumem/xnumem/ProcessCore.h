@@ -28,6 +28,11 @@ class ProcessCore
     friend class xnu_proc;
     friend class ProcessMemory;
     friend class ProcessModules;
+    friend class ProcessThreads;
+    friend class HeapWalker;
+    friend class MemoryUsage;
+    friend class Profiler;
+    friend class RemoteArena;
     
 public:
 
@@ -39,7 +44,7 @@ private:
     ProcessCore( const ProcessCore& ) = delete;
     ~ProcessCore();
     
-    int Open(int pid);
+    kern_return_t Open(int pid);
     int Close();
     
     int _pid = 0;
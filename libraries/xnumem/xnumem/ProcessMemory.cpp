@@ -17,89 +17,422 @@
  * Contact : jonathandaniel@email.com
  */
 
+#include "Epoch.h"
 #include "ProcessMemory.h"
+#include "Stats.h"
+#include "Trace.h"
 #include "xnumem.h"
 
 #include <mach/mach_vm.h>
 
 #include <assert.h>
+#include <string.h>
+#include <unistd.h>
 
-ProcessMemory::ProcessMemory( xnu_proc *pprocess ) : _process( pprocess ), _core(pprocess->core())
+#include <algorithm>
+#include <condition_variable>
+#include <thread>
+
+ProcessMemory::ProcessMemory( xnu_proc *pprocess ) : _regions( new RegionIndex() ), _views( new ViewCache() ), _process( pprocess ), _core(pprocess->core())
 {
 }
 
 ProcessMemory::~ProcessMemory()
 {
+    delete _regions.load();
+    delete _views.load();
+}
+
+ProcessMemory::ViewCache::~ViewCache()
+{
+    for (std::map<std::pair<mach_vm_address_t, mach_vm_size_t>, mach_vm_address_t>::const_iterator it = views.begin(); it != views.end(); ++it)
+    {
+        if(it->second)
+            mach_vm_deallocate(mach_task_self(), it->second, it->first.second);
+    }
 }
 
 kern_return_t ProcessMemory::Read( uintptr_t address, size_t size, void * buffer )
 {
     assert(size != 0 || address != 0);
-	
-	unsigned char *rbuffer;
-	mach_msg_type_number_t data_cnt;
     
-    int systemPageSize = getpagesize();
+	kern_return_t kernret = TryRead(address, size, buffer);
+	if(kernret != KERN_SUCCESS) MACH_CHECK_ERROR(kernret);
     
-    // use the negative of the page size for the mask to find the page address
-    mach_vm_address_t page_address = address & (-systemPageSize);
+	return KERN_SUCCESS;
+}
+
+kern_return_t ProcessMemory::TryRead( uintptr_t address, size_t size, void * buffer )
+{
+    StatScope stat(kStatRead, size);
+    TraceSpan span("read", "memory", size);
+    if(_source)
+    {
+        kern_return_t kret = _source->Read(address, size, buffer);
+        stat.transfer(kret == KERN_SUCCESS ? size : 0);
+        return kret;
+    }
     
-    mach_vm_address_t last_page_address =
-    (address + size + (systemPageSize - 1)) & (-systemPageSize);
+    // Straight into the caller's buffer, no out-of-line copy to release afterwards
+    mach_vm_size_t data_cnt = 0;
+    kern_return_t kret = mach_vm_read_overwrite(_core._pmach_port, address, size, (mach_vm_address_t)buffer, &data_cnt);
+    stat.syscall(kret, data_cnt);
+    return kret;
+}
+
+kern_return_t ProcessMemory::ReadBatch( std::vector<ReadRequest_t>& requests, mach_vm_size_t gap /* = 4096 */ )
+{
+    StatScope stat(kStatReadBatch);
+    TraceSpan trace("ReadBatch", "memory", requests.size());
+    std::vector<size_t> order(requests.size());
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        order[i] = i;
+        stat.request(requests[i].size);
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return requests[a].address < requests[b].address; });
     
-    mach_vm_size_t page_size = last_page_address - page_address;
+    kern_return_t result = KERN_SUCCESS;
+    std::vector<uint8_t> span;
+    for (size_t first = 0; first < order.size(); )
+    {
+        // Grow the span while the next request starts within gap of its end
+        mach_vm_address_t start = requests[order[first]].address;
+        mach_vm_address_t end = start + requests[order[first]].size;
+        size_t last = first + 1;
+        while(last < order.size() && requests[order[last]].address <= end + gap)
+        {
+            end = std::max(end, requests[order[last]].address + requests[order[last]].size);
+            last++;
+        }
+        
+        kern_return_t kret = KERN_FAILURE;
+        if(last - first > 1)
+        {
+            span.resize(end - start);
+            kret = TryRead(start, span.size(), span.data());
+        }
+        
+        for (size_t i = first; i < last; i++)
+        {
+            ReadRequest_t& request = requests[order[i]];
+            if(kret == KERN_SUCCESS)
+            {
+                memcpy(request.buffer, &span[request.address - start], request.size);
+                request.status = KERN_SUCCESS;
+            }
+            else
+                request.status = TryRead(request.address, request.size, request.buffer);
+            
+            if(request.status != KERN_SUCCESS)
+                result = request.status;
+            else
+                stat.transfer(request.size);
+        }
+        first = last;
+    }
     
-	kern_return_t kernret = vm_read(_core._pmach_port, page_address, page_size, (vm_offset_t*)&rbuffer, &data_cnt);
-	if(kernret != KERN_SUCCESS) MACH_CHECK_ERROR(kernret);
+    return result;
+}
+
+kern_return_t ProcessMemory::ReadMapped( uintptr_t address, size_t size, const void ** data )
+{
+    if(_source)
+        return KERN_NOT_SUPPORTED;
     
-    memcpy(buffer,&rbuffer[(mach_vm_address_t)address - page_address], size);
-    mach_vm_deallocate(_core._pmach_port, (mach_vm_address_t)rbuffer, size);
+    StatScope stat(kStatReadMapped, size);
+    vm_offset_t local = 0;
+    mach_msg_type_number_t count = 0;
+    kern_return_t kret = mach_vm_read(_core._pmach_port, address, size, &local, &count);
+    stat.syscall(kret, count);
+    if(kret == KERN_SUCCESS)
+        *data = (const void *)local;
     
-	return KERN_SUCCESS;
+    return kret;
+}
+
+kern_return_t ProcessMemory::ReleaseMapped( const void * data, size_t size )
+{
+    return vm_deallocate(mach_task_self(), (vm_address_t)data, size);
+}
+
+const void * ProcessMemory::Map( uintptr_t address, size_t size )
+{
+    if(_source)
+        return _source->Map(address, size);
+    
+    EpochGuard guard;
+    const MemoryRegion_t* region = regions().Find(address);
+    if(region == nullptr || address + size > region->address + region->size)
+        return nullptr;
+    
+    const uint8_t * view = (const uint8_t *)MapView(*region);
+    return view ? view + (address - region->address) : nullptr;
+}
+
+bool ProcessMemory::Mappable( const MemoryRegion_t& region )
+{
+    if(!(region.info.protection & VM_PROT_READ))
+        return false;
+    
+    return region.info.shared || !(region.info.max_protection & VM_PROT_WRITE);
+}
+
+const void * ProcessMemory::MapView( const MemoryRegion_t& region )
+{
+    if(_source || !Mappable(region))
+        return nullptr;
+    
+    EpochGuard guard;
+    ViewCache * cache = _views.load(std::memory_order_acquire);
+    std::lock_guard<std::mutex> lock(cache->lock);
+    std::pair<mach_vm_address_t, mach_vm_size_t> key(region.address, region.size);
+    std::map<std::pair<mach_vm_address_t, mach_vm_size_t>, mach_vm_address_t>::const_iterator it = cache->views.find(key);
+    if(it != cache->views.end())
+        return (const void *)it->second;
+    
+    // A view of a file mapping faults with SIGBUS once the file is truncated under it,
+    // those are left to be read
+    StatScope stat(kStatMapView, region.size);
+    mach_vm_address_t local = 0;
+    vm_prot_t current, maximum;
+    kern_return_t kret = KERN_NOT_SUPPORTED;
+    if(Anonymous(region))
+    {
+        kret = mach_vm_remap(mach_task_self(), &local, region.size, 0, VM_FLAGS_ANYWHERE,
+                             _core._pmach_port, region.address, FALSE, &current, &maximum, VM_INHERIT_NONE);
+        stat.syscall(kret);
+    }
+    
+    // Never writable from our side, whatever the target may do
+    if(kret == KERN_SUCCESS && mach_vm_protect(mach_task_self(), local, region.size, TRUE, VM_PROT_READ) != KERN_SUCCESS)
+    {
+        mach_vm_deallocate(mach_task_self(), local, region.size);
+        kret = KERN_PROTECTION_FAILURE;
+    }
+    
+    cache->views[key] = kret == KERN_SUCCESS ? local : 0;
+    return kret == KERN_SUCCESS ? (const void *)local : nullptr;
+}
+
+bool ProcessMemory::Anonymous( const MemoryRegion_t& region )
+{
+    // Every entry of the region, inside submaps too, must be without a pager
+    mach_vm_address_t address = region.address;
+    natural_t depth = 0;
+    while(address < region.address + region.size)
+    {
+        mach_vm_address_t start = address;
+        mach_vm_size_t size = 0;
+        vm_region_submap_info_data_64_t info;
+        mach_msg_type_number_t count = VM_REGION_SUBMAP_INFO_COUNT_64;
+        kern_return_t kret = mach_vm_region_recurse(_core._pmach_port, &start, &size, &depth, (vm_region_recurse_info_t)&info, &count);
+        if(kret != KERN_SUCCESS || start > address)
+            return false;
+        if(info.is_submap)
+        {
+            depth++;
+            continue;
+        }
+        if(info.external_pager)
+            return false;
+        address = start + size;
+    }
+    return true;
+}
+
+void ProcessMemory::ReleaseViews()
+{
+    Epoch::Retire(_views.exchange(new ViewCache(), std::memory_order_acq_rel));
+}
+
+kern_return_t ProcessMemory::QueryPages( uintptr_t address, size_t size, std::vector<integer_t>& dispositions )
+{
+    if(_source)
+        return KERN_NOT_SUPPORTED;
+    
+    StatScope stat(kStatQueryPages, size);
+    const size_t page  = getpagesize();
+    const size_t batch = 4096;
+    dispositions.assign((size + page - 1) / page, 0);
+    
+    for (size_t done = 0; done < dispositions.size(); )
+    {
+        mach_vm_size_t count = std::min(batch, dispositions.size() - done);
+        kern_return_t kret = mach_vm_page_range_query(_core._pmach_port, address + done * page, count * page,
+                                                      (mach_vm_address_t)&dispositions[done], &count);
+        stat.syscall(kret, count * page);
+        if(kret != KERN_SUCCESS)
+            return kret;
+        if(count == 0)
+            return KERN_FAILURE;
+        done += count;
+    }
+    
+    return KERN_SUCCESS;
 }
 
 kern_return_t ProcessMemory::Write( uintptr_t address, size_t size, void * buffer )
 {
     if (address == 0 || size == 0 )
         return KERN_INVALID_ARGUMENT;
-    vm_prot_t backup = 0;
+    if (_source)
+        return KERN_PROTECTION_FAILURE;
+    StatScope stat(kStatWrite, size);
+    vm_prot_t backup = -1;      // stays -1 for memory mapped since the regions were queried
     
     mach_msg_type_number_t dataCount = (mach_msg_type_number_t)size;
     
     Protect(address, size, VM_PROT_READ | VM_PROT_WRITE, &backup);
 	
 	kern_return_t kret = vm_write(_core._pmach_port, (vm_address_t)address, (vm_offset_t)buffer, dataCount);
+    stat.syscall(kret, size);
 	if(kret != KERN_SUCCESS){
         MACH_CHECK_ERROR(kret);
         return kret;
     }
     
-    Protect(address, size, backup);
+    if(backup != -1)
+        Protect(address, size, backup);
     
     return KERN_SUCCESS;
 }
 
 kern_return_t ProcessMemory::Copy ( uintptr_t source_address, size_t size, uintptr_t dest_address )
 {
+    if (_source)
+        return KERN_PROTECTION_FAILURE;
+    if (size == 0)
+        return KERN_SUCCESS;
+    
     kern_return_t kret;
-    kret = vm_copy(_core._pmach_port, source_address, size, dest_address);
-    return KERN_SUCCESS;
+    {
+        StatScope stat(kStatCopy, size);
+        kret = mach_vm_copy(_core._pmach_port, source_address, size, dest_address);
+        stat.syscall(kret, kret == KERN_SUCCESS ? size : 0);
+    }
+    if(kret == KERN_SUCCESS)
+        return kret;
+    
+    return CopyStream(*this, source_address, *this, dest_address, size);
+}
+
+const size_t ProcessMemory::kCopyChunk;
+
+kern_return_t ProcessMemory::Copy ( xnu_proc& from, uintptr_t source_address, xnu_proc& to, uintptr_t dest_address, size_t size )
+{
+    return CopyStream(from.memory(), source_address, to.memory(), dest_address, size);
+}
+
+kern_return_t ProcessMemory::CopyStream( ProcessMemory& from, uintptr_t source_address, ProcessMemory& to, uintptr_t dest_address, size_t size )
+{
+    if (to._source)
+        return KERN_PROTECTION_FAILURE;
+    if (size == 0)
+        return KERN_SUCCESS;
+    
+    TraceSpan span("Copy", "memory", size);
+    StatScope stat(kStatCopy, size);
+    std::lock_guard<std::mutex> guard(to._copy_lock);
+    size_t chunks = (size + kCopyChunk - 1) / kCopyChunk;
+    for (size_t i = 0; i < 2; i++)
+        to._copy_buffers[i].resize(std::min(size, kCopyChunk));
+    
+    // Within one task, overlapping ranges are copied from the end that is not overwritten first
+    bool backwards = !from._source && from._core._pmach_port == to._core._pmach_port &&
+                     dest_address > source_address && dest_address < source_address + size;
+    
+    // Slot i % 2 carries piece i from the reader to the writer
+    struct Slot {
+        bool          full;
+        kern_return_t status;
+    } slots[2] = { { false, KERN_SUCCESS }, { false, KERN_SUCCESS } };
+    std::mutex lock;
+    std::condition_variable ready;
+    bool abort = false;
+    
+    auto piece = [&](size_t index, size_t& offset, size_t& length) {
+        size_t i = backwards ? chunks - 1 - index : index;
+        offset = i * kCopyChunk;
+        length = std::min(kCopyChunk, size - offset);
+    };
+    
+    auto reader = [&]() {
+        for (size_t index = 0; index < chunks; index++)
+        {
+            Slot& slot = slots[index % 2];
+            {
+                std::unique_lock<std::mutex> wait(lock);
+                ready.wait(wait, [&]() { return !slot.full || abort; });
+                if(abort)
+                    return;
+            }
+            
+            size_t offset, length;
+            piece(index, offset, length);
+            kern_return_t kret = from.TryRead(source_address + offset, length, to._copy_buffers[index % 2].data());
+            
+            std::lock_guard<std::mutex> done(lock);
+            slot.full = true;
+            slot.status = kret;
+            ready.notify_all();
+        }
+    };
+    
+    // A single piece gains nothing from a second thread
+    std::thread worker;
+    if(chunks > 1)
+        worker = std::thread(reader);
+    else
+        reader();
+    
+    kern_return_t kret = KERN_SUCCESS;
+    for (size_t index = 0; index < chunks && kret == KERN_SUCCESS; index++)
+    {
+        Slot& slot = slots[index % 2];
+        {
+            std::unique_lock<std::mutex> wait(lock);
+            ready.wait(wait, [&]() { return slot.full; });
+            kret = slot.status;
+        }
+        
+        size_t offset, length;
+        piece(index, offset, length);
+        if(kret == KERN_SUCCESS)
+        {
+            kret = mach_vm_write(to._core._pmach_port, dest_address + offset, (vm_offset_t)to._copy_buffers[index % 2].data(), (mach_msg_type_number_t)length);
+            stat.syscall(kret, kret == KERN_SUCCESS ? length : 0);
+        }
+        
+        std::lock_guard<std::mutex> done(lock);
+        slot.full = false;
+        abort = kret != KERN_SUCCESS;
+        ready.notify_all();
+    }
+    
+    if(worker.joinable())
+        worker.join();
+    return kret;
 }
 
 kern_return_t ProcessMemory::Protect( uintptr_t address, size_t size, vm_prot_t protection, vm_prot_t * backup /* = nullptr */ )
 {
     kern_return_t kret = KERN_SUCCESS;
+    if(_source)
+        return KERN_PROTECTION_FAILURE;
+    StatScope stat(kStatProtect, size);
     if(backup != nullptr){
-        for (std::vector<MemoryRegion_t>::iterator it = _segments.begin(); it != _segments.end(); ++it)
+        EpochGuard guard;
+        const MemoryRegion_t* region = regions().Find(address);
+        if(region != nullptr)
         {
-            if(it->address <= address && address <= (it->address + it->size))
-            {
-                *backup = it->info.protection;
-            }
+            *backup = region->info.protection;
+            stat.hit();
         }
     }
     
     kret = vm_protect(_core._pmach_port, (vm_address_t)address, size, 0, protection);
+    stat.syscall(kret);
     if(kret != KERN_SUCCESS)
         MACH_CHECK_ERROR(kret);
     
@@ -109,9 +442,11 @@ kern_return_t ProcessMemory::Protect( uintptr_t address, size_t size, vm_prot_t
 kern_return_t ProcessMemory::Free(uintptr_t address, size_t size)
 {
     kern_return_t kret = KERN_SUCCESS;
+    if(_source)
+        return KERN_PROTECTION_FAILURE;
+    StatScope stat(kStatFree, size);
     kret = vm_deallocate(_core._pmach_port, (vm_address_t)address, size);
-    if(kret)
-        MACH_CHECK_ERROR(kret);
+    stat.syscall(kret);
     return kret;
 }
 
@@ -119,24 +454,37 @@ uintptr_t ProcessMemory::Allocate( size_t size, vm_prot_t prot /* =  VM_PROT_REA
 {
     kern_return_t kret = KERN_SUCCESS;
     boolean_t     anywhere;
-    unsigned char * address;
-    *address = BaseAddr;
+    vm_address_t  address = (vm_address_t)BaseAddr;
+    
+    if(_source)
+        return 0;
     
     if(size == 0)
         printf("Xnumem : Warning -- size to allocate is zero.\n");
     
-    if(*address == 0)
+    if(address == 0)
         anywhere = TRUE;
     else
         anywhere = FALSE;
     
-    kret = vm_allocate(_core._pmach_port, (vm_address_t*)&address, size, anywhere);
-    if(kret)
-        MACH_CHECK_ERROR(kret);
+    // Reserved, not transferred: only the request is counted in bytes
+    StatScope stat(kStatAllocate, size);
+    kret = vm_allocate(_core._pmach_port, &address, size, anywhere);
+    stat.syscall(kret);
+    if(kret != KERN_SUCCESS)
+        return 0;
     
-    kret = Protect((uintptr_t)address, size, prot);
-    if(kret)
-        MACH_CHECK_ERROR(kret);
+    // New memory already comes read / write
+    if(prot != VM_PROT_DEFAULT)
+    {
+        kret = vm_protect(_core._pmach_port, address, size, 0, prot);
+        stat.syscall(kret);
+        if(kret != KERN_SUCCESS)
+        {
+            vm_deallocate(_core._pmach_port, address, size);
+            return 0;
+        }
+    }
     
     return (uintptr_t)address;
 }
@@ -201,30 +549,56 @@ const char * ProcessMemory::behavior_to_text (vm_behavior_t b)
 
 kern_return_t ProcessMemory::QueryRegions()
 {
+    TraceSpan span("QueryRegions", "process");
     mach_vm_address_t address = 0x0;
     mach_vm_size_t size;
     vm_region_basic_info_data_64_t info;
     mach_msg_type_number_t infoCount = VM_REGION_BASIC_INFO_COUNT_64;
     mach_port_t objectName = MACH_PORT_NULL;
+    std::vector<MemoryRegion_t> segments;
+    StatScope stat(kStatQueryRegions);
+    kern_return_t kret = KERN_SUCCESS;
     
-    while (mach_vm_region(_core._pmach_port, &address, &size, VM_REGION_BASIC_INFO_64, (vm_region_info_t)&info, &infoCount, &objectName) == 0) {
-		MemoryRegion_t *region = (MemoryRegion_t*)malloc(sizeof(MemoryRegion_t));
-		region->address = address;
-		region->size = size;
-		region->info = info;
-		_segments.push_back(*region);
-		address += size;
-        free(region);
-	}
+    // One writer at a time; readers keep whatever index they loaded
+    std::lock_guard<std::mutex> writer(_regions_writer);
+    if(_source)
+        kret = _source->QueryRegions(segments);
+    else
+    {
+    
+        while (mach_vm_region(_core._pmach_port, &address, &size, VM_REGION_BASIC_INFO_64, (vm_region_info_t)&info, &infoCount, &objectName) == 0) {
+            stat.syscall(KERN_SUCCESS);
+            MemoryRegion_t region;
+            region.address = address;
+            region.size = size;
+            region.info = info;
+            segments.push_back(region);
+            address += size;
+        }
+    }
+    
+    RegionIndex * index = new RegionIndex();
+    index->Build(segments);
+    Epoch::Retire(_regions.exchange(index, std::memory_order_acq_rel));
+    
+    // A view may show a mapping the target has since replaced
+    ReleaseViews();
 
-    return KERN_SUCCESS;
+    return kret;
+}
+
+kern_return_t ProcessMemory::RefreshRegions()
+{
+    return QueryRegions();
 }
 
 // todo : show binaries
 kern_return_t ProcessMemory::PrintSegments()
 {
-    printf("\n ==== Regions for process %i (%s) \n",_core.pid(), _core._pinfo_proc->kp_proc.p_comm);
-    for (std::vector<MemoryRegion_t>::iterator it = _segments.begin(); it != _segments.end(); ++it)
+    printf("\n ==== Regions for process %i (%s) \n",_core.pid(), _core._pinfo_proc ? _core._pinfo_proc->kp_proc.p_comm : "snapshot");
+    EpochGuard guard;
+    const std::vector<MemoryRegion_t>& table = segments();
+    for (std::vector<MemoryRegion_t>::const_iterator it = table.begin(); it != table.end(); ++it)
     {
         int	print_size;
         const char *print_size_unit = NULL;
@@ -255,6 +629,29 @@ kern_return_t ProcessMemory::PrintSegments()
 
 mach_vm_size_t ProcessMemory::GetMemoryRegionSize(const uint64_t address, mach_vm_size_t *size_to_end)
 {
+    StatScope stat(kStatRegionSize);
+    if(_source)
+    {
+        stat.hit();
+        // Offline: walk the index, merging regions that follow each other
+        EpochGuard guard;
+        const RegionIndex& index = regions();
+        const MemoryRegion_t* region = index.Find(address);
+        if(region == nullptr)
+        {
+            *size_to_end = 0;
+            return 0;
+        }
+        
+        const MemoryRegion_t* last = &index.table().back();
+        mach_vm_size_t region_size = region->size;
+        for (const MemoryRegion_t* next = region + 1; next <= last && next->address == (next - 1)->address + (next - 1)->size && region->address + region_size - address < 4096; ++next)
+            region_size += next->size;
+        
+        *size_to_end = region->address + region_size - address;
+        return region_size;
+    }
+    
     mach_vm_address_t region_base = (mach_vm_address_t)address;
     mach_vm_size_t region_size;
     natural_t nesting_level = 0;
@@ -272,6 +669,7 @@ mach_vm_size_t ProcessMemory::GetMemoryRegionSize(const uint64_t address, mach_v
                            &nesting_level,
                            region_info,
                            &info_count);
+    stat.syscall(result);
     
     if (result == KERN_SUCCESS) {
         // Get distance from |address| to the end of this region
@@ -295,6 +693,7 @@ mach_vm_size_t ProcessMemory::GetMemoryRegionSize(const uint64_t address, mach_v
                                    &nesting_level,
                                    region_info,
                                    &info_count);
+            stat.syscall(result);
             
             // Extend region_size to go all the way to the end of the 2nd region
             if (result == KERN_SUCCESS
@@ -319,6 +718,7 @@ const char * ProcessMemory::ReadString( const uint64_t address )
     // the string is. And we don't know how long the string is, until we've read
     // the memory!  So, we'll try to read kMaxStringLength bytes
     // (or as many bytes as we can until we reach the end of the vm region).
+    StatScope stat(kStatReadString);
     mach_vm_size_t size_to_end;
     GetMemoryRegionSize( address, &size_to_end);
     
@@ -328,6 +728,8 @@ const char * ProcessMemory::ReadString( const uint64_t address )
         
         char * string = (char*)malloc(size_to_read);
         kern_return_t kret = Read(address, size_to_read, string);
+        stat.request(size_to_read);
+        stat.transfer(kret == KERN_SUCCESS ? size_to_read : 0);
         if(kret)
             MACH_CHECK_ERROR(kret);
         
@@ -21,14 +21,21 @@
 #define __xnumem__ProcessMemory__
 
 #include <mach/mach.h>
+#include <atomic>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <vector>
 
-typedef struct MemoryRegion {
-	mach_vm_address_t address;
-	mach_vm_size_t size;
-	vm_region_basic_info_data_64_t info;
-} MemoryRegion_t;
+#include "MemorySource.h"
+#include "RegionIndex.h"
+
+typedef struct ReadRequest {
+    mach_vm_address_t address;
+    mach_vm_size_t    size;
+    void *            buffer;
+    kern_return_t     status;   // set by ReadBatch
+} ReadRequest_t;
 
 class ProcessMemory
 {
@@ -47,6 +54,102 @@ public:
      */
     kern_return_t Read ( uintptr_t address, size_t size, void * buffer );
     
+    /**
+     Read data, returning failures instead of treating them as fatal.
+     For bulk readers walking regions that may be partially backed or already gone.
+     
+     @param address -- Memory address.
+     @param size    -- Size to read
+     @param buffer  -- Output buffer
+     @return Status.
+     */
+    kern_return_t TryRead ( uintptr_t address, size_t size, void * buffer );
+    
+    /**
+     Read many small ranges, e.g. a frontier of remote list or tree nodes. Requests are
+     sorted and the ones less than gap bytes apart are fetched as one span, so nodes that
+     share pages cost one read between them. A span that fails is retried request by
+     request, each request gets its own status.
+     
+     @param requests -- Ranges and output buffers, any order. Buffers must not overlap.
+     @param gap      -- Largest hole between requests read through. (optional)
+     @return KERN_SUCCESS if every request was read, otherwise the status of a failed one.
+     */
+    kern_return_t ReadBatch( std::vector<ReadRequest_t>& requests, mach_vm_size_t gap = 4096 );
+    
+    /**
+     Read a range as a copy-on-write mapping in our task (mach_vm_read). Pages are only
+     copied if either side writes them, which makes this the cheap way to hold large
+     ranges. Not available for offline sources, use Map there.
+     
+     @param address -- Memory address.
+     @param size    -- Size to read.
+     @param data    -- Output pointer to the mapped copy.
+     @return Status.
+     */
+    kern_return_t ReadMapped( uintptr_t address, size_t size, const void ** data );
+    
+    /**
+     Release a copy from ReadMapped.
+     
+     @param data -- Mapped copy.
+     @param size -- Size that was read.
+     @return Status.
+     */
+    kern_return_t ReleaseMapped( const void * data, size_t size );
+    
+    /**
+     Zero-copy access to memory, when the backend keeps it mapped (see MemorySource::Map)
+     or the range lies in a Mappable region of a live task (see MapView).
+     
+     @param address -- Memory address.
+     @param size    -- Size of the range, must not cross a region boundary.
+     @return Pointer to the data, nullptr if it has to be read.
+     */
+    const void * Map( uintptr_t address, size_t size );
+    
+    /**
+     Whether MapView may share a region into our task: shared memory and regions the
+     target can never write. Private writable memory is left out, sharing it would end
+     its copy-on-write. MapView also refuses file-backed memory, see there.
+     
+     @param region -- Region.
+     @return true if mappable.
+     */
+    static bool Mappable( const MemoryRegion_t& region );
+    
+    /**
+     Map a whole region into our task read-only, on the target's own pages (mach_vm_remap
+     without copy), so reading it moves no data. Views live as long as the region index
+     they were taken from: until the next refresh, or while the caller holds an EpochGuard.
+     Only anonymous memory (shm, anonymous shared or read-only memory) is viewed: a view
+     of a file mapping would fault with SIGBUS once the file is truncated, so those are
+     read instead.
+     
+     @param region -- Region, from regions().
+     @return Start of the view, nullptr if the region is not Mappable, file-backed, or the kernel refused it.
+     */
+    const void * MapView( const MemoryRegion_t& region );
+    
+    /**
+     Drop all views from MapView, as a refresh does.
+     
+     @param void
+     @return void
+     */
+    void ReleaseViews();
+    
+    /**
+     Page residency and dirty state, one VM_PAGE_QUERY_PAGE_* disposition per page.
+     Queried in large batches; not available for offline sources.
+     
+     @param address      -- Page aligned memory address.
+     @param size         -- Size of the range.
+     @param dispositions -- Output dispositions.
+     @return Status.
+     */
+    kern_return_t QueryPages( uintptr_t address, size_t size, std::vector<integer_t>& dispositions );
+    
     /**
      Write data.
      
@@ -58,15 +161,33 @@ public:
     kern_return_t Write( uintptr_t address, size_t size, void * buffer );
 
     /**
-     Copy a region of memory from one address to the other.
+     Copy a range of memory from one address to the other, ranges may overlap.
+     The kernel copies within the task (mach_vm_copy, whole pages copy-on-write); if it
+     refuses, the copy is streamed through our task like the cross-process Copy.
      
      @param source_address -- Memory address.
-     @param size    -- Size to read
-     @param buffer  -- Output buffer
+     @param size           -- Size to copy.
+     @param dest_address   -- Destination address, must be writable.
      @return Status.
      */
     kern_return_t Copy ( uintptr_t source_address, size_t size, uintptr_t dest_address );
     
+    /**
+     Copy memory between two attached processes. Streamed in kCopyChunk pieces through
+     two buffers of the destination, the read of the next piece overlapping the write
+     of the current one. The source may be an offline snapshot.
+     
+     @param from           -- Source process.
+     @param source_address -- Memory address in from.
+     @param to             -- Destination process, attached to a live task.
+     @param dest_address   -- Memory address in to, must be writable.
+     @param size           -- Size to copy.
+     @return Status of the first read or write that failed.
+     */
+    static kern_return_t Copy ( class xnu_proc& from, uintptr_t source_address, class xnu_proc& to, uintptr_t dest_address, size_t size );
+    
+    static const size_t kCopyChunk = 4 * 1024 * 1024;
+    
     /**
      Change memory protection.
      
@@ -86,7 +207,8 @@ public:
      @param BaseAddr -- Desired base address. If left zero it will find a suitable address and return it.
                         If the region as specified by the given base address and size would not lie within the task's
                         un-allocated memory, the kernel does not allocate the region. (optional)
-     @return Actual address of the memory block.
+     @return Actual address of the memory block, 0 if it could not be allocated or given
+             the protection. Many small blocks are cheaper from a RemoteArena.
      */
     uintptr_t Allocate( size_t size, vm_prot_t prot = VM_PROT_READ | VM_PROT_WRITE | VM_PROT_EXECUTE, uintptr_t BaseAddr = 0);
     
@@ -95,7 +217,7 @@ public:
      
      @param address  -- Memory address to release.
      @param size     -- Region size.
-     @return Status.
+     @return Status, an error rather than an abort when the task is gone.
      */
     kern_return_t Free(uintptr_t address, size_t size);
     
@@ -147,13 +269,44 @@ public:
      Memory regions
      
      @param void
-     @return Vector containing all region information.
+     @return Vector containing all region information, in address order.
      */
-    inline std::vector<MemoryRegion_t> segments() { return _segments; };
+    inline const std::vector<MemoryRegion_t>& segments() const { return regions().table(); };
+    
+    /**
+     Indexed memory regions, see RegionIndex.
+     The index is immutable once published; RefreshRegions swaps in a new one. Hold an
+     EpochGuard while using it from a thread that may race a refresh.
+     
+     @param void
+     @return Region index. Valid until the next refresh, or while the caller holds an EpochGuard.
+     */
+    inline const RegionIndex& regions() const { return *_regions.load(std::memory_order_acquire); };
+    
+    /**
+     Re-query the region list and publish a new index. Safe against concurrent readers
+     of regions(); the previous index is freed once no guard can still see it.
+     
+     @param void
+     @return KERN_SUCCESS or the error of the region query.
+     */
+    kern_return_t RefreshRegions();
+    
+    /**
+     Whether a region is anonymous memory: no entry, inside submaps too, has a pager,
+     so no file can change or shrink under its pages.
+     
+     @param region -- Region, from regions().
+     @return false for file-backed regions, holes, or when the task can't be queried.
+     */
+    bool Anonymous( const MemoryRegion_t& region );
     
     // Subroutines
     inline class ProcessCore& core() { return _core; }
     
+    // Offline backend in use, nullptr for a live task
+    inline MemorySource* source() const { return _source; }
+    
 private:
     ProcessMemory( const ProcessMemory& ) = delete;
     ProcessMemory& operator =(const ProcessMemory&) = delete;
@@ -165,7 +318,21 @@ private:
     
     // Retrieve all region info structures
     kern_return_t QueryRegions();
-    std::vector<MemoryRegion_t> _segments;
+    std::atomic<RegionIndex*> _regions;     // published index, retired through Epoch
+    std::mutex                _regions_writer;
+    
+    // Views from MapView, retired together with the region index they belong to
+    struct ViewCache {
+        std::mutex lock;
+        std::map<std::pair<mach_vm_address_t, mach_vm_size_t>, mach_vm_address_t> views;  // 0 remembers a refusal
+        ~ViewCache();
+    };
+    std::atomic<ViewCache*>   _views;
+    
+    // Double buffered copy into this task, see Copy
+    static kern_return_t CopyStream( ProcessMemory& from, uintptr_t source_address, ProcessMemory& to, uintptr_t dest_address, size_t size );
+    std::vector<uint8_t>      _copy_buffers[2];
+    std::mutex                _copy_lock;
     
     // Returns the size of the memory region containing |address| and the
     // number of bytes from |address| to the end of the region.
@@ -178,6 +345,7 @@ private:
 private:
     class xnu_proc     *_process;   // Owning process object
     class ProcessCore& _core;   // Core routines
+    MemorySource       *_source = nullptr;  // Offline backend, see xnu_proc::Attach(MemorySource*)
     
 };
 
@@ -17,91 +17,251 @@
  * Contact : jonathandaniel@email.com
  */
 
+#include "Epoch.h"
 #include "ProcessModules.h"
 
+#include "Stats.h"
+#include "Trace.h"
 #include "xnumem.h"
 #include <mach-o/dyld_images.h>
+#include <mach-o/loader.h>
+#include <mach-o/nlist.h>
+#include <limits.h>
+
+#include <algorithm>
 
 ProcessModules::ProcessModules( class xnu_proc& pprocess ) :
+    _all_modules(new std::vector<ModuleData_t>()),
+    _stamped(false),
     _process( pprocess ),
     _core(pprocess.core()),
     _memory(pprocess.memory())
 {
+    memset(&_dyld_info, 0, sizeof(_dyld_info));
+    memset(&_all_module_infos, 0, sizeof(_all_module_infos));
 }
 
 ProcessModules::~ProcessModules()
 {
+    delete _all_modules.load();
 }
 
-char *basename(const char * path)
+static const char *basename(const char * path)
 {
-    char *s = strrchr(path, '/');
-    if(s==NULL) {
-        return strdup(path);
-    } else {
-        return strdup(s + 1);
-    }
+    const char *s = strrchr(path, '/');
+    return s == NULL ? path : s + 1;
 }
 
 kern_return_t ProcessModules::QueryModules()
 {
-    mach_msg_type_number_t count = TASK_DYLD_INFO_COUNT;
+    TraceSpan span("QueryModules", "process");
+    StatScope stat(kStatQueryModules);
     kern_return_t kret = KERN_SUCCESS;
+    {
+        std::lock_guard<std::mutex> writer(_writer);
+        std::vector<ModuleData_t> * modules = new std::vector<ModuleData_t>();
+        _paths.clear();
+        _stamped = false;
+        memset(&_dyld_info, 0, sizeof(_dyld_info));
+        memset(&_all_module_infos, 0, sizeof(_all_module_infos));
+        
+        if(_memory.source())
+            kret = _memory.source()->QueryModules(*modules);
+        Epoch::Retire(_all_modules.exchange(modules, std::memory_order_acq_rel));
+        if(_memory.source())
+            return kret;
+        
+        mach_msg_type_number_t count = TASK_DYLD_INFO_COUNT;
+        kret = task_info(_core._pmach_port, TASK_DYLD_INFO, (task_info_t)&_dyld_info, &count);
+        stat.syscall(kret, sizeof(_dyld_info));
+        if(kret != KERN_SUCCESS)
+            return kret;    // e.g. the task is gone
+    }
     
-    kret = task_info(_core._pmach_port, TASK_DYLD_INFO, (task_info_t)&_dyld_info, &count);
+    return Refresh();
+}
+
+kern_return_t ProcessModules::Refresh( bool* changed /* = nullptr */ )
+{
+    TraceSpan span("Refresh", "process");
+    StatScope stat(kStatRefreshModules);
+    if(changed)
+        *changed = false;
+    
+    // Readers never take this, they load whatever list is published
+    std::lock_guard<std::mutex> writer(_writer);
+    if(_memory.source() || _dyld_info.all_image_info_addr == 0)
+        return KERN_SUCCESS;
+    
+    // Read the structure inside of dyld that contains information about
+    // loaded images.  We're reading from the desired task's address space.
+    struct dyld_all_image_infos infos;
+    memset(&infos, 0, sizeof(infos));
+    size_t size = std::min<size_t>(sizeof(infos), _dyld_info.all_image_info_size ? _dyld_info.all_image_info_size : sizeof(infos));
+    kern_return_t kret = _memory.TryRead(_dyld_info.all_image_info_addr, size, &infos);
     if(kret != KERN_SUCCESS)
-        MACH_CHECK_ERROR(kret);
+        return kret;
     
-    if(_dyld_info.all_image_info_addr != 0){
-        // _all_module_infos = *(struct dyld_all_image_infos*)_dyld_info.all_image_info_addr;
-        mach_vm_address_t address = _dyld_info.all_image_info_addr;
-        
-        if(address){
-            // Read the structure inside of dyld that contains information about
-            // loaded images.  We're reading from the desired task's address space.
-            _all_module_infos = _memory.Read<struct dyld_all_image_infos>(address);
-            
+    // The change stamp exists from version 15 on, older dylds get the array read every time
+    bool stamped = infos.version >= 15;
+    if(_stamped && stamped && infos.infoArrayChangeTimestamp == _all_module_infos.infoArrayChangeTimestamp)
+        return KERN_SUCCESS;
+    
+    // dyld clears the array pointer while it edits the list, try again on the next refresh
+    if(infos.infoArray == NULL)
+        return KERN_SUCCESS;
+    
+    std::vector<struct dyld_image_info> images(infos.infoArrayCount);
+    kret = _memory.TryRead((mach_vm_address_t)infos.infoArray, images.size() * sizeof(struct dyld_image_info), images.data());
+    if(kret != KERN_SUCCESS)
+        return kret;
+    
+    // Keep the copies of paths we already have, read the rest; a string address alone may be
+    // reused by an image loaded after another was unloaded, it must belong to the same image
+    std::unordered_map<mach_vm_address_t, const char *> paths;
+    std::vector<mach_vm_address_t> missing;
+    for (std::vector<struct dyld_image_info>::const_iterator it = images.begin(); it != images.end(); ++it)
+    {
+        mach_vm_address_t address = (mach_vm_address_t)it->imageFilePath;
+        std::unordered_map<mach_vm_address_t, CachedPath>::const_iterator known = _paths.find((mach_vm_address_t)it->imageLoadAddress);
+        if(known != _paths.end() && known->second.first == address)
+        {
+            paths[address] = known->second.second;
+            stat.hit();
         }
+        else if(address != 0 && paths.find(address) == paths.end())
+            missing.push_back(address);
+    }
+    ReadPaths(missing, paths);
+    
+    std::vector<ModuleData_t> modules(images.size());
+    std::unordered_map<mach_vm_address_t, CachedPath> cached;
+    for (size_t j = 0; j < images.size(); j++)
+    {
+        std::unordered_map<mach_vm_address_t, const char *>::const_iterator path = paths.find((mach_vm_address_t)images[j].imageFilePath);
+        modules[j].imageLoadAddress = images[j].imageLoadAddress;
+        modules[j].imageFilePath    = path != paths.end() ? path->second : InternPath("", 0);
+        modules[j].imageFileModDate = images[j].imageFileModDate;
+        if(path != paths.end())
+            cached[(mach_vm_address_t)images[j].imageLoadAddress] = CachedPath(path->first, path->second);
     }
     
-    for(int j = 0; j < _all_module_infos.infoArrayCount; j++)
+    const std::vector<ModuleData_t>& current = *_all_modules.load(std::memory_order_relaxed);
+    bool same = modules.size() == current.size();
+    for (size_t j = 0; same && j < modules.size(); j++)
     {
-        ModuleData_t *ModInfo = (ModuleData_t *)malloc(sizeof(ModuleData_t));
-        // Initialise _all_modules vector
-        ModInfo->imageFilePath    = _all_module_infos.infoArray[j].imageFilePath;
-        ModInfo->imageFileModDate = _all_module_infos.infoArray[j].imageFileModDate;
-        ModInfo->imageLoadAddress = _all_module_infos.infoArray[j].imageLoadAddress;
-        _all_modules.push_back(*ModInfo);
-        free(ModInfo);
+        same = modules[j].imageLoadAddress == current[j].imageLoadAddress &&
+               modules[j].imageFilePath == current[j].imageFilePath;
     }
+    if(changed)
+        *changed = !same;
     
-    return kret;
+    // An unchanged list keeps its array, so pointers into it stay good
+    if(!same)
+    {
+        std::vector<ModuleData_t> * published = new std::vector<ModuleData_t>();
+        published->swap(modules);
+        Epoch::Retire(_all_modules.exchange(published, std::memory_order_acq_rel));
+    }
+    _paths.swap(cached);
+    _all_module_infos = infos;
+    _stamped = stamped;
+    return KERN_SUCCESS;
 }
 
-const ModuleData_t* ProcessModules::GetModule( const char * name )
+void ProcessModules::ReadPaths( const std::vector<mach_vm_address_t>& addresses, std::unordered_map<mach_vm_address_t, const char *>& paths )
 {
-    ModuleData_t *ret = new ModuleData_t;
+    // dyld keeps most paths close together, so neighbours are read with one call
+    const mach_vm_size_t kBatch = 64 * 1024;
+    const mach_vm_size_t page = getpagesize();
+    StatScope stat(kStatReadPaths);
+    std::vector<mach_vm_address_t> sorted(addresses);
+    std::sort(sorted.begin(), sorted.end());
+    std::vector<char> buffer;
     
-    for (std::vector<ModuleData_t>::iterator it = _all_modules.begin() ; it != _all_modules.end(); ++it)
+    for (size_t i = 0; i < sorted.size(); )
     {
-        if(strcmp(basename(it->imageFilePath), name) ==0){
-            ret = _all_modules.data() + (it - _all_modules.begin());
-            return ret;
+        mach_vm_address_t start = sorted[i];
+        size_t last = i;
+        while(last + 1 < sorted.size() && sorted[last + 1] - start < kBatch)
+            last++;
+        
+        // Up to the end of the page holding the last path's start, it usually ends there
+        mach_vm_address_t end = (sorted[last] + page) & ~(page - 1);
+        buffer.resize(end - start);
+        bool batched = _memory.TryRead(start, buffer.size(), buffer.data()) == KERN_SUCCESS;
+        stat.request(buffer.size());
+        stat.transfer(batched ? buffer.size() : 0);
+        
+        for (; i <= last; i++)
+        {
+            const char * local = nullptr;
+            if(batched)
+            {
+                size_t offset = sorted[i] - start;
+                const char * terminator = (const char *)memchr(&buffer[offset], 0, buffer.size() - offset);
+                if(terminator)
+                    local = InternPath(&buffer[offset], terminator - &buffer[offset]);
+            }
+            
+            // Page by page, for paths that run past the batch or sit next to unmapped memory
+            if(local == nullptr)
+            {
+                std::string path;
+                char chunk[PATH_MAX];
+                mach_vm_address_t address = sorted[i];
+                while(path.size() < PATH_MAX)
+                {
+                    size_t size = std::min<size_t>(sizeof(chunk), ((address + page) & ~(page - 1)) - address);
+                    if(_memory.TryRead(address, size, chunk) != KERN_SUCCESS)
+                        break;
+                    
+                    const char * terminator = (const char *)memchr(chunk, 0, size);
+                    path.append(chunk, terminator ? terminator - chunk : size);
+                    if(terminator)
+                        break;
+                    address += size;
+                }
+                local = InternPath(path.data(), path.size());
+            }
+            
+            paths[sorted[i]] = local;
         }
     }
+}
+
+const char * ProcessModules::InternPath( const char * path, size_t length )
+{
+    return _path_pool.insert(std::string(path, length)).first->c_str();
+}
+
+std::vector<ModuleData_t> ProcessModules::modules()
+{
+    EpochGuard guard;
+    return *_all_modules.load(std::memory_order_acquire);
+}
+
+const ModuleData_t* ProcessModules::GetModule( const char * name )
+{
+    EpochGuard guard;
+    const std::vector<ModuleData_t>& modules = *_all_modules.load(std::memory_order_acquire);
+    for (std::vector<ModuleData_t>::const_iterator it = modules.begin() ; it != modules.end(); ++it)
+    {
+        if(strcmp(basename(it->imageFilePath), name) ==0)
+            return &(*it);
+    }
     
     return nullptr;
 }
 
 const ModuleData_t* ProcessModules::GetModule( module_t BaseAddr )
 {
-    const ModuleData_t * temp = new ModuleData_t;
-    for (std::vector<ModuleData_t>::iterator it = _all_modules.begin() ; it != _all_modules.end(); ++it)
+    EpochGuard guard;
+    const std::vector<ModuleData_t>& modules = *_all_modules.load(std::memory_order_acquire);
+    for (std::vector<ModuleData_t>::const_iterator it = modules.begin() ; it != modules.end(); ++it)
     {
-        if((uintptr_t)it->imageLoadAddress == BaseAddr){
-            temp = &(*it);
-            return temp;
-        }
+        if((uintptr_t)it->imageLoadAddress == BaseAddr)
+            return &(*it);
     }
     
     return nullptr;
@@ -109,5 +269,241 @@ const ModuleData_t* ProcessModules::GetModule( module_t BaseAddr )
 
 const ModuleData_t* ProcessModules::GetMainModule( )
 {
-    return &_all_modules[0];
+    EpochGuard guard;
+    const std::vector<ModuleData_t>& modules = *_all_modules.load(std::memory_order_acquire);
+    return modules.empty() ? nullptr : &modules[0];
+}
+
+kern_return_t ProcessModules::ReadLoadCommands( const ModuleData_t* module, std::vector<uint8_t>& commands, uint32_t& ncmds )
+{
+    if(module == nullptr)
+        return KERN_INVALID_ARGUMENT;
+    
+    mach_vm_address_t base = (mach_vm_address_t)module->imageLoadAddress;
+    struct mach_header_native header;
+    kern_return_t kret = _memory.TryRead(base, sizeof(header), &header);
+    if(kret != KERN_SUCCESS)
+        return kret;
+    if(header.magic != MH_MAGIC && header.magic != MH_MAGIC_64)
+        return KERN_INVALID_ARGUMENT;
+    
+    // Load commands follow the header
+    commands.resize(header.sizeofcmds);
+    ncmds = header.ncmds;
+    return _memory.TryRead(base + sizeof(header), commands.size(), commands.data());
+}
+
+kern_return_t ProcessModules::GetModuleSegments( const ModuleData_t* module, std::vector<AddressRange_t>& ranges )
+{
+    std::vector<uint8_t> commands;
+    uint32_t ncmds = 0;
+    kern_return_t kret = ReadLoadCommands(module, commands, ncmds);
+    if(kret != KERN_SUCCESS)
+        return kret;
+    
+    mach_vm_address_t base = (mach_vm_address_t)module->imageLoadAddress;
+    std::vector<AddressRange_t> segments;
+    mach_vm_address_t slide = 0;
+    uint32_t offset = 0;
+    
+    for (uint32_t i = 0; i < ncmds && offset + sizeof(struct load_command) <= commands.size(); i++)
+    {
+        const struct load_command *lc = (const struct load_command *)&commands[offset];
+        if(lc->cmdsize == 0 || offset + lc->cmdsize > commands.size())
+            break;
+        
+        if(lc->cmd == LC_SEGMENT_NATIVE)
+        {
+            const struct segment_command_native *seg = (const struct segment_command_native *)lc;
+            
+            // The header lives at the start of __TEXT, which gives us the slide
+            if(seg->fileoff == 0 && seg->filesize != 0)
+                slide = base - seg->vmaddr;
+            
+            if(seg->vmsize != 0 &&
+               strncmp(seg->segname, SEG_PAGEZERO, sizeof(seg->segname)) != 0 &&
+               strncmp(seg->segname, SEG_LINKEDIT, sizeof(seg->segname)) != 0)
+            {
+                AddressRange_t range = { seg->vmaddr, seg->vmaddr + seg->vmsize };
+                segments.push_back(range);
+            }
+        }
+        
+        offset += lc->cmdsize;
+    }
+    
+    for (std::vector<AddressRange_t>::iterator it = segments.begin(); it != segments.end(); ++it)
+    {
+        it->start += slide;
+        it->end   += slide;
+        ranges.push_back(*it);
+    }
+    
+    return KERN_SUCCESS;
+}
+
+kern_return_t ProcessModules::GetModuleSections( const ModuleData_t* module, std::vector<ModuleSection_t>& sections )
+{
+    std::vector<uint8_t> commands;
+    uint32_t ncmds = 0;
+    kern_return_t kret = ReadLoadCommands(module, commands, ncmds);
+    if(kret != KERN_SUCCESS)
+        return kret;
+    
+    mach_vm_address_t base = (mach_vm_address_t)module->imageLoadAddress;
+    size_t first = sections.size();
+    mach_vm_address_t slide = 0;
+    uint32_t offset = 0;
+    
+    for (uint32_t i = 0; i < ncmds && offset + sizeof(struct load_command) <= commands.size(); i++)
+    {
+        const struct load_command *lc = (const struct load_command *)&commands[offset];
+        if(lc->cmdsize == 0 || offset + lc->cmdsize > commands.size())
+            break;
+        
+        if(lc->cmd == LC_SEGMENT_NATIVE)
+        {
+            const struct segment_command_native *seg = (const struct segment_command_native *)lc;
+            if(seg->fileoff == 0 && seg->filesize != 0)
+                slide = base - seg->vmaddr;
+            
+            // Section headers follow their segment command
+            const struct section_native *sect = (const struct section_native *)(seg + 1);
+            for (uint32_t n = 0; n < seg->nsects && (const uint8_t *)(sect + n + 1) <= (const uint8_t *)lc + lc->cmdsize; n++)
+            {
+                if(sect[n].size == 0)
+                    continue;
+                
+                ModuleSection_t section;
+                memset(&section, 0, sizeof(section));
+                memcpy(section.segment, sect[n].segname, sizeof(sect[n].segname));
+                memcpy(section.section, sect[n].sectname, sizeof(sect[n].sectname));
+                section.range.start = sect[n].addr;
+                section.range.end   = sect[n].addr + sect[n].size;
+                section.flags       = sect[n].flags;
+                section.protection  = seg->initprot;
+                sections.push_back(section);
+            }
+        }
+        
+        offset += lc->cmdsize;
+    }
+    
+    // The slide is only known once __TEXT has been seen
+    for (std::vector<ModuleSection_t>::iterator it = sections.begin() + first; it != sections.end(); ++it)
+    {
+        it->range.start += slide;
+        it->range.end   += slide;
+    }
+    
+    return KERN_SUCCESS;
+}
+
+kern_return_t ProcessModules::GetModuleRanges( std::vector<ModuleRange_t>& ranges )
+{
+    EpochGuard guard;
+    return GetModuleRanges(*_all_modules.load(std::memory_order_acquire), ranges);
+}
+
+kern_return_t ProcessModules::GetModuleRanges( const std::vector<ModuleData_t>& modules, std::vector<ModuleRange_t>& ranges )
+{
+    ranges.clear();
+    for (size_t i = 0; i < modules.size(); i++)
+    {
+        std::vector<AddressRange_t> segments;
+        if(GetModuleSegments(&modules[i], segments) != KERN_SUCCESS)
+            continue;
+        
+        for (std::vector<AddressRange_t>::const_iterator it = segments.begin(); it != segments.end(); ++it)
+        {
+            ModuleRange_t range = { *it, i };
+            ranges.push_back(range);
+        }
+    }
+    
+    std::sort(ranges.begin(), ranges.end(), [](const ModuleRange_t& a, const ModuleRange_t& b) { return a.range.start < b.range.start; });
+    return KERN_SUCCESS;
+}
+
+const ModuleRange_t* ProcessModules::FindModuleRange( const std::vector<ModuleRange_t>& ranges, mach_vm_address_t address )
+{
+    std::vector<ModuleRange_t>::const_iterator it = std::upper_bound(ranges.begin(), ranges.end(), address,
+                                                                     [](mach_vm_address_t address, const ModuleRange_t& range) {
+                                                                         return address < range.range.start;
+                                                                     });
+    if(it == ranges.begin() || address >= (--it)->range.end)
+        return nullptr;
+    
+    return &(*it);
+}
+
+static bool ModuleSymbolLess( const ModuleSymbol_t& a, const ModuleSymbol_t& b )
+{
+    return a.address < b.address;
+}
+
+kern_return_t ProcessModules::GetModuleSymbols( const ModuleData_t* module, std::vector<ModuleSymbol_t>& symbols )
+{
+    std::vector<uint8_t> commands;
+    uint32_t ncmds = 0;
+    kern_return_t kret = ReadLoadCommands(module, commands, ncmds);
+    if(kret != KERN_SUCCESS)
+        return kret;
+    
+    mach_vm_address_t base = (mach_vm_address_t)module->imageLoadAddress;
+    const struct segment_command_native *linkedit = nullptr;
+    const struct symtab_command *symtab = nullptr;
+    mach_vm_address_t slide = 0;
+    uint32_t offset = 0;
+    
+    for (uint32_t i = 0; i < ncmds && offset + sizeof(struct load_command) <= commands.size(); i++)
+    {
+        const struct load_command *lc = (const struct load_command *)&commands[offset];
+        if(lc->cmdsize == 0 || offset + lc->cmdsize > commands.size())
+            break;
+        
+        if(lc->cmd == LC_SEGMENT_NATIVE)
+        {
+            const struct segment_command_native *seg = (const struct segment_command_native *)lc;
+            if(seg->fileoff == 0 && seg->filesize != 0)
+                slide = base - seg->vmaddr;
+            if(strncmp(seg->segname, SEG_LINKEDIT, sizeof(seg->segname)) == 0)
+                linkedit = seg;
+        }
+        else if(lc->cmd == LC_SYMTAB)
+        {
+            symtab = (const struct symtab_command *)lc;
+        }
+        
+        offset += lc->cmdsize;
+    }
+    
+    if(linkedit == nullptr || symtab == nullptr)
+        return KERN_NOT_FOUND;
+    
+    // Symbol and string tables are file offsets into __LINKEDIT
+    mach_vm_address_t linkedit_base = linkedit->vmaddr + slide - linkedit->fileoff;
+    std::vector<struct nlist_native> nlists(symtab->nsyms);
+    std::vector<char> strings(symtab->strsize + 1, 0);
+    
+    kret = _memory.TryRead(linkedit_base + symtab->symoff, nlists.size() * sizeof(struct nlist_native), nlists.data());
+    if(kret == KERN_SUCCESS)
+        kret = _memory.TryRead(linkedit_base + symtab->stroff, symtab->strsize, strings.data());
+    if(kret != KERN_SUCCESS)
+        return kret;
+    
+    size_t first = symbols.size();
+    for (std::vector<struct nlist_native>::const_iterator it = nlists.begin(); it != nlists.end(); ++it)
+    {
+        if((it->n_type & N_STAB) || (it->n_type & N_TYPE) != N_SECT || it->n_un.n_strx >= symtab->strsize)
+            continue;
+        
+        ModuleSymbol_t symbol;
+        symbol.address = it->n_value + slide;
+        symbol.name    = &strings[it->n_un.n_strx];
+        symbols.push_back(symbol);
+    }
+    
+    std::sort(symbols.begin() + first, symbols.end(), ModuleSymbolLess);
+    return KERN_SUCCESS;
 }
@@ -20,11 +20,18 @@
 #ifndef __xnumem__ProcessModules__
 #define __xnumem__ProcessModules__
 
+#include <atomic>
 #include <iostream>
 #include <mach/mach.h>
 #include <mach-o/dyld_images.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "RegionIndex.h"
+
 typedef struct ModuleData{
  	const struct mach_header*	imageLoadAddress;	/* base address image is mapped into */
 	const char*					imageFilePath;		/* path dyld used to load the image */
@@ -33,6 +40,24 @@ typedef struct ModuleData{
 
 typedef uintptr_t         module_t;     // Module base pointer
 
+typedef struct ModuleRange {
+    AddressRange_t range;   // one segment
+    size_t         index;   // into modules()
+} ModuleRange_t;
+
+typedef struct ModuleSection {
+    char           segment[17];     // NUL terminated copies of the 16 byte names
+    char           section[17];
+    AddressRange_t range;           // slid to the module's load address
+    uint32_t       flags;           // section type and attributes (S_*)
+    vm_prot_t      protection;      // initial protection of the segment
+} ModuleSection_t;
+
+typedef struct ModuleSymbol {
+    uint64_t    address;    // slid to the module's load address
+    std::string name;
+} ModuleSymbol_t;
+
 class ProcessModules
 {
     friend class xnu_proc;
@@ -64,8 +89,78 @@ public:
      */
     const ModuleData_t* GetMainModule( );
     
-    // Contains all modules and their data
-    inline std::vector<ModuleData_t> modules() { return _all_modules; };
+    /**
+     Get the address ranges of a module's segments, read from its load commands.
+     __PAGEZERO and __LINKEDIT are left out (the latter is shared by every image in the dyld cache).
+     
+     @param module -- Module data.
+     @param ranges -- Output ranges, slid to the module's load address.
+     @return Status.
+     */
+    kern_return_t GetModuleSegments( const ModuleData_t* module, std::vector<AddressRange_t>& ranges );
+    
+    /**
+     Get the sections of a module, read from its load commands. Empty sections are left out.
+     
+     @param module   -- Module data.
+     @param sections -- Output sections, in load command order.
+     @return Status.
+     */
+    kern_return_t GetModuleSections( const ModuleData_t* module, std::vector<ModuleSection_t>& sections );
+    
+    /**
+     Get the segments of every module, for address to module lookups (see FindModuleRange).
+     Modules whose load commands can't be read are left out.
+     
+     @param ranges -- Output ranges, sorted by address.
+     @return Status.
+     */
+    kern_return_t GetModuleRanges( std::vector<ModuleRange_t>& ranges );
+    
+    /**
+     Same, for a copy of the module list taken earlier; indices are into that copy.
+     
+     @param modules -- Module list, e.g. a copy of modules().
+     @param ranges  -- Output ranges, sorted by address.
+     @return Status.
+     */
+    kern_return_t GetModuleRanges( const std::vector<ModuleData_t>& modules, std::vector<ModuleRange_t>& ranges );
+    
+    /**
+     Module segment containing an address.
+     
+     @param ranges  -- Ranges from GetModuleRanges.
+     @param address -- Memory address.
+     @return Range, nullptr if no module holds the address.
+     */
+    static const ModuleRange_t* FindModuleRange( const std::vector<ModuleRange_t>& ranges, mach_vm_address_t address );
+    
+    /**
+     Get the defined symbols of a module, read from its LC_SYMTAB through __LINKEDIT.
+     Images from the shared cache only carry their exported symbols there.
+     
+     @param module  -- Module data.
+     @param symbols -- Output symbols, sorted by address.
+     @return Status.
+     */
+    kern_return_t GetModuleSymbols( const ModuleData_t* module, std::vector<ModuleSymbol_t>& symbols );
+    
+    /**
+     Bring the module list up to date after the target loaded or unloaded images.
+     dyld stamps every change of its image list, so while the stamp is unchanged this
+     costs one small read. Otherwise the image array is read in one go and only the
+     paths of images not seen before are read, in batches.
+     Module paths stay valid for the lifetime of this object. A changed list is published
+     as a new array, so ModuleData_t pointers handed out before stay valid until the next
+     refresh, or for as long as the reader holds an EpochGuard.
+     
+     @param changed -- Set to whether the list changed. (optional)
+     @return Status.
+     */
+    kern_return_t Refresh( bool* changed = nullptr );
+    
+    // Copy of all modules and their data
+    std::vector<ModuleData_t> modules();
     
 private:
     ProcessModules( const ProcessModules& ) = delete;
@@ -74,9 +169,21 @@ private:
     // Retrieve all module info structures
     kern_return_t QueryModules();
     
+    // Local copies of remote image paths, batched by address
+    void ReadPaths( const std::vector<mach_vm_address_t>& addresses, std::unordered_map<mach_vm_address_t, const char *>& paths );
+    const char * InternPath( const char * path, size_t length );
+    
+    // Load commands of a module, read in one go
+    kern_return_t ReadLoadCommands( const ModuleData_t* module, std::vector<uint8_t>& commands, uint32_t& ncmds );
+    
     struct task_dyld_info        _dyld_info;
     struct dyld_all_image_infos _all_module_infos;
-    std::vector<ModuleData_t>    _all_modules;
+    std::atomic<std::vector<ModuleData_t>*> _all_modules;  // published list, retired through Epoch
+    std::mutex                   _writer;        // QueryModules / Refresh
+    bool                         _stamped;       // _all_module_infos.infoArrayChangeTimestamp matches _all_modules
+    typedef std::pair<mach_vm_address_t, const char *> CachedPath;   // remote path, local copy
+    std::unordered_map<mach_vm_address_t, CachedPath> _paths;  // image load address -> its path, current images
+    std::unordered_set<std::string> _path_pool;  // local copies, never shrinks so handed out paths stay valid
     
 private:
     class xnu_proc&        _process;
@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+#include "ProcessThreads.h"
+
+#include "Trace.h"
+#include "xnumem.h"
+
+ProcessThreads::ProcessThreads( class xnu_proc& pprocess ) :
+    _process( pprocess ),
+    _core(pprocess.core()),
+    _memory(pprocess.memory())
+{
+}
+
+ProcessThreads::~ProcessThreads()
+{
+    Release();
+}
+
+void ProcessThreads::Release()
+{
+    for (std::vector<ThreadData_t>::iterator it = _all_threads.begin(); it != _all_threads.end(); ++it)
+        mach_port_deallocate(mach_task_self(), it->port);
+    
+    _all_threads.clear();
+}
+
+kern_return_t ProcessThreads::QueryThreads()
+{
+    TraceSpan span("QueryThreads", "process");
+    Release();
+    if(_memory.source())
+        return KERN_NOT_SUPPORTED;
+    
+    thread_act_array_t list = NULL;
+    mach_msg_type_number_t count = 0;
+    kern_return_t kret = task_threads(_core._pmach_port, &list, &count);
+    if(kret != KERN_SUCCESS)
+        return kret;
+    
+    _all_threads.reserve(count);
+    for (mach_msg_type_number_t i = 0; i < count; i++)
+    {
+        ThreadData_t thread;
+        memset(&thread, 0, sizeof(thread));
+        thread.port = list[i];
+        
+        // A thread may exit between task_threads and here, keep what we could get
+        thread_identifier_info_data_t identifier;
+        mach_msg_type_number_t info_count = THREAD_IDENTIFIER_INFO_COUNT;
+        if(thread_info(list[i], THREAD_IDENTIFIER_INFO, (thread_info_t)&identifier, &info_count) == KERN_SUCCESS)
+        {
+            thread.thread_id      = identifier.thread_id;
+            thread.dispatch_qaddr = identifier.dispatch_qaddr;
+        }
+        
+        thread_extended_info_data_t extended;
+        info_count = THREAD_EXTENDED_INFO_COUNT;
+        if(thread_info(list[i], THREAD_EXTENDED_INFO, (thread_info_t)&extended, &info_count) == KERN_SUCCESS)
+        {
+            thread.run_state   = extended.pth_run_state;
+            thread.user_time   = extended.pth_user_time;
+            thread.system_time = extended.pth_system_time;
+            strncpy(thread.name, extended.pth_name, sizeof(thread.name) - 1);
+        }
+        
+        thread_basic_info_data_t basic;
+        info_count = THREAD_BASIC_INFO_COUNT;
+        if(thread_info(list[i], THREAD_BASIC_INFO, (thread_info_t)&basic, &info_count) == KERN_SUCCESS)
+            thread.suspend_count = basic.suspend_count;
+        
+        _all_threads.push_back(thread);
+    }
+    
+    // The ports now belong to _all_threads, only the array goes
+    vm_deallocate(mach_task_self(), (vm_address_t)list, count * sizeof(thread_act_t));
+    return KERN_SUCCESS;
+}
+
+const ThreadData_t* ProcessThreads::GetThread( uint64_t thread_id )
+{
+    for (std::vector<ThreadData_t>::iterator it = _all_threads.begin(); it != _all_threads.end(); ++it)
+    {
+        if(it->thread_id == thread_id)
+            return &(*it);
+    }
+    
+    return nullptr;
+}
+
+kern_return_t ProcessThreads::GetThreadState( const ThreadData_t& thread, ThreadState_t& state )
+{
+    memset(&state, 0, sizeof(state));
+    
+#if defined(__x86_64__)
+    x86_thread_state64_t registers;
+    mach_msg_type_number_t count = x86_THREAD_STATE64_COUNT;
+    kern_return_t kret = thread_get_state(thread.port, x86_THREAD_STATE64, (thread_state_t)&registers, &count);
+    if(kret != KERN_SUCCESS)
+        return kret;
+    
+    state.pc = registers.__rip;
+    state.sp = registers.__rsp;
+    state.fp = registers.__rbp;
+#elif defined(__arm64__)
+    arm_thread_state64_t registers;
+    mach_msg_type_number_t count = ARM_THREAD_STATE64_COUNT;
+    kern_return_t kret = thread_get_state(thread.port, ARM_THREAD_STATE64, (thread_state_t)&registers, &count);
+    if(kret != KERN_SUCCESS)
+        return kret;
+    
+    state.pc = arm_thread_state64_get_pc(registers);
+    state.sp = arm_thread_state64_get_sp(registers);
+    state.fp = arm_thread_state64_get_fp(registers);
+    state.lr = arm_thread_state64_get_lr(registers);
+#else
+    kern_return_t kret = KERN_NOT_SUPPORTED;
+#endif
+    
+    return kret;
+}
+
+kern_return_t ProcessThreads::Suspend( const ThreadData_t& thread )
+{
+    return thread_suspend(thread.port);
+}
+
+kern_return_t ProcessThreads::Resume( const ThreadData_t& thread )
+{
+    return thread_resume(thread.port);
+}
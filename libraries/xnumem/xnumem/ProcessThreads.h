@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+#ifndef __xnumem__ProcessThreads__
+#define __xnumem__ProcessThreads__
+
+#include <mach/mach.h>
+#include <stdint.h>
+#include <vector>
+
+typedef struct ThreadData {
+    thread_act_t port;              // send right, owned by ProcessThreads
+    uint64_t     thread_id;         // system-wide unique id
+    uint64_t     dispatch_qaddr;    // dispatch queue pointer, 0 if none
+    integer_t    run_state;         // TH_STATE_*
+    integer_t    suspend_count;
+    uint64_t     user_time;         // nanoseconds
+    uint64_t     system_time;       // nanoseconds
+    char         name[64];          // pthread name, may be empty
+} ThreadData_t;
+
+typedef struct ThreadState {
+    uint64_t pc;
+    uint64_t sp;
+    uint64_t fp;
+    uint64_t lr;                    // 0 where the architecture has no link register
+} ThreadState_t;
+
+class ProcessThreads
+{
+    friend class xnu_proc;
+public:
+    ProcessThreads( class xnu_proc& process );
+    ~ProcessThreads();
+    
+    /**
+     Enumerate the threads of the task. Threads come and go, call again to refresh;
+     the ports of the previous enumeration are released.
+     
+     @param void
+     @return Status. KERN_NOT_SUPPORTED for offline sources, which have no threads.
+     */
+    kern_return_t QueryThreads();
+    
+    /**
+     Get thread data by thread id.
+     
+     @param thread_id -- System-wide thread id.
+     @return ThreadData structure of the thread. nullptr if not found.
+     */
+    const ThreadData_t* GetThread( uint64_t thread_id );
+    
+    /**
+     Registers needed to unwind a thread. The thread should be suspended for the
+     result to mean anything.
+     
+     @param thread -- Thread.
+     @param state  -- Output registers.
+     @return Status.
+     */
+    kern_return_t GetThreadState( const ThreadData_t& thread, ThreadState_t& state );
+    
+    /**
+     Suspend / resume a thread. Suspensions nest, every Suspend needs a Resume.
+     
+     @param thread -- Thread.
+     @return Status.
+     */
+    kern_return_t Suspend( const ThreadData_t& thread );
+    kern_return_t Resume( const ThreadData_t& thread );
+    
+    // Threads of the last enumeration
+    inline const std::vector<ThreadData_t>& threads() const { return _all_threads; }
+    
+private:
+    ProcessThreads( const ProcessThreads& ) = delete;
+    ProcessThreads& operator =(const ProcessThreads&) = delete;
+    
+    // Drop the thread ports
+    void Release();
+    
+    std::vector<ThreadData_t>    _all_threads;
+    
+private:
+    class xnu_proc&        _process;
+    class ProcessCore&     _core;
+    class ProcessMemory&   _memory;
+};
+
+#endif /* defined(__xnumem__ProcessThreads__) */
@@ -0,0 +1,408 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+#include "Profiler.h"
+#include "Epoch.h"
+#include "Hash.h"
+#include "Trace.h"
+#include "xnumem.h"
+
+#include <mach/mach_time.h>
+#include <mach/mach_vm.h>
+#include <cxxabi.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+
+// Batches read past the first window, bounds the cost of runaway frame chains
+static const size_t kMaxStackBatches = 64;
+
+static bool SymbolLess( uint64_t address, const ModuleSymbol_t& symbol )
+{
+    return address < symbol.address;
+}
+
+static uint64_t StripPointer( uint64_t address )
+{
+#if defined(__arm64__)
+    // Return addresses may carry a pointer authentication code in the high bits
+    return address & 0x0000007fffffffffULL;
+#else
+    return address;
+#endif
+}
+
+size_t Profiler::StackHasher::operator ()( const std::vector<uint64_t>& stack ) const
+{
+    return (size_t)Hash64(stack.data(), stack.size() * sizeof(uint64_t));
+}
+
+Profiler::Profiler( xnu_proc& process, const ProfilerConfig_t& config /* = DefaultConfig() */ ) :
+    _process(process),
+    _config(config),
+    _window(config.stack_window),
+    _samples(0),
+    _cost(0),
+    _running(false)
+{
+}
+
+Profiler::~Profiler()
+{
+    Stop();
+}
+
+ProfilerConfig_t Profiler::DefaultConfig()
+{
+    ProfilerConfig_t config;
+    config.interval_us  = 10000;
+    config.max_depth    = 128;
+    config.stack_window = 16 * 1024;
+    config.per_thread   = false;
+    return config;
+}
+
+mach_vm_address_t Profiler::WindowEnd( const RegionIndex& regions, mach_vm_address_t address ) const
+{
+    // Up to the end of the stack region; threads created after the regions were
+    // queried are not in the table, take at least the rest of the page
+    mach_vm_address_t end = address + _config.stack_window;
+    const MemoryRegion_t* region = regions.Find(address);
+    if(region)
+        end = std::min<mach_vm_address_t>(end, region->address + region->size);
+    else
+        end = std::min<mach_vm_address_t>(end, (address | (getpagesize() - 1)) + 1);
+    return end;
+}
+
+size_t Profiler::ReadWindow( uint8_t * buffer, mach_vm_address_t address )
+{
+    EpochGuard guard;
+    mach_vm_address_t end = WindowEnd(_process.memory().regions(), address);
+    if(end <= address || _process.memory().TryRead(address, end - address, buffer) != KERN_SUCCESS)
+        return 0;
+    
+    return end - address;
+}
+
+size_t Profiler::ReadStopped( const RegionIndex& regions, mach_vm_address_t address )
+{
+    // Bare read, no stats, trace or epoch bookkeeping: those allocate and lock on first use
+    mach_vm_address_t end = WindowEnd(regions, address);
+    mach_vm_size_t size = 0;
+    if(end <= address || mach_vm_read_overwrite(_process.core()._pmach_port, address, end - address, (mach_vm_address_t)_window.data(), &size) != KERN_SUCCESS)
+        return 0;
+    
+    return size;
+}
+
+bool Profiler::Load( StackReader& reader, mach_vm_address_t address, uint64_t& value )
+{
+    for (size_t i = 0; i < reader.base.size(); i++)
+    {
+        if(address >= reader.base[i] && address + sizeof(value) <= reader.base[i] + reader.data[i].size())
+        {
+            memcpy(&value, &reader.data[i][address - reader.base[i]], sizeof(value));
+            return true;
+        }
+    }
+    
+    if(reader.base.size() > kMaxStackBatches)
+        return false;
+    
+    // Next batch of stack pages, starting at the page holding the frame
+    mach_vm_address_t base = address & ~(mach_vm_address_t)(getpagesize() - 1);
+    std::vector<uint8_t> data(_config.stack_window);
+    data.resize(ReadWindow(data.data(), base));
+    if(address + sizeof(value) > base + data.size())
+        return false;
+    
+    memcpy(&value, &data[address - base], sizeof(value));
+    reader.base.push_back(base);
+    reader.data.push_back(std::vector<uint8_t>());
+    reader.data.back().swap(data);
+    return true;
+}
+
+void Profiler::Walk( const ThreadState_t& state, StackReader& reader, std::vector<uint64_t>& frames )
+{
+    frames.push_back(state.pc);
+    
+    // Frame records are { caller fp, return address }, on x86_64 and arm64 alike
+    uint64_t fp = state.fp;
+    if(fp < state.sp)
+        return;
+    
+    while(frames.size() < _config.max_depth && fp != 0 && (fp & (sizeof(uint64_t) - 1)) == 0)
+    {
+        uint64_t next, ret;
+        if(!Load(reader, fp, next) || !Load(reader, fp + sizeof(uint64_t), ret) || ret == 0)
+            break;
+        
+        frames.push_back(StripPointer(ret));
+        
+        // Stacks grow down, a caller's frame is always above
+        if(next <= fp)
+            break;
+        fp = next;
+    }
+}
+
+kern_return_t Profiler::Sample()
+{
+    TraceSpan span("Sample", "Profiler");
+    std::lock_guard<std::mutex> sampling(_sample_lock);
+    if(_process.memory().source())
+        return KERN_NOT_SUPPORTED;
+    
+    // The pass owns its ports: the shared list of xnu_proc::threads() is not ours to rebuild from here
+    uint64_t start = mach_absolute_time();
+    thread_act_array_t list = NULL;
+    mach_msg_type_number_t count = 0;
+    kern_return_t kret = task_threads(_process.core()._pmach_port, &list, &count);
+    if(kret != KERN_SUCCESS)
+        return kret;
+    
+    // Profiling our own task, the thread ports name the same threads as ours
+    ProcessThreads& threads = _process.threads();
+    thread_act_t self = mach_thread_self();
+    bool own_task = _process.pid() == getpid();
+    
+    StackReader reader;
+    std::vector<uint64_t> frames;
+    frames.reserve(_config.max_depth + 1);
+    
+    // Pinned for the whole pass, so the region index is looked up without entering the epoch
+    // while a thread is stopped; the guard's slot is allocated here, on the first use
+    EpochGuard guard;
+    const RegionIndex& regions = _process.memory().regions();
+    
+    uint64_t sampled = 0;
+    for (mach_msg_type_number_t i = 0; i < count; i++)
+    {
+        if(own_task && list[i] == self)
+            continue;
+        
+        ThreadData_t thread;
+        memset(&thread, 0, sizeof(thread));
+        thread.port = list[i];
+        if(threads.Suspend(thread) != KERN_SUCCESS)
+            continue;
+        
+        // Nothing may allocate while the thread is stopped, it could hold the malloc lock of our own task
+        ThreadState_t state;
+        size_t window = 0;
+        bool valid = threads.GetThreadState(thread, state) == KERN_SUCCESS;
+        if(valid)
+            window = ReadStopped(regions, state.sp);
+        threads.Resume(thread);
+        
+        if(!valid)
+            continue;
+        
+        reader.base.assign(1, state.sp);
+        reader.data.resize(1);
+        reader.data[0].assign(_window.begin(), _window.begin() + window);
+        
+        frames.clear();
+        if(_config.per_thread)
+        {
+            thread_identifier_info_data_t identifier;
+            mach_msg_type_number_t info_count = THREAD_IDENTIFIER_INFO_COUNT;
+            if(thread_info(thread.port, THREAD_IDENTIFIER_INFO, (thread_info_t)&identifier, &info_count) == KERN_SUCCESS)
+                thread.thread_id = identifier.thread_id;
+            frames.push_back(thread.thread_id);
+        }
+        Walk(state, reader, frames);
+        sampled++;
+        
+        std::lock_guard<std::mutex> lock(_lock);
+        _stacks[frames]++;
+        if(_config.per_thread && _thread_names.find(thread.thread_id) == _thread_names.end())
+        {
+            thread_extended_info_data_t extended;
+            mach_msg_type_number_t info_count = THREAD_EXTENDED_INFO_COUNT;
+            char name[96];
+            if(thread_info(thread.port, THREAD_EXTENDED_INFO, (thread_info_t)&extended, &info_count) == KERN_SUCCESS && extended.pth_name[0])
+                snprintf(name, sizeof(name), "%s", extended.pth_name);
+            else
+                snprintf(name, sizeof(name), "thread-%llu", (unsigned long long)thread.thread_id);
+            _thread_names[thread.thread_id] = name;
+        }
+    }
+    
+    for (mach_msg_type_number_t i = 0; i < count; i++)
+        mach_port_deallocate(mach_task_self(), list[i]);
+    vm_deallocate(mach_task_self(), (vm_address_t)list, count * sizeof(thread_act_t));
+    mach_port_deallocate(mach_task_self(), self);
+    
+    // The whole pass, enumeration included, spread over the threads it sampled
+    if(sampled)
+    {
+        _cost.fetch_add(mach_absolute_time() - start, std::memory_order_relaxed);
+        _samples.fetch_add(sampled, std::memory_order_relaxed);
+    }
+    return KERN_SUCCESS;
+}
+
+kern_return_t Profiler::Start()
+{
+    std::lock_guard<std::mutex> lock(_run_lock);
+    if(_running || _thread.joinable())
+        return KERN_FAILURE;
+    if(_process.memory().source())
+        return KERN_NOT_SUPPORTED;
+    
+    _running = true;
+    _thread = std::thread([this]() {
+        std::unique_lock<std::mutex> lock(_run_lock);
+        while(_running)
+        {
+            lock.unlock();
+            Sample();
+            lock.lock();
+            _wake.wait_for(lock, std::chrono::microseconds(_config.interval_us), [this]() { return !_running; });
+        }
+    });
+    
+    return KERN_SUCCESS;
+}
+
+void Profiler::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(_run_lock);
+        _running = false;
+    }
+    _wake.notify_all();
+    
+    if(_thread.joinable())
+        _thread.join();
+}
+
+void Profiler::Reset()
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    _stacks.clear();
+    _thread_names.clear();
+    _samples = 0;
+    _cost = 0;
+}
+
+uint64_t Profiler::average_cost() const
+{
+    uint64_t count = samples();
+    if(count == 0)
+        return 0;
+    
+    mach_timebase_info_data_t timebase;
+    mach_timebase_info(&timebase);
+    return _cost.load(std::memory_order_relaxed) * timebase.numer / timebase.denom / count;
+}
+
+void Profiler::LoadModules()
+{
+    _modules = _process.modules().modules();
+    _process.modules().GetModuleRanges(_ranges);
+    _symbols.assign(_modules.size(), std::vector<ModuleSymbol_t>());
+    _loaded.assign(_modules.size(), false);
+}
+
+std::string Profiler::Symbolize( uint64_t address, bool return_address )
+{
+    char text[64];
+    
+    // A return address points past the call, look up the call itself
+    uint64_t lookup = return_address ? address - 1 : address;
+    const ModuleRange_t* module = ProcessModules::FindModuleRange(_ranges, lookup);
+    if(module == nullptr)
+    {
+        snprintf(text, sizeof(text), "0x%llx", (unsigned long long)address);
+        return text;
+    }
+    
+    std::vector<ModuleSymbol_t>& symbols = _symbols[module->index];
+    if(!_loaded[module->index])
+    {
+        _loaded[module->index] = true;
+        _process.modules().GetModuleSymbols(&_modules[module->index], symbols);
+    }
+    
+    std::vector<ModuleSymbol_t>::const_iterator symbol = std::upper_bound(symbols.begin(), symbols.end(), lookup, SymbolLess);
+    if(symbol != symbols.begin())
+    {
+        // C symbols carry a leading underscore, C++ ones demangle after it
+        const std::string& name = (--symbol)->name;
+        const char * plain = name.c_str() + (name[0] == '_' ? 1 : 0);
+        
+        int status = 0;
+        char *demangled = abi::__cxa_demangle(plain, NULL, NULL, &status);
+        std::string result = status == 0 && demangled ? demangled : plain;
+        free(demangled);
+        return result;
+    }
+    
+    const ModuleData_t& data = _modules[module->index];
+    const char * path = data.imageFilePath ? data.imageFilePath : "";
+    const char * file = strrchr(path, '/');
+    snprintf(text, sizeof(text), "+0x%llx", (unsigned long long)(lookup - (uint64_t)data.imageLoadAddress));
+    return std::string(file ? file + 1 : path) + text;
+}
+
+kern_return_t Profiler::WriteFolded( FILE * out )
+{
+    LoadModules();
+    
+    std::lock_guard<std::mutex> lock(_lock);
+    std::unordered_map<uint64_t, std::string> names;
+    
+    for (StackMap::const_iterator it = _stacks.begin(); it != _stacks.end(); ++it)
+    {
+        const std::vector<uint64_t>& stack = it->first;
+        size_t first = 0;
+        std::string line;
+        
+        if(_config.per_thread && !stack.empty())
+        {
+            line = _thread_names[stack[0]];
+            first = 1;
+        }
+        
+        // Leaf first in memory, root first on the line
+        for (size_t i = stack.size(); i-- > first; )
+        {
+            bool return_address = i > first;
+            uint64_t key = stack[i] ^ (return_address ? 0 : 1ULL << 63);
+            std::unordered_map<uint64_t, std::string>::iterator name = names.find(key);
+            if(name == names.end())
+                name = names.insert(std::make_pair(key, Symbolize(stack[i], return_address))).first;
+            
+            if(!line.empty())
+                line += ';';
+            line += name->second;
+        }
+        
+        if(fprintf(out, "%s %llu\n", line.c_str(), (unsigned long long)it->second) < 0)
+            return KERN_FAILURE;
+    }
+    
+    return KERN_SUCCESS;
+}
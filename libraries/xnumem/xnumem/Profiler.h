@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+#ifndef __xnumem__Profiler__
+#define __xnumem__Profiler__
+
+#include <mach/mach.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "ProcessModules.h"
+#include "ProcessThreads.h"
+#include "RegionIndex.h"
+
+typedef struct ProfilerConfig {
+    uint32_t interval_us;       // between sampling passes over all threads
+    uint32_t max_depth;         // frames kept per stack
+    uint32_t stack_window;      // bytes of stack read while the thread is stopped, and per later batch
+    bool     per_thread;        // root every stack at its thread name
+} ProfilerConfig_t;
+
+/**
+ Sampling stack profiler for an attached process.
+ 
+ Each sample stops one thread just long enough to take its registers and one read of
+ the top of its stack, then walks frame pointers from that copy. Frames past the first
+ window are read in page batches after the thread runs again; they belong to callers
+ that are still on the stack, so they rarely change under the walk. Stacks are counted
+ by raw address and only symbolized when written out, in folded format:
+ 
+    Profiler profiler(process);
+    profiler.Start();
+    sleep(10);
+    profiler.Stop();
+    profiler.WriteFolded(stdout);       // | flamegraph.pl > profile.svg
+ 
+ Code built without frame pointers produces truncated stacks.
+ */
+class Profiler
+{
+public:
+    Profiler( class xnu_proc& process, const ProfilerConfig_t& config = DefaultConfig() );
+    ~Profiler();
+    
+    /**
+     Default configuration: 100 samples a second, 128 frames, 16KB stack window, no per-thread roots.
+     
+     @param void
+     @return Configuration.
+     */
+    static ProfilerConfig_t DefaultConfig();
+    
+    /**
+     Take one sample of every thread. The calling thread is skipped. Threads are enumerated
+     into ports the profiler owns for the pass; xnu_proc::threads() is not touched.
+     
+     @param void
+     @return Status.
+     */
+    kern_return_t Sample();
+    
+    /**
+     Sample on a background thread every interval until Stop.
+     
+     @param void
+     @return Status.
+     */
+    kern_return_t Start();
+    
+    /**
+     Stop background sampling.
+     
+     @param void
+     @return void
+     */
+    void Stop();
+    
+    /**
+     Write the collected stacks in folded format, root first, one "frame;frame;... count" line each.
+     Frames are "symbol", "module+0xoffset" or "0xaddress".
+     
+     @param out -- Output stream.
+     @return Status.
+     */
+    kern_return_t WriteFolded( FILE * out );
+    
+    /**
+     Drop the collected stacks and statistics.
+     
+     @param void
+     @return void
+     */
+    void Reset();
+    
+    // Thread samples taken, and their average cost (share of the thread enumeration, stop, registers, stack copy, walk) in nanoseconds.
+    inline uint64_t samples() const { return _samples.load(std::memory_order_relaxed); }
+    uint64_t average_cost() const;
+    
+private:
+    Profiler( const Profiler& ) = delete;
+    Profiler& operator =(const Profiler&) = delete;
+    
+    struct StackHasher {
+        size_t operator ()( const std::vector<uint64_t>& stack ) const;
+    };
+    typedef std::unordered_map<std::vector<uint64_t>, uint64_t, StackHasher> StackMap;
+    
+    // Stack memory copied from the target, in window sized batches
+    struct StackReader {
+        std::vector<mach_vm_address_t> base;
+        std::vector<std::vector<uint8_t> > data;
+    };
+    
+    bool Load( StackReader& reader, mach_vm_address_t address, uint64_t& value );
+    mach_vm_address_t WindowEnd( const RegionIndex& regions, mach_vm_address_t address ) const;
+    size_t ReadWindow( uint8_t * buffer, mach_vm_address_t address );
+    size_t ReadStopped( const RegionIndex& regions, mach_vm_address_t address );
+    void Walk( const ThreadState_t& state, StackReader& reader, std::vector<uint64_t>& frames );
+    
+    // Symbolization, on the writing thread only
+    void LoadModules();
+    std::string Symbolize( uint64_t address, bool return_address );
+    
+    class xnu_proc&                     _process;
+    ProfilerConfig_t                    _config;
+    
+    std::mutex                          _sample_lock;   // one Sample at a time, _window
+    std::mutex                          _lock;          // _stacks, _thread_names
+    StackMap                            _stacks;        // [thread id,] leaf first frames -> count
+    std::map<uint64_t, std::string>     _thread_names;
+    std::vector<uint8_t>                _window;        // first stack window, allocated before threads are stopped
+    
+    std::vector<ModuleData_t>           _modules;
+    std::vector<ModuleRange_t>          _ranges;        // module segments, by address
+    std::vector<std::vector<ModuleSymbol_t> > _symbols; // per module
+    std::vector<bool>                   _loaded;        // per module, symbols read
+    
+    std::atomic<uint64_t>               _samples;
+    std::atomic<uint64_t>               _cost;          // mach_absolute_time units
+    
+    std::thread                         _thread;
+    std::mutex                          _run_lock;
+    std::condition_variable             _wake;
+    bool                                _running;
+};
+
+#endif /* defined(__xnumem__Profiler__) */
@@ -0,0 +1,414 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+#include "RegionIndex.h"
+#include "xnumem.h"
+
+#include <algorithm>
+
+static bool RangeStartLess( const AddressRange_t& a, const AddressRange_t& b )
+{
+    return a.start < b.start;
+}
+
+static bool RegionAddressLess( const MemoryRegion_t& region, mach_vm_address_t address )
+{
+    return region.address + region.size <= address;
+}
+
+// Insert [start, end) into a sorted, non-overlapping list
+static void AddRange( std::vector<AddressRange_t>& ranges, mach_vm_address_t start, mach_vm_address_t end )
+{
+    if(start >= end)
+        return;
+    
+    AddressRange_t range = { start, end };
+    std::vector<AddressRange_t>::iterator it = std::upper_bound(ranges.begin(), ranges.end(), range, RangeStartLess);
+    it = ranges.insert(it, range);
+    
+    // Merge with the neighbours so the list stays non-overlapping
+    if(it != ranges.begin() && (it - 1)->end >= it->start)
+    {
+        (it - 1)->end = std::max((it - 1)->end, it->end);
+        it = ranges.erase(it) - 1;
+    }
+    while(it + 1 != ranges.end() && (it + 1)->start <= it->end)
+    {
+        it->end = std::max(it->end, (it + 1)->end);
+        ranges.erase(it + 1);
+    }
+}
+
+static uint32_t SectionKind( const ModuleSection_t& section )
+{
+    uint32_t type = section.flags & SECTION_TYPE;
+    if(section.flags & (S_ATTR_PURE_INSTRUCTIONS | S_ATTR_SOME_INSTRUCTIONS))
+        return kScopeCode;
+    if(type == S_ZEROFILL || type == S_GB_ZEROFILL || type == S_THREAD_LOCAL_ZEROFILL)
+        return kScopeBss;
+    
+    // __DATA_CONST and __AUTH_CONST are only writable while dyld binds them
+    size_t length = strlen(section.segment);
+    if(!(section.protection & VM_PROT_WRITE) || (length > 6 && strcmp(section.segment + length - 6, "_CONST") == 0))
+        return kScopeConst;
+    
+    return kScopeData;
+}
+
+RegionFilter::RegionFilter() :
+    _prot_set(VM_PROT_NONE),
+    _prot_clear(VM_PROT_NONE),
+    _shared(-1),
+    _min_size(0),
+    _max_size(~(mach_vm_size_t)0),
+    _none(false),
+    _scoped(false)
+{
+}
+
+RegionFilter& RegionFilter::Protection( vm_prot_t required )
+{
+    _prot_set |= required;
+    if(_prot_set & _prot_clear)
+        _none = true;
+    return *this;
+}
+
+RegionFilter& RegionFilter::NoProtection( vm_prot_t denied )
+{
+    _prot_clear |= denied;
+    if(_prot_set & _prot_clear)
+        _none = true;
+    return *this;
+}
+
+RegionFilter& RegionFilter::Shared()
+{
+    if(_shared == 0)
+        _none = true;
+    _shared = 1;
+    return *this;
+}
+
+RegionFilter& RegionFilter::Private()
+{
+    if(_shared == 1)
+        _none = true;
+    _shared = 0;
+    return *this;
+}
+
+RegionFilter& RegionFilter::MinSize( mach_vm_size_t size )
+{
+    _min_size = std::max(_min_size, size);
+    return *this;
+}
+
+RegionFilter& RegionFilter::MaxSize( mach_vm_size_t size )
+{
+    _max_size = std::min(_max_size, size);
+    return *this;
+}
+
+RegionFilter& RegionFilter::Within( mach_vm_address_t start, mach_vm_address_t end )
+{
+    _scoped = true;
+    AddRange(_ranges, start, end);
+    return *this;
+}
+
+RegionFilter& RegionFilter::Module( ProcessModules& modules, const char * name )
+{
+    std::vector<AddressRange_t> segments;
+    const ModuleData_t* module = modules.GetModule(name);
+    
+    if(module == nullptr || modules.GetModuleSegments(module, segments) != KERN_SUCCESS || segments.empty())
+    {
+        _scoped = true;
+        _none = true;
+        return *this;
+    }
+    
+    for (std::vector<AddressRange_t>::iterator it = segments.begin(); it != segments.end(); ++it)
+        Within(it->start, it->end);
+    
+    return *this;
+}
+
+ScanScope::ScanScope()
+{
+}
+
+ScanScope& ScanScope::Module( ProcessModules& modules, const char * name, uint32_t kinds /* = kScopeAll */ )
+{
+    std::vector<ModuleSection_t> sections;
+    const ModuleData_t* module = name ? modules.GetModule(name) : modules.GetMainModule();
+    if(module == nullptr || modules.GetModuleSections(module, sections) != KERN_SUCCESS)
+        return *this;
+    
+    for (std::vector<ModuleSection_t>::const_iterator it = sections.begin(); it != sections.end(); ++it)
+    {
+        if(SectionKind(*it) & kinds)
+            AddRange(_ranges, it->range.start, it->range.end);
+    }
+    
+    return *this;
+}
+
+ScanScope& ScanScope::Section( ProcessModules& modules, const char * name, const char * segment, const char * section )
+{
+    std::vector<ModuleSection_t> sections;
+    const ModuleData_t* module = name ? modules.GetModule(name) : modules.GetMainModule();
+    if(module == nullptr || modules.GetModuleSections(module, sections) != KERN_SUCCESS)
+        return *this;
+    
+    for (std::vector<ModuleSection_t>::const_iterator it = sections.begin(); it != sections.end(); ++it)
+    {
+        if(strcmp(it->segment, segment) == 0 && strcmp(it->section, section) == 0)
+            AddRange(_ranges, it->range.start, it->range.end);
+    }
+    
+    return *this;
+}
+
+ScanScope& ScanScope::Within( mach_vm_address_t start, mach_vm_address_t end )
+{
+    AddRange(_ranges, start, end);
+    return *this;
+}
+
+void ScanScope::Clip( const std::vector<MemoryRegion_t>& regions, std::vector<MemoryRegion_t>& clipped ) const
+{
+    clipped.clear();
+    
+    // Whole pages, which may merge ranges that shared one
+    const mach_vm_address_t page = getpagesize();
+    std::vector<AddressRange_t> pages;
+    for (std::vector<AddressRange_t>::const_iterator it = _ranges.begin(); it != _ranges.end(); ++it)
+    {
+        mach_vm_address_t end = (it->end + page - 1) & ~(page - 1);
+        AddRange(pages, it->start & ~(page - 1), end < it->end ? it->end : end);
+    }
+    
+    std::vector<AddressRange_t>::const_iterator range = pages.begin();
+    for (std::vector<MemoryRegion_t>::const_iterator it = regions.begin(); it != regions.end() && range != pages.end(); ++it)
+    {
+        mach_vm_address_t end = it->address + it->size;
+        while(range != pages.end() && range->end <= it->address)
+            ++range;
+        
+        // A range may cover several regions, so it is only passed once it ends inside one
+        for (std::vector<AddressRange_t>::const_iterator cut = range; cut != pages.end() && cut->start < end; ++cut)
+        {
+            MemoryRegion_t piece = *it;
+            piece.address      = std::max(it->address, cut->start);
+            piece.size         = std::min(end, cut->end) - piece.address;
+            piece.info.offset += piece.address - it->address;
+            clipped.push_back(piece);
+        }
+    }
+}
+
+mach_vm_size_t ScanScope::bytes() const
+{
+    mach_vm_size_t total = 0;
+    for (std::vector<AddressRange_t>::const_iterator it = _ranges.begin(); it != _ranges.end(); ++it)
+        total += it->end - it->start;
+    return total;
+}
+
+bool RegionFilter::Match( const MemoryRegion_t& region ) const
+{
+    if(_none)
+        return false;
+    
+    vm_prot_t prot = region.info.protection;
+    if((prot & _prot_set) != _prot_set || (prot & _prot_clear) != 0)
+        return false;
+    
+    if(_shared >= 0 && (region.info.shared != 0) != (_shared != 0))
+        return false;
+    
+    if(region.size < _min_size || region.size > _max_size)
+        return false;
+    
+    if(_scoped)
+    {
+        // First range ending past the region start must begin before the region end
+        AddressRange_t key = { region.address + region.size, 0 };
+        std::vector<AddressRange_t>::const_iterator it = std::lower_bound(_ranges.begin(), _ranges.end(), key, RangeStartLess);
+        if(it == _ranges.begin() || (it - 1)->end <= region.address)
+            return false;
+    }
+    
+    return true;
+}
+
+RegionView::iterator::iterator( const MemoryRegion_t* it, const MemoryRegion_t* end, const RegionFilter* filter ) :
+    _it(it),
+    _end(end),
+    _filter(filter)
+{
+    skip();
+}
+
+RegionView::iterator& RegionView::iterator::operator ++()
+{
+    ++_it;
+    skip();
+    return *this;
+}
+
+void RegionView::iterator::skip()
+{
+    while(_it != _end && !_filter->Match(*_it))
+        ++_it;
+}
+
+RegionView::RegionView( const MemoryRegion_t* first, const MemoryRegion_t* last, const RegionFilter& filter ) :
+    _first(first),
+    _last(last),
+    _filter(filter)
+{
+}
+
+size_t RegionView::count() const
+{
+    size_t n = 0;
+    for (iterator it = begin(); it != end(); ++it)
+        n++;
+    return n;
+}
+
+mach_vm_size_t RegionView::bytes() const
+{
+    mach_vm_size_t total = 0;
+    for (iterator it = begin(); it != end(); ++it)
+        total += it->size;
+    return total;
+}
+
+RegionIndex::RegionIndex()
+{
+    std::fill(_class_offsets, _class_offsets + kClassCount + 1, 0);
+}
+
+unsigned RegionIndex::ClassOf( const MemoryRegion_t& region )
+{
+    // Most significant bit first: unreadable, shared, unwritable, unexecutable.
+    vm_prot_t prot = region.info.protection;
+    return  ((prot & VM_PROT_READ)    ? 0 : 8) |
+            (region.info.shared       ? 4 : 0) |
+            ((prot & VM_PROT_WRITE)   ? 0 : 2) |
+            ((prot & VM_PROT_EXECUTE) ? 0 : 1);
+}
+
+void RegionIndex::Build( std::vector<MemoryRegion_t>& regions )
+{
+    _by_address.swap(regions);
+    regions.clear();
+    
+    // Counting sort into protection classes, stable so each class stays in address order
+    size_t counts[kClassCount] = { 0 };
+    for (std::vector<MemoryRegion_t>::const_iterator it = _by_address.begin(); it != _by_address.end(); ++it)
+        counts[ClassOf(*it)]++;
+    
+    _class_offsets[0] = 0;
+    for (unsigned c = 0; c < kClassCount; c++)
+        _class_offsets[c + 1] = _class_offsets[c] + counts[c];
+    
+    size_t fill[kClassCount];
+    std::copy(_class_offsets, _class_offsets + kClassCount, fill);
+    
+    _by_class.resize(_by_address.size());
+    for (std::vector<MemoryRegion_t>::const_iterator it = _by_address.begin(); it != _by_address.end(); ++it)
+        _by_class[fill[ClassOf(*it)]++] = *it;
+}
+
+void RegionIndex::PartitionSpan( vm_prot_t required, int shared, const MemoryRegion_t** first, const MemoryRegion_t** last ) const
+{
+    // Lowest and highest class that can hold a matching region
+    unsigned lo = kClassCount, hi = 0;
+    for (unsigned c = 0; c < kClassCount; c++)
+    {
+        vm_prot_t prot = ((c & 8) ? 0 : VM_PROT_READ) | ((c & 2) ? 0 : VM_PROT_WRITE) | ((c & 1) ? 0 : VM_PROT_EXECUTE);
+        if((prot & required) != required)
+            continue;
+        if(shared >= 0 && ((c & 4) != 0) != (shared != 0))
+            continue;
+        lo = std::min(lo, c);
+        hi = std::max(hi, c);
+    }
+    
+    const MemoryRegion_t* base = _by_class.data();
+    if(lo > hi)
+    {
+        *first = *last = base;
+        return;
+    }
+    
+    *first = base + _class_offsets[lo];
+    *last  = base + _class_offsets[hi + 1];
+}
+
+RegionView RegionIndex::all() const
+{
+    const MemoryRegion_t* base = _by_address.data();
+    return RegionView(base, base + _by_address.size(), RegionFilter());
+}
+
+RegionView RegionIndex::where( const RegionFilter& filter ) const
+{
+    if(filter._prot_set == VM_PROT_NONE && filter._shared < 0)
+    {
+        const MemoryRegion_t* base = _by_address.data();
+        return RegionView(base, base + _by_address.size(), filter);
+    }
+    
+    // The filter still runs over the span, it only drops the classes in between
+    const MemoryRegion_t *first, *last;
+    PartitionSpan(filter._prot_set, filter._shared, &first, &last);
+    return RegionView(first, last, filter);
+}
+
+RegionView RegionIndex::partition( vm_prot_t required, int shared /* = -1 */ ) const
+{
+    RegionFilter filter;
+    filter.Protection(required);
+    if(shared == 0)
+        filter.Private();
+    else if(shared > 0)
+        filter.Shared();
+    
+    return where(filter);
+}
+
+const MemoryRegion_t* RegionIndex::Find( mach_vm_address_t address ) const
+{
+    return Find(_by_address, address);
+}
+
+const MemoryRegion_t* RegionIndex::Find( const std::vector<MemoryRegion_t>& regions, mach_vm_address_t address )
+{
+    std::vector<MemoryRegion_t>::const_iterator it = std::lower_bound(regions.begin(), regions.end(), address, RegionAddressLess);
+    if(it == regions.end() || it->address > address)
+        return nullptr;
+    return &(*it);
+}
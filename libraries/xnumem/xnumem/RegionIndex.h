@@ -0,0 +1,317 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+#ifndef __xnumem__RegionIndex__
+#define __xnumem__RegionIndex__
+
+#include <mach/mach.h>
+#include <vector>
+
+typedef struct MemoryRegion {
+	mach_vm_address_t address;
+	mach_vm_size_t size;
+	vm_region_basic_info_data_64_t info;
+} MemoryRegion_t;
+
+typedef struct AddressRange {
+    mach_vm_address_t start;    // first byte
+    mach_vm_address_t end;      // one past the last byte
+} AddressRange_t;
+
+/**
+ Precompiled region predicate.
+ 
+ Every constraint is folded into a couple of masks and bounds when the filter is
+ built, so matching a region is a handful of compares. Constraints are cumulative:
+ 
+    RegionFilter().Protection(VM_PROT_READ).Private().Module(modules, "libfoo.dylib").MinSize(64 * 1024)
+ */
+class RegionFilter
+{
+    friend class RegionIndex;
+public:
+    RegionFilter();
+    
+    /**
+     Require protection bits.
+     
+     @param required -- Bits that must all be set.
+     @return The filter.
+     */
+    RegionFilter& Protection( vm_prot_t required );
+    
+    /**
+     Reject protection bits.
+     
+     @param denied -- Bits that must all be clear.
+     @return The filter.
+     */
+    RegionFilter& NoProtection( vm_prot_t denied );
+    
+    // Only shared / only private regions.
+    RegionFilter& Shared();
+    RegionFilter& Private();
+    
+    // Region size bounds (inclusive).
+    RegionFilter& MinSize( mach_vm_size_t size );
+    RegionFilter& MaxSize( mach_vm_size_t size );
+    
+    /**
+     Only regions overlapping [start, end). May be called several times, a region
+     then has to overlap any of the ranges.
+     
+     @param start -- First address.
+     @param end   -- One past the last address.
+     @return The filter.
+     */
+    RegionFilter& Within( mach_vm_address_t start, mach_vm_address_t end );
+    
+    /**
+     Only regions holding a segment of a loaded module.
+     If the module is not loaded the filter matches nothing.
+     
+     @param modules -- Module list of the process.
+     @param name    -- Module name.
+     @return The filter.
+     */
+    RegionFilter& Module( class ProcessModules& modules, const char * name );
+    
+    /**
+     Test a region against the filter.
+     
+     @param region -- Region to test.
+     @return true if all constraints hold.
+     */
+    bool Match( const MemoryRegion_t& region ) const;
+    
+private:
+    vm_prot_t       _prot_set;      // must be set
+    vm_prot_t       _prot_clear;    // must be clear
+    int             _shared;        // -1 any, 0 private, 1 shared
+    mach_vm_size_t  _min_size;
+    mach_vm_size_t  _max_size;
+    bool            _none;          // unsatisfiable (e.g. module not found)
+    bool            _scoped;        // _ranges is in effect, even if empty
+    std::vector<AddressRange_t> _ranges;   // sorted, non-overlapping
+};
+
+enum {
+    kScopeCode     = 1 << 0,    // sections holding instructions
+    kScopeConst    = 1 << 1,    // read-only data: __TEXT,__cstring, __DATA_CONST ...
+    kScopeData     = 1 << 2,    // writable initialized data: __DATA,__data ...
+    kScopeBss      = 1 << 3,    // writable zero fill: __bss, __common
+    kScopeWritable = kScopeData | kScopeBss,
+    kScopeAll      = kScopeCode | kScopeConst | kScopeData | kScopeBss
+};
+
+/**
+ Byte ranges a scan, dump or diff is restricted to, built from module sections.
+ 
+ Where RegionFilter picks whole regions, a scope cuts below them: the writable data of
+ one image is a few pages next to megabytes of heap, and section boundaries are not
+ region boundaries. Ranges accumulate and are kept sorted and merged:
+ 
+    ScanScope scope;
+    scope.Module(process.modules(), "libfoo.dylib", kScopeWritable);
+    Scheduler::Shared().ForEachChunk(scope.ranges(), fn);
+    Snapshot::Capture(process, "libfoo.snap", nullptr, &scope);
+ */
+class ScanScope
+{
+public:
+    ScanScope();
+    
+    /**
+     Add the sections of a module. Nothing is added if the module is not loaded.
+     
+     @param modules -- Module list of the process.
+     @param name    -- Module name, nullptr for the main module.
+     @param kinds   -- kScope* section kinds to add.
+     @return The scope.
+     */
+    ScanScope& Module( class ProcessModules& modules, const char * name, uint32_t kinds = kScopeAll );
+    
+    /**
+     Add one section of a module.
+     
+     @param modules -- Module list of the process.
+     @param name    -- Module name, nullptr for the main module.
+     @param segment -- Segment name, e.g. "__DATA".
+     @param section -- Section name, e.g. "__data".
+     @return The scope.
+     */
+    ScanScope& Section( class ProcessModules& modules, const char * name, const char * segment, const char * section );
+    
+    /**
+     Add [start, end).
+     
+     @param start -- First address.
+     @param end   -- One past the last address.
+     @return The scope.
+     */
+    ScanScope& Within( mach_vm_address_t start, mach_vm_address_t end );
+    
+    /**
+     Cut a region list down to the scope, widened to whole pages. Pieces keep the
+     attributes of their region, with the object offset moved along.
+     
+     @param regions -- Regions in address order.
+     @param clipped -- Output pieces, in address order.
+     @return void
+     */
+    void Clip( const std::vector<MemoryRegion_t>& regions, std::vector<MemoryRegion_t>& clipped ) const;
+    
+    // Sorted, non-overlapping ranges, and their total size.
+    inline const std::vector<AddressRange_t>& ranges() const { return _ranges; }
+    mach_vm_size_t bytes() const;
+    
+    inline bool empty() const { return _ranges.empty(); }
+    
+private:
+    std::vector<AddressRange_t> _ranges;
+};
+
+/**
+ Lazy, non-owning view over a slice of the region table.
+ Regions are filtered while iterating; the view stays valid until the
+ owning index is rebuilt.
+ */
+class RegionView
+{
+public:
+    class iterator
+    {
+    public:
+        iterator( const MemoryRegion_t* it, const MemoryRegion_t* end, const RegionFilter* filter );
+        
+        inline const MemoryRegion_t& operator *() const { return *_it; }
+        inline const MemoryRegion_t* operator ->() const { return _it; }
+        inline bool operator ==( const iterator& other ) const { return _it == other._it; }
+        inline bool operator !=( const iterator& other ) const { return _it != other._it; }
+        iterator& operator ++();
+        
+    private:
+        void skip();
+        
+        const MemoryRegion_t* _it;
+        const MemoryRegion_t* _end;
+        const RegionFilter*   _filter;
+    };
+    
+    RegionView( const MemoryRegion_t* first, const MemoryRegion_t* last, const RegionFilter& filter );
+    
+    inline iterator begin() const { return iterator(_first, _last, &_filter); }
+    inline iterator end()   const { return iterator(_last, _last, &_filter); }
+    
+    // Number of matching regions.
+    size_t count() const;
+    
+    // Sum of matching region sizes.
+    mach_vm_size_t bytes() const;
+    
+    inline bool empty() const { return begin() == end(); }
+    
+private:
+    const MemoryRegion_t* _first;
+    const MemoryRegion_t* _last;
+    RegionFilter          _filter;
+};
+
+/**
+ Indexed region table.
+ 
+ Holds the regions in address order plus a copy partitioned by protection class.
+ Classes are ordered readable > private > writable > executable, so the common
+ scan sets ("readable", "readable private", "readable private writable") are each
+ one contiguous span of the partitioned table; within a class regions stay in
+ address order.
+ */
+class RegionIndex
+{
+    friend class ProcessMemory;
+public:
+    RegionIndex();
+    
+    /**
+     All regions, in address order.
+     
+     @param void
+     @return View over the whole table.
+     */
+    RegionView all() const;
+    
+    /**
+     Regions matching a filter. Protection and shared constraints narrow the walk to
+     the matching protection partitions, so those regions come grouped by class.
+     
+     @param filter -- Compiled filter.
+     @return View over the matching regions.
+     */
+    RegionView where( const RegionFilter& filter ) const;
+    
+    /**
+     Contiguous span of regions in a protection class.
+     
+     @param required -- Protection bits that must be set (VM_PROT_READ, VM_PROT_READ | VM_PROT_WRITE ...).
+     @param shared   -- 1 shared only, 0 private only, -1 both.
+     @return View over the span.
+     */
+    RegionView partition( vm_prot_t required, int shared = -1 ) const;
+    
+    /**
+     Region containing an address.
+     
+     @param address -- Memory address.
+     @return Region, nullptr if the address is not mapped.
+     */
+    const MemoryRegion_t* Find( mach_vm_address_t address ) const;
+    
+    /**
+     Region containing an address, in any address ordered region list.
+     
+     @param regions -- Regions in address order.
+     @param address -- Memory address.
+     @return Region, nullptr if the address is not in the list.
+     */
+    static const MemoryRegion_t* Find( const std::vector<MemoryRegion_t>& regions, mach_vm_address_t address );
+    
+    inline size_t size() const { return _by_address.size(); }
+    inline const std::vector<MemoryRegion_t>& table() const { return _by_address; }
+    
+private:
+    RegionIndex( const RegionIndex& ) = delete;
+    RegionIndex& operator =(const RegionIndex&) = delete;
+    
+    // (Re)build from an address ordered region list, taking its contents.
+    void Build( std::vector<MemoryRegion_t>& regions );
+    
+    // Span of the partitioned table covering every class that can satisfy the constraints.
+    void PartitionSpan( vm_prot_t required, int shared, const MemoryRegion_t** first, const MemoryRegion_t** last ) const;
+    
+    static unsigned ClassOf( const MemoryRegion_t& region );
+    
+    enum { kClassCount = 16 };
+    
+    std::vector<MemoryRegion_t> _by_address;
+    std::vector<MemoryRegion_t> _by_class;
+    size_t                      _class_offsets[kClassCount + 1];
+};
+
+#endif /* defined(__xnumem__RegionIndex__) */
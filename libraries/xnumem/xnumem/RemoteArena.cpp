@@ -0,0 +1,253 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+#include "RemoteArena.h"
+#include "xnumem.h"
+
+#include <algorithm>
+#include <iterator>
+
+// Smallest class whose slots hold size bytes
+static size_t SizeClass( size_t size )
+{
+    size_t size_class = 0;
+    while((kArenaMinClass << size_class) < size)
+        size_class++;
+    return size_class;
+}
+
+static inline mach_vm_address_t AlignUp( mach_vm_address_t address, size_t alignment )
+{
+    return (address + alignment - 1) & ~(mach_vm_address_t)(alignment - 1);
+}
+
+RemoteArena::RemoteArena( xnu_proc& process, size_t block_size /* = kArenaBlockSize */, vm_prot_t protection /* = VM_PROT_READ | VM_PROT_WRITE */ ) :
+    _process(process),
+    _task(process.core()._pmach_port),
+    _pid(process.pid()),
+    _protection(protection),
+    _page(getpagesize()),
+    _cursor(0),
+    _limit(0),
+    _reserved(0),
+    _used(0)
+{
+    // Whole pages, and room for at least one slab
+    _block_size = std::max<size_t>(kArenaSlabSize, AlignUp(block_size, _page));
+}
+
+RemoteArena::~RemoteArena()
+{
+    Release();
+}
+
+bool RemoteArena::Attached() const
+{
+    // A re-attach may hand out the same port name for another task, the pid tells them apart
+    return _task != 0 && _process.core()._pmach_port == _task && _process.pid() == _pid;
+}
+
+mach_vm_address_t RemoteArena::Allocate( size_t size, size_t alignment /* = kArenaMinClass */ )
+{
+    if(size == 0 || alignment == 0 || (alignment & (alignment - 1)) || alignment > _page || !Attached())
+        return 0;
+    
+    // Slots are aligned to their size, so alignment only picks the class
+    size_t wanted = std::max(size, alignment);
+    if(wanted > (kArenaMinClass << (kArenaClasses - 1)))
+        return AllocateLarge(size, alignment);
+    
+    size_t size_class = SizeClass(wanted);
+    size_t slot = kArenaMinClass << size_class;
+    std::vector<mach_vm_address_t>& free_slots = _free_slots[size_class];
+    if(free_slots.empty())
+    {
+        mach_vm_address_t base = Carve(kArenaSlabSize, _page);
+        if(base == 0)
+            return 0;
+        
+        Slab_t& slab = _slabs[base];
+        slab.size_class = size_class;
+        slab.live.assign(kArenaSlabSize / slot, false);
+        
+        // Reversed, so slots go out in address order
+        for (size_t i = kArenaSlabSize / slot; i-- > 0; )
+            free_slots.push_back(base + i * slot);
+    }
+    
+    mach_vm_address_t address = free_slots.back();
+    free_slots.pop_back();
+    std::map<mach_vm_address_t, Slab_t>::iterator it = std::prev(_slabs.upper_bound(address));
+    it->second.live[(address - it->first) / slot] = true;
+    _used += slot;
+    return address;
+}
+
+mach_vm_address_t RemoteArena::AllocateLarge( size_t size, size_t alignment )
+{
+    size_t rounded = AlignUp(size, kArenaMinClass);
+    
+    // First fit among the ranges given back
+    for (std::map<mach_vm_address_t, size_t>::iterator it = _holes.begin(); it != _holes.end(); ++it)
+    {
+        mach_vm_address_t address = AlignUp(it->first, alignment);
+        mach_vm_address_t start = it->first;
+        mach_vm_address_t end = it->first + it->second;
+        if(address + rounded > end)
+            continue;
+        
+        _holes.erase(it);
+        if(address > start)
+            _holes[start] = address - start;
+        if(address + rounded < end)
+            _holes[address + rounded] = end - (address + rounded);
+        _large[address] = rounded;
+        _used += rounded;
+        return address;
+    }
+    
+    mach_vm_address_t address;
+    if(rounded > _block_size / 2)
+    {
+        // A block of its own; the newest block keeps taking the small requests
+        size_t block = AlignUp(rounded, _page);
+        address = _process.memory().Allocate(block, _protection);
+        if(address == 0)
+            return 0;
+        
+        Block_t entry = { address, block };
+        _blocks.push_back(entry);
+        _reserved += block;
+        if(block > rounded)
+            FreeRange(address + rounded, block - rounded);
+    }
+    else
+    {
+        address = Carve(rounded, alignment);
+        if(address == 0)
+            return 0;
+    }
+    
+    _large[address] = rounded;
+    _used += rounded;
+    return address;
+}
+
+mach_vm_address_t RemoteArena::Carve( size_t size, size_t alignment )
+{
+    mach_vm_address_t address = AlignUp(_cursor, alignment);
+    if(_cursor == 0 || address + size > _limit)
+    {
+        size_t block = std::max(_block_size, (size_t)AlignUp(size, _page));
+        mach_vm_address_t base = _process.memory().Allocate(block, _protection);
+        if(base == 0)
+            return 0;
+        
+        // The tail of the previous block is left to large allocations
+        if(_limit > _cursor)
+            FreeRange(_cursor, _limit - _cursor);
+        
+        Block_t entry = { base, block };
+        _blocks.push_back(entry);
+        _reserved += block;
+        _cursor = base;
+        _limit = base + block;
+        address = base;
+    }
+    
+    if(address > _cursor)
+        FreeRange(_cursor, address - _cursor);
+    _cursor = address + size;
+    return address;
+}
+
+void RemoteArena::FreeRange( mach_vm_address_t address, size_t size )
+{
+    // Merge with the neighbours, so holes grow back into large ranges
+    std::map<mach_vm_address_t, size_t>::iterator next = _holes.lower_bound(address);
+    if(next != _holes.begin())
+    {
+        std::map<mach_vm_address_t, size_t>::iterator previous = std::prev(next);
+        if(previous->first + previous->second == address)
+        {
+            address = previous->first;
+            size += previous->second;
+            _holes.erase(previous);
+        }
+    }
+    if(next != _holes.end() && address + size == next->first)
+    {
+        size += next->second;
+        _holes.erase(next);
+    }
+    _holes[address] = size;
+}
+
+kern_return_t RemoteArena::Free( mach_vm_address_t address )
+{
+    std::map<mach_vm_address_t, size_t>::iterator large = _large.find(address);
+    if(large != _large.end())
+    {
+        _used -= large->second;
+        FreeRange(address, large->second);
+        _large.erase(large);
+        return KERN_SUCCESS;
+    }
+    
+    std::map<mach_vm_address_t, Slab_t>::iterator it = _slabs.upper_bound(address);
+    if(it == _slabs.begin())
+        return KERN_INVALID_ADDRESS;
+    --it;
+    
+    size_t slot = kArenaMinClass << it->second.size_class;
+    mach_vm_size_t offset = address - it->first;
+    if(offset >= kArenaSlabSize || offset % slot != 0 || !it->second.live[offset / slot])
+        return KERN_INVALID_ADDRESS;
+    
+    it->second.live[offset / slot] = false;
+    _free_slots[it->second.size_class].push_back(address);
+    _used -= slot;
+    return KERN_SUCCESS;
+}
+
+kern_return_t RemoteArena::Release()
+{
+    // The blocks went with a task that is no longer attached, freeing them could hit another
+    bool attached = Attached();
+    kern_return_t kret = attached || _blocks.empty() ? KERN_SUCCESS : KERN_INVALID_TASK;
+    for (size_t i = 0; attached && i < _blocks.size(); i++)
+    {
+        kern_return_t freed = _process.memory().Free(_blocks[i].address, _blocks[i].size);
+        if(freed != KERN_SUCCESS && kret == KERN_SUCCESS)
+            kret = freed;
+    }
+    
+    _blocks.clear();
+    for (size_t i = 0; i < kArenaClasses; i++)
+        _free_slots[i].clear();
+    _slabs.clear();
+    _large.clear();
+    _holes.clear();
+    _cursor = 0;
+    _limit = 0;
+    _reserved = 0;
+    _used = 0;
+    return kret;
+}
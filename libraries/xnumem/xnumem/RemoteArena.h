@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+
+
+#ifndef __xnumem__RemoteArena__
+#define __xnumem__RemoteArena__
+
+#include <mach/mach.h>
+#include <stdint.h>
+#include <map>
+#include <vector>
+
+static const size_t kArenaBlockSize = 1024 * 1024;
+static const size_t kArenaSlabSize  = 16 * 1024;
+static const size_t kArenaMinClass  = 16;           // smallest slot, and default alignment
+static const size_t kArenaClasses   = 8;            // 16 .. 2048 byte slots
+
+/**
+ Sub-allocator for memory in another task.
+ 
+ Reserves large blocks with ProcessMemory::Allocate and hands out pieces of them with
+ local bookkeeping only, so staging thousands of small buffers costs a handful of
+ syscalls. Sizes up to 2KB come from slabs of equal slots, one slab size class per power
+ of two; larger ones are carved from the blocks first fit, with freed ranges merged
+ back. Requests larger than half a block get a block of their own.
+ 
+ Nothing is returned to the kernel before Release (or destruction), which frees whole
+ blocks. The arena belongs to the task attached at construction; once the process
+ object is detached or attached elsewhere it allocates nothing and frees nothing.
+ Not thread safe.
+ 
+    RemoteArena arena(process);
+    mach_vm_address_t name = arena.Allocate(strlen(text) + 1);
+    process.memory().Write(name, strlen(text) + 1, text);
+ */
+class RemoteArena
+{
+public:
+    RemoteArena( class xnu_proc& process, size_t block_size = kArenaBlockSize, vm_prot_t protection = VM_PROT_READ | VM_PROT_WRITE );
+    ~RemoteArena();
+    
+    /**
+     Allocate target memory.
+     
+     @param size      -- Size in bytes.
+     @param alignment -- Power of two alignment, up to the page size. (optional)
+     @return Address in the target, 0 if a block could not be reserved or the task changed.
+     */
+    mach_vm_address_t Allocate( size_t size, size_t alignment = kArenaMinClass );
+    
+    /**
+     Give an allocation back to the arena for reuse.
+     
+     @param address -- Address from Allocate.
+     @return KERN_INVALID_ADDRESS if it is not a live allocation of this arena.
+     */
+    kern_return_t Free( mach_vm_address_t address );
+    
+    /**
+     Free every block in the target. All allocations become invalid.
+     
+     @param void
+     @return Status of the first block that could not be freed, KERN_INVALID_TASK if the
+             blocks belong to a task that is no longer attached; they are forgotten either way.
+     */
+    kern_return_t Release();
+    
+    inline size_t blocks() const { return _blocks.size(); }
+    inline size_t reserved() const { return _reserved; }   // bytes held in the target
+    inline size_t used() const { return _used; }           // bytes handed out, rounded to slots
+    
+private:
+    RemoteArena( const RemoteArena& ) = delete;
+    RemoteArena& operator =(const RemoteArena&) = delete;
+    
+    typedef struct Block {
+        mach_vm_address_t address;
+        size_t            size;
+    } Block_t;
+    
+    typedef struct Slab {
+        size_t            size_class;
+        std::vector<bool> live;         // per slot
+    } Slab_t;
+    
+    // Still attached to the task the blocks were reserved in
+    bool Attached() const;
+    
+    // A range of the current block, reserving a new block if it does not fit
+    mach_vm_address_t Carve( size_t size, size_t alignment );
+    mach_vm_address_t AllocateLarge( size_t size, size_t alignment );
+    void FreeRange( mach_vm_address_t address, size_t size );
+    
+    class xnu_proc&     _process;
+    mach_port_t         _task;          // task and pid at construction
+    int                 _pid;
+    size_t              _block_size;
+    vm_prot_t           _protection;
+    size_t              _page;
+    
+    std::vector<Block_t> _blocks;
+    mach_vm_address_t   _cursor;        // unused tail of the newest block
+    mach_vm_address_t   _limit;
+    
+    std::vector<mach_vm_address_t> _free_slots[kArenaClasses];
+    std::map<mach_vm_address_t, Slab_t> _slabs;         // by base address
+    std::map<mach_vm_address_t, size_t> _large;         // live large allocation -> size
+    std::map<mach_vm_address_t, size_t> _holes;         // freed large ranges, merged, by address
+    
+    size_t              _reserved;
+    size_t              _used;
+};
+
+#endif /* defined(__xnumem__RemoteArena__) */
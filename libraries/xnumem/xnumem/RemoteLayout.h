@@ -0,0 +1,299 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+
+
+#ifndef __xnumem__RemoteLayout__
+#define __xnumem__RemoteLayout__
+
+#include <mach/mach.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <deque>
+#include <functional>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "ProcessMemory.h"
+
+namespace RemoteLayoutDetail
+{
+    // Every read of one pointer depth, across all layouts and pointer fields: one ReadBatch,
+    // then each part decodes its objects and queues their pointees into the next level
+    struct Level
+    {
+        std::vector<ReadRequest_t> requests;
+        std::deque<std::vector<uint8_t> > buffers;     // a deque, so queued buffers never move
+        std::vector<std::function<void ( const Level& done, Level& next )> > finish;
+    };
+    
+    // Read level by level until no pointer is left to follow
+    inline kern_return_t Run( ProcessMemory& memory, Level& level )
+    {
+        kern_return_t status = KERN_SUCCESS;
+        for (bool first = true; !level.finish.empty(); first = false)
+        {
+            kern_return_t kret = level.requests.empty() ? KERN_SUCCESS : memory.ReadBatch(level.requests);
+            if(first)
+                status = kret;
+            
+            Level next;
+            for (size_t i = 0; i < level.finish.size(); i++)
+                level.finish[i](level, next);
+            std::swap(level, next);
+        }
+        return status;
+    }
+}
+
+/**
+ A plain field of a remote struct.
+ 
+ @param Offset -- Offset in the remote struct.
+ @param T      -- Type, trivially copyable, with the target's size.
+ */
+template <size_t Offset, typename T>
+struct RemoteField
+{
+    static_assert(std::is_trivially_copyable<T>::value, "remote fields are copied bytewise");
+    
+    typedef T value_type;
+    static const size_t offset = Offset;
+    static const size_t size = sizeof(T);
+    
+    static inline void Decode( const uint8_t * data, value_type& value ) { memcpy((void *)&value, data, sizeof(T)); }
+    
+    template <size_t I, typename Object>
+    static inline void Follow( const std::vector<Object*>&, RemoteLayoutDetail::Level& ) {}
+};
+
+/**
+ A pointer field, followed and read with another layout.
+ 
+ @param Offset -- Offset in the remote struct.
+ @param Layout -- RemoteLayout of the pointee.
+ */
+template <size_t Offset, typename Layout>
+struct RemotePointer
+{
+    typedef typename Layout::Object value_type;
+    static const size_t offset = Offset;
+    static const size_t size = sizeof(void *);
+    
+    static inline void Decode( const uint8_t * data, value_type& value )
+    {
+        value.address = 0;
+        value.valid = false;
+        memcpy(&value.address, data, sizeof(void *));
+    }
+    
+    // Queue the pointees of every object with the rest of the next level, decoded in place
+    template <size_t I, typename Object>
+    static inline void Follow( const std::vector<Object*>& objects, RemoteLayoutDetail::Level& next )
+    {
+        std::vector<mach_vm_address_t> addresses(objects.size());
+        std::vector<value_type*> pointees(objects.size());
+        for (size_t n = 0; n < objects.size(); n++)
+        {
+            addresses[n] = objects[n]->valid ? std::get<I>(objects[n]->values).address : 0;
+            pointees[n] = &std::get<I>(objects[n]->values);
+        }
+        
+        Layout::Queue(addresses, pointees, next);
+    }
+};
+
+// Field of a described struct, by member name
+#define REMOTE_FIELD(type, member) RemoteField<offsetof(type, member), decltype(((type *)0)->member)>
+#define REMOTE_POINTER(type, member, layout) RemotePointer<offsetof(type, member), layout>
+
+namespace RemoteLayoutDetail
+{
+    template <size_t... I> struct Indices {};
+    template <size_t N, size_t... I> struct MakeIndices : MakeIndices<N - 1, N - 1, I...> {};
+    template <size_t... I> struct MakeIndices<0, I...> { typedef Indices<I...> type; };
+    
+    // Evaluates its arguments, for pack expansion
+    struct Expand { template <typename... T> Expand( T&&... ) {} };
+    
+    constexpr size_t Max( size_t a, size_t b ) { return a > b ? a : b; }
+    
+    // Span arithmetic over the field offsets, complete before the layout uses it
+    template <typename... Fields>
+    struct Geometry
+    {
+        static const size_t kFields = sizeof...(Fields);
+        static constexpr size_t kOffsets[kFields] = { Fields::offset... };
+        static constexpr size_t kSizes[kFields] = { Fields::size... };
+        
+        // A field opens a new span when it starts past the end of all fields before it
+        static constexpr size_t EndBefore( size_t i ) { return i == 0 ? 0 : Max(EndBefore(i - 1), kOffsets[i - 1] + kSizes[i - 1]); }
+        static constexpr bool Opens( size_t i ) { return i == 0 || kOffsets[i] > EndBefore(i); }
+        static constexpr bool Sorted( size_t i ) { return i == 0 || (kOffsets[i - 1] <= kOffsets[i] && Sorted(i - 1)); }
+        static constexpr size_t SpanOf( size_t i ) { return i == 0 ? 0 : SpanOf(i - 1) + (Opens(i) ? 1 : 0); }
+        static constexpr size_t FieldSpanStart( size_t i ) { return Opens(i) ? kOffsets[i] : FieldSpanStart(i - 1); }
+        static constexpr size_t SpanBegin( size_t k, size_t i = 0 ) { return SpanOf(i) == k ? kOffsets[i] : SpanBegin(k, i + 1); }
+        static constexpr size_t SpanEnd( size_t k, size_t i = 0 ) { return i == kFields ? 0 : Max(SpanOf(i) == k ? kOffsets[i] + kSizes[i] : 0, SpanEnd(k, i + 1)); }
+        static constexpr size_t SpanBuffer( size_t k ) { return k == 0 ? 0 : SpanBuffer(k - 1) + SpanEnd(k - 1) - SpanBegin(k - 1); }
+        static constexpr size_t FieldBuffer( size_t i ) { return SpanBuffer(SpanOf(i)) + kOffsets[i] - FieldSpanStart(i); }
+    };
+    
+    template <typename... Fields>
+    constexpr size_t Geometry<Fields...>::kOffsets[];
+    template <typename... Fields>
+    constexpr size_t Geometry<Fields...>::kSizes[];
+}
+
+/**
+ Compile-time description of the fields wanted from a remote struct.
+ 
+ Fields must be listed in offset order. Touching or overlapping fields are merged into
+ spans when the layout is instantiated, and reading a set of objects issues one
+ ReadBatch for all the spans of all objects, which coalesces them further across objects
+ that are close together. Every offset is a compile-time constant, so decoding is a
+ fixed sequence of copies. Pointer fields are followed with their own layout; the
+ pointees of all pointer fields at one depth share one more batch, so a read costs one
+ batch per level of the tree. Layouts can't refer to themselves.
+ 
+    typedef RemoteLayout<REMOTE_FIELD(Name, length), REMOTE_FIELD(Name, flags)> NameLayout;
+    typedef RemoteLayout<REMOTE_FIELD(Entry, id), REMOTE_POINTER(Entry, name, NameLayout)> EntryLayout;
+ 
+    std::vector<EntryLayout::Object> entries;
+    EntryLayout::Read(process.memory(), addresses, entries);
+    uint32_t length = std::get<0>(std::get<1>(entries[0].values).values);
+ */
+template <typename... Fields>
+class RemoteLayout
+{
+public:
+    typedef std::tuple<typename Fields::value_type...> Values;
+    
+    struct Object {
+        mach_vm_address_t address;
+        bool              valid;        // every span was read
+        Values            values;
+    };
+    
+    typedef RemoteLayoutDetail::Geometry<Fields...> Geometry;
+    
+    static const size_t kFields = sizeof...(Fields);
+    static_assert(kFields > 0, "a layout needs at least one field");
+    static_assert(Geometry::Sorted(kFields - 1), "fields must be listed in offset order");
+    
+    static const size_t kSpans = Geometry::SpanOf(kFields - 1) + 1;
+    static const size_t kStride = Geometry::SpanBuffer(kSpans);     // bytes read per object
+    
+    /**
+     Read objects, one ReadBatch for all of them and one more per level of pointers.
+     
+     @param memory    -- Process memory.
+     @param addresses -- Object addresses; 0 gives an invalid object.
+     @param objects   -- Output objects, one per address.
+     @return KERN_SUCCESS if every object at this level was read, otherwise the status of a failed read.
+     */
+    static kern_return_t Read( ProcessMemory& memory, const std::vector<mach_vm_address_t>& addresses, std::vector<Object>& objects )
+    {
+        objects.assign(addresses.size(), Object());
+        std::vector<Object*> targets(objects.size());
+        for (size_t n = 0; n < objects.size(); n++)
+            targets[n] = &objects[n];
+        
+        RemoteLayoutDetail::Level level;
+        Queue(addresses, targets, level);
+        return RemoteLayoutDetail::Run(memory, level);
+    }
+    
+    /**
+     Add objects to a level read together with others; see Read.
+     
+     @param addresses -- Object addresses; 0 gives an invalid object.
+     @param objects   -- Where to decode each object, alive until the read finished.
+     @param level     -- Level to join.
+     */
+    static void Queue( const std::vector<mach_vm_address_t>& addresses, const std::vector<Object*>& objects, RemoteLayoutDetail::Level& level )
+    {
+        typedef typename RemoteLayoutDetail::MakeIndices<kSpans>::type SpanIndices;
+        
+        level.buffers.push_back(std::vector<uint8_t>(addresses.size() * kStride));
+        uint8_t * buffer = level.buffers.back().data();
+        size_t first = level.requests.size();
+        for (size_t n = 0; n < addresses.size(); n++)
+        {
+            if(addresses[n] != 0)
+                Requests(addresses[n], buffer + n * kStride, level.requests, SpanIndices());
+        }
+        
+        level.finish.push_back([addresses, objects, buffer, first]( const RemoteLayoutDetail::Level& done, RemoteLayoutDetail::Level& next ) {
+            Finish(addresses, objects, buffer, done.requests.data() + first, next);
+        });
+    }
+    
+private:
+    static void Finish( const std::vector<mach_vm_address_t>& addresses, const std::vector<Object*>& objects, const uint8_t * buffer,
+                        const ReadRequest_t * request, RemoteLayoutDetail::Level& next )
+    {
+        typedef typename RemoteLayoutDetail::MakeIndices<kFields>::type FieldIndices;
+        
+        for (size_t n = 0; n < addresses.size(); n++)
+        {
+            Object& object = *objects[n];
+            object.address = addresses[n];
+            object.valid = addresses[n] != 0;
+            for (size_t k = 0; object.address && k < kSpans; k++, ++request)
+                object.valid = object.valid && request->status == KERN_SUCCESS;
+            
+            object.values = Values();
+            if(object.valid)
+                Decode(buffer + n * kStride, object.values, FieldIndices());
+        }
+        
+        Follow(objects, next, FieldIndices());
+    }
+    
+    template <size_t... K>
+    static inline void Requests( mach_vm_address_t address, uint8_t * buffer, std::vector<ReadRequest_t>& requests, RemoteLayoutDetail::Indices<K...> )
+    {
+        RemoteLayoutDetail::Expand{ (requests.push_back(Request(address + std::integral_constant<size_t, Geometry::SpanBegin(K)>::value,
+                                                                std::integral_constant<size_t, Geometry::SpanEnd(K) - Geometry::SpanBegin(K)>::value,
+                                                                buffer + std::integral_constant<size_t, Geometry::SpanBuffer(K)>::value)), 0)... };
+    }
+    
+    static inline ReadRequest_t Request( mach_vm_address_t address, mach_vm_size_t size, uint8_t * buffer )
+    {
+        ReadRequest_t request = { address, size, buffer, KERN_SUCCESS };
+        return request;
+    }
+    
+    template <size_t... I>
+    static inline void Decode( const uint8_t * buffer, Values& values, RemoteLayoutDetail::Indices<I...> )
+    {
+        RemoteLayoutDetail::Expand{ (Fields::Decode(buffer + std::integral_constant<size_t, Geometry::FieldBuffer(I)>::value, std::get<I>(values)), 0)... };
+    }
+    
+    template <size_t... I>
+    static inline void Follow( const std::vector<Object*>& objects, RemoteLayoutDetail::Level& next, RemoteLayoutDetail::Indices<I...> )
+    {
+        RemoteLayoutDetail::Expand{ (Fields::template Follow<I>(objects, next), 0)... };
+    }
+};
+
+#endif /* defined(__xnumem__RemoteLayout__) */
@@ -0,0 +1,425 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+#include "Scheduler.h"
+#include "Trace.h"
+
+#include <mach/mach.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+
+// Batches this thread is inside of; workers always count as inside one
+static __thread unsigned t_depth = 0;
+static __thread int t_worker = -1;
+
+struct Scheduler::Batch {
+    Batch( const ChunkFn* pchunk_fn, const IndexFn* pindex_fn, ScanJob* pjob ) :
+        chunk_fn(pchunk_fn), index_fn(pindex_fn), job(pjob ? pjob : &local), remaining(0)
+    {
+        // A reused job starts counting again, unless another batch still runs on it
+        if(job->_running.fetch_add(1) == 0)
+        {
+            job->_done.store(0, std::memory_order_relaxed);
+            job->_total.store(0, std::memory_order_relaxed);
+        }
+    }
+    
+    ~Batch() { job->_running.fetch_sub(1); }
+    
+    const ChunkFn*          chunk_fn;
+    const IndexFn*          index_fn;
+    ScanJob*                job;
+    ScanJob                 local;
+    size_t                  remaining;  // guarded by lock
+    std::mutex              lock;
+    std::condition_variable done;
+};
+
+ScanJob::ScanJob() : _cancelled(false), _done(0), _total(0), _running(0)
+{
+}
+
+Scheduler& Scheduler::Shared()
+{
+    static Scheduler scheduler;
+    return scheduler;
+}
+
+SchedulerConfig_t Scheduler::DefaultConfig()
+{
+    SchedulerConfig_t config;
+    config.workers   = 0;
+    config.min_chunk = 64 * 1024;
+    config.max_chunk = 8 * 1024 * 1024;
+    return config;
+}
+
+Scheduler::Scheduler() : _queued(0), _next(0), _active(0), _stop(false), _reconfiguring(false)
+{
+    Start(DefaultConfig());
+}
+
+Scheduler::~Scheduler()
+{
+    Stop();
+}
+
+kern_return_t Scheduler::Configure( const SchedulerConfig_t& config )
+{
+    if(config.min_chunk == 0 || config.min_chunk > config.max_chunk)
+        return KERN_INVALID_ARGUMENT;
+    
+    // From a worker or a running operation, waiting for idle would wait for this thread
+    if(t_depth > 0)
+        return KERN_FAILURE;
+    
+    {
+        // Let running operations drain and hold off new ones
+        std::unique_lock<std::mutex> lock(_lock);
+        _idle.wait(lock, [this] { return !_reconfiguring; });
+        _reconfiguring = true;
+        _idle.wait(lock, [this] { return _active == 0; });
+    }
+    
+    Stop();
+    Start(config);
+    
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _reconfiguring = false;
+    }
+    _idle.notify_all();
+    
+    return KERN_SUCCESS;
+}
+
+void Scheduler::Start( const SchedulerConfig_t& config )
+{
+    _config = config;
+    _stop   = false;
+    
+    unsigned count = config.workers;
+    if(count == 0)
+        count = std::max(1u, std::thread::hardware_concurrency());
+    
+    for (unsigned i = 0; i < count; i++)
+        _workers.push_back(new Worker);
+    
+    for (unsigned i = 0; i < count; i++)
+    {
+        integer_t tag = config.affinity.empty() ? THREAD_AFFINITY_TAG_NULL : config.affinity[i % config.affinity.size()];
+        _workers[i]->thread = std::thread(&Scheduler::WorkerMain, this, i, tag);
+    }
+}
+
+void Scheduler::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _stop = true;
+    }
+    _wake.notify_all();
+    
+    for (std::vector<Worker*>::iterator it = _workers.begin(); it != _workers.end(); ++it)
+    {
+        (*it)->thread.join();
+        delete *it;
+    }
+    _workers.clear();
+}
+
+void Scheduler::WorkerMain( unsigned id, integer_t affinity )
+{
+    char name[32];
+    snprintf(name, sizeof(name), "xnumem worker %u", id);
+    pthread_setname_np(name);
+    t_depth = 1;
+    t_worker = (int)id;
+    
+    if(affinity != THREAD_AFFINITY_TAG_NULL)
+    {
+        // Mach has no hard pinning; workers with different tags are spread over different L2 domains
+        thread_affinity_policy_data_t policy = { affinity };
+        thread_policy_set(pthread_mach_thread_np(pthread_self()), THREAD_AFFINITY_POLICY, (thread_policy_t)&policy, THREAD_AFFINITY_POLICY_COUNT);
+    }
+    
+    for (;;)
+    {
+        Task task;
+        bool stolen = false;
+        if(Pop(id, task) || (stolen = Steal(id, task)))
+        {
+            _queued.fetch_sub(1, std::memory_order_relaxed);
+            TraceSpan span(stolen ? "stolen task" : "task", "scheduler", task.batch->chunk_fn ? task.chunk.size : 0);
+            Execute(task, id);
+            continue;
+        }
+        
+        std::unique_lock<std::mutex> lock(_lock);
+        _wake.wait(lock, [this] { return _stop || _queued.load() > 0; });
+        if(_stop && _queued.load() == 0)
+            return;
+    }
+}
+
+bool Scheduler::Pop( unsigned id, Task& task )
+{
+    Worker* worker = _workers[id];
+    std::lock_guard<std::mutex> lock(worker->lock);
+    if(worker->tasks.empty())
+        return false;
+    
+    task = worker->tasks.front();
+    worker->tasks.pop_front();
+    return true;
+}
+
+bool Scheduler::Steal( unsigned id, Task& task )
+{
+    // Take from the back of the victims, away from where the owner works
+    size_t count = _workers.size();
+    for (size_t i = 1; i < count; i++)
+    {
+        Worker* victim = _workers[(id + i) % count];
+        std::lock_guard<std::mutex> lock(victim->lock);
+        if(victim->tasks.empty())
+            continue;
+        
+        task = victim->tasks.back();
+        victim->tasks.pop_back();
+        return true;
+    }
+    
+    return false;
+}
+
+bool Scheduler::Take( unsigned id, Batch* batch, Task& task )
+{
+    // Only this batch's tasks, any other may share per-worker state with the task that waits
+    size_t count = _workers.size();
+    for (size_t i = 0; i < count; i++)
+    {
+        Worker* worker = _workers[(id + i) % count];
+        std::lock_guard<std::mutex> lock(worker->lock);
+        for (std::deque<Task>::iterator it = worker->tasks.begin(); it != worker->tasks.end(); ++it)
+        {
+            if(it->batch != batch)
+                continue;
+            
+            task = *it;
+            worker->tasks.erase(it);
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+void Scheduler::Execute( const Task& task, unsigned id )
+{
+    Batch* batch = task.batch;
+    
+    if(!batch->job->cancelled())
+    {
+        if(batch->chunk_fn)
+        {
+            (*batch->chunk_fn)(task.chunk, id);
+            batch->job->_done.fetch_add(task.chunk.size, std::memory_order_relaxed);
+        }
+        else
+        {
+            (*batch->index_fn)(task.index, id);
+            batch->job->_done.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    
+    // Last touch of the batch, the caller may return as soon as the lock is released
+    std::lock_guard<std::mutex> lock(batch->lock);
+    if(--batch->remaining == 0)
+        batch->done.notify_all();
+}
+
+void Scheduler::Split( const std::vector<AddressRange_t>& ranges, Batch* batch )
+{
+    mach_vm_size_t page = getpagesize();
+    mach_vm_size_t spread = (mach_vm_size_t)_workers.size() * 4;
+    std::vector<Task> tasks;
+    
+    for (std::vector<AddressRange_t>::const_iterator it = ranges.begin(); it != ranges.end(); ++it)
+    {
+        if(it->end <= it->start)
+            continue;
+        
+        // Aim for a few chunks per worker on big ranges, never below / above the configured bounds
+        mach_vm_size_t size = it->end - it->start;
+        mach_vm_size_t chunk = (size / spread + page - 1) & ~(page - 1);
+        chunk = std::min(std::max(chunk, _config.min_chunk), _config.max_chunk);
+        
+        mach_vm_address_t address = it->start;
+        while(address < it->end)
+        {
+            // Cut on page boundaries even if the range itself is not page aligned
+            mach_vm_address_t next = ((address + chunk) & ~(page - 1));
+            if(next <= address)
+                next = address + chunk;
+            next = std::min(next, it->end);
+            
+            Task task;
+            task.batch         = batch;
+            task.chunk.address = address;
+            task.chunk.size    = next - address;
+            task.chunk.limit   = it->end;
+            task.chunk.origin  = it->start;
+            task.index         = tasks.size();
+            tasks.push_back(task);
+            
+            batch->job->_total.fetch_add(task.chunk.size, std::memory_order_relaxed);
+            address = next;
+        }
+    }
+    
+    Submit(tasks, batch);
+}
+
+void Scheduler::Submit( std::vector<Task>& tasks, Batch* batch )
+{
+    batch->remaining = tasks.size();
+    if(tasks.empty())
+        return;
+    
+    // Hand each worker a contiguous run so it walks memory in order until it starts stealing
+    size_t count = _workers.size();
+    size_t run   = (tasks.size() + count - 1) / count;
+    unsigned first = _next.fetch_add(1, std::memory_order_relaxed);
+    
+    _queued.fetch_add(tasks.size());
+    for (size_t i = 0; i < tasks.size(); i += run)
+    {
+        Worker* worker = _workers[(first + i / run) % count];
+        std::lock_guard<std::mutex> lock(worker->lock);
+        worker->tasks.insert(worker->tasks.end(), tasks.begin() + i, tasks.begin() + std::min(i + run, tasks.size()));
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+    }
+    _wake.notify_all();
+}
+
+kern_return_t Scheduler::Wait( Batch* batch, const ProgressFn& progress )
+{
+    if(t_worker >= 0)
+    {
+        // Nested in a worker: every worker may be waiting like this one, run the batch here
+        Task task;
+        while(Take((unsigned)t_worker, batch, task))
+        {
+            _queued.fetch_sub(1, std::memory_order_relaxed);
+            Execute(task, (unsigned)t_worker);
+        }
+    }
+    
+    {
+        std::unique_lock<std::mutex> lock(batch->lock);
+        while(batch->remaining > 0)
+        {
+            batch->done.wait_for(lock, std::chrono::milliseconds(100));
+            if(progress && batch->remaining > 0)
+            {
+                lock.unlock();
+                progress(batch->job->done(), batch->job->total());
+                lock.lock();
+            }
+        }
+    }
+    
+    if(progress)
+        progress(batch->job->done(), batch->job->total());
+    
+    return batch->job->cancelled() ? KERN_ABORTED : KERN_SUCCESS;
+}
+
+void Scheduler::Enter()
+{
+    // Nested in a worker or another batch: reconfiguration already waits for this thread
+    std::unique_lock<std::mutex> lock(_lock);
+    if(t_depth == 0)
+        _idle.wait(lock, [this] { return !_reconfiguring; });
+    _active++;
+    t_depth++;
+}
+
+void Scheduler::Leave()
+{
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _active--;
+        t_depth--;
+    }
+    _idle.notify_all();
+}
+
+kern_return_t Scheduler::ForEachChunk( const RegionView& regions, const ChunkFn& fn, ScanJob* job /* = nullptr */, const ProgressFn& progress /* = ProgressFn() */ )
+{
+    std::vector<AddressRange_t> ranges;
+    for (RegionView::iterator it = regions.begin(); it != regions.end(); ++it)
+    {
+        AddressRange_t range = { it->address, it->address + it->size };
+        ranges.push_back(range);
+    }
+    
+    return ForEachChunk(ranges, fn, job, progress);
+}
+
+kern_return_t Scheduler::ForEachChunk( const std::vector<AddressRange_t>& ranges, const ChunkFn& fn, ScanJob* job /* = nullptr */, const ProgressFn& progress /* = ProgressFn() */ )
+{
+    TraceSpan span("ForEachChunk", "scheduler");
+    Enter();
+    Batch batch(&fn, nullptr, job);
+    Split(ranges, &batch);
+    span.set(batch.job->total());
+    kern_return_t kret = Wait(&batch, progress);
+    Leave();
+    return kret;
+}
+
+kern_return_t Scheduler::ForEach( size_t count, const IndexFn& fn, ScanJob* job /* = nullptr */, const ProgressFn& progress /* = ProgressFn() */ )
+{
+    TraceSpan span("ForEach", "scheduler", count);
+    Enter();
+    Batch batch(nullptr, &fn, job);
+    
+    std::vector<Task> tasks(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        tasks[i].batch = &batch;
+        tasks[i].index = i;
+    }
+    batch.job->_total.fetch_add(count, std::memory_order_relaxed);
+    
+    Submit(tasks, &batch);
+    kern_return_t kret = Wait(&batch, progress);
+    Leave();
+    return kret;
+}
@@ -0,0 +1,228 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+#ifndef __xnumem__Scheduler__
+#define __xnumem__Scheduler__
+
+#include <mach/mach.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "RegionIndex.h"
+
+typedef struct ScanChunk {
+    mach_vm_address_t address;     // chunk start, page aligned unless the range start is not
+    mach_vm_size_t    size;         // chunk size
+    mach_vm_address_t limit;        // end of the range the chunk was cut from, for reads that straddle chunks
+    mach_vm_address_t origin;       // start of the range the chunk was cut from
+} ScanChunk_t;
+
+typedef struct SchedulerConfig {
+    unsigned              workers;      // worker threads, 0 for one per core
+    std::vector<integer_t> affinity;    // affinity tags handed out round-robin to workers, empty for none
+    mach_vm_size_t        min_chunk;    // smallest chunk handed to a worker
+    mach_vm_size_t        max_chunk;    // largest chunk handed to a worker
+} SchedulerConfig_t;
+
+/**
+ Cancellation and progress of one bulk operation.
+ May be cancelled from any thread; chunks not yet started are then skipped.
+ */
+class ScanJob
+{
+    friend class Scheduler;
+public:
+    ScanJob();
+    
+    inline void Cancel() { _cancelled.store(true, std::memory_order_relaxed); }
+    inline bool cancelled() const { return _cancelled.load(std::memory_order_relaxed); }
+    
+    // Bytes (or items) processed and scheduled so far.
+    inline mach_vm_size_t done()  const { return _done.load(std::memory_order_relaxed); }
+    inline mach_vm_size_t total() const { return _total.load(std::memory_order_relaxed); }
+    
+private:
+    ScanJob( const ScanJob& ) = delete;
+    ScanJob& operator =(const ScanJob&) = delete;
+    
+    std::atomic<bool>           _cancelled;
+    std::atomic<mach_vm_size_t> _done;
+    std::atomic<mach_vm_size_t> _total;
+    std::atomic<unsigned>       _running;   // batches in flight, counters restart when a batch starts on an idle job
+};
+
+typedef std::function<void( const ScanChunk_t& chunk, unsigned worker )>    ChunkFn;
+typedef std::function<void( size_t index, unsigned worker )>                IndexFn;
+typedef std::function<void( mach_vm_size_t done, mach_vm_size_t total )>   ProgressFn;
+
+/**
+ Library-wide work-stealing scheduler for bulk memory operations.
+ 
+ Each worker owns a deque; it takes work from the front of its own deque and steals
+ from the back of the others when it runs dry. Ranges are cut into page aligned chunks
+ sized from the range size and worker count, so large regions are spread over all
+ workers while small regions are not split at all.
+ 
+ Calls block until every chunk ran (or was skipped after cancellation). The progress
+ callback is invoked on the calling thread.
+ Calls may be nested in a callback; the worker then runs the nested tasks while it waits.
+ */
+class Scheduler
+{
+public:
+    /**
+     Shared instance, started on first use with the default configuration.
+     
+     @param void
+     @return The scheduler.
+     */
+    static Scheduler& Shared();
+    
+    /**
+     Default configuration: one worker per core, no affinity, 64KB - 8MB chunks.
+     
+     @param void
+     @return Configuration.
+     */
+    static SchedulerConfig_t DefaultConfig();
+    
+    /**
+     Restart the workers with a new configuration, e.g. to limit scans to a few cores.
+     Waits for running operations to finish; refused from a worker or under a SchedulerGuard,
+     which would wait for itself.
+     
+     @param config -- New configuration.
+     @return Status, KERN_FAILURE when called from inside an operation.
+     */
+    kern_return_t Configure( const SchedulerConfig_t& config );
+    
+    /**
+     Run a function over every chunk of a set of regions.
+     
+     @param regions  -- Regions to process.
+     @param fn       -- Called once per chunk, concurrently from worker threads.
+     @param job      -- Cancellation / progress. (optional)
+     @param progress -- Progress callback, called on this thread. (optional)
+     @return KERN_SUCCESS, or KERN_ABORTED if the job was cancelled.
+     */
+    kern_return_t ForEachChunk( const RegionView& regions, const ChunkFn& fn, ScanJob* job = nullptr, const ProgressFn& progress = ProgressFn() );
+    
+    /**
+     Run a function over every chunk of a set of address ranges.
+     
+     @param ranges   -- Ranges to process.
+     @param fn       -- Called once per chunk, concurrently from worker threads.
+     @param job      -- Cancellation / progress. (optional)
+     @param progress -- Progress callback, called on this thread. (optional)
+     @return KERN_SUCCESS, or KERN_ABORTED if the job was cancelled.
+     */
+    kern_return_t ForEachChunk( const std::vector<AddressRange_t>& ranges, const ChunkFn& fn, ScanJob* job = nullptr, const ProgressFn& progress = ProgressFn() );
+    
+    /**
+     Run a function for each index in [0, count).
+     
+     @param count    -- Number of items.
+     @param fn       -- Called once per item, concurrently from worker threads.
+     @param job      -- Cancellation / progress, counted in items. (optional)
+     @param progress -- Progress callback, called on this thread. (optional)
+     @return KERN_SUCCESS, or KERN_ABORTED if the job was cancelled.
+     */
+    kern_return_t ForEach( size_t count, const IndexFn& fn, ScanJob* job = nullptr, const ProgressFn& progress = ProgressFn() );
+    
+    // Worker count, stable only under a SchedulerGuard
+    inline unsigned workers() const { return (unsigned)_workers.size(); }
+    
+private:
+    friend class SchedulerGuard;
+    
+    struct Batch;
+    
+    struct Task {
+        Batch*      batch;
+        ScanChunk_t chunk;
+        size_t      index;
+    };
+    
+    struct Worker {
+        std::mutex       lock;
+        std::deque<Task> tasks;
+        std::thread      thread;
+    };
+    
+    Scheduler();
+    ~Scheduler();
+    Scheduler( const Scheduler& ) = delete;
+    Scheduler& operator =(const Scheduler&) = delete;
+    
+    void Start( const SchedulerConfig_t& config );
+    void Stop();
+    
+    void WorkerMain( unsigned id, integer_t affinity );
+    bool Pop( unsigned id, Task& task );
+    bool Steal( unsigned id, Task& task );
+    bool Take( unsigned id, Batch* batch, Task& task );
+    void Execute( const Task& task, unsigned id );
+    
+    // Register a batch, waits out reconfiguration unless this thread is already inside one
+    void Enter();
+    void Leave();
+    
+    // Cut ranges into chunks and queue them
+    void Split( const std::vector<AddressRange_t>& ranges, Batch* batch );
+    void Submit( std::vector<Task>& tasks, Batch* batch );
+    kern_return_t Wait( Batch* batch, const ProgressFn& progress );
+    
+    SchedulerConfig_t       _config;
+    std::vector<Worker*>    _workers;
+    std::mutex              _lock;          // guards sleeping / waking and reconfiguration
+    std::condition_variable _wake;          // workers wait for tasks
+    std::condition_variable _idle;          // reconfiguration waits for batches
+    std::atomic<size_t>     _queued;        // tasks sitting in any deque
+    std::atomic<unsigned>   _next;          // round-robin cursor for submissions
+    unsigned                _active;        // batches in flight, guarded by _lock
+    bool                    _stop;
+    bool                    _reconfiguring;
+};
+
+/**
+ Holds off reconfiguration, so per-worker state can be sized from workers() before
+ the operations that index it by worker id.
+ */
+class SchedulerGuard
+{
+public:
+    inline SchedulerGuard( Scheduler& scheduler = Scheduler::Shared() ) : _scheduler(scheduler) { _scheduler.Enter(); }
+    inline ~SchedulerGuard() { _scheduler.Leave(); }
+    
+    inline unsigned workers() const { return _scheduler.workers(); }
+    
+private:
+    SchedulerGuard( const SchedulerGuard& ) = delete;
+    SchedulerGuard& operator =(const SchedulerGuard&) = delete;
+    
+    Scheduler& _scheduler;
+};
+
+#endif /* defined(__xnumem__Scheduler__) */
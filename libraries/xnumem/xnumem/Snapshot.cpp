@@ -0,0 +1,667 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+#include "Snapshot.h"
+#include "Epoch.h"
+#include "Hash.h"
+#include "Scheduler.h"
+#include "Trace.h"
+#include "xnumem.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <mach/mach_time.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+
+static uint64_t RoundToPage( uint64_t value, uint64_t page )
+{
+    return (value + page - 1) & ~(page - 1);
+}
+
+// count items of size bytes at offset end at or before limit, without overflowing
+static bool Fits( uint64_t offset, uint64_t count, uint64_t size, uint64_t limit )
+{
+    return offset <= limit && count <= (limit - offset) / size;
+}
+
+static bool SnapshotRegionLess( const SnapshotRegion_t& region, mach_vm_address_t address )
+{
+    return region.address + region.size <= address;
+}
+
+static bool IsZero( const uint8_t * data, size_t size )
+{
+    const uint64_t *words = (const uint64_t *)data;
+    for (size_t i = 0; i < size / sizeof(uint64_t); i++)
+    {
+        if(words[i])
+            return false;
+    }
+    
+    for (size_t i = size & ~(sizeof(uint64_t) - 1); i < size; i++)
+    {
+        if(data[i])
+            return false;
+    }
+    
+    return true;
+}
+
+Snapshot::Snapshot() : _base(nullptr), _size(0), _parent(nullptr)
+{
+}
+
+Snapshot::~Snapshot()
+{
+    Close();
+}
+
+kern_return_t Snapshot::Capture( xnu_proc& process, const char * path, ScanJob* job /* = nullptr */, const ScanScope* scope /* = nullptr */ )
+{
+    return Write(process, path, nullptr, nullptr, job, scope);
+}
+
+kern_return_t Snapshot::CaptureIncremental( xnu_proc& process, const char * path, const char * previous, ScanJob* job /* = nullptr */,
+                                            const ScanScope* scope /* = nullptr */ )
+{
+    char resolved[PATH_MAX];
+    if(realpath(previous, resolved) == NULL)
+        return KERN_NOT_FOUND;
+    
+    Snapshot parent;
+    kern_return_t kret = parent.Open(resolved);
+    if(kret != KERN_SUCCESS)
+        return kret;
+    
+    if(parent.header()->pid != process.pid() || parent.header()->page_size != (uint32_t)getpagesize())
+        return KERN_INVALID_ARGUMENT;
+    
+    // Truncating a file of the chain would pull the pages out from under the capture
+    char target[PATH_MAX];
+    if(realpath(path, target) != NULL)
+    {
+        for (const Snapshot* it = &parent; it->parent(); it = it->parent())
+        {
+            if(strcmp(it->string(it->header()->parent_path), target) == 0)
+                return KERN_INVALID_ARGUMENT;
+        }
+        if(strcmp(resolved, target) == 0)
+            return KERN_INVALID_ARGUMENT;
+    }
+    
+    return Write(process, path, &parent, resolved, job, scope);
+}
+
+kern_return_t Snapshot::Write( xnu_proc& process, const char * path, const Snapshot* parent, const char * parent_path, ScanJob* job,
+                               const ScanScope* scope )
+{
+    TraceSpan span("Write", "Snapshot");
+    ProcessMemory& memory = process.memory();
+    EpochGuard guard;
+    std::vector<MemoryRegion_t> scoped;
+    if(scope)
+        scope->Clip(memory.segments(), scoped);
+    const std::vector<MemoryRegion_t>& segments = scope ? scoped : memory.segments();
+    const std::vector<ModuleData_t> modules = process.modules().modules();
+    uint64_t page = getpagesize();
+    
+    SnapshotHeader_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kSnapshotMagic, sizeof(kSnapshotMagic));
+    header.version   = kSnapshotVersion;
+    header.page_size = (uint32_t)page;
+    header.pid       = process.pid();
+    header.created   = (uint64_t)time(NULL);
+    if(process.core().pinfo_proc())
+        strncpy(header.comm, process.core().pinfo_proc()->kp_proc.p_comm, sizeof(header.comm) - 1);
+    
+    uint64_t seed[3] = { mach_absolute_time(), (uint64_t)header.pid, header.created };
+    header.identity = Hash64(seed, sizeof(seed), Hash64(path, strlen(path)));
+    
+    // Modules and their paths, then the parent's
+    std::vector<SnapshotModule_t> module_table;
+    std::vector<char> strings;
+    DescribeModules(modules, module_table, strings);
+    
+    header.parent_path = kSnapshotNoParent;
+    if(parent)
+    {
+        header.parent_identity = parent->header()->identity;
+        header.parent_path     = strings.size();
+        strings.insert(strings.end(), parent_path, parent_path + strlen(parent_path) + 1);
+    }
+    
+    // One page map byte per page of every readable region
+    std::vector<SnapshotRegion_t> region_table(segments.size());
+    std::vector<AddressRange_t> ranges;
+    uint64_t page_count = 0;
+    for (size_t i = 0; i < segments.size(); i++)
+    {
+        if(segments[i].info.protection & VM_PROT_READ)
+            page_count += RoundToPage(segments[i].size, page) / page;
+    }
+    
+    header.region_count   = segments.size();
+    header.region_offset  = sizeof(SnapshotHeader_t);
+    header.module_count   = module_table.size();
+    header.module_offset  = header.region_offset + header.region_count * sizeof(SnapshotRegion_t);
+    header.strings_offset = header.module_offset + header.module_count * sizeof(SnapshotModule_t);
+    header.strings_size   = strings.size();
+    header.map_offset     = header.strings_offset + header.strings_size;
+    header.map_size       = page_count;
+    header.data_offset    = RoundToPage(header.map_offset + header.map_size, page);
+    
+    // Lay out one blob per readable region, and find the regions the parent saw unchanged
+    std::vector<const SnapshotRegion_t*> previous(segments.size(), nullptr);
+    uint64_t cursor = header.data_offset;
+    uint64_t map_cursor = header.map_offset;
+    for (size_t i = 0; i < segments.size(); i++)
+    {
+        const MemoryRegion_t& region = segments[i];
+        SnapshotRegion_t& entry = region_table[i];
+        DescribeRegion(region, entry);
+        
+        if(region.info.protection & VM_PROT_READ)
+        {
+            entry.flags       = kSnapshotRegionCaptured;
+            entry.data_offset = cursor;
+            entry.page_map    = map_cursor;
+            cursor     += RoundToPage(region.size, page);
+            map_cursor += RoundToPage(region.size, page) / page;
+            
+            AddressRange_t range = { region.address, region.address + region.size };
+            ranges.push_back(range);
+            
+            // Clean file-backed pages change with their file, only anonymous ones are taken as the parent's unread
+            const SnapshotRegion_t* old = parent ? parent->FindRegion(region.address) : nullptr;
+            if(old && old->address == entry.address && old->size == entry.size && old->offset == entry.offset &&
+               old->protection == entry.protection && old->shared == entry.shared && old->page_map && memory.Anonymous(region))
+                previous[i] = old;
+        }
+    }
+    header.file_size = cursor;
+    
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+        return KERN_FAILURE;
+    
+    // Sparse file, blobs that stay zero or are inherited are never written
+    if(ftruncate(fd, (off_t)header.file_size) != 0)
+    {
+        close(fd);
+        return KERN_FAILURE;
+    }
+    
+    std::vector<uint8_t> page_maps(header.map_size, 0);
+    std::vector<std::atomic<uint32_t> > flags(region_table.size());
+    SchedulerGuard scheduling;   // per-worker state below stays sized for the workers that run
+    std::vector<std::vector<uint8_t> > buffers(scheduling.workers());
+    std::vector<std::vector<integer_t> > dispositions(scheduling.workers());
+    std::atomic<bool> io_error(false);
+    
+    kern_return_t kret = Scheduler::Shared().ForEachChunk(ranges, [&](const ScanChunk_t& chunk, unsigned worker) {
+        size_t index = RegionIndex::Find(segments, chunk.address) - segments.data();
+        const SnapshotRegion_t& entry = region_table[index];
+        const SnapshotRegion_t* old = previous[index];
+        
+        size_t pages = (size_t)(RoundToPage(chunk.size, page) / page);
+        uint8_t *states = &page_maps[entry.page_map - header.map_offset + (chunk.address - entry.address) / page];
+        
+        // Dispositions for the whole chunk in one query; without them every page counts as written
+        std::vector<integer_t>& disposition = dispositions[worker];
+        bool known = !entry.shared && memory.QueryPages(chunk.address, chunk.size, disposition) == KERN_SUCCESS;
+        
+        // Shared and read-only regions are written straight from a view of the target's pages
+        const uint8_t * view = (const uint8_t *)memory.Map(chunk.address, chunk.size);
+        std::vector<uint8_t>& buffer = buffers[worker];
+        if(!view)
+            buffer.resize(chunk.size);
+        const uint8_t * base = view ? view : buffer.data();
+        
+        std::vector<bool> wanted(pages, true);
+        for (size_t i = 0; i < pages; i++)
+        {
+            bool clean = known && !(disposition[i] & (VM_PAGE_QUERY_PAGE_DIRTY | VM_PAGE_QUERY_PAGE_PAGED_OUT));
+            states[i] = clean ? kSnapshotPageClean : 0;
+            
+            mach_vm_address_t address = chunk.address + i * page;
+            if(clean && old && (parent->PageState(old, address) & kSnapshotPageClean) && parent->PageData(address))
+                wanted[i] = false;
+        }
+        
+        // Read the pages that may have changed in as few runs as possible
+        for (size_t i = 0; !view && i < pages; )
+        {
+            if(!wanted[i])
+            {
+                i++;
+                continue;
+            }
+            
+            size_t run = i;
+            while(run < pages && wanted[run])
+                run++;
+            
+            mach_vm_size_t size = std::min<mach_vm_size_t>((run - i) * page, chunk.size - i * page);
+            if(!ReadZeroFilled(memory, chunk.address + i * page, size, buffer.data() + i * page))
+                flags[index].fetch_or(kSnapshotRegionPartial, std::memory_order_relaxed);
+            i = run;
+        }
+        
+        // Keep what differs from the parent, write runs of non-zero local pages
+        bool inherits = false;
+        size_t write_start = pages;
+        for (size_t i = 0; i <= pages; i++)
+        {
+            bool write = false;
+            if(i < pages)
+            {
+                size_t size = (size_t)std::min<uint64_t>(page, chunk.size - i * page);
+                const uint8_t * data = base + i * page;
+                const uint8_t * previous_data = parent ? parent->PageData(chunk.address + i * page) : nullptr;
+                
+                if(!wanted[i] || (previous_data && memcmp(previous_data, data, size) == 0))
+                {
+                    inherits = true;
+                }
+                else
+                {
+                    states[i] |= kSnapshotPageLocal;
+                    write = !IsZero(data, size);
+                }
+            }
+            
+            if(write && write_start == pages)
+                write_start = i;
+            
+            if(!write && write_start != pages)
+            {
+                size_t size = (size_t)std::min<uint64_t>((i - write_start) * page, chunk.size - write_start * page);
+                off_t offset = (off_t)(entry.data_offset + (chunk.address - entry.address) + write_start * page);
+                if(pwrite(fd, base + write_start * page, size, offset) != (ssize_t)size)
+                    io_error.store(true, std::memory_order_relaxed);
+                write_start = pages;
+            }
+        }
+        
+        if(inherits)
+            flags[index].fetch_or(kSnapshotRegionInherits, std::memory_order_relaxed);
+    }, job);
+    
+    for (size_t i = 0; i < region_table.size(); i++)
+        region_table[i].flags |= flags[i].load(std::memory_order_relaxed);
+    
+    // Tables go last, a capture that dies midway leaves no valid header behind
+    if(kret == KERN_SUCCESS && !io_error)
+    {
+        ssize_t written = 0;
+        written += pwrite(fd, region_table.data(), region_table.size() * sizeof(SnapshotRegion_t), (off_t)header.region_offset);
+        written += pwrite(fd, module_table.data(), module_table.size() * sizeof(SnapshotModule_t), (off_t)header.module_offset);
+        written += pwrite(fd, strings.data(), strings.size(), (off_t)header.strings_offset);
+        written += pwrite(fd, page_maps.data(), page_maps.size(), (off_t)header.map_offset);
+        written += pwrite(fd, &header, sizeof(header), 0);
+        
+        if(written != (ssize_t)(header.map_offset + header.map_size))
+            io_error = true;
+    }
+    
+    close(fd);
+    
+    if(kret != KERN_SUCCESS)
+        return kret;
+    return io_error ? KERN_FAILURE : KERN_SUCCESS;
+}
+
+kern_return_t Snapshot::Open( const char * path )
+{
+    return Open(path, 0);
+}
+
+kern_return_t Snapshot::Open( const char * path, unsigned depth )
+{
+    Close();
+    
+    // Chains are short in practice, this only stops cycles
+    if(depth > 256)
+        return KERN_INVALID_ARGUMENT;
+    
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return KERN_FAILURE;
+    
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader_t))
+    {
+        close(fd);
+        return KERN_INVALID_ARGUMENT;
+    }
+    
+    void * base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED)
+        return KERN_FAILURE;
+    
+    _base = (const uint8_t *)base;
+    _size = (size_t)st.st_size;
+    
+    // Validate once so the tables can be used in place afterwards
+    if(!Validate())
+    {
+        Close();
+        return KERN_INVALID_ARGUMENT;
+    }
+    
+    const SnapshotHeader_t* h = header();
+    if(h->parent_path != kSnapshotNoParent)
+    {
+        _parent = new Snapshot();
+        kern_return_t kret = _parent->Open(string(h->parent_path), depth + 1);
+        if(kret == KERN_SUCCESS && _parent->header()->identity != h->parent_identity)
+            kret = KERN_INVALID_ARGUMENT;
+        
+        if(kret != KERN_SUCCESS)
+        {
+            Close();
+            return kret;
+        }
+    }
+    
+    return KERN_SUCCESS;
+}
+
+bool Snapshot::Validate() const
+{
+    const SnapshotHeader_t* h = header();
+    if(memcmp(h->magic, kSnapshotMagic, sizeof(kSnapshotMagic)) != 0 || h->version != kSnapshotVersion || h->file_size != _size ||
+       h->page_size == 0 || (h->page_size & (h->page_size - 1)) != 0 ||
+       !Fits(h->region_offset, h->region_count, sizeof(SnapshotRegion_t), h->module_offset) ||
+       !Fits(h->module_offset, h->module_count, sizeof(SnapshotModule_t), h->strings_offset) ||
+       !Fits(h->strings_offset, h->strings_size, 1, h->map_offset) ||
+       !Fits(h->map_offset, h->map_size, 1, h->data_offset) ||
+       h->data_offset > _size || h->region_offset < sizeof(SnapshotHeader_t))
+        return false;
+    
+    // Strings are used as C strings, each must end inside the table
+    const char * strings = string(0);
+    if(h->parent_path != kSnapshotNoParent &&
+       (h->parent_path >= h->strings_size || !memchr(strings + h->parent_path, 0, h->strings_size - h->parent_path)))
+        return false;
+    
+    for (uint64_t i = 0; i < h->module_count; i++)
+    {
+        uint64_t offset = modules()[i].path_offset;
+        if(offset >= h->strings_size || !memchr(strings + offset, 0, h->strings_size - offset))
+            return false;
+    }
+    
+    // Lookups binary search the regions, they must be sorted and apart; blobs and page maps stay in their areas
+    const SnapshotRegion_t* table = regions();
+    for (uint64_t i = 0; i < h->region_count; i++)
+    {
+        const SnapshotRegion_t& region = table[i];
+        if(region.size == 0 || region.address + region.size < region.address ||
+           (i > 0 && table[i - 1].address + table[i - 1].size > region.address))
+            return false;
+        
+        if(!(region.flags & kSnapshotRegionCaptured))
+            continue;
+        
+        uint64_t pages = region.size / h->page_size + (region.size % h->page_size != 0);
+        if(region.data_offset < h->data_offset || !Fits(region.data_offset, pages, h->page_size, _size) ||
+           (region.page_map && (region.page_map < h->map_offset || !Fits(region.page_map, pages, 1, h->map_offset + h->map_size))))
+            return false;
+    }
+    
+    return true;
+}
+
+kern_return_t Snapshot::Close()
+{
+    if(_base)
+        munmap((void *)_base, _size);
+    
+    delete _parent;
+    _parent = nullptr;
+    _base = nullptr;
+    _size = 0;
+    return KERN_SUCCESS;
+}
+
+const SnapshotRegion_t* Snapshot::FindRegion( mach_vm_address_t address ) const
+{
+    if(!_base)
+        return nullptr;
+    
+    const SnapshotRegion_t* first = regions();
+    const SnapshotRegion_t* last  = first + header()->region_count;
+    const SnapshotRegion_t* it = std::lower_bound(first, last, address, SnapshotRegionLess);
+    if(it == last || it->address > address)
+        return nullptr;
+    
+    return it;
+}
+
+const uint8_t * Snapshot::RegionData( const SnapshotRegion_t* region ) const
+{
+    if(!(region->flags & kSnapshotRegionCaptured) || (region->flags & kSnapshotRegionInherits) ||
+       region->data_offset + region->size > _size)
+        return nullptr;
+    
+    return _base + region->data_offset;
+}
+
+const uint8_t * Snapshot::PageData( mach_vm_address_t address ) const
+{
+    const SnapshotRegion_t* region = FindRegion(address);
+    if(region == nullptr || !(region->flags & kSnapshotRegionCaptured))
+        return nullptr;
+    
+    uint64_t page = header()->page_size;
+    uint64_t offset = (address - region->address) & ~(page - 1);
+    if(PageState(region, address) & kSnapshotPageLocal)
+        return region->data_offset + offset + page <= _size ? _base + region->data_offset + offset : nullptr;
+    
+    return _parent ? _parent->PageData(region->address + offset) : nullptr;
+}
+
+uint8_t Snapshot::PageState( const SnapshotRegion_t* region, mach_vm_address_t address ) const
+{
+    uint64_t index = region->page_map + (address - region->address) / header()->page_size;
+    if(!region->page_map || index >= header()->map_offset + header()->map_size)
+        return kSnapshotPageLocal;
+    
+    return _base[index];
+}
+
+bool Snapshot::ReadZeroFilled( ProcessMemory& memory, mach_vm_address_t address, mach_vm_size_t size, uint8_t * buffer )
+{
+    if(memory.TryRead(address, size, buffer) == KERN_SUCCESS)
+        return true;
+    
+    // Retry page by page, leaving zeros where the region is not backed
+    mach_vm_size_t page = getpagesize();
+    bool complete = true;
+    for (mach_vm_size_t offset = 0; offset < size; )
+    {
+        mach_vm_size_t count = std::min<mach_vm_size_t>(page - ((address + offset) & (page - 1)), size - offset);
+        if(memory.TryRead(address + offset, count, buffer + offset) != KERN_SUCCESS)
+        {
+            memset(buffer + offset, 0, count);
+            complete = false;
+        }
+        offset += count;
+    }
+    
+    return complete;
+}
+
+void Snapshot::DescribeRegion( const MemoryRegion_t& region, SnapshotRegion_t& entry )
+{
+    memset(&entry, 0, sizeof(entry));
+    entry.address          = region.address;
+    entry.size             = region.size;
+    entry.protection       = region.info.protection;
+    entry.max_protection   = region.info.max_protection;
+    entry.inheritance      = region.info.inheritance;
+    entry.shared           = region.info.shared;
+    entry.reserved         = region.info.reserved;
+    entry.behavior         = region.info.behavior;
+    entry.offset           = region.info.offset;
+    entry.user_wired_count = region.info.user_wired_count;
+}
+
+void Snapshot::RestoreRegion( const SnapshotRegion_t& entry, MemoryRegion_t& region )
+{
+    memset(&region, 0, sizeof(region));
+    region.address               = entry.address;
+    region.size                  = entry.size;
+    region.info.protection       = entry.protection;
+    region.info.max_protection   = entry.max_protection;
+    region.info.inheritance      = entry.inheritance;
+    region.info.shared           = entry.shared;
+    region.info.reserved         = entry.reserved;
+    region.info.offset           = entry.offset;
+    region.info.behavior         = entry.behavior;
+    region.info.user_wired_count = (unsigned short)entry.user_wired_count;
+}
+
+void Snapshot::DescribeModules( const std::vector<ModuleData_t>& modules, std::vector<SnapshotModule_t>& table, std::vector<char>& strings )
+{
+    for (std::vector<ModuleData_t>::const_iterator it = modules.begin(); it != modules.end(); ++it)
+    {
+        SnapshotModule_t entry;
+        entry.load_address = (uint64_t)it->imageLoadAddress;
+        entry.mod_date     = it->imageFileModDate;
+        entry.path_offset  = strings.size();
+        const char * path = it->imageFilePath ? it->imageFilePath : "";
+        strings.insert(strings.end(), path, path + strlen(path) + 1);
+        table.push_back(entry);
+    }
+}
+
+SnapshotSource::SnapshotSource()
+{
+}
+
+SnapshotSource::~SnapshotSource()
+{
+}
+
+kern_return_t SnapshotSource::Open( const char * path )
+{
+    return _snapshot.Open(path);
+}
+
+kern_return_t SnapshotSource::Read( mach_vm_address_t address, mach_vm_size_t size, void * buffer )
+{
+    uint8_t *out = (uint8_t *)buffer;
+    
+    // Reads may straddle adjacent regions, like they do on a live task
+    while(size > 0)
+    {
+        const SnapshotRegion_t* region = _snapshot.FindRegion(address);
+        if(region == nullptr)
+            return KERN_INVALID_ADDRESS;
+        
+        mach_vm_size_t count = std::min(size, region->address + region->size - address);
+        const uint8_t * data = _snapshot.RegionData(region);
+        if(data)
+        {
+            memcpy(out, data + (address - region->address), count);
+        }
+        else
+        {
+            // Incremental region, each page may come from a different snapshot of the chain
+            mach_vm_size_t page = _snapshot.header()->page_size;
+            const uint8_t * page_data = _snapshot.PageData(address);
+            if(page_data == nullptr)
+                return KERN_PROTECTION_FAILURE;
+            
+            count = std::min(count, page - (address & (page - 1)));
+            memcpy(out, page_data + (address & (page - 1)), count);
+        }
+        
+        out     += count;
+        address += count;
+        size    -= count;
+    }
+    
+    return KERN_SUCCESS;
+}
+
+kern_return_t SnapshotSource::QueryRegions( std::vector<MemoryRegion_t>& regions )
+{
+    if(!_snapshot.isOpen())
+        return KERN_INVALID_ARGUMENT;
+    
+    const SnapshotRegion_t* table = _snapshot.regions();
+    for (uint64_t i = 0; i < _snapshot.header()->region_count; i++)
+    {
+        MemoryRegion_t region;
+        Snapshot::RestoreRegion(table[i], region);
+        regions.push_back(region);
+    }
+    
+    return KERN_SUCCESS;
+}
+
+kern_return_t SnapshotSource::QueryModules( std::vector<ModuleData_t>& modules )
+{
+    if(!_snapshot.isOpen())
+        return KERN_INVALID_ARGUMENT;
+    
+    const SnapshotModule_t* table = _snapshot.modules();
+    for (uint64_t i = 0; i < _snapshot.header()->module_count; i++)
+    {
+        ModuleData_t module;
+        module.imageLoadAddress = (const struct mach_header*)table[i].load_address;
+        module.imageFilePath    = _snapshot.string(table[i].path_offset);
+        module.imageFileModDate = (uintptr_t)table[i].mod_date;
+        modules.push_back(module);
+    }
+    
+    return KERN_SUCCESS;
+}
+
+const void * SnapshotSource::Map( mach_vm_address_t address, mach_vm_size_t size )
+{
+    const SnapshotRegion_t* region = _snapshot.FindRegion(address);
+    if(region == nullptr || address + size > region->address + region->size)
+        return nullptr;
+    
+    const uint8_t * data = _snapshot.RegionData(region);
+    if(data)
+        return data + (address - region->address);
+    
+    // Inherited pages are only contiguous within a page
+    mach_vm_size_t page = _snapshot.header()->page_size;
+    if(size == 0 || (address & (page - 1)) + size > page)
+        return nullptr;
+    
+    data = _snapshot.PageData(address);
+    return data ? data + (address & (page - 1)) : nullptr;
+}
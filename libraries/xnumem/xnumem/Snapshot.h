@@ -0,0 +1,271 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+#ifndef __xnumem__Snapshot__
+#define __xnumem__Snapshot__
+
+#include <mach/mach.h>
+#include <stdint.h>
+#include <vector>
+
+#include "MemorySource.h"
+#include "ProcessModules.h"
+
+class ScanJob;
+
+#define kSnapshotMagic      "XNUSNAP"
+#define kSnapshotVersion    2
+#define kSnapshotNoParent   (~0ULL)
+
+// On-disk layout, all offsets are from the start of the file:
+//
+//   SnapshotHeader_t
+//   SnapshotRegion_t[region_count]     sorted by address
+//   SnapshotModule_t[module_count]
+//   string table                       NUL terminated module and parent paths
+//   page maps                          one kSnapshotPage* byte per captured page
+//   data blobs                         one per captured region, page aligned
+//
+// The tables are used in place from the mapping, they are only bounds checked on open.
+//
+// An incremental snapshot names its parent. Pages without kSnapshotPageLocal were
+// unchanged since the parent and are read from it (and so on down the chain), their
+// range in the data blob is a hole.
+
+typedef struct SnapshotHeader {
+    char     magic[8];              // kSnapshotMagic
+    uint32_t version;               // kSnapshotVersion
+    uint32_t page_size;             // page size of the captured task
+    int32_t  pid;                   // captured process
+    char     comm[20];              // process name
+    uint64_t created;               // time(), seconds
+    uint64_t region_count;
+    uint64_t region_offset;
+    uint64_t module_count;
+    uint64_t module_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    uint64_t identity;              // unique per capture, checked by children
+    uint64_t parent_identity;
+    uint64_t parent_path;           // string offset, kSnapshotNoParent for a full snapshot
+    uint64_t map_offset;            // page maps
+    uint64_t map_size;
+    uint64_t data_offset;           // first data blob
+    uint64_t file_size;
+} SnapshotHeader_t;
+
+enum {
+    kSnapshotRegionCaptured = 1 << 0,   // data blob holds the region contents
+    kSnapshotRegionPartial  = 1 << 1,   // some pages could not be read and are zero
+    kSnapshotRegionInherits = 1 << 2,   // some pages are held by the parent
+};
+
+enum {
+    kSnapshotPageLocal = 1 << 0,        // page is in this snapshot's data blob
+    kSnapshotPageClean = 1 << 1,        // page was clean or untouched at capture
+};
+
+typedef struct SnapshotRegion {
+    uint64_t address;
+    uint64_t size;
+    int32_t  protection;
+    int32_t  max_protection;
+    uint32_t inheritance;
+    uint32_t shared;
+    uint32_t reserved;
+    int32_t  behavior;
+    uint64_t offset;                // vm_region_basic_info offset
+    uint32_t user_wired_count;
+    uint32_t flags;                 // kSnapshotRegion*
+    uint64_t data_offset;           // blob offset, 0 if not captured
+    uint64_t page_map;              // page map offset, 0 if not captured
+} SnapshotRegion_t;
+
+typedef struct SnapshotModule {
+    uint64_t load_address;
+    uint64_t mod_date;
+    uint64_t path_offset;           // into the string table
+} SnapshotModule_t;
+
+/**
+ Read-only, memory mapped snapshot of a process.
+ */
+class Snapshot
+{
+public:
+    Snapshot();
+    ~Snapshot();
+    
+    /**
+     Capture all regions and modules of an attached process into a snapshot file.
+     Readable regions are read in parallel on the shared scheduler.
+     
+     @param process -- Attached process.
+     @param path    -- Output file.
+     @param job     -- Cancellation / progress. (optional)
+     @param scope   -- Only capture these pages; the snapshot then holds the clipped regions only. (optional)
+     @return Status.
+     */
+    static kern_return_t Capture( class xnu_proc& process, const char * path, ScanJob* job = nullptr, const ScanScope* scope = nullptr );
+    
+    /**
+     Capture only what changed since a previous snapshot of the same process. Mach has no
+     soft-dirty tracking, so page dispositions decide what has to be looked at: pages that
+     were clean or untouched in a private anonymous mapping at both captures cannot have been
+     written in between and are inherited without being read; clean file-backed pages follow
+     their file and are always read. Everything else is read in coalesced
+     runs and compared against the previous contents; only pages that differ are stored.
+     The previous snapshot must stay in place, it is opened along with this one.
+     
+     @param process  -- Attached process.
+     @param path     -- Output file.
+     @param previous -- Snapshot (full or incremental) to build on.
+     @param job      -- Cancellation / progress. (optional)
+     @param scope    -- Only capture these pages, best the scope of the previous capture. (optional)
+     @return Status.
+     */
+    static kern_return_t CaptureIncremental( class xnu_proc& process, const char * path, const char * previous, ScanJob* job = nullptr,
+                                             const ScanScope* scope = nullptr );
+    
+    /**
+     Map a snapshot file and the snapshots it builds on. The header, tables and strings
+     are checked against the file size once, so nothing read later can point outside it.
+     
+     @param path -- Snapshot file.
+     @return Status.
+     */
+    kern_return_t Open( const char * path );
+    
+    /**
+     Unmap the snapshot.
+     
+     @param void
+     @return Status.
+     */
+    kern_return_t Close();
+    
+    /**
+     Region containing an address.
+     
+     @param address -- Memory address.
+     @return Region entry, nullptr if the address was not mapped.
+     */
+    const SnapshotRegion_t* FindRegion( mach_vm_address_t address ) const;
+    
+    /**
+     Captured bytes of a region.
+     
+     @param region -- Region entry.
+     @return Pointer into the mapping, nullptr if the region was not captured or
+             some of its pages are inherited (see PageData).
+     */
+    const uint8_t * RegionData( const SnapshotRegion_t* region ) const;
+    
+    /**
+     Captured page, wherever it is held in the snapshot chain.
+     
+     @param address -- Memory address.
+     @return Start of the page containing address, nullptr if it was not captured.
+     */
+    const uint8_t * PageData( mach_vm_address_t address ) const;
+    
+    /**
+     Page map entry.
+     
+     @param region  -- Region entry.
+     @param address -- Memory address within the region.
+     @return kSnapshotPage* bits.
+     */
+    uint8_t PageState( const SnapshotRegion_t* region, mach_vm_address_t address ) const;
+    
+    /**
+     Read a range, zero-filling pages that can't be read.
+     
+     @param memory  -- Process memory.
+     @param address -- Memory address.
+     @param size    -- Size to read.
+     @param buffer  -- Output buffer.
+     @return true if every page was read.
+     */
+    static bool ReadZeroFilled( class ProcessMemory& memory, mach_vm_address_t address, mach_vm_size_t size, uint8_t * buffer );
+    
+    // Table entry conversions, shared with SnapshotStore manifests
+    static void DescribeRegion( const MemoryRegion_t& region, SnapshotRegion_t& entry );
+    static void RestoreRegion( const SnapshotRegion_t& entry, MemoryRegion_t& region );
+    static void DescribeModules( const std::vector<ModuleData_t>& modules, std::vector<SnapshotModule_t>& table, std::vector<char>& strings );
+    
+    inline bool isOpen() const { return _base != nullptr; }
+    inline const SnapshotHeader_t* header() const { return (const SnapshotHeader_t*)_base; }
+    inline const SnapshotRegion_t* regions() const { return (const SnapshotRegion_t*)(_base + header()->region_offset); }
+    inline const SnapshotModule_t* modules() const { return (const SnapshotModule_t*)(_base + header()->module_offset); }
+    inline const char * string( uint64_t offset ) const { return (const char *)(_base + header()->strings_offset + offset); }
+    inline const Snapshot* parent() const { return _parent; }
+    
+private:
+    Snapshot( const Snapshot& ) = delete;
+    Snapshot& operator =(const Snapshot&) = delete;
+    
+    static kern_return_t Write( class xnu_proc& process, const char * path, const Snapshot* parent, const char * parent_path, ScanJob* job,
+                                const ScanScope* scope );
+    kern_return_t Open( const char * path, unsigned depth );
+    
+    // Every table, region and string stays within the mapping
+    bool Validate() const;
+    
+    const uint8_t * _base;
+    size_t          _size;
+    Snapshot       *_parent;            // Previous snapshot of an incremental one
+};
+
+/**
+ MemorySource backed by a snapshot file, so ProcessMemory and the scanners can run
+ against it as if it were a live process:
+ 
+    SnapshotSource source;
+    source.Open("service.snap");
+    xnu_proc process;
+    process.Attach(&source);
+ */
+class SnapshotSource : public MemorySource
+{
+public:
+    SnapshotSource();
+    ~SnapshotSource();
+    
+    /**
+     Map a snapshot file.
+     
+     @param path -- Snapshot file.
+     @return Status.
+     */
+    kern_return_t Open( const char * path );
+    
+    virtual kern_return_t Read( mach_vm_address_t address, mach_vm_size_t size, void * buffer );
+    virtual kern_return_t QueryRegions( std::vector<MemoryRegion_t>& regions );
+    virtual kern_return_t QueryModules( std::vector<ModuleData_t>& modules );
+    virtual const void * Map( mach_vm_address_t address, mach_vm_size_t size );
+    
+    inline Snapshot& snapshot() { return _snapshot; }
+    
+private:
+    Snapshot _snapshot;
+};
+
+#endif /* defined(__xnumem__Snapshot__) */
@@ -0,0 +1,746 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+#include "SnapshotStore.h"
+#include "Epoch.h"
+#include "Scheduler.h"
+#include "Trace.h"
+#include "xnumem.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+
+static const Hash128_t kZeroPage = { 0, 0 };
+static const uint64_t kCheckSeed = 0xc2b2ae3d27d4eb4fULL;    // unlike either lane of Hash128
+
+static bool IsZeroPage( const uint8_t * data, size_t size )
+{
+    const uint64_t *words = (const uint64_t *)data;
+    for (size_t i = 0; i < size / sizeof(uint64_t); i++)
+    {
+        if(words[i])
+            return false;
+    }
+    return true;
+}
+
+static kern_return_t ReadFile( const std::string& path, std::vector<uint8_t>& data )
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        return errno == ENOENT ? KERN_NOT_FOUND : KERN_FAILURE;
+    
+    struct stat st;
+    if(fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return KERN_FAILURE;
+    }
+    
+    data.resize((size_t)st.st_size);
+    ssize_t count = data.empty() ? 0 : pread(fd, data.data(), data.size(), 0);
+    close(fd);
+    
+    return count == (ssize_t)data.size() ? KERN_SUCCESS : KERN_FAILURE;
+}
+
+// Write to a temporary file and rename over the target, so readers never see half a file
+static kern_return_t WriteFileAtomic( const std::string& path, const void * data, size_t size )
+{
+    std::string temp = path + ".tmp";
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+        return KERN_FAILURE;
+    
+    bool ok = write(fd, data, size) == (ssize_t)size && fsync(fd) == 0;
+    close(fd);
+    
+    if(!ok || rename(temp.c_str(), path.c_str()) != 0)
+    {
+        unlink(temp.c_str());
+        return KERN_FAILURE;
+    }
+    
+    return KERN_SUCCESS;
+}
+
+// count items of size bytes at offset end at or before limit, without overflowing
+static bool Fits( uint64_t offset, uint64_t count, uint64_t size, uint64_t limit )
+{
+    return offset <= limit && count <= (limit - offset) / size;
+}
+
+static bool ValidManifest( const uint8_t * data, size_t size )
+{
+    if(size < sizeof(StoreManifestHeader_t))
+        return false;
+    
+    const StoreManifestHeader_t* h = (const StoreManifestHeader_t*)data;
+    if(memcmp(h->magic, kStoreManifestMagic, sizeof(kStoreManifestMagic)) != 0 ||
+       h->version != kStoreVersion ||
+       !Fits(h->region_offset, h->region_count, sizeof(SnapshotRegion_t), h->module_offset) ||
+       !Fits(h->module_offset, h->module_count, sizeof(SnapshotModule_t), h->strings_offset) ||
+       !Fits(h->strings_offset, h->strings_size, 1, h->hash_offset) ||
+       !Fits(h->hash_offset, h->hash_count, sizeof(Hash128_t), size))
+        return false;
+    
+    // Module paths are handed out as C strings, each must end inside the table
+    const char * strings = (const char *)data + h->strings_offset;
+    const SnapshotModule_t* modules = (const SnapshotModule_t*)(data + h->module_offset);
+    for (uint64_t i = 0; i < h->module_count; i++)
+    {
+        uint64_t offset = modules[i].path_offset;
+        if(offset >= h->strings_size || !memchr(strings + offset, 0, h->strings_size - offset))
+            return false;
+    }
+    
+    // Lookups binary search the regions, they must be sorted and apart
+    const SnapshotRegion_t* regions = (const SnapshotRegion_t*)(data + h->region_offset);
+    for (uint64_t i = 0; i < h->region_count; i++)
+    {
+        const SnapshotRegion_t& region = regions[i];
+        if(region.size == 0 || region.address + region.size < region.address ||
+           (i > 0 && regions[i - 1].address + regions[i - 1].size > region.address))
+            return false;
+    }
+    
+    return true;
+}
+
+SnapshotStore::SnapshotStore() : _pack(-1), _page_size(0), _slot_count(0)
+{
+}
+
+SnapshotStore::~SnapshotStore()
+{
+    Close();
+}
+
+kern_return_t SnapshotStore::Open( const char * directory )
+{
+    Close();
+    
+    if(mkdir(directory, 0755) != 0 && errno != EEXIST)
+        return KERN_FAILURE;
+    
+    _directory = directory;
+    _pack = open((_directory + "/pages").c_str(), O_RDWR | O_CREAT, 0644);
+    if(_pack < 0)
+        return KERN_FAILURE;
+    
+    kern_return_t kret = LoadIndex();
+    if(kret != KERN_SUCCESS)
+        Close();
+    
+    return kret;
+}
+
+kern_return_t SnapshotStore::Close()
+{
+    kern_return_t kret = KERN_SUCCESS;
+    if(_pack >= 0)
+    {
+        kret = SaveIndex();
+        close(_pack);
+    }
+    
+    _pack = -1;
+    _page_size = 0;
+    _slot_count = 0;
+    _entries.clear();
+    _free.clear();
+    _released.clear();
+    return kret;
+}
+
+kern_return_t SnapshotStore::LoadIndex()
+{
+    std::vector<uint8_t> data;
+    kern_return_t kret = ReadFile(_directory + "/index", data);
+    if(kret == KERN_NOT_FOUND)
+    {
+        // New store
+        _page_size = getpagesize();
+        return KERN_SUCCESS;
+    }
+    if(kret != KERN_SUCCESS)
+        return kret;
+    
+    if(data.size() < sizeof(StoreIndexHeader_t))
+        return KERN_INVALID_ARGUMENT;
+    
+    const StoreIndexHeader_t* header = (const StoreIndexHeader_t*)data.data();
+    if(memcmp(header->magic, kStoreIndexMagic, sizeof(kStoreIndexMagic)) != 0 || header->version != kStoreVersion ||
+       !Fits(sizeof(StoreIndexHeader_t), header->entry_count, sizeof(StoreIndexEntry_t), data.size()) ||
+       !Fits(sizeof(StoreIndexHeader_t) + header->entry_count * sizeof(StoreIndexEntry_t), header->free_count, sizeof(uint64_t), data.size()))
+        return KERN_INVALID_ARGUMENT;
+    
+    _page_size  = header->page_size;
+    _slot_count = header->slot_count;
+    
+    const StoreIndexEntry_t* entries = (const StoreIndexEntry_t*)(header + 1);
+    _entries.reserve(header->entry_count);
+    for (uint64_t i = 0; i < header->entry_count; i++)
+    {
+        Entry entry = { entries[i].slot, entries[i].refs, entries[i].check, entries[i].length };
+        _entries[entries[i].hash] = entry;
+    }
+    
+    const uint64_t * free_slots = (const uint64_t *)(entries + header->entry_count);
+    _free.assign(free_slots, free_slots + header->free_count);
+    
+    return KERN_SUCCESS;
+}
+
+kern_return_t SnapshotStore::SaveIndex()
+{
+    // Slots released since the last save go on disk as free before they can be reused
+    std::vector<uint8_t> data(sizeof(StoreIndexHeader_t) + _entries.size() * sizeof(StoreIndexEntry_t) + (_free.size() + _released.size()) * sizeof(uint64_t));
+    
+    StoreIndexHeader_t* header = (StoreIndexHeader_t*)data.data();
+    memcpy(header->magic, kStoreIndexMagic, sizeof(kStoreIndexMagic));
+    header->version     = kStoreVersion;
+    header->page_size   = _page_size;
+    header->slot_count  = _slot_count;
+    header->entry_count = _entries.size();
+    header->free_count  = _free.size() + _released.size();
+    
+    StoreIndexEntry_t* entry = (StoreIndexEntry_t*)(header + 1);
+    for (EntryMap::const_iterator it = _entries.begin(); it != _entries.end(); ++it, ++entry)
+    {
+        entry->hash   = it->first;
+        entry->slot   = it->second.slot;
+        entry->refs   = it->second.refs;
+        entry->check  = it->second.check;
+        entry->length = it->second.length;
+    }
+    
+    uint64_t * free_slots = (uint64_t *)entry;
+    if(!_free.empty())
+        memcpy(free_slots, _free.data(), _free.size() * sizeof(uint64_t));
+    if(!_released.empty())
+        memcpy(free_slots + _free.size(), _released.data(), _released.size() * sizeof(uint64_t));
+    
+    // Page data must be durable before the index points at it
+    fsync(_pack);
+    kern_return_t kret = WriteFileAtomic(_directory + "/index", data.data(), data.size());
+    if(kret != KERN_SUCCESS)
+        return kret;
+    
+    for (std::vector<uint64_t>::const_iterator it = _released.begin(); it != _released.end(); ++it)
+    {
+#ifdef F_PUNCHHOLE
+        // Give the disk space back, the slot keeps its place in the pack
+        fpunchhole_t hole;
+        memset(&hole, 0, sizeof(hole));
+        hole.fp_offset = (off_t)(*it * _page_size);
+        hole.fp_length = _page_size;
+        fcntl(_pack, F_PUNCHHOLE, &hole);
+#endif
+        _free.push_back(*it);
+    }
+    _released.clear();
+    
+    return KERN_SUCCESS;
+}
+
+std::string SnapshotStore::ManifestPath( const char * name ) const
+{
+    return _directory + "/" + name + ".manifest";
+}
+
+int64_t SnapshotStore::SlotOf( const Hash128_t& hash ) const
+{
+    std::lock_guard<std::mutex> lock(const_cast<std::mutex&>(_lock));
+    EntryMap::const_iterator it = _entries.find(hash);
+    return it == _entries.end() ? -1 : (int64_t)it->second.slot;
+}
+
+void SnapshotStore::Release( const Hash128_t* hashes, size_t count )
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    for (size_t i = 0; i < count; i++)
+    {
+        if(hashes[i] == kZeroPage)
+            continue;
+        
+        EntryMap::iterator it = _entries.find(hashes[i]);
+        if(it == _entries.end() || --it->second.refs > 0)
+            continue;
+        
+        // The saved index may still map the hash to this slot, keep it until it no longer does
+        _released.push_back(it->second.slot);
+        _entries.erase(it);
+    }
+}
+
+kern_return_t SnapshotStore::Capture( xnu_proc& process, const char * name, ScanJob* job /* = nullptr */, const ScanScope* scope /* = nullptr */ )
+{
+    TraceSpan span("Capture", "SnapshotStore");
+    if(_pack < 0)
+        return KERN_INVALID_ARGUMENT;
+    if(_page_size != (uint32_t)getpagesize())
+        return KERN_NOT_SUPPORTED;
+    
+    ProcessMemory& memory = process.memory();
+    EpochGuard guard;
+    std::vector<MemoryRegion_t> scoped;
+    if(scope)
+        scope->Clip(memory.segments(), scoped);
+    const std::vector<MemoryRegion_t>& segments = scope ? scoped : memory.segments();
+    const uint64_t page = _page_size;
+    
+    StoreManifestHeader_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kStoreManifestMagic, sizeof(kStoreManifestMagic));
+    header.version   = kStoreVersion;
+    header.page_size = _page_size;
+    header.pid       = process.pid();
+    header.created   = (uint64_t)time(NULL);
+    if(process.core().pinfo_proc())
+        strncpy(header.comm, process.core().pinfo_proc()->kp_proc.p_comm, sizeof(header.comm) - 1);
+    
+    std::vector<SnapshotModule_t> module_table;
+    std::vector<char> strings;
+    Snapshot::DescribeModules(process.modules().modules(), module_table, strings);
+    
+    // One hash per page of every readable region
+    std::vector<SnapshotRegion_t> region_table(segments.size());
+    std::vector<AddressRange_t> ranges;
+    uint64_t page_count = 0;
+    for (size_t i = 0; i < segments.size(); i++)
+    {
+        Snapshot::DescribeRegion(segments[i], region_table[i]);
+        if(segments[i].info.protection & VM_PROT_READ)
+        {
+            region_table[i].flags       = kSnapshotRegionCaptured;
+            region_table[i].data_offset = page_count;
+            page_count += (segments[i].size + page - 1) / page;
+            
+            AddressRange_t range = { segments[i].address, segments[i].address + segments[i].size };
+            ranges.push_back(range);
+        }
+    }
+    
+    // Zero means "zero page" or "not counted yet", so a failed capture can release exactly what it took
+    std::vector<Hash128_t> hashes(page_count, kZeroPage);
+    std::vector<std::atomic<uint32_t> > partial(region_table.size());
+    SchedulerGuard scheduling;   // per-worker state below stays sized for the workers that run
+    std::vector<std::vector<uint8_t> > buffers(scheduling.workers());
+    std::atomic<bool> io_error(false);
+    std::atomic<bool> collided(false);
+    
+    kern_return_t kret = Scheduler::Shared().ForEachChunk(ranges, [&](const ScanChunk_t& chunk, unsigned worker) {
+        size_t index = RegionIndex::Find(segments, chunk.address) - segments.data();
+        const SnapshotRegion_t& entry = region_table[index];
+        
+        std::vector<uint8_t>& buffer = buffers[worker];
+        buffer.resize(chunk.size);
+        if(!Snapshot::ReadZeroFilled(memory, chunk.address, chunk.size, buffer.data()))
+            partial[index].store(kSnapshotRegionPartial, std::memory_order_relaxed);
+        
+        // Hash outside the lock, then account for the whole chunk at once
+        size_t pages = (size_t)((chunk.size + page - 1) / page);
+        uint64_t first = entry.data_offset + (chunk.address - entry.address) / page;
+        std::vector<Hash128_t> local(pages, kZeroPage);
+        std::vector<uint64_t> checks(pages, 0);
+        for (size_t i = 0; i < pages; i++)
+        {
+            size_t size = (size_t)std::min<uint64_t>(page, chunk.size - i * page);
+            if(!IsZeroPage(buffer.data() + i * page, size))
+            {
+                local[i]  = Hash128(buffer.data() + i * page, size);
+                checks[i] = Hash64(buffer.data() + i * page, size, kCheckSeed);
+            }
+        }
+        
+        std::vector<std::pair<uint64_t, size_t> > writes;
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            for (size_t i = 0; i < pages; i++)
+            {
+                if(local[i] == kZeroPage)
+                    continue;
+                
+                uint32_t length = (uint32_t)std::min<uint64_t>(page, chunk.size - i * page);
+                EntryMap::iterator it = _entries.find(local[i]);
+                if(it != _entries.end())
+                {
+                    // Same hash, different page: refuse rather than alias the two
+                    if(it->second.check != checks[i] || it->second.length != length)
+                    {
+                        collided.store(true, std::memory_order_relaxed);
+                        continue;
+                    }
+                    it->second.refs++;
+                }
+                else
+                {
+                    uint64_t slot;
+                    if(!_free.empty())
+                    {
+                        slot = _free.back();
+                        _free.pop_back();
+                    }
+                    else
+                    {
+                        slot = _slot_count++;
+                    }
+                    Entry created = { slot, 1, checks[i], length };
+                    _entries[local[i]] = created;
+                    writes.push_back(std::make_pair(slot, i));
+                }
+                hashes[first + i] = local[i];
+            }
+        }
+        
+        // Only pages the store has never seen hit the disk
+        for (size_t i = 0; i < writes.size(); i++)
+        {
+            size_t size = (size_t)std::min<uint64_t>(page, chunk.size - writes[i].second * page);
+            uint8_t * data = buffer.data() + writes[i].second * page;
+            if(size < page)
+            {
+                // Partial trailing page, pad it like the pack slot expects
+                std::vector<uint8_t> padded(page, 0);
+                memcpy(padded.data(), data, size);
+                if(pwrite(_pack, padded.data(), page, (off_t)(writes[i].first * page)) != (ssize_t)page)
+                    io_error.store(true, std::memory_order_relaxed);
+            }
+            else if(pwrite(_pack, data, page, (off_t)(writes[i].first * page)) != (ssize_t)page)
+            {
+                io_error.store(true, std::memory_order_relaxed);
+            }
+        }
+    }, job);
+    
+    if(kret == KERN_SUCCESS && (io_error || collided))
+        kret = KERN_FAILURE;
+    
+    if(kret != KERN_SUCCESS)
+    {
+        Release(hashes.data(), hashes.size());
+        SaveIndex();
+        return kret;
+    }
+    
+    for (size_t i = 0; i < region_table.size(); i++)
+        region_table[i].flags |= partial[i].load(std::memory_order_relaxed);
+    
+    header.region_count   = region_table.size();
+    header.region_offset  = sizeof(StoreManifestHeader_t);
+    header.module_count   = module_table.size();
+    header.module_offset  = header.region_offset + header.region_count * sizeof(SnapshotRegion_t);
+    header.strings_offset = header.module_offset + header.module_count * sizeof(SnapshotModule_t);
+    header.strings_size   = strings.size();
+    header.hash_count     = hashes.size();
+    header.hash_offset    = (header.strings_offset + header.strings_size + 15) & ~15ULL;
+    
+    std::vector<uint8_t> manifest(header.hash_offset + header.hash_count * sizeof(Hash128_t), 0);
+    memcpy(manifest.data(), &header, sizeof(header));
+    if(!region_table.empty())
+        memcpy(&manifest[header.region_offset], region_table.data(), region_table.size() * sizeof(SnapshotRegion_t));
+    if(!module_table.empty())
+        memcpy(&manifest[header.module_offset], module_table.data(), module_table.size() * sizeof(SnapshotModule_t));
+    if(!strings.empty())
+        memcpy(&manifest[header.strings_offset], strings.data(), strings.size());
+    if(!hashes.empty())
+        memcpy(&manifest[header.hash_offset], hashes.data(), hashes.size() * sizeof(Hash128_t));
+    
+    // A snapshot of the same name is replaced; its pages are released once the new manifest is in place
+    std::vector<uint8_t> previous;
+    bool replacing = ReadFile(ManifestPath(name), previous) == KERN_SUCCESS && ValidManifest(previous.data(), previous.size());
+    
+    // The index holding the new pages goes first, a crash in between only leaks their slots
+    kret = SaveIndex();
+    if(kret == KERN_SUCCESS)
+        kret = WriteFileAtomic(ManifestPath(name), manifest.data(), manifest.size());
+    if(kret != KERN_SUCCESS)
+    {
+        Release(hashes.data(), hashes.size());
+        SaveIndex();
+        return kret;
+    }
+    
+    if(replacing)
+    {
+        const StoreManifestHeader_t* old = (const StoreManifestHeader_t*)previous.data();
+        Release((const Hash128_t*)&previous[old->hash_offset], old->hash_count);
+    }
+    
+    return SaveIndex();
+}
+
+kern_return_t SnapshotStore::Remove( const char * name )
+{
+    if(_pack < 0)
+        return KERN_INVALID_ARGUMENT;
+    
+    std::vector<uint8_t> manifest;
+    kern_return_t kret = ReadFile(ManifestPath(name), manifest);
+    if(kret != KERN_SUCCESS)
+        return kret;
+    if(!ValidManifest(manifest.data(), manifest.size()))
+        return KERN_INVALID_ARGUMENT;
+    
+    if(unlink(ManifestPath(name).c_str()) != 0)
+        return KERN_FAILURE;
+    
+    const StoreManifestHeader_t* header = (const StoreManifestHeader_t*)manifest.data();
+    Release((const Hash128_t*)&manifest[header->hash_offset], header->hash_count);
+    
+    return SaveIndex();
+}
+
+kern_return_t SnapshotStore::List( std::vector<std::string>& names )
+{
+    DIR *dir = opendir(_directory.c_str());
+    if(dir == NULL)
+        return KERN_FAILURE;
+    
+    static const char kSuffix[] = ".manifest";
+    const size_t suffix = sizeof(kSuffix) - 1;
+    
+    struct dirent *entry;
+    while((entry = readdir(dir)) != NULL)
+    {
+        size_t length = strlen(entry->d_name);
+        if(length > suffix && strcmp(entry->d_name + length - suffix, kSuffix) == 0)
+            names.push_back(std::string(entry->d_name, length - suffix));
+    }
+    
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+    return KERN_SUCCESS;
+}
+
+StoreSource::StoreSource() :
+    _store(nullptr),
+    _manifest(nullptr),
+    _manifest_size(0),
+    _pack(nullptr),
+    _pack_size(0)
+{
+}
+
+StoreSource::~StoreSource()
+{
+    Close();
+}
+
+kern_return_t StoreSource::Open( SnapshotStore& store, const char * name )
+{
+    Close();
+    if(store._pack < 0)
+        return KERN_INVALID_ARGUMENT;
+    
+    int fd = open(store.ManifestPath(name).c_str(), O_RDONLY);
+    if(fd < 0)
+        return KERN_NOT_FOUND;
+    
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return KERN_INVALID_ARGUMENT;
+    }
+    
+    void * manifest = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(manifest == MAP_FAILED)
+        return KERN_FAILURE;
+    
+    _store         = &store;
+    _manifest      = (const uint8_t *)manifest;
+    _manifest_size = (size_t)st.st_size;
+    _zero.assign(store._page_size, 0);
+    
+    if(!ValidManifest(_manifest, _manifest_size) || header()->page_size != store._page_size)
+    {
+        Close();
+        return KERN_INVALID_ARGUMENT;
+    }
+    
+    // Every page of the manifest was written before it, so the current pack covers it
+    if(fstat(store._pack, &st) != 0)
+    {
+        Close();
+        return KERN_FAILURE;
+    }
+    
+    if(st.st_size > 0)
+    {
+        void * pack = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, store._pack, 0);
+        if(pack == MAP_FAILED)
+        {
+            Close();
+            return KERN_FAILURE;
+        }
+        _pack      = (const uint8_t *)pack;
+        _pack_size = (size_t)st.st_size;
+    }
+    
+    return KERN_SUCCESS;
+}
+
+kern_return_t StoreSource::Close()
+{
+    if(_manifest)
+        munmap((void *)_manifest, _manifest_size);
+    if(_pack)
+        munmap((void *)_pack, _pack_size);
+    
+    _store = nullptr;
+    _manifest = nullptr;
+    _manifest_size = 0;
+    _pack = nullptr;
+    _pack_size = 0;
+    return KERN_SUCCESS;
+}
+
+const SnapshotRegion_t* StoreSource::FindRegion( mach_vm_address_t address ) const
+{
+    if(!_manifest)
+        return nullptr;
+    
+    const SnapshotRegion_t* first = (const SnapshotRegion_t*)(_manifest + header()->region_offset);
+    const SnapshotRegion_t* last  = first + header()->region_count;
+    const SnapshotRegion_t* it = std::lower_bound(first, last, address,
+                                                  [](const SnapshotRegion_t& region, mach_vm_address_t address) {
+                                                      return region.address + region.size <= address;
+                                                  });
+    if(it == last || it->address > address)
+        return nullptr;
+    
+    return it;
+}
+
+const uint8_t * StoreSource::Page( const SnapshotRegion_t* region, mach_vm_address_t address ) const
+{
+    if(!(region->flags & kSnapshotRegionCaptured))
+        return nullptr;
+    
+    const uint64_t page = header()->page_size;
+    uint64_t index = region->data_offset + (address - region->address) / page;
+    if(index >= header()->hash_count)
+        return nullptr;
+    
+    const Hash128_t* hashes = (const Hash128_t*)(_manifest + header()->hash_offset);
+    if(hashes[index] == kZeroPage)
+        return _zero.data();
+    
+    int64_t slot = _store->SlotOf(hashes[index]);
+    if(slot < 0 || (uint64_t)(slot + 1) * page > _pack_size)
+        return nullptr;
+    
+    return _pack + slot * page;
+}
+
+kern_return_t StoreSource::Read( mach_vm_address_t address, mach_vm_size_t size, void * buffer )
+{
+    if(!_manifest)
+        return KERN_INVALID_ARGUMENT;
+    
+    const uint64_t page = header()->page_size;
+    uint8_t *out = (uint8_t *)buffer;
+    
+    while(size > 0)
+    {
+        const SnapshotRegion_t* region = FindRegion(address);
+        if(region == nullptr)
+            return KERN_INVALID_ADDRESS;
+        
+        const uint8_t * data = Page(region, address);
+        if(data == nullptr)
+            return KERN_PROTECTION_FAILURE;
+        
+        mach_vm_size_t offset = (address - region->address) % page;
+        mach_vm_size_t count = std::min(std::min(size, page - offset), region->address + region->size - address);
+        memcpy(out, data + offset, count);
+        
+        out     += count;
+        address += count;
+        size    -= count;
+    }
+    
+    return KERN_SUCCESS;
+}
+
+kern_return_t StoreSource::QueryRegions( std::vector<MemoryRegion_t>& regions )
+{
+    if(!_manifest)
+        return KERN_INVALID_ARGUMENT;
+    
+    const SnapshotRegion_t* table = (const SnapshotRegion_t*)(_manifest + header()->region_offset);
+    for (uint64_t i = 0; i < header()->region_count; i++)
+    {
+        MemoryRegion_t region;
+        Snapshot::RestoreRegion(table[i], region);
+        regions.push_back(region);
+    }
+    
+    return KERN_SUCCESS;
+}
+
+kern_return_t StoreSource::QueryModules( std::vector<ModuleData_t>& modules )
+{
+    if(!_manifest)
+        return KERN_INVALID_ARGUMENT;
+    
+    const SnapshotModule_t* table = (const SnapshotModule_t*)(_manifest + header()->module_offset);
+    const char * strings = (const char *)(_manifest + header()->strings_offset);
+    for (uint64_t i = 0; i < header()->module_count; i++)
+    {
+        ModuleData_t module;
+        module.imageLoadAddress = (const struct mach_header*)table[i].load_address;
+        module.imageFilePath    = strings + table[i].path_offset;
+        module.imageFileModDate = (uintptr_t)table[i].mod_date;
+        modules.push_back(module);
+    }
+    
+    return KERN_SUCCESS;
+}
+
+const void * StoreSource::Map( mach_vm_address_t address, mach_vm_size_t size )
+{
+    // Pages are scattered over the pack, only single page ranges can be mapped
+    if(!_manifest)
+        return nullptr;
+    
+    const uint64_t page = header()->page_size;
+    mach_vm_address_t page_start = address & ~(page - 1);
+    if(size == 0 || address + size > page_start + page)
+        return nullptr;
+    
+    const SnapshotRegion_t* region = FindRegion(address);
+    if(region == nullptr || address + size > region->address + region->size)
+        return nullptr;
+    
+    const uint8_t * data = Page(region, address);
+    return data ? data + (address - region->address) % page : nullptr;
+}
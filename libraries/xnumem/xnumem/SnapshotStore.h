@@ -0,0 +1,245 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+#ifndef __xnumem__SnapshotStore__
+#define __xnumem__SnapshotStore__
+
+#include <mach/mach.h>
+#include <stdint.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Hash.h"
+#include "MemorySource.h"
+#include "Snapshot.h"
+
+class ScanJob;
+
+#define kStoreIndexMagic    "XNUSIDX"
+#define kStoreManifestMagic "XNUSMAN"
+#define kStoreVersion       3
+
+// A store is a directory:
+//
+//   pages              pack file of page_size slots, each holding one distinct page
+//   index              StoreIndexHeader_t, StoreIndexEntry_t[entry_count], uint64_t free slots[free_count]
+//   <name>.manifest    one per snapshot
+//
+// A manifest has the layout of a snapshot file (header, SnapshotRegion_t table, module
+// table, strings) followed by one Hash128_t per captured page instead of data blobs.
+// There data_offset of a captured region is the index of its first page hash.
+// The all-zero hash stands for a zero page, which takes no slot.
+//
+// The index is written before the manifest that refers to its pages, and a freed slot is
+// only reused once an index that lists it as free is on disk. A crash can leak slots
+// but never leave a manifest pointing at a slot that holds another page.
+
+typedef struct StoreIndexHeader {
+    char     magic[8];              // kStoreIndexMagic
+    uint32_t version;               // kStoreVersion
+    uint32_t page_size;
+    uint64_t slot_count;            // slots in use or free in the pack file
+    uint64_t entry_count;
+    uint64_t free_count;
+} StoreIndexHeader_t;
+
+typedef struct StoreIndexEntry {
+    Hash128_t hash;
+    uint64_t  slot;
+    uint64_t  refs;                 // page references from all manifests
+    uint64_t  check;                // independent hash of the page, confirms a match on hash
+    uint32_t  length;               // bytes of the page that were captured, the rest of the slot is zero
+    uint32_t  reserved;
+} StoreIndexEntry_t;
+
+typedef struct StoreManifestHeader {
+    char     magic[8];              // kStoreManifestMagic
+    uint32_t version;               // kStoreVersion
+    uint32_t page_size;
+    int32_t  pid;
+    char     comm[20];
+    uint64_t created;
+    uint64_t region_count;
+    uint64_t region_offset;
+    uint64_t module_count;
+    uint64_t module_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    uint64_t hash_count;
+    uint64_t hash_offset;
+} StoreManifestHeader_t;
+
+/**
+ Content-addressed, deduplicated store for series of snapshots.
+ 
+ Every captured page is hashed and stored once; snapshots are manifests of page
+ hashes. Pages are reference counted across manifests and their slots are reused
+ once the last manifest referencing them is removed. Capture hashes pages in
+ parallel and only writes pages the store has not seen, so repeated captures of a
+ mostly idle process cost I/O in proportion to what changed.
+ 
+ A store is used by one process at a time.
+ */
+class SnapshotStore
+{
+    friend class StoreSource;
+public:
+    SnapshotStore();
+    ~SnapshotStore();
+    
+    /**
+     Open a store, creating the directory if needed.
+     
+     @param directory -- Store directory.
+     @return Status.
+     */
+    kern_return_t Open( const char * directory );
+    
+    /**
+     Save the index and close the store.
+     
+     @param void
+     @return Status.
+     */
+    kern_return_t Close();
+    
+    /**
+     Capture an attached process into a new manifest. Pages are shared with the pages
+     already stored when their hash, length and check hash all match; a hash that matches
+     while the others don't fails the capture rather than aliasing two pages.
+     
+     @param process -- Attached process.
+     @param name    -- Snapshot name, replaces an existing snapshot of that name.
+     @param job     -- Cancellation / progress. (optional)
+     @param scope   -- Only capture these pages. (optional)
+     @return Status.
+     */
+    kern_return_t Capture( class xnu_proc& process, const char * name, ScanJob* job = nullptr, const ScanScope* scope = nullptr );
+    
+    /**
+     Remove a snapshot and release its pages. Pages no longer referenced by any manifest
+     are freed and their slots reused.
+     
+     @param name -- Snapshot name.
+     @return Status.
+     */
+    kern_return_t Remove( const char * name );
+    
+    /**
+     Names of all snapshots in the store.
+     
+     @param names -- Output names.
+     @return Status.
+     */
+    kern_return_t List( std::vector<std::string>& names );
+    
+    // Distinct pages held, and pack file slots (held + free).
+    inline uint64_t pages() const { return _entries.size(); }
+    inline uint64_t slots() const { return _slot_count; }
+    inline uint32_t page_size() const { return _page_size; }
+    
+private:
+    SnapshotStore( const SnapshotStore& ) = delete;
+    SnapshotStore& operator =(const SnapshotStore&) = delete;
+    
+    struct Entry {
+        uint64_t slot;
+        uint64_t refs;
+        uint64_t check;
+        uint32_t length;
+    };
+    
+    typedef std::unordered_map<Hash128_t, Entry, Hash128Hasher> EntryMap;
+    
+    kern_return_t LoadIndex();
+    kern_return_t SaveIndex();
+    
+    // Slot holding a page, or -1
+    int64_t SlotOf( const Hash128_t& hash ) const;
+    
+    // Drop one reference to each hash; slots that reach zero are free after the next SaveIndex
+    void Release( const Hash128_t* hashes, size_t count );
+    
+    std::string ManifestPath( const char * name ) const;
+    
+    std::string           _directory;
+    int                   _pack;            // pack file descriptor, -1 when closed
+    uint32_t              _page_size;
+    uint64_t              _slot_count;
+    EntryMap              _entries;
+    std::vector<uint64_t> _free;
+    std::vector<uint64_t> _released;        // freed since the index was last saved, not reusable yet
+    std::mutex            _lock;            // guards _entries, _free, _released, _slot_count during capture
+};
+
+/**
+ MemorySource reading a stored snapshot, for analysing it like a live process.
+ The store must stay open while the source is in use.
+ */
+class StoreSource : public MemorySource
+{
+public:
+    StoreSource();
+    ~StoreSource();
+    
+    /**
+     Map a manifest and the page pack of a store.
+     
+     @param store -- Open store.
+     @param name  -- Snapshot name.
+     @return Status.
+     */
+    kern_return_t Open( SnapshotStore& store, const char * name );
+    
+    /**
+     Unmap the manifest and pack.
+     
+     @param void
+     @return Status.
+     */
+    kern_return_t Close();
+    
+    virtual kern_return_t Read( mach_vm_address_t address, mach_vm_size_t size, void * buffer );
+    virtual kern_return_t QueryRegions( std::vector<MemoryRegion_t>& regions );
+    virtual kern_return_t QueryModules( std::vector<ModuleData_t>& modules );
+    virtual const void * Map( mach_vm_address_t address, mach_vm_size_t size );
+    
+private:
+    StoreSource( const StoreSource& ) = delete;
+    StoreSource& operator =(const StoreSource&) = delete;
+    
+    const SnapshotRegion_t* FindRegion( mach_vm_address_t address ) const;
+    
+    // Local copy of a page, nullptr if not captured; zero pages map to a shared zero page
+    const uint8_t * Page( const SnapshotRegion_t* region, mach_vm_address_t address ) const;
+    
+    inline const StoreManifestHeader_t* header() const { return (const StoreManifestHeader_t*)_manifest; }
+    
+    SnapshotStore*       _store;
+    const uint8_t *      _manifest;
+    size_t               _manifest_size;
+    const uint8_t *      _pack;
+    size_t               _pack_size;
+    std::vector<uint8_t> _zero;
+};
+
+#endif /* defined(__xnumem__SnapshotStore__) */
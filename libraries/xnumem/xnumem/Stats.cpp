@@ -0,0 +1,279 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+#include "Stats.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+namespace {
+    
+    // Written by one thread at a time, read by Collect
+    struct Counters {
+        std::atomic<uint64_t> calls;
+        std::atomic<uint64_t> syscalls;
+        std::atomic<uint64_t> requested;
+        std::atomic<uint64_t> transferred;
+        std::atomic<uint64_t> faults;
+        std::atomic<uint64_t> hits;
+        std::atomic<uint64_t> latency_ns;
+        std::atomic<uint64_t> histogram[kStatBuckets];
+    };
+    
+    struct Block {
+        Counters ops[kStatOpCount];
+    };
+    
+    // Blocks are never freed: a thread that exits leaves its block, counts and all, to the next new thread
+    struct Registry {
+        std::mutex              lock;
+        std::vector<Block *>    blocks;
+        std::vector<Block *>    spare;
+        StatsSnapshot_t         baseline;
+        pthread_key_t           key;
+        mach_timebase_info_data_t timebase;
+        
+        Registry()
+        {
+            memset(&baseline, 0, sizeof(baseline));
+            mach_timebase_info(&timebase);
+            pthread_key_create(&key, [](void * block) {
+                Registry& registry = Shared();
+                std::lock_guard<std::mutex> guard(registry.lock);
+                registry.spare.push_back((Block *)block);
+            });
+        }
+        
+        static Registry& Shared()
+        {
+            static Registry * registry = new Registry();
+            return *registry;
+        }
+    };
+    
+    __thread Block * t_block = nullptr;
+    
+    Block * ThreadBlock()
+    {
+        if(t_block)
+            return t_block;
+        
+        Registry& registry = Registry::Shared();
+        std::lock_guard<std::mutex> guard(registry.lock);
+        if(!registry.spare.empty())
+        {
+            t_block = registry.spare.back();
+            registry.spare.pop_back();
+        }
+        else
+        {
+            t_block = new Block();
+            memset((void *)t_block, 0, sizeof(Block));
+            registry.blocks.push_back(t_block);
+        }
+        pthread_setspecific(registry.key, t_block);
+        return t_block;
+    }
+    
+    // Single writer, a plain load and store is enough
+    inline void Add( std::atomic<uint64_t>& counter, uint64_t value )
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+    
+    void Sum( StatsSnapshot_t& snapshot )
+    {
+        Registry& registry = Registry::Shared();
+        memset(&snapshot, 0, sizeof(snapshot));
+        for (size_t b = 0; b < registry.blocks.size(); b++)
+        {
+            for (size_t op = 0; op < kStatOpCount; op++)
+            {
+                const Counters& from = registry.blocks[b]->ops[op];
+                StatCounters_t& to = snapshot.ops[op];
+                to.calls       += from.calls.load(std::memory_order_relaxed);
+                to.syscalls    += from.syscalls.load(std::memory_order_relaxed);
+                to.requested   += from.requested.load(std::memory_order_relaxed);
+                to.transferred += from.transferred.load(std::memory_order_relaxed);
+                to.faults      += from.faults.load(std::memory_order_relaxed);
+                to.hits        += from.hits.load(std::memory_order_relaxed);
+                to.latency_ns  += from.latency_ns.load(std::memory_order_relaxed);
+                for (size_t i = 0; i < kStatBuckets; i++)
+                    to.histogram[i] += from.histogram[i].load(std::memory_order_relaxed);
+            }
+        }
+    }
+}
+
+void Stats::Record( StatOp op, uint64_t ticks, uint64_t requested, uint64_t transferred, uint32_t syscalls, uint32_t faults, uint32_t hits )
+{
+    static const mach_timebase_info_data_t& timebase = Registry::Shared().timebase;
+    uint64_t ns = timebase.numer == timebase.denom ? ticks : ticks * timebase.numer / timebase.denom;
+    
+    Counters& counters = ThreadBlock()->ops[op];
+    Add(counters.calls, 1);
+    Add(counters.syscalls, syscalls);
+    Add(counters.requested, requested);
+    Add(counters.transferred, transferred);
+    Add(counters.faults, faults);
+    Add(counters.hits, hits);
+    Add(counters.latency_ns, ns);
+    Add(counters.histogram[Bucket(ns)], 1);
+}
+
+void Stats::Collect( StatsSnapshot_t& snapshot )
+{
+    Registry& registry = Registry::Shared();
+    std::lock_guard<std::mutex> guard(registry.lock);
+    Sum(snapshot);
+    
+    // Less what Reset saw; uint64_t fields, so walk them as an array
+    uint64_t * values = (uint64_t *)&snapshot;
+    const uint64_t * baseline = (const uint64_t *)&registry.baseline;
+    for (size_t i = 0; i < sizeof(snapshot) / sizeof(uint64_t); i++)
+        values[i] -= baseline[i];
+}
+
+void Stats::Reset()
+{
+    Registry& registry = Registry::Shared();
+    std::lock_guard<std::mutex> guard(registry.lock);
+    Sum(registry.baseline);
+}
+
+uint64_t Stats::BucketLimit( size_t bucket )
+{
+    bucket++;
+    if(bucket < 4)
+        return bucket;
+    if(bucket >= kStatBuckets)
+        return UINT64_MAX;
+    return (uint64_t)(4 + bucket % 4) << (bucket / 4 - 1);
+}
+
+uint64_t Stats::Percentile( const StatCounters_t& counters, double fraction )
+{
+    uint64_t total = 0;
+    for (size_t i = 0; i < kStatBuckets; i++)
+        total += counters.histogram[i];
+    if(total == 0)
+        return 0;
+    
+    uint64_t rank = (uint64_t)(fraction * total + 0.5);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kStatBuckets; i++)
+    {
+        seen += counters.histogram[i];
+        if(seen >= rank && seen > 0)
+            return BucketLimit(i);
+    }
+    return BucketLimit(kStatBuckets - 1);
+}
+
+const char * Stats::Name( StatOp op )
+{
+    static const char * names[kStatOpCount] = {
+        "read", "read_batch", "read_mapped", "map_view", "read_string", "query_pages", "region_size", "query_regions",
+        "write", "copy", "protect", "allocate", "free", "query_modules", "refresh_modules", "read_paths",
+        "open", "close"
+    };
+    return op < kStatOpCount ? names[op] : "unknown";
+}
+
+void Stats::WriteJSON( FILE * out, const StatsSnapshot_t& snapshot )
+{
+    bool first = true;
+    fprintf(out, "{\"enabled\": %s, \"ops\": {", enabled() ? "true" : "false");
+    for (size_t op = 0; op < kStatOpCount; op++)
+    {
+        const StatCounters_t& counters = snapshot.ops[op];
+        if(counters.calls == 0)
+            continue;
+        
+        fprintf(out, "%s\n  \"%s\": {\"calls\": %llu, \"syscalls\": %llu, \"requested\": %llu, \"transferred\": %llu, "
+                     "\"faults\": %llu, \"hits\": %llu, \"latency_ns\": %llu, \"p50_ns\": %llu, \"p99_ns\": %llu, \"histogram\": [",
+                first ? "" : ",", Name((StatOp)op),
+                (unsigned long long)counters.calls, (unsigned long long)counters.syscalls,
+                (unsigned long long)counters.requested, (unsigned long long)counters.transferred,
+                (unsigned long long)counters.faults, (unsigned long long)counters.hits, (unsigned long long)counters.latency_ns,
+                (unsigned long long)Percentile(counters, 0.5), (unsigned long long)Percentile(counters, 0.99));
+        
+        // Non-empty buckets only, as [upper bound ns, count]
+        bool bucket_first = true;
+        for (size_t i = 0; i < kStatBuckets; i++)
+        {
+            if(counters.histogram[i] == 0)
+                continue;
+            fprintf(out, "%s[%llu, %llu]", bucket_first ? "" : ", ", (unsigned long long)BucketLimit(i), (unsigned long long)counters.histogram[i]);
+            bucket_first = false;
+        }
+        fprintf(out, "]}");
+        first = false;
+    }
+    fprintf(out, "\n}}\n");
+}
+
+void Stats::WritePrometheus( FILE * out, const StatsSnapshot_t& snapshot )
+{
+    static const struct { const char * name; size_t offset; } kCounters[] = {
+        { "xnumem_calls_total",             offsetof(StatCounters_t, calls) },
+        { "xnumem_syscalls_total",          offsetof(StatCounters_t, syscalls) },
+        { "xnumem_requested_bytes_total",   offsetof(StatCounters_t, requested) },
+        { "xnumem_transferred_bytes_total", offsetof(StatCounters_t, transferred) },
+        { "xnumem_faults_total",            offsetof(StatCounters_t, faults) },
+        { "xnumem_cache_hits_total",        offsetof(StatCounters_t, hits) },
+    };
+    
+    for (size_t c = 0; c < sizeof(kCounters) / sizeof(kCounters[0]); c++)
+    {
+        fprintf(out, "# TYPE %s counter\n", kCounters[c].name);
+        for (size_t op = 0; op < kStatOpCount; op++)
+        {
+            if(snapshot.ops[op].calls == 0)
+                continue;
+            uint64_t value = *(const uint64_t *)((const uint8_t *)&snapshot.ops[op] + kCounters[c].offset);
+            fprintf(out, "%s{op=\"%s\"} %llu\n", kCounters[c].name, Name((StatOp)op), (unsigned long long)value);
+        }
+    }
+    
+    // Cumulative buckets, every limit every time: scrapers expect the same le set in each sample
+    fprintf(out, "# TYPE xnumem_latency_seconds histogram\n");
+    for (size_t op = 0; op < kStatOpCount; op++)
+    {
+        const StatCounters_t& counters = snapshot.ops[op];
+        if(counters.calls == 0)
+            continue;
+        
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i + 1 < kStatBuckets; i++)
+        {
+            cumulative += counters.histogram[i];
+            fprintf(out, "xnumem_latency_seconds_bucket{op=\"%s\",le=\"%.9g\"} %llu\n", Name((StatOp)op), BucketLimit(i) / 1e9, (unsigned long long)cumulative);
+        }
+        fprintf(out, "xnumem_latency_seconds_bucket{op=\"%s\",le=\"+Inf\"} %llu\n", Name((StatOp)op), (unsigned long long)counters.calls);
+        fprintf(out, "xnumem_latency_seconds_sum{op=\"%s\"} %.9f\n", Name((StatOp)op), counters.latency_ns / 1e9);
+        fprintf(out, "xnumem_latency_seconds_count{op=\"%s\"} %llu\n", Name((StatOp)op), (unsigned long long)counters.calls);
+    }
+}
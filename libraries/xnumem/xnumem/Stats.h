@@ -0,0 +1,209 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+
+
+#ifndef __xnumem__Stats__
+#define __xnumem__Stats__
+
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Build with XNUMEM_STATS=0 to compile the counters out; StatScope is then empty
+#ifndef XNUMEM_STATS
+#define XNUMEM_STATS 1
+#endif
+
+typedef enum StatOp {
+    kStatRead = 0,          // ProcessMemory::TryRead, every read ends there
+    kStatReadBatch,
+    kStatReadMapped,
+    kStatMapView,
+    kStatReadString,
+    kStatQueryPages,
+    kStatRegionSize,        // GetMemoryRegionSize
+    kStatQueryRegions,
+    kStatWrite,
+    kStatCopy,
+    kStatProtect,
+    kStatAllocate,
+    kStatFree,
+    kStatQueryModules,
+    kStatRefreshModules,
+    kStatReadPaths,
+    kStatOpen,              // ProcessCore::Open
+    kStatClose,
+    kStatOpCount
+} StatOp;
+
+// Log-linear latency buckets: four per power of two of nanoseconds, up to about 18 minutes
+static const size_t kStatBuckets = 160;
+
+typedef struct StatCounters {
+    uint64_t calls;
+    uint64_t syscalls;              // kernel calls made by the operation itself
+    uint64_t requested;             // bytes asked for
+    uint64_t transferred;           // bytes the kernel moved
+    uint64_t faults;                // kernel calls that failed
+    uint64_t hits;                  // answers from a cache or the region index
+    uint64_t latency_ns;            // sum
+    uint64_t histogram[kStatBuckets];
+} StatCounters_t;
+
+typedef struct StatsSnapshot {
+    StatCounters_t ops[kStatOpCount];
+} StatsSnapshot_t;
+
+/**
+ Process-wide operation counters.
+ 
+ Every thread counts into its own block, only it writes there, and Collect sums the
+ blocks when asked. Operations nest: a ReadBatch is counted once as itself and once
+ per read it issues.
+ */
+class Stats
+{
+public:
+    /**
+     Sum the counters of all threads since the last Reset.
+     
+     @param snapshot -- Output.
+     */
+    static void Collect( StatsSnapshot_t& snapshot );
+    
+    /**
+     Start counting from zero; threads keep counting, Collect subtracts the totals seen here.
+     */
+    static void Reset();
+    
+    /**
+     Latency below which a fraction of the calls fall, from the histogram.
+     
+     @param counters -- Counters of one operation.
+     @param fraction -- 0.5 for the median, 0.99 ...
+     @return Upper bound of the bucket, in nanoseconds.
+     */
+    static uint64_t Percentile( const StatCounters_t& counters, double fraction );
+    
+    /**
+     Bucket limits.
+     
+     @param bucket -- Bucket index.
+     @return Smallest latency, in nanoseconds, of the next bucket.
+     */
+    static uint64_t BucketLimit( size_t bucket );
+    
+    static const char * Name( StatOp op );
+    
+    /**
+     Dump a snapshot as JSON, one object per operation that was called.
+     
+     @param out      -- Output.
+     @param snapshot -- Counters.
+     */
+    static void WriteJSON( FILE * out, const StatsSnapshot_t& snapshot );
+    
+    /**
+     Dump a snapshot in the Prometheus text format: counters per operation and a
+     xnumem_latency_seconds histogram with the full, fixed set of buckets up to +Inf.
+     
+     @param out      -- Output.
+     @param snapshot -- Counters.
+     */
+    static void WritePrometheus( FILE * out, const StatsSnapshot_t& snapshot );
+    
+    static inline bool enabled() { return XNUMEM_STATS != 0; }
+    
+    static inline size_t Bucket( uint64_t ns )
+    {
+        if(ns < 4)
+            return (size_t)ns;
+        unsigned msb = 63 - __builtin_clzll(ns);
+        size_t bucket = (msb - 1) * 4 + ((ns >> (msb - 2)) & 3);
+        return bucket < kStatBuckets ? bucket : kStatBuckets - 1;
+    }
+    
+    static void Record( StatOp op, uint64_t ticks, uint64_t requested, uint64_t transferred, uint32_t syscalls, uint32_t faults, uint32_t hits );
+};
+
+#if XNUMEM_STATS
+
+/**
+ Counts one call of an operation, from construction to destruction.
+ 
+    StatScope stat(kStatRead, size);
+    kret = mach_vm_read_overwrite(...);
+    stat.syscall(kret, count);
+ */
+class StatScope
+{
+public:
+    inline StatScope( StatOp op, uint64_t requested = 0 ) :
+        _op(op), _syscalls(0), _faults(0), _hits(0), _requested(requested), _transferred(0), _start(mach_absolute_time()) {}
+    inline ~StatScope() { Stats::Record(_op, mach_absolute_time() - _start, _requested, _transferred, _syscalls, _faults, _hits); }
+    
+    // A kernel call and what it moved if it succeeded
+    inline void syscall( kern_return_t kret, uint64_t transferred = 0 )
+    {
+        _syscalls++;
+        if(kret != KERN_SUCCESS)
+            _faults++;
+        else
+            _transferred += transferred;
+    }
+    
+    inline void request( uint64_t bytes ) { _requested += bytes; }
+    inline void transfer( uint64_t bytes ) { _transferred += bytes; }
+    inline void hit( uint32_t count = 1 ) { _hits += count; }
+    
+private:
+    StatScope( const StatScope& ) = delete;
+    StatScope& operator =(const StatScope&) = delete;
+    
+    StatOp      _op;
+    uint32_t    _syscalls;
+    uint32_t    _faults;
+    uint32_t    _hits;
+    uint64_t    _requested;
+    uint64_t    _transferred;
+    uint64_t    _start;
+};
+
+#else
+
+class StatScope
+{
+public:
+    inline StatScope( StatOp op, uint64_t requested = 0 ) {}
+    inline void syscall( kern_return_t kret, uint64_t transferred = 0 ) {}
+    inline void request( uint64_t bytes ) {}
+    inline void transfer( uint64_t bytes ) {}
+    inline void hit( uint32_t count = 1 ) {}
+    
+private:
+    StatScope( const StatScope& ) = delete;
+    StatScope& operator =(const StatScope&) = delete;
+};
+
+#endif
+
+#endif /* defined(__xnumem__Stats__) */
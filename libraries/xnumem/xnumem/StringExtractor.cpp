@@ -0,0 +1,271 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+
+
+#include "StringExtractor.h"
+#include "Epoch.h"
+#include "Hash.h"
+#include "Scheduler.h"
+#include "Snapshot.h"
+#include "Trace.h"
+#include "xnumem.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include <algorithm>
+#include <string.h>
+#include <vector>
+
+const size_t StringExtractor::kStringMaxText;
+const size_t StringExtractor::kShards;
+
+// Bit i set for even byte offsets
+static const uint64_t kEvenBytes = 0x5555555555555555ULL;
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+static inline uint64_t Movemask( uint8x16_t mask )
+{
+    static const uint8_t weights[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t bits = vandq_u8(mask, vld1q_u8(weights));
+    return (uint64_t)vaddv_u8(vget_low_u8(bits)) | (uint64_t)vaddv_u8(vget_high_u8(bits)) << 8;
+}
+#endif
+
+// Printable (0x20 - 0x7e and tab) and zero bitmaps of 64 bytes
+static inline void Classify( const uint8_t * data, uint64_t& printable, uint64_t& zero )
+{
+    printable = 0;
+    zero = 0;
+#if defined(__SSE2__)
+    const __m128i space = _mm_set1_epi8(0x1f), del = _mm_set1_epi8(0x7f), tab = _mm_set1_epi8('\t'), nul = _mm_setzero_si128();
+    for (unsigned i = 0; i < 4; i++)
+    {
+        // Signed compares, bytes from 0x80 up are negative and fail the first one
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + i * 16));
+        __m128i text = _mm_or_si128(_mm_and_si128(_mm_cmpgt_epi8(block, space), _mm_cmplt_epi8(block, del)), _mm_cmpeq_epi8(block, tab));
+        printable |= (uint64_t)(uint16_t)_mm_movemask_epi8(text) << (i * 16);
+        zero      |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, nul)) << (i * 16);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const uint8x16_t space = vdupq_n_u8(0x1f), del = vdupq_n_u8(0x7f), tab = vdupq_n_u8('\t');
+    for (unsigned i = 0; i < 4; i++)
+    {
+        uint8x16_t block = vld1q_u8(data + i * 16);
+        uint8x16_t text = vorrq_u8(vandq_u8(vcgtq_u8(block, space), vcltq_u8(block, del)), vceqq_u8(block, tab));
+        printable |= Movemask(text) << (i * 16);
+        zero      |= Movemask(vceqzq_u8(block)) << (i * 16);
+    }
+#else
+    for (unsigned i = 0; i < 64; i++)
+    {
+        if((data[i] > 0x1f && data[i] < 0x7f) || data[i] == '\t')
+            printable |= 1ULL << i;
+        if(data[i] == 0)
+            zero |= 1ULL << i;
+    }
+#endif
+}
+
+// Classify the block at offset, bytes past size are neither printable nor zero
+static inline void Load( const uint8_t * data, size_t size, size_t offset, uint64_t& printable, uint64_t& zero )
+{
+    if(offset + 64 <= size)
+    {
+        Classify(data + offset, printable, zero);
+        return;
+    }
+    
+    uint8_t block[64] = { 0 };
+    memcpy(block, data + offset, size - offset);
+    Classify(block, printable, zero);
+    
+    uint64_t valid = (1ULL << (size - offset)) - 1;
+    printable &= valid;
+    zero &= valid;
+}
+
+// One kind of string being followed through the blocks
+struct Lane {
+    size_t start;
+    bool   open;
+};
+
+// Walk the transitions of a lane in one block. in marks positions inside a string, out
+// positions that end one; positions in neither belong to another lane.
+template <typename Close>
+static inline void Advance( Lane& lane, uint64_t in, uint64_t out, size_t offset, const Close& close )
+{
+    unsigned position = 0;
+    while(position < 64)
+    {
+        uint64_t bits = (lane.open ? out : in) >> position;
+        if(!bits)
+            return;
+        
+        position += __builtin_ctzll(bits);
+        if(lane.open)
+            close(lane.start, offset + position);
+        else
+            lane.start = offset + position;
+        lane.open = !lane.open;
+    }
+}
+
+StringExtractor::StringExtractor()
+{
+}
+
+StringExtractor::~StringExtractor()
+{
+}
+
+size_t StringExtractor::Extract( const uint8_t * data, size_t size, size_t first, size_t report, mach_vm_address_t base, size_t min_length, uint32_t encodings, const StringFn& fn )
+{
+    size_t count = 0;
+    std::string text;
+    
+    auto ascii_close = [&](size_t start, size_t end) {
+        if(end - start < min_length || start < first || start >= report)
+            return;
+        text.assign((const char *)data + start, std::min(end - start, kStringMaxText));
+        fn(base + start, kStringASCII, text);
+        count++;
+    };
+    
+    auto wide_close = [&](size_t start, size_t end) {
+        size_t length = (end - start) / 2;
+        if(length < min_length || start < first || start >= report)
+            return;
+        text.resize(std::min(length, kStringMaxText));
+        for (size_t i = 0; i < text.size(); i++)
+            text[i] = (char)data[start + i * 2];
+        fn(base + start, kStringUTF16LE, text);
+        count++;
+    };
+    
+    Lane ascii = { 0, false };
+    Lane wide[2] = { { 0, false }, { 0, false } };
+    bool want_ascii = (encodings & kStringASCII) != 0;
+    bool want_wide = (encodings & kStringUTF16LE) != 0;
+    
+    uint64_t printable = 0, zero = 0;
+    if(size > 0)
+        Load(data, size, 0, printable, zero);
+    
+    for (size_t offset = 0; offset < size; offset += 64)
+    {
+        // A UTF-16 unit is a printable byte followed by a zero, which may be in the next block
+        uint64_t next_printable = 0, next_zero = 0;
+        if(offset + 64 < size)
+            Load(data, size, offset + 64, next_printable, next_zero);
+        
+        if(want_ascii)
+            Advance(ascii, printable, ~printable, offset, ascii_close);
+        
+        if(want_wide)
+        {
+            uint64_t units = printable & (zero >> 1 | next_zero << 63);
+            Advance(wide[0], units & kEvenBytes, ~units & kEvenBytes, offset, wide_close);
+            Advance(wide[1], units & ~kEvenBytes, ~units & ~kEvenBytes, offset, wide_close);
+        }
+        
+        printable = next_printable;
+        zero = next_zero;
+    }
+    
+    // Strings running up to the end of the data
+    if(ascii.open)
+        ascii_close(ascii.start, size);
+    for (unsigned i = 0; i < 2; i++)
+    {
+        if(wide[i].open)
+            wide_close(wide[i].start, size);
+    }
+    
+    return count;
+}
+
+bool StringExtractor::Insert( uint32_t encoding, const std::string& text )
+{
+    uint64_t hash = Hash64(text.data(), text.size(), encoding);
+    Shard& shard = _shards[hash & (kShards - 1)];
+    
+    std::lock_guard<std::mutex> lock(shard.lock);
+    return shard.seen.insert(hash).second;
+}
+
+kern_return_t StringExtractor::ExtractStrings( xnu_proc& process, size_t min_length, uint32_t encodings, const StringFn& fn, bool unique /* = false */, ScanJob* job /* = nullptr */, const ScanScope* scope /* = nullptr */ )
+{
+    TraceSpan span("ExtractStrings", "StringExtractor");
+    if(min_length == 0 || !(encodings & (kStringASCII | kStringUTF16LE)) || !fn)
+        return KERN_INVALID_ARGUMENT;
+    
+    for (size_t i = 0; i < kShards; i++)
+        _shards[i].seen.clear();
+    
+    StringFn report = fn;
+    if(unique)
+    {
+        report = [&](mach_vm_address_t address, uint32_t encoding, const std::string& text) {
+            if(Insert(encoding, text))
+                fn(address, encoding, text);
+        };
+    }
+    
+    ProcessMemory& memory = process.memory();
+    SchedulerGuard scheduling;   // per-worker state below stays sized for the workers that run
+    std::vector<std::vector<uint8_t> > buffers(scheduling.workers());
+    
+    ChunkFn chunk_fn = [&](const ScanChunk_t& chunk, unsigned worker) {
+        // Read back far enough to tell whether a string runs in from the previous chunk, and
+        // on far enough for strings starting here to reach min_length and their reported length
+        mach_vm_size_t lead = std::min<mach_vm_size_t>(2, chunk.address - chunk.origin);
+        mach_vm_address_t end = chunk.address + chunk.size;
+        mach_vm_size_t reach = std::max<mach_vm_size_t>(min_length, kStringMaxText);
+        mach_vm_size_t tail = reach < (chunk.limit - end) / 2 ? reach * 2 + 2 : chunk.limit - end;
+        
+        mach_vm_address_t address = chunk.address - lead;
+        mach_vm_size_t size = lead + chunk.size + tail;
+        const uint8_t * view = (const uint8_t *)memory.Map(address, size);
+        if(view)
+        {
+            Extract(view, size, lead, lead + chunk.size, address, min_length, encodings, report);
+            return;
+        }
+        
+        std::vector<uint8_t>& buffer = buffers[worker];
+        buffer.resize(size);
+        
+        // Unreadable pages read as zeros, which end any string
+        Snapshot::ReadZeroFilled(memory, address, size, buffer.data());
+        Extract(buffer.data(), size, lead, lead + chunk.size, address, min_length, encodings, report);
+    };
+    
+    // Pins the region index and the views taken from it until the workers are done
+    EpochGuard guard;
+    if(scope)
+        return Scheduler::Shared().ForEachChunk(scope->ranges(), chunk_fn, job);
+    return Scheduler::Shared().ForEachChunk(memory.regions().partition(VM_PROT_READ), chunk_fn, job);
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+
+
+#ifndef __xnumem__StringExtractor__
+#define __xnumem__StringExtractor__
+
+#include <mach/mach.h>
+#include <stdint.h>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+
+class ScanJob;
+class ScanScope;
+
+enum {
+    kStringASCII   = 1 << 0,    // printable ASCII bytes
+    kStringUTF16LE = 1 << 1,    // printable ASCII characters as little endian UTF-16 units
+};
+
+typedef std::function<void( mach_vm_address_t address, uint32_t encoding, const std::string& text )> StringFn;
+
+/**
+ Pulls printable strings out of process memory, like strings(1) over every readable region.
+ 
+ Bytes are classified 64 at a time into printable / zero bitmaps with SSE2 / NEON and the
+ string runs are found with bit scans on those, so text-free memory costs a couple of
+ vector compares per 16 bytes. UTF-16LE strings are found at either alignment and are
+ reported converted to ASCII. Strings longer than kStringMaxText characters are cut.
+ 
+    StringExtractor extractor;
+    extractor.ExtractStrings(process, 6, kStringASCII | kStringUTF16LE,
+        [](mach_vm_address_t address, uint32_t encoding, const std::string& text) { ... });
+ */
+class StringExtractor
+{
+public:
+    static const size_t kStringMaxText = 4096;
+    
+    StringExtractor();
+    ~StringExtractor();
+    
+    /**
+     Extract the strings of every readable region of a process, or a scope, in one parallel
+     pass on the shared scheduler. Strings are reported from worker threads, in no particular
+     order.
+     
+     @param process    -- Attached process or source.
+     @param min_length -- Shortest string reported, in characters.
+     @param encodings  -- kString* encodings to look for.
+     @param fn         -- Called for every string, concurrently.
+     @param unique     -- Report each distinct text once per encoding, at whichever address is found first. (optional)
+     @param job        -- Cancellation / progress. (optional)
+     @param scope      -- Only scan these ranges. (optional)
+     @return Status.
+     */
+    kern_return_t ExtractStrings( class xnu_proc& process, size_t min_length, uint32_t encodings, const StringFn& fn, bool unique = false, ScanJob* job = nullptr, const ScanScope* scope = nullptr );
+    
+    /**
+     Extract the strings of a local buffer.
+     
+     @param data       -- Bytes to scan.
+     @param size       -- Bytes available, strings may extend up to here.
+     @param first      -- Only strings starting at or after this offset are reported.
+     @param report     -- Only strings starting before this offset are reported.
+     @param base       -- Address of data[0], added to reported offsets.
+     @param min_length -- Shortest string reported, in characters.
+     @param encodings  -- kString* encodings to look for.
+     @param fn         -- Called for every string.
+     @return Number of strings.
+     */
+    static size_t Extract( const uint8_t * data, size_t size, size_t first, size_t report, mach_vm_address_t base, size_t min_length, uint32_t encodings, const StringFn& fn );
+    
+private:
+    StringExtractor( const StringExtractor& ) = delete;
+    StringExtractor& operator =(const StringExtractor&) = delete;
+    
+    bool Insert( uint32_t encoding, const std::string& text );
+    
+    // Texts seen by unique extractions, sharded by hash to keep workers off each other's locks
+    static const size_t kShards = 64;
+    struct Shard {
+        std::mutex                   lock;
+        std::unordered_set<uint64_t> seen;
+    };
+    
+    Shard _shards[kShards];
+};
+
+#endif /* defined(__xnumem__StringExtractor__) */
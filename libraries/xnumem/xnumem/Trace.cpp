@@ -0,0 +1,249 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+#include "Trace.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+std::atomic<bool> Trace::_enabled(false);
+
+namespace {
+    
+    struct Buffer {
+        std::vector<TraceEvent_t>   events;
+        std::atomic<size_t>         count;      // published with release, events below it are complete
+        std::atomic<uint64_t>       dropped;
+        unsigned                    generation;
+        unsigned                    tid;
+        bool                        retired;    // its thread exited
+        char                        name[64];
+    };
+    
+    struct Registry {
+        std::mutex              lock;
+        std::vector<Buffer *>   buffers;
+        std::atomic<unsigned>   generation;
+        size_t                  capacity;
+        uint64_t                origin;         // mach_absolute_time at Start
+        unsigned                next_tid;
+        pthread_key_t           key;
+        mach_timebase_info_data_t timebase;
+        
+        Registry() : generation(1), capacity(0), origin(0), next_tid(1)
+        {
+            mach_timebase_info(&timebase);
+            pthread_key_create(&key, [](void * buffer) {
+                std::lock_guard<std::mutex> guard(Shared().lock);
+                ((Buffer *)buffer)->retired = true;
+            });
+        }
+        
+        static Registry& Shared()
+        {
+            static Registry * registry = new Registry();
+            return *registry;
+        }
+    };
+    
+    __thread Buffer * t_buffer = nullptr;
+    
+    Buffer * ThreadBuffer()
+    {
+        Registry& registry = Registry::Shared();
+        if(t_buffer)
+        {
+            // First event of a new session, the owner clears its own buffer
+            unsigned generation = registry.generation.load(std::memory_order_acquire);
+            if(t_buffer->generation != generation)
+            {
+                std::lock_guard<std::mutex> guard(registry.lock);
+                t_buffer->events.resize(registry.capacity);
+                t_buffer->count.store(0, std::memory_order_relaxed);
+                t_buffer->dropped.store(0, std::memory_order_relaxed);
+                t_buffer->generation = generation;
+            }
+            return t_buffer;
+        }
+        
+        std::lock_guard<std::mutex> guard(registry.lock);
+        Buffer * buffer = new Buffer();
+        buffer->events.resize(registry.capacity);
+        buffer->count.store(0, std::memory_order_relaxed);
+        buffer->dropped.store(0, std::memory_order_relaxed);
+        buffer->generation = registry.generation.load(std::memory_order_relaxed);
+        buffer->tid = registry.next_tid++;
+        buffer->retired = false;
+        buffer->name[0] = 0;
+        pthread_getname_np(pthread_self(), buffer->name, sizeof(buffer->name));
+        registry.buffers.push_back(buffer);
+        pthread_setspecific(registry.key, buffer);
+        
+        t_buffer = buffer;
+        return buffer;
+    }
+    
+    inline double Microseconds( const Registry& registry, uint64_t ticks )
+    {
+        return (double)ticks * registry.timebase.numer / registry.timebase.denom / 1000.0;
+    }
+    
+    // Names are library literals; escape anyway so a caller's string can't break the file
+    void WriteString( FILE * out, const char * text )
+    {
+        fputc('"', out);
+        for (const char * c = text; *c; c++)
+        {
+            if(*c == '"' || *c == '\\')
+                fputc('\\', out);
+            if((unsigned char)*c >= 0x20)
+                fputc(*c, out);
+        }
+        fputc('"', out);
+    }
+}
+
+void Trace::Start( size_t events /* = 64 * 1024 */ )
+{
+    Registry& registry = Registry::Shared();
+    {
+        std::lock_guard<std::mutex> guard(registry.lock);
+        
+        // Buffers of exited threads have no writer left, drop them
+        std::vector<Buffer *> live;
+        for (size_t i = 0; i < registry.buffers.size(); i++)
+        {
+            if(registry.buffers[i]->retired)
+                delete registry.buffers[i];
+            else
+                live.push_back(registry.buffers[i]);
+        }
+        registry.buffers.swap(live);
+        
+        registry.capacity = std::max<size_t>(events, 1);
+        registry.origin = mach_absolute_time();
+        registry.generation.fetch_add(1, std::memory_order_release);
+    }
+    _enabled.store(true, std::memory_order_release);
+}
+
+void Trace::Stop()
+{
+    _enabled.store(false, std::memory_order_release);
+}
+
+void Trace::Record( const TraceEvent_t& event )
+{
+    Buffer * buffer = ThreadBuffer();
+    size_t count = buffer->count.load(std::memory_order_relaxed);
+    if(count >= buffer->events.size())
+    {
+        buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    
+    buffer->events[count] = event;
+    buffer->count.store(count + 1, std::memory_order_release);
+}
+
+uint64_t Trace::dropped()
+{
+    Registry& registry = Registry::Shared();
+    std::lock_guard<std::mutex> guard(registry.lock);
+    unsigned generation = registry.generation.load(std::memory_order_relaxed);
+    
+    uint64_t total = 0;
+    for (size_t i = 0; i < registry.buffers.size(); i++)
+    {
+        if(registry.buffers[i]->generation == generation)
+            total += registry.buffers[i]->dropped.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+kern_return_t Trace::Write( FILE * out )
+{
+    Registry& registry = Registry::Shared();
+    std::lock_guard<std::mutex> guard(registry.lock);
+    unsigned generation = registry.generation.load(std::memory_order_relaxed);
+    int pid = getpid();
+    bool first = true;
+    
+    fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+    for (size_t i = 0; i < registry.buffers.size(); i++)
+    {
+        const Buffer * buffer = registry.buffers[i];
+        size_t count = buffer->count.load(std::memory_order_acquire);
+        if(buffer->generation != generation || count == 0)
+            continue;
+        
+        // One track per thread, named after it
+        fprintf(out, "%s\n{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": %d, \"tid\": %u, \"args\": {\"name\": ", first ? "" : ",", pid, buffer->tid);
+        if(buffer->name[0])
+            WriteString(out, buffer->name);
+        else
+            fprintf(out, "\"thread %u\"", buffer->tid);
+        fprintf(out, "}}");
+        first = false;
+        
+        for (size_t n = 0; n < count; n++)
+        {
+            // Opened before Start
+            const TraceEvent_t& event = buffer->events[n];
+            if(event.start < registry.origin)
+                continue;
+            
+            fprintf(out, ",\n{\"ph\": \"X\", \"name\": ");
+            WriteString(out, event.name);
+            fprintf(out, ", \"cat\": ");
+            WriteString(out, event.category);
+            fprintf(out, ", \"pid\": %d, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f",
+                    pid, buffer->tid, Microseconds(registry, event.start - registry.origin), Microseconds(registry, event.end - event.start));
+            if(event.arg)
+                fprintf(out, ", \"args\": {\"count\": %llu}", (unsigned long long)event.arg);
+            fprintf(out, "}");
+        }
+        
+        uint64_t dropped = buffer->dropped.load(std::memory_order_relaxed);
+        if(dropped)
+            fprintf(out, ",\n{\"ph\": \"i\", \"s\": \"t\", \"name\": \"dropped %llu events\", \"pid\": %d, \"tid\": %u, \"ts\": %.3f}",
+                    (unsigned long long)dropped, pid, buffer->tid, Microseconds(registry, buffer->events[count - 1].end - registry.origin));
+    }
+    fprintf(out, "\n]}\n");
+    
+    return ferror(out) ? KERN_FAILURE : KERN_SUCCESS;
+}
+
+kern_return_t Trace::WriteFile( const char * path )
+{
+    FILE * out = fopen(path, "w");
+    if(!out)
+        return KERN_INVALID_ARGUMENT;
+    
+    kern_return_t kret = Write(out);
+    if(fclose(out) != 0)
+        kret = KERN_FAILURE;
+    return kret;
+}
@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2014  Jonathan Daniel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact : jonathandaniel@email.com
+ */
+
+
+
+
+#ifndef __xnumem__Trace__
+#define __xnumem__Trace__
+
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+
+typedef struct TraceEvent {
+    const char *    name;           // static strings only, they are kept by address
+    const char *    category;
+    uint64_t        start;          // mach_absolute_time
+    uint64_t        end;
+    uint64_t        arg;            // bytes or items, 0 if none
+} TraceEvent_t;
+
+/**
+ Timeline of library operations, written as Chrome trace-event JSON
+ (chrome://tracing, ui.perfetto.dev).
+ 
+ Spans go into per-thread buffers that only their thread writes, so recording takes
+ no lock; a full buffer drops events and counts them. With tracing stopped a span
+ costs one relaxed load.
+ */
+class Trace
+{
+    friend class TraceSpan;
+    
+public:
+    /**
+     Start recording, dropping what an earlier session recorded.
+     
+     @param events -- Capacity of each thread's buffer.
+     */
+    static void Start( size_t events = 64 * 1024 );
+    
+    static void Stop();
+    
+    /**
+     Write the session as trace-event JSON. Call after Stop, spans still open are missing.
+     
+     @param out -- Output.
+     @return KERN_SUCCESS, KERN_FAILURE if writing failed.
+     */
+    static kern_return_t Write( FILE * out );
+    
+    /**
+     Write the session to a file, see Write.
+     
+     @param path -- Output file.
+     @return KERN_SUCCESS, KERN_INVALID_ARGUMENT if the file can't be created, KERN_FAILURE if writing failed.
+     */
+    static kern_return_t WriteFile( const char * path );
+    
+    /**
+     Events dropped on full buffers in this session.
+     */
+    static uint64_t dropped();
+    
+    static inline bool enabled() { return _enabled.load(std::memory_order_relaxed); }
+    
+private:
+    static void Record( const TraceEvent_t& event );
+    
+    static std::atomic<bool> _enabled;
+};
+
+/**
+ Records the time from construction to destruction while tracing is on.
+ 
+    TraceSpan span("scan", "MultiPatternScanner");
+ */
+class TraceSpan
+{
+public:
+    inline TraceSpan( const char * name, const char * category, uint64_t arg = 0 )
+    {
+        _event.name = Trace::enabled() ? name : nullptr;
+        if(_event.name)
+        {
+            _event.category = category;
+            _event.arg = arg;
+            _event.start = mach_absolute_time();
+        }
+    }
+    
+    inline ~TraceSpan()
+    {
+        if(_event.name)
+        {
+            _event.end = mach_absolute_time();
+            Trace::Record(_event);
+        }
+    }
+    
+    // Attach a count known only at the end, e.g. bytes read
+    inline void set( uint64_t arg ) { _event.arg = arg; }
+    
+private:
+    TraceSpan( const TraceSpan& ) = delete;
+    TraceSpan& operator =(const TraceSpan&) = delete;
+    
+    TraceEvent_t _event;
+};
+
+#endif /* defined(__xnumem__Trace__) */
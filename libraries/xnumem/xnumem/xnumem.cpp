@@ -18,6 +18,7 @@
  */
 
 #include "xnumem.h"
+#include "Trace.h"
 
 #include <mach/mach.h>
 #include <mach/mach_vm.h>
@@ -51,7 +52,7 @@ void mach_check_error (kern_return_t ret, const char *file, unsigned int line, c
          line, file, mach_error_string (ret));
 }
 
-xnu_proc::xnu_proc() : _core(), _memory(this), _modules(*this)
+xnu_proc::xnu_proc() : _core(), _memory(this), _modules(*this), _threads(*this)
 {
     
 }
@@ -63,25 +64,56 @@ xnu_proc::~xnu_proc()
 
 int xnu_proc::Attach(int pid)
 {
-    int ret = 0;
-    ret = _core.Open(pid);
+    TraceSpan span("Attach", "process");
+    _memory._source = nullptr;
+    if(_core.Open(pid) != KERN_SUCCESS)
+        return 0;
     _memory.QueryRegions();
-    _modules.QueryModules();
-    return ret;
+    if(_modules.QueryModules() != KERN_SUCCESS)
+    {
+        Detach();
+        return 0;
+    }
+    _threads.QueryThreads();
+    return 1;
 }
 
 int xnu_proc::Attach(char * procname)
 {
-    int ret = 0;
+    TraceSpan span("Attach", "process");
     int pid = PidFromName(procname);
-    ret = _core.Open(pid);
+    _memory._source = nullptr;
+    if(_core.Open(pid) != KERN_SUCCESS)
+        return 0;
+    _memory.QueryRegions();
+    if(_modules.QueryModules() != KERN_SUCCESS)
+    {
+        Detach();
+        return 0;
+    }
+    _threads.QueryThreads();
+    return 1;
+}
+
+int xnu_proc::Attach(MemorySource * source)
+{
+    TraceSpan span("Attach", "process");
+    if(source == nullptr)
+        return 0;
+    
+    _threads.Release();
+    _core.Close();
+    _memory._source = source;
     _memory.QueryRegions();
     _modules.QueryModules();
-    return ret;
+    return 1;
 }
 
 int xnu_proc::Detach()
 {
+    _threads.Release();
+    _memory.ReleaseViews();
+    _memory._source = nullptr;
     return _core.Close();
 }
 
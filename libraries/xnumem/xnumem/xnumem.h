@@ -30,6 +30,7 @@
 #include "ProcessCore.h"
 #include "ProcessMemory.h"
 #include "ProcessModules.h"
+#include "ProcessThreads.h"
 
 typedef struct kinfo_proc kinfo_proc;
 typedef struct vm_region_basic_info vm_region_basic_info;
@@ -84,6 +85,15 @@ public:
      */
     int Attach(char * procname);
     
+    /**
+     Attach to an offline memory source, e.g. a SnapshotSource.
+     Reads, region and module queries go to the source; writes are refused.
+     
+     @param source -- Memory source, must outlive the attachment.
+     @return int representing success or error ( 1 is success 0 is error ).
+     */
+    int Attach(MemorySource * source);
+    
     /**
      Detach from the attached process.
      
@@ -119,6 +129,7 @@ public:
     inline ProcessCore&     core()        { return _core; }
     inline ProcessMemory&   memory()      { return _memory; }
     inline ProcessModules&  modules()     { return _modules; }     // Memory manipulations
+    inline ProcessThreads&  threads()     { return _threads; }
     
 private:
     xnu_proc(const xnu_proc&) = delete;
@@ -130,6 +141,7 @@ private:
     ProcessCore     _core;
     ProcessMemory   _memory;     // Memory manipulations
     ProcessModules  _modules;    // Modules info & manipulation
+    ProcessThreads  _threads;    // Threads and their registers
 };
 
 #endif /* _xnu_mem_ */
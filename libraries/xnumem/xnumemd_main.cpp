@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#include <vector>
+
+#include "xnumem.h"
+#include "DaemonServer.h"
+
+/*
+ Inspection daemon: keeps processes attached and answers DaemonClient requests.
+
+    xnumemd [--socket PATH] [--attach PID]...
+
+ Processes are attached on their first request, or up front with --attach, and stay
+ attached until a client detaches them or the daemon exits on SIGINT / SIGTERM.
+ */
+
+static DaemonServer * Server = nullptr;
+
+static void OnSignal( int number )
+{
+    if(Server)
+        Server->Stop();
+}
+
+int main (int argc, const char * argv[]) {
+
+    const char * path = kDaemonSocketPath;
+    std::vector<int> attach;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        if(!strcmp(argv[i], "--socket"))            path = argv[i + 1];
+        else if(!strcmp(argv[i], "--attach"))       attach.push_back((int)strtol(argv[i + 1], nullptr, 0));
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    DaemonServer server;
+    if(server.Listen(path) != KERN_SUCCESS)
+    {
+        fprintf(stderr, "Cannot listen on %s\n", path);
+        return 1;
+    }
+    for (size_t i = 0; i < attach.size(); i++)
+    {
+        if(server.Attach(attach[i]) != KERN_SUCCESS)
+            fprintf(stderr, "Cannot attach %d\n", attach[i]);
+    }
+
+    Server = &server;
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, OnSignal);
+    signal(SIGTERM, OnSignal);
+
+    printf("xnumemd listening on %s\n", path);
+    server.Run();
+    Server = nullptr;
+    return 0;
+}